@@ -6,6 +6,7 @@
 
 #include "contract-constants.hpp"
 #include "hexutils.hpp"
+#include "metrics.hpp"
 
 #include "rpc-stubs/ethrpcclient.h"
 
@@ -141,6 +142,20 @@ ExtractMove (const Json::Value& val)
   return res;
 }
 
+/**
+ * Returns the histogram for the latency of a given kind of request
+ * to the Ethereum endpoint.
+ */
+Histogram&
+GetRequestHistogram (const std::string& method)
+{
+  return MetricsRegistry::Get ().GetHistogram (
+      "xayax_basechain_request_seconds",
+      "Time for requests to the base chain",
+      Histogram::LatencyBuckets (),
+      "chain=\"eth\",method=\"" + method + "\"");
+}
+
 } // anonymous namespace
 
 MoveData
@@ -542,6 +557,9 @@ EthChain::GetBlockRange (const uint64_t start, const uint64_t count)
   if (count == 0)
     return {};
 
+  static Histogram& time = GetRequestHistogram ("getblockrange");
+  ScopedTimer timer(time);
+
   EthRpc rpc(*this);
 
   const uint64_t endHeight = start + count - 1;
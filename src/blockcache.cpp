@@ -1,14 +1,34 @@
-// Copyright (C) 2023 The Xaya developers
+// Copyright (C) 2023-2024 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "blockcache.hpp"
 
+#include "metrics.hpp"
+
 #include <glog/logging.h>
 
 namespace xayax
 {
 
+namespace
+{
+
+/**
+ * Returns the counter for GetBlockRange requests to the block cache
+ * with the given result.
+ */
+Counter&
+GetRequestsCounter (const std::string& result)
+{
+  return MetricsRegistry::Get ().GetCounter (
+      "xayax_blockcache_requests_total",
+      "Block-range requests to the block cache by result",
+      "result=\"" + result + "\"");
+}
+
+} // anonymous namespace
+
 /* ************************************************************************** */
 
 void
@@ -43,6 +63,10 @@ BlockCacheChain::GetTipHeight ()
 std::vector<BlockData>
 BlockCacheChain::GetBlockRange (const uint64_t start, const uint64_t count)
 {
+  static Counter& nearTip = GetRequestsCounter ("neartip");
+  static Counter& hits = GetRequestsCounter ("hit");
+  static Counter& misses = GetRequestsCounter ("miss");
+
   /* If this range is close to the tip, do not work with the cache at all
      (neither try to query, as the blocks won't be there, nor store).  */
   if (start + count + minDepth > lastTipHeight + 1)
@@ -51,6 +75,7 @@ BlockCacheChain::GetBlockRange (const uint64_t start, const uint64_t count)
           << "Not using block cache for range "
           << start << "+" << count
           << " close to the tip @" << lastTipHeight;
+      nearTip.Increment ();
       return base.GetBlockRange (start, count);
     }
 
@@ -59,10 +84,12 @@ BlockCacheChain::GetBlockRange (const uint64_t start, const uint64_t count)
   if (res.size () == count)
     {
       VLOG (1) << "All blocks for range " << start << "+" << count << " cached";
+      hits.Increment ();
       return res;
     }
 
   /* Otherwise, query the base chain, and save in the cache.  */
+  misses.Increment ();
   res = base.GetBlockRange (start, count);
   store.Store (res);
   VLOG (1) << "Stored range " << start << "+" << count << " in the cache";
@@ -8,6 +8,7 @@
 
 #include <mypp/tempdb.hpp>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -17,6 +18,9 @@
 
 namespace xayax
 {
+
+DECLARE_int32 (xayax_mysql_batch_bytes);
+
 namespace
 {
 
@@ -233,6 +237,24 @@ TEST_F (MySqlBlockStorageTests, Storage)
                ElementsAre (GetBlock (10), GetBlock (11)));
 }
 
+TEST_F (MySqlBlockStorageTests, Batching)
+{
+  /* More blocks than fit into a single statement.  */
+  store->Store (GetRange (0, 300));
+  EXPECT_EQ (store->GetRange (0, 300), GetRange (0, 300));
+
+  /* Each block in its own statement, reusing the prepared ones.  */
+  FLAGS_xayax_mysql_batch_bytes = 1;
+  store->Store (GetRange (300, 5));
+  store->Store (GetRange (305, 5));
+  FLAGS_xayax_mysql_batch_bytes = 4 << 20;
+  EXPECT_EQ (store->GetRange (295, 20), GetRange (295, 15));
+
+  /* Overwriting existing entries works as well.  */
+  store->Store (GetRange (290, 20));
+  EXPECT_EQ (store->GetRange (0, 400), GetRange (0, 310));
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
@@ -4,13 +4,21 @@
 
 #include "blockcache.hpp"
 
+#include "metrics.hpp"
+
 #include <mypp/connection.hpp>
 #include <mypp/error.hpp>
 #include <mypp/statement.hpp>
 #include <mypp/url.hpp>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sstream>
+
 /* The MySQL cache stores blocks into a single table inside a given database,
    which should be set up with a schema like this:
 
@@ -23,6 +31,57 @@
 namespace xayax
 {
 
+DEFINE_int32 (xayax_mysql_batch_bytes, 4 << 20,
+              "maximum size in bytes of the block data written to the MySQL"
+              " cache with a single multi-row statement (must stay below the"
+              " server's max_allowed_packet)");
+
+namespace
+{
+
+/**
+ * Maximum number of blocks written with a single statement.  This also
+ * bounds the number of prepared statements we keep (one per row count).
+ */
+constexpr size_t MAX_BATCH_ROWS = 128;
+
+/**
+ * Metrics about writes to the MySQL cache.
+ */
+struct MySqlMetrics
+{
+
+  Counter& blocks;
+  Counter& bytes;
+  Counter& failures;
+  Histogram& storeTime;
+
+  MySqlMetrics ()
+    : blocks(MetricsRegistry::Get ().GetCounter (
+          "xayax_mysql_blocks_stored_total",
+          "Blocks written to the MySQL cache")),
+      bytes(MetricsRegistry::Get ().GetCounter (
+          "xayax_mysql_bytes_stored_total",
+          "Bytes of block data written to the MySQL cache")),
+      failures(MetricsRegistry::Get ().GetCounter (
+          "xayax_mysql_store_failures_total",
+          "Failed statements or transactions writing to the MySQL cache")),
+      storeTime(MetricsRegistry::Get ().GetHistogram (
+          "xayax_mysql_store_seconds",
+          "Time for writing a range of blocks to the MySQL cache"))
+  {}
+
+  static MySqlMetrics&
+  Get ()
+  {
+    static MySqlMetrics instance;
+    return instance;
+  }
+
+};
+
+} // anonymous namespace
+
 /* ************************************************************************** */
 
 class MySqlBlockStorage::Implementation
@@ -36,6 +95,30 @@ private:
   /** The name of the table to use.  */
   std::string table;
 
+  /**
+   * Lock for the connection and the prepared statements, which are
+   * not safe to use from multiple threads at the same time.
+   */
+  std::mutex mut;
+
+  /**
+   * Prepared REPLACE statements for storing blocks, keyed by the number
+   * of rows they insert.  They are reused across calls to Store.
+   */
+  std::map<size_t, std::unique_ptr<mypp::Statement>> storeStatements;
+
+  /**
+   * Returns the prepared statement for storing the given number of rows,
+   * preparing it if necessary.  Must be called with the lock held.
+   */
+  mypp::Statement& GetStoreStatement (size_t rows);
+
+  /**
+   * Executes a statement without parameters or results directly on the
+   * connection (e.g. for transactions).  Returns false if it failed.
+   */
+  bool Execute (const std::string& sql);
+
 public:
 
   Implementation () = default;
@@ -55,7 +138,9 @@ public:
                 const std::string& db, const std::string& tbl);
 
   /**
-   * Stores an array of blocks into the database.
+   * Stores an array of blocks into the database.  The blocks are written
+   * in a single transaction, with multi-row statements of a bounded size.
+   * If any statement fails, the transaction is rolled back.
    */
   void Store (const std::vector<BlockData>& blocks);
 
@@ -96,27 +181,99 @@ MySqlBlockStorage::Implementation::Connect (
     }
 }
 
+mypp::Statement&
+MySqlBlockStorage::Implementation::GetStoreStatement (const size_t rows)
+{
+  CHECK_GT (rows, 0);
+  CHECK_LE (rows, MAX_BATCH_ROWS);
+
+  auto& stmt = storeStatements[rows];
+  if (stmt != nullptr)
+    return *stmt;
+
+  std::ostringstream sql;
+  sql << "REPLACE INTO `" << table << "` (`height`, `data`) VALUES ";
+  for (size_t i = 0; i < rows; ++i)
+    {
+      if (i > 0)
+        sql << ", ";
+      sql << "(?, ?)";
+    }
+
+  stmt = std::make_unique<mypp::Statement> (*connection);
+  try
+    {
+      stmt->Prepare (2 * rows, sql.str ());
+    }
+  catch (const mypp::Error& exc)
+    {
+      LOG (FATAL) << exc.what ();
+    }
+
+  return *stmt;
+}
+
+bool
+MySqlBlockStorage::Implementation::Execute (const std::string& sql)
+{
+  try
+    {
+      connection.Execute (sql);
+      return true;
+    }
+  catch (const mypp::Error& exc)
+    {
+      LOG (WARNING) << exc.what ();
+      return false;
+    }
+}
+
 void
 MySqlBlockStorage::Implementation::Store (const std::vector<BlockData>& blocks)
 {
+  if (blocks.empty ())
+    return;
+
+  auto& metrics = MySqlMetrics::Get ();
+  const auto startTime = std::chrono::steady_clock::now ();
+
+  std::vector<std::string> data;
+  data.reserve (blocks.size ());
   for (const auto& b : blocks)
+    data.push_back (b.Serialise ());
+
+  std::lock_guard<std::mutex> lock(mut);
+
+  /* If we cannot start a transaction for some reason, the statements
+     are still executed on their own (with auto-commit).  */
+  const bool inTransaction = Execute ("START TRANSACTION");
+
+  size_t storedBlocks = 0;
+  size_t storedBytes = 0;
+  bool ok = true;
+  for (size_t begin = 0; begin < blocks.size (); )
     {
-      mypp::Statement stmt(*connection);
-      try
+      /* Each batch has at least one block, even if that alone is already
+         larger than the byte limit.  */
+      size_t end = begin;
+      size_t batchBytes = 0;
+      while (end < blocks.size () && end - begin < MAX_BATCH_ROWS
+               && (end == begin
+                    || batchBytes + data[end].size ()
+                        <= static_cast<size_t> (FLAGS_xayax_mysql_batch_bytes)))
         {
-          stmt.Prepare (2, R"(
-            REPLACE INTO `)" + table + R"(`
-              (`height`, `data`) VALUES (?, ?)
-          )");
+          batchBytes += data[end].size ();
+          ++end;
         }
-      catch (const mypp::Error& exc)
+
+      auto& stmt = GetStoreStatement (end - begin);
+      for (size_t i = begin; i < end; ++i)
         {
-          LOG (FATAL) << exc.what ();
+          const unsigned param = 2 * (i - begin);
+          stmt.Bind<int64_t> (param, blocks[i].height);
+          stmt.BindBlob (param + 1, data[i]);
         }
 
-      stmt.Bind<int64_t> (0, b.height);
-      stmt.BindBlob (1, b.Serialise ());
-
       try
         {
           stmt.Execute ();
@@ -124,16 +281,48 @@ MySqlBlockStorage::Implementation::Store (const std::vector<BlockData>& blocks)
       catch (const mypp::Error& exc)
         {
           LOG (WARNING) << exc.what ();
-          /* We continue here and try the next block.  It is not fatal
-             if one of them failed to insert for whatever reason.  */
+          ok = false;
+          break;
         }
+
+      storedBlocks += end - begin;
+      storedBytes += batchBytes;
+      begin = end;
+    }
+
+  /* If a batch fails, we abort the call.  That is not fatal, as the blocks
+     are then just not cached.  MySQL only rolls back the failed statement
+     itself and not the transaction, so we have to do that explicitly
+     (otherwise the connection would stay inside it).  */
+  if (inTransaction && (!ok || !Execute ("COMMIT")))
+    {
+      Execute ("ROLLBACK");
+      metrics.failures.Increment ();
+      return;
     }
+
+  /* Without a transaction, the batches before the failed one have been
+     stored (and are counted) nevertheless.  */
+  if (!ok)
+    metrics.failures.Increment ();
+
+  const std::chrono::duration<double> elapsed
+      = std::chrono::steady_clock::now () - startTime;
+  metrics.blocks.Increment (storedBlocks);
+  metrics.bytes.Increment (storedBytes);
+  metrics.storeTime.Observe (elapsed.count ());
+
+  VLOG (1)
+      << "Stored " << storedBlocks << " blocks (" << storedBytes << " bytes)"
+      << " in the MySQL cache in " << elapsed.count () << " s";
 }
 
 std::vector<BlockData>
 MySqlBlockStorage::Implementation::GetRange (const uint64_t start,
                                              const uint64_t count)
 {
+  std::lock_guard<std::mutex> lock(mut);
+
   mypp::Statement stmt(*connection);
   try
     {
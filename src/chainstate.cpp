@@ -1,9 +1,10 @@
-// Copyright (C) 2021-2023 The Xaya developers
+// Copyright (C) 2021-2024 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "private/chainstate.hpp"
 
+#include "metrics.hpp"
 #include "private/jsonutils.hpp"
 
 #include <glog/logging.h>
@@ -14,6 +15,41 @@ namespace xayax
 namespace
 {
 
+/**
+ * Metrics about the chainstate.
+ */
+struct ChainstateMetrics
+{
+
+  Gauge& tipHeight;
+  Counter& attached;
+  Counter& pruned;
+  Histogram& setTipTime;
+
+  ChainstateMetrics ()
+    : tipHeight(MetricsRegistry::Get ().GetGauge (
+          "xayax_chainstate_tip_height",
+          "Height of the current chainstate tip")),
+      attached(MetricsRegistry::Get ().GetCounter (
+          "xayax_chainstate_blocks_attached_total",
+          "Blocks set as new tip of the chainstate")),
+      pruned(MetricsRegistry::Get ().GetCounter (
+          "xayax_chainstate_blocks_pruned_total",
+          "Blocks pruned from the chainstate")),
+      setTipTime(MetricsRegistry::Get ().GetHistogram (
+          "xayax_chainstate_settip_seconds",
+          "Time for setting a new chainstate tip"))
+  {}
+
+  static ChainstateMetrics&
+  Get ()
+  {
+    static ChainstateMetrics instance;
+    return instance;
+  }
+
+};
+
 /**
  * Sets up the schema we use for storing the chain data in the given database.
  * Does nothing if the schema is already there.
@@ -296,11 +332,18 @@ Chainstate::ImportTip (const BlockData& tip)
 
   CHECK_EQ (GetLowestUnprunedHeight (), tip.height);
   CHECK_EQ (GetTipHeight (), tip.height);
+
+  auto& metrics = ChainstateMetrics::Get ();
+  metrics.attached.Increment ();
+  metrics.tipHeight.Set (tip.height);
 }
 
 bool
 Chainstate::SetTip (const BlockData& blk, std::string& oldTip)
 {
+  auto& metrics = ChainstateMetrics::Get ();
+  ScopedTimer timer(metrics.setTipTime);
+
   /* Set the old tip from what is currently the highest branch-zero block.
      If there is none, it means we have no blocks and can't attach our tip.  */
   auto stmt = PrepareRo (R"(
@@ -339,6 +382,9 @@ Chainstate::SetTip (const BlockData& blk, std::string& oldTip)
       UpdateBatch upd(*this);
       MarkAsTip (*this, *this, blk);
       upd.Commit ();
+
+      metrics.attached.Increment ();
+      metrics.tipHeight.Set (blk.height);
       return true;
     }
 
@@ -372,6 +418,8 @@ Chainstate::SetTip (const BlockData& blk, std::string& oldTip)
   MarkAsTip (*this, *this, blk);
   upd.Commit ();
 
+  metrics.attached.Increment ();
+  metrics.tipHeight.Set (blk.height);
   return true;
 }
 
@@ -450,6 +498,7 @@ Chainstate::Prune (const uint64_t untilHeight)
   upd.Commit ();
 
   const unsigned cnt = RowsModified ();
+  ChainstateMetrics::Get ().pruned.Increment (cnt);
   LOG_IF (INFO, cnt > 0)
       << "Pruned " << cnt << " blocks until height " << untilHeight;
 }
@@ -4,9 +4,13 @@
 
 #include "controller.hpp"
 
+#include "metrics.hpp"
 #include "private/chainstate.hpp"
+#include "private/httpconnector.hpp"
 #include "private/pending.hpp"
+#include "private/ratelimit.hpp"
 #include "private/sync.hpp"
+#include "private/taskpool.hpp"
 #include "private/zmqpub.hpp"
 #include "rpc-stubs/xayarpcserverstub.h"
 
@@ -22,19 +26,553 @@
 
 #include <experimental/filesystem>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <list>
+#include <map>
 #include <memory>
+#include <set>
 #include <sstream>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace xayax
 {
 
 DECLARE_int32 (xayax_block_range);
 
+DEFINE_bool (xayax_stream_catchup, false,
+             "if enabled, game_sendupdates requests that are further behind"
+             " than --xayax_block_range are answered by streaming all blocks"
+             " up to the current tip in the background");
+DEFINE_int32 (xayax_stream_blocks_per_second, 0,
+              "if positive, limit streaming catch-ups to this many blocks"
+              " per second");
+DEFINE_int32 (xayax_stream_max_jobs, 4,
+              "maximum number of streaming catch-ups running at the same"
+              " time; further requests are answered without streaming");
+DEFINE_int32 (xayax_waitforchange_timeout_ms, 5'000,
+              "maximum time in milliseconds that a waitforchange call"
+              " blocks before returning the unchanged tip");
+DEFINE_int32 (xayax_waitforchange_max_waiters, 0,
+              "maximum number of waitforchange calls blocking at the same"
+              " time, further calls are rejected; if zero, this is half of"
+              " --xayax_rpc_threads (so that the long-polling calls cannot"
+              " occupy all workers of the built-in HTTP connector) and"
+              " unlimited without it");
+DEFINE_int32 (xayax_rpc_threads, 0,
+              "if positive, serve RPC requests with the built-in HTTP"
+              " connector using this many worker threads, instead of the"
+              " HTTP server of libjson-rpc-cpp");
+DEFINE_int32 (xayax_rpc_queue, 256,
+              "maximum number of connections waiting for a worker of the"
+              " built-in HTTP connector before new ones are rejected");
+DEFINE_int32 (xayax_rpc_max_connections, 1'024,
+              "maximum number of open connections to the built-in HTTP"
+              " connector before new ones are rejected");
+DEFINE_int32 (xayax_hash_cache_size, 10'000,
+              "number of pruned main-chain blocks for which the height and"
+              " hash are cached for getblockhash and getblockheader");
+DEFINE_int32 (xayax_mempool_refresh_ms, 10'000,
+              "if pending moves are tracked, getrawmempool is answered from"
+              " a cache that is refreshed from the base chain at most this"
+              " often (in milliseconds)");
+DEFINE_int32 (xayax_verify_threads, 4,
+              "number of threads used to verify the signatures of"
+              " a verifymessages call in parallel");
+DEFINE_int32 (xayax_verify_max_batch, 1'000,
+              "maximum number of entries in a single verifymessages call");
+DEFINE_int32 (xayax_signature_cache_size, 10'000,
+              "number of (message, signature) pairs for which the result"
+              " of verifymessage is cached");
+DEFINE_double (xayax_rpc_client_rate, 0,
+               "if positive, maximum sustained rate (per second) of expensive"
+               " RPC requests (game_sendupdates, getrawmempool and getblockhash"
+               " or getblockrange for blocks not in memory) per client; clients"
+               " that cannot be told apart (without --xayax_rpc_threads) share"
+               " a single limit");
+DEFINE_int32 (xayax_rpc_client_burst, 20,
+              "number of expensive RPC requests a client can make in a burst"
+              " before --xayax_rpc_client_rate applies");
+DEFINE_int32 (xayax_rpc_client_concurrency, 0,
+              "if positive, maximum number of expensive RPC requests running"
+              " concurrently per client");
+
 namespace
 {
 
 namespace fs = std::experimental::filesystem;
 
+/**
+ * RAII helper that temporarily releases a lock (if one is given) while
+ * it is in scope, e.g. for network I/O that should not block others.
+ * If the given lock does not own its mutex (e.g. because it is held for
+ * an entire batch of RPC calls), then nothing is done.
+ */
+class ScopedUnlock
+{
+
+private:
+
+  /** The lock to release, or null if there is nothing to do.  */
+  std::unique_lock<std::mutex>* lock;
+
+public:
+
+  explicit ScopedUnlock (std::unique_lock<std::mutex>* l)
+    : lock(l != nullptr && l->owns_lock () ? l : nullptr)
+  {
+    if (lock != nullptr)
+      lock->unlock ();
+  }
+
+  ~ScopedUnlock ()
+  {
+    if (lock != nullptr)
+      lock->lock ();
+  }
+
+  ScopedUnlock () = delete;
+  ScopedUnlock (const ScopedUnlock&) = delete;
+  void operator= (const ScopedUnlock&) = delete;
+
+};
+
+/**
+ * The methods of our RPC interface (as in rpc-stubs/xaya.json), for which
+ * the metrics are set up when the RPC server is constructed.
+ */
+const char* const RPC_METHODS[] =
+  {
+    "getzmqnotifications",
+    "getzmqstats",
+    "getzmqdictionary",
+    "trackedgames",
+    "getnetworkinfo",
+    "getblockchaininfo",
+    "getblockhash",
+    "getblockheader",
+    "getblockrange",
+    "waitforchange",
+    "game_sendupdates",
+    "game_sendupdates2",
+    "game_sendupdates3",
+    "verifymessage",
+    "verifymessages",
+    "getrawmempool",
+    "stop",
+  };
+
+/**
+ * Set while the current thread is processing a batch of read-only RPC
+ * calls, for which it holds the chain lock throughout.
+ */
+thread_local bool inReadOnlyBatch = false;
+
+/**
+ * Bounded cache of the height/hash mapping of main-chain blocks that are
+ * already pruned from the chainstate.  Since we never reorg beyond the
+ * pruning depth, those are final and can be cached indefinitely (up to
+ * the size limit, with the least recently used entries being evicted).
+ * This is not thread-safe by itself, and only accessed with the chain
+ * lock held.
+ */
+class FinalisedHashCache
+{
+
+private:
+
+  using Entry = std::pair<uint64_t, std::string>;
+
+  /** The entries, most recently used first.  */
+  std::list<Entry> entries;
+
+  /** Entries by height.  */
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> byHeight;
+
+  /** Entries by hash.  */
+  std::unordered_map<std::string, std::list<Entry>::iterator> byHash;
+
+  /**
+   * Marks an entry as most recently used.
+   */
+  void
+  Touch (const std::list<Entry>::iterator it)
+  {
+    entries.splice (entries.begin (), entries, it);
+  }
+
+public:
+
+  FinalisedHashCache () = default;
+
+  FinalisedHashCache (const FinalisedHashCache&) = delete;
+  void operator= (const FinalisedHashCache&) = delete;
+
+  /**
+   * Adds a finalised block to the cache.  If we have a different block
+   * cached for the height already (which should not happen, but might with
+   * a reorg deeper than supported on the base chain), the old entry is
+   * replaced, so that its hash is not resolved to the height anymore.
+   */
+  void
+  Add (const uint64_t height, const std::string& hash)
+  {
+    const auto mit = byHeight.find (height);
+    if (mit != byHeight.end ())
+      {
+        const auto it = mit->second;
+        if (it->second == hash)
+          {
+            Touch (it);
+            return;
+          }
+
+        LOG (WARNING)
+            << "Finalised block at height " << height << " changed from "
+            << it->second << " to " << hash;
+        byHash.erase (it->second);
+        byHeight.erase (mit);
+        entries.erase (it);
+      }
+
+    if (FLAGS_xayax_hash_cache_size <= 0)
+      return;
+
+    entries.emplace_front (height, hash);
+    byHeight.emplace (height, entries.begin ());
+    byHash.emplace (hash, entries.begin ());
+
+    while (entries.size () > static_cast<size_t> (FLAGS_xayax_hash_cache_size))
+      {
+        byHeight.erase (entries.back ().first);
+        byHash.erase (entries.back ().second);
+        entries.pop_back ();
+      }
+  }
+
+  /**
+   * Looks up the hash of the finalised block at the given height.
+   */
+  bool
+  GetHash (const uint64_t height, std::string& hash)
+  {
+    const auto mit = byHeight.find (height);
+    if (mit == byHeight.end ())
+      return false;
+
+    Touch (mit->second);
+    hash = mit->second->second;
+    return true;
+  }
+
+  /**
+   * Looks up the height of a finalised block by hash.
+   */
+  bool
+  GetHeight (const std::string& hash, uint64_t& height)
+  {
+    const auto mit = byHash.find (hash);
+    if (mit == byHash.end ())
+      return false;
+
+    Touch (mit->second);
+    height = mit->second->first;
+    return true;
+  }
+
+};
+
+
+/**
+ * Cached view of the mempool for getrawmempool, used when pending moves
+ * are tracked.  It is updated incrementally from the pending-move
+ * notifications (adding new txids) and attached blocks (removing confirmed
+ * txids), and only refreshed from the base chain periodically to pick up
+ * anything missed that way (e.g. transactions without moves, which are
+ * not notified about, or ones returned to the mempool by a reorg).
+ *
+ * This class is thread-safe.  The base-chain query itself is done by
+ * the caller, without holding any of our locks.
+ */
+class MempoolCache
+{
+
+private:
+
+  using Clock = std::chrono::steady_clock;
+
+  std::mutex mut;
+
+  /** The cached txids in mempool order.  */
+  std::vector<std::string> txids;
+
+  /** The set of txids we have, for fast lookup.  */
+  std::set<std::string> known;
+
+  /** Whether we have any data at all yet.  */
+  bool initialised = false;
+
+  /** Whether some thread is currently refreshing from the base chain.  */
+  bool refreshing = false;
+
+  /** When we last got a full mempool from the base chain.  */
+  Clock::time_point lastRefresh;
+
+  /**
+   * Updates received while a refresh is in progress, which will be
+   * applied on top of its result as well.  The flag is true for an added
+   * and false for a removed txid.
+   */
+  std::vector<std::pair<bool, std::string>> updatesDuringRefresh;
+
+  /**
+   * Adds a txid (if we do not have it yet).  Must be called with
+   * the lock held.
+   */
+  void
+  AddInternal (const std::string& txid)
+  {
+    if (known.insert (txid).second)
+      txids.push_back (txid);
+  }
+
+  /**
+   * Removes all txids in the given set.  Must be called with the lock held.
+   */
+  void
+  RemoveInternal (const std::set<std::string>& removed)
+  {
+    auto newEnd = std::remove_if (txids.begin (), txids.end (),
+        [&removed] (const std::string& txid)
+        {
+          return removed.count (txid) > 0;
+        });
+    txids.erase (newEnd, txids.end ());
+    for (const auto& txid : removed)
+      known.erase (txid);
+  }
+
+public:
+
+  MempoolCache () = default;
+
+  MempoolCache (const MempoolCache&) = delete;
+  void operator= (const MempoolCache&) = delete;
+
+  /**
+   * Updates the cache for newly received pending moves.
+   */
+  void
+  AddMoves (const std::vector<MoveData>& moves)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    for (const auto& mv : moves)
+      {
+        if (initialised)
+          AddInternal (mv.txid);
+        if (refreshing)
+          updatesDuringRefresh.emplace_back (true, mv.txid);
+      }
+  }
+
+  /**
+   * Updates the cache for newly attached blocks, whose moves are
+   * no longer in the mempool.
+   */
+  void
+  BlocksAttached (const std::vector<BlockData>& attaches)
+  {
+    std::set<std::string> confirmed;
+    for (const auto& blk : attaches)
+      for (const auto& mv : blk.moves)
+        confirmed.insert (mv.txid);
+
+    std::lock_guard<std::mutex> lock(mut);
+    if (initialised)
+      RemoveInternal (confirmed);
+    if (refreshing)
+      for (const auto& txid : confirmed)
+        updatesDuringRefresh.emplace_back (false, txid);
+  }
+
+  /**
+   * Returns the cached mempool in out if possible, i.e. it is initialised
+   * and either still fresh or another thread is refreshing it already.
+   * Otherwise returns false, and the caller should query the base chain.
+   * In that case, if refresh is set to true, the caller is responsible
+   * for the refresh and must call either Refreshed or RefreshFailed.
+   */
+  bool
+  Get (std::vector<std::string>& out, bool& refresh)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+
+    const auto maxAge
+        = std::chrono::milliseconds (FLAGS_xayax_mempool_refresh_ms);
+    if (initialised
+          && (refreshing || Clock::now () - lastRefresh < maxAge))
+      {
+        out = txids;
+        return true;
+      }
+
+    refresh = !refreshing;
+    if (refresh)
+      {
+        refreshing = true;
+        updatesDuringRefresh.clear ();
+      }
+
+    return false;
+  }
+
+  /**
+   * Sets the cache to the mempool returned from the base chain, after
+   * the caller has been told to refresh it by Get.
+   */
+  void
+  Refreshed (const std::vector<std::string>& mempool)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    CHECK (refreshing);
+
+    txids.clear ();
+    known.clear ();
+    for (const auto& txid : mempool)
+      AddInternal (txid);
+
+    for (const auto& entry : updatesDuringRefresh)
+      if (entry.first)
+        AddInternal (entry.second);
+      else
+        RemoveInternal ({entry.second});
+    updatesDuringRefresh.clear ();
+
+    initialised = true;
+    refreshing = false;
+    lastRefresh = Clock::now ();
+  }
+
+  /**
+   * Marks a refresh as failed (e.g. due to a base-chain error).
+   */
+  void
+  RefreshFailed ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    CHECK (refreshing);
+    refreshing = false;
+    updatesDuringRefresh.clear ();
+  }
+
+};
+
+
+/**
+ * LRU cache of signature verification results, keyed by message and
+ * signature.  Channel games often verify the same signatures over and
+ * over again (e.g. on each replica), and the result only depends on
+ * the message and signature.  This class is thread-safe.
+ */
+class SignatureCache
+{
+
+public:
+
+  /**
+   * The result of verifying a signature.
+   */
+  struct Result
+  {
+
+    /** Whether the signature is valid at all.  */
+    bool valid;
+
+    /** The recovered signer address if it is valid.  */
+    std::string address;
+
+  };
+
+private:
+
+  using Entry = std::pair<std::string, Result>;
+
+  std::mutex mut;
+
+  /** The entries, most recently used first.  */
+  std::list<Entry> entries;
+
+  /** The entries by key.  */
+  std::unordered_map<std::string, std::list<Entry>::iterator> byKey;
+
+  /**
+   * Returns the key used for a message and signature.  The message length
+   * is included, so that the key is unambiguous.
+   */
+  static std::string
+  GetKey (const std::string& msg, const std::string& sgn)
+  {
+    std::ostringstream out;
+    out << msg.size () << ':' << msg << sgn;
+    return out.str ();
+  }
+
+public:
+
+  SignatureCache () = default;
+
+  SignatureCache (const SignatureCache&) = delete;
+  void operator= (const SignatureCache&) = delete;
+
+  /**
+   * Looks up the result for a message and (raw) signature.
+   */
+  bool
+  Get (const std::string& msg, const std::string& sgn, Result& res)
+  {
+    const std::string key = GetKey (msg, sgn);
+
+    std::lock_guard<std::mutex> lock(mut);
+    const auto mit = byKey.find (key);
+    if (mit == byKey.end ())
+      return false;
+
+    entries.splice (entries.begin (), entries, mit->second);
+    res = mit->second->second;
+    return true;
+  }
+
+  /**
+   * Adds the result for a message and signature.
+   */
+  void
+  Add (const std::string& msg, const std::string& sgn, const Result& res)
+  {
+    if (FLAGS_xayax_signature_cache_size <= 0)
+      return;
+
+    std::string key = GetKey (msg, sgn);
+
+    std::lock_guard<std::mutex> lock(mut);
+    if (byKey.count (key) > 0)
+      return;
+
+    entries.emplace_front (std::move (key), res);
+    byKey.emplace (entries.front ().first, entries.begin ());
+
+    while (entries.size ()
+              > static_cast<size_t> (FLAGS_xayax_signature_cache_size))
+      {
+        byKey.erase (entries.back ().first);
+        entries.pop_back ();
+      }
+  }
+
+};
+
 } // anonymous namespace
 
 /* ************************************************************************** */
@@ -55,13 +593,80 @@ private:
   /** Mutex for the chainstate.  */
   std::mutex mutChain;
 
+  /**
+   * Condition variable (used with mutChain) that is notified whenever
+   * the chainstate tip changes or we are shutting down.  This is used
+   * for the waitforchange RPC.
+   */
+  std::condition_variable cvTip;
+
+  /** Set to true (with mutChain held) when waitforchange calls should stop.  */
+  bool stopWaiting = false;
+
   Chainstate chain;
   std::unique_ptr<Sync> sync;
+
+  /**
+   * Heights and hashes of pruned blocks, which are looked up frequently
+   * e.g. by GSPs on startup.  Protected by mutChain.
+   */
+  FinalisedHashCache prunedHashes;
   ZmqPub zmq;
   PendingManager pendings;
 
-  /** HTTP connector for the RPC server.  */
-  jsonrpc::HttpServer http;
+  /** Cached mempool view, used if pending moves are tracked.  */
+  MempoolCache mempool;
+
+  /** Cache of signature verification results.  */
+  SignatureCache signatures;
+
+  /** Thread pool for verifying signatures in parallel.  */
+  TaskPool verifyPool;
+
+  /**
+   * Per-client admission control for expensive RPC requests, if enabled.
+   * Clients are only known (and thus limited) with our own HttpConnector.
+   */
+  std::unique_ptr<RateLimiter> limiter;
+
+  /**
+   * HTTP connector for the RPC server.  This is either our own HttpConnector
+   * or the HttpServer from libjson-rpc-cpp.
+   */
+  std::unique_ptr<jsonrpc::AbstractServerConnector> http;
+
+  /**
+   * HTTP connector for the RPC server on a Unix domain socket, if enabled.
+   * It shares the request handler with the main connector.
+   */
+  std::unique_ptr<HttpConnector> unixSocket;
+
+  /** HTTP server for the metrics page, if enabled.  */
+  std::unique_ptr<HttpConnector> metricsHttp;
+
+  /** Mutex for the in-flight block range fetches.  */
+  std::mutex mutFetches;
+
+  /**
+   * Block range fetches from the base chain that are currently in flight,
+   * keyed by start height and count.  Concurrent requests for the same
+   * range (e.g. many GSPs calling game_sendupdates from the same block
+   * after a restart) wait for and share the result of a single fetch.
+   */
+  std::map<std::pair<uint64_t, uint64_t>,
+           std::shared_future<std::vector<BlockData>>> fetches;
+
+  /** Mutex for the streaming catch-up jobs.  */
+  std::mutex mutCatchUp;
+
+  /** Condition variable used to interrupt rate limiting when stopping.  */
+  std::condition_variable cvCatchUp;
+
+  /** Set to true when all catch-up jobs should stop.  */
+  bool stopCatchUp = false;
+
+  /** Running (or finished but not yet cleaned up) catch-up jobs.  */
+  std::list<std::future<void>> catchUpJobs;
 
   /** The RPC server run.  */
   std::unique_ptr<RpcServer> rpc;
@@ -88,17 +693,99 @@ private:
    * was not filled in and is instead retrieved, then those blocks will be
    * returned in queriedAttach.
    *
+   * If gameId is not empty, the notifications are only sent for that game
+   * rather than all tracked games.
+   *
+   * This must be called with the chainstate lock held.  If lockChain
+   * is not null, it is the lock we hold, and it will be released temporarily
+   * while doing base-chain I/O and sending the notifications.  In that
+   * case, the result is revalidated against the chainstate afterwards.
+   *
    * If there is an error, such as an unknown "from" block requested, then
    * the method returns false.
    *
    * This method may throw in case of a base-chain error.
    */
-  bool PushZmqBlocks (const std::string& from,
-                      const std::string& to,
-                      const std::vector<BlockData>& attaches, unsigned num,
-                      const std::string& reqtoken,
-                      std::vector<BlockData>& detach,
-                      std::vector<BlockData>& queriedAttach);
+  bool PushZmqBlocks (const std::string& from,
+                      const std::string& to,
+                      const std::vector<BlockData>& attaches, unsigned num,
+                      const std::string& reqtoken,
+                      const std::string& gameId,
+                      std::unique_lock<std::mutex>* lockChain,
+                      std::vector<BlockData>& detach,
+                      std::vector<BlockData>& queriedAttach);
+
+  /**
+   * Determines the blocks to send for PushZmqBlocks (with the same
+   * arguments), without sending them.  The blocks that should be
+   * attached are returned in toAttach (in addition to queriedAttach).
+   * Detaches in the returned list should be sent even if the method
+   * returns false.
+   */
+  bool GetZmqBlocks (const std::string& from,
+                     const std::string& to,
+                     const std::vector<BlockData>& attaches, unsigned num,
+                     std::unique_lock<std::mutex>* lockChain,
+                     std::vector<BlockData>& detach,
+                     std::vector<BlockData>& queriedAttach,
+                     std::vector<BlockData>& toAttach);
+
+  /**
+   * Returns the hash of the current chainstate tip, or the empty string
+   * if there is none yet.  Must be called with the chainstate lock held.
+   */
+  std::string GetTipHash () const;
+
+  /**
+   * Tries to get a range of main-chain blocks from the ZMQ publisher's
+   * buffer of recently sent blocks, which avoids querying the base chain.
+   * The hashes are looked up from the local chainstate.  Returns false
+   * if not all of the blocks are available.  Must be called with the
+   * chainstate lock held.
+   */
+  bool GetRecentBlockRange (uint64_t start, unsigned num,
+                            std::vector<BlockData>& blocks);
+
+  /**
+   * Queries the base chain for a range of blocks.  If an identical query
+   * is already in flight, its result is used instead of querying again.
+   * This should be called without the chainstate lock held.
+   */
+  std::vector<BlockData> FetchBlockRange (uint64_t start, uint64_t count);
+
+  /**
+   * Starts a background job that streams attach notifications for all
+   * main-chain blocks after the given last block (which has already been
+   * sent) up to the target block.  The blocks are fetched ahead while
+   * the previous ones are being published.  Returns false (and does not
+   * start anything) if too many catch-up jobs are running already.
+   */
+  bool StartCatchUp (const BlockData& last, const std::string& targetHash,
+                     uint64_t targetHeight, const std::string& reqtoken,
+                     const std::string& gameId);
+
+  /**
+   * Runs a streaming catch-up job (on its own thread).  If it does not
+   * end with the target block still on the main chain (e.g. because of
+   * an error or a reorg), the block notifications are marked as skipped,
+   * so that the GSP notices it will not get the target and requests
+   * updates again.
+   */
+  void RunCatchUp (std::string prev, uint64_t next,
+                   const std::string& targetHash, uint64_t targetHeight,
+                   const std::string& reqtoken, const std::string& gameId);
+
+  /**
+   * Stops all running catch-up jobs and waits for them to finish.
+   */
+  void StopCatchUps ();
+
+  /**
+   * Verifies a message with a raw signature on the base chain, using
+   * the signature cache.  This may throw in case of a base-chain error.
+   */
+  SignatureCache::Result VerifyMessage (const std::string& msg,
+                                        const std::string& sgn);
 
   friend class RpcServer;
 
@@ -128,14 +815,25 @@ class Controller::RpcServer : public XayaRpcServerStub
 
 private:
 
+  class BatchHandler;
+
   RunData& run;
 
-  /** Lock for this instance (requests counter and cached version/chain).  */
+  /**
+   * Connection handler that wraps the JSON-RPC protocol handler, so that
+   * we can process batch requests as a whole.
+   */
+  std::unique_ptr<BatchHandler> batchHandler;
+
+  /** Lock for this instance (counters and cached version/chain).  */
   std::mutex mut;
 
   /** Counter used to generate request tokens.  */
   unsigned requests = 0;
 
+  /** Number of waitforchange calls currently blocking.  */
+  unsigned waiters = 0;
+
   /** Cached chain string of the basechain.  */
   std::string cachedChain;
   /** Cached version of the basechain.  */
@@ -144,6 +842,27 @@ private:
   /** The procedure for game_sendupdates with all three arguments set.  */
   const jsonrpc::Procedure procGameSendUpdates3;
 
+  /**
+   * The metrics recorded for calls to a particular RPC method.
+   */
+  struct MethodMetrics
+  {
+
+    Counter& requests;
+    Counter& errors;
+    Histogram& latency;
+
+    explicit MethodMetrics (const std::string& method);
+
+  };
+
+  /**
+   * The metrics for each of our RPC methods.  They are looked up from the
+   * registry once at construction, so that processing a call does not
+   * need to take the registry lock.
+   */
+  std::map<std::string, MethodMetrics> metrics;
+
   /**
    * Throws an internal JSON-RPC error to indicate that we had an issue
    * with the base chain given by the passed-in exception.
@@ -158,6 +877,47 @@ private:
                                      msg.str ());
   }
 
+  /**
+   * Decodes the base64 signature passed to verifymessage(s) into the
+   * raw bytes expected by the base chain, or throws an RPC error.
+   */
+  static std::string DecodeSignature (const std::string& sgn);
+
+  /**
+   * Builds the verifymessage result for the given address argument (empty
+   * for address recovery) from the verification result.
+   */
+  static Json::Value VerificationResult (const std::string& addr,
+                                         const SignatureCache::Result& res);
+
+  /**
+   * Admits an expensive request of the current client, if admission
+   * control is enabled.  Throws an RPC error if the client is over its
+   * limits.  The returned admission (which may be null) must be kept
+   * alive while the request is processed.
+   */
+  std::unique_ptr<RateLimiter::Admission> Admit ();
+
+  /**
+   * Returns true if the given call from a read-only batch can be answered
+   * from local state, without reaching out to the base chain.  Must be
+   * called with the chain lock held.
+   */
+  bool IsLocalCall (const Json::Value& call);
+
+  /**
+   * Locks the chainstate for a read-only RPC method.  If the current thread
+   * is processing a read-only batch and thus holds the lock already, the
+   * returned lock does not own the mutex.
+   */
+  std::unique_lock<std::mutex>
+  LockChain ()
+  {
+    if (inReadOnlyBatch)
+      return std::unique_lock<std::mutex> (run.mutChain, std::defer_lock);
+    return std::unique_lock<std::mutex> (run.mutChain);
+  }
+
 public:
 
   explicit RpcServer (jsonrpc::AbstractServerConnector& conn, RunData& r);
@@ -165,12 +925,15 @@ public:
   /**
    * libjson-rpc-cpp does not by itself support optional arguments, which
    * we need for game_sendupdates.  Thus we override the HandleMethodCall
-   * method to manually handle calls to this method.
+   * method to manually handle calls to this method.  This is also where
+   * the per-method RPC metrics are recorded.
    */
   void HandleMethodCall (jsonrpc::Procedure& proc, const Json::Value& input,
                          Json::Value& output) override;
 
   Json::Value getzmqnotifications () override;
+  Json::Value getzmqstats () override;
+  Json::Value getzmqdictionary () override;
   void trackedgames (const std::string& cmd, const std::string& game) override;
 
   Json::Value getnetworkinfo () override;
@@ -178,6 +941,9 @@ public:
 
   std::string getblockhash (int height) override;
   Json::Value getblockheader (const std::string& hash);
+  Json::Value getblockrange (int count, const std::string& gameId,
+                             int start) override;
+  std::string waitforchange (const std::string& blockHash) override;
 
   Json::Value game_sendupdates () override;
   Json::Value game_sendupdates2 (const std::string& from,
@@ -188,12 +954,181 @@ public:
 
   Json::Value verifymessage (const std::string& addr, const std::string& msg,
                              const std::string& sgn) override;
+  Json::Value verifymessages (const Json::Value& requests) override;
 
   Json::Value getrawmempool () override;
   void stop () override;
 
 };
 
+/**
+ * Connection handler for our RPC server that passes requests on to the
+ * actual JSON-RPC protocol handler.  Batch requests that only consist of
+ * read-only calls, which can all be answered from local state, are
+ * processed with the chain lock held throughout, so that all calls see
+ * the same chainstate (and the lock is only acquired once).  Other requests
+ * (including batches that need to query the base chain, which must not
+ * happen with the lock held) are passed through as they are.
+ */
+class Controller::RpcServer::BatchHandler
+    : public jsonrpc::IClientConnectionHandler
+{
+
+private:
+
+  /** The RPC server this is for.  */
+  RpcServer& server;
+
+  /** The underlying protocol handler.  */
+  jsonrpc::IClientConnectionHandler& wrapped;
+
+  /**
+   * Returns true if the given request is a batch of only read-only calls.
+   * In that case, the parsed calls are returned in batch.
+   */
+  static bool IsReadOnlyBatch (const std::string& request, Json::Value& batch);
+
+public:
+
+  explicit BatchHandler (RpcServer& s, jsonrpc::IClientConnectionHandler& w)
+    : server(s), wrapped(w)
+  {}
+
+  BatchHandler () = delete;
+  BatchHandler (const BatchHandler&) = delete;
+  void operator= (const BatchHandler&) = delete;
+
+  void HandleRequest (const std::string& request,
+                      std::string& retValue) override;
+
+};
+
+bool
+Controller::RpcServer::BatchHandler::IsReadOnlyBatch (
+    const std::string& request, Json::Value& batch)
+{
+  /* Avoid parsing the request here for the common case of single calls,
+     which are not JSON arrays.  */
+  const auto start = request.find_first_not_of (" \t\r\n");
+  if (start == std::string::npos || request[start] != '[')
+    return false;
+
+  Json::CharReaderBuilder rbuilder;
+  std::istringstream in(request);
+  std::string parseErrs;
+  if (!Json::parseFromStream (rbuilder, in, &batch, &parseErrs))
+    return false;
+
+  if (!batch.isArray () || batch.empty ())
+    return false;
+
+  static const std::set<std::string> readOnly =
+    {
+      "getblockchaininfo",
+      "getblockhash",
+      "getblockheader",
+      "getnetworkinfo",
+    };
+  for (const auto& call : batch)
+    {
+      if (!call.isObject () || !call["method"].isString ()
+            || readOnly.count (call["method"].asString ()) == 0)
+        return false;
+    }
+
+  return true;
+}
+
+void
+Controller::RpcServer::BatchHandler::HandleRequest (const std::string& request,
+                                                    std::string& retValue)
+{
+  Json::Value batch;
+  if (!IsReadOnlyBatch (request, batch))
+    {
+      wrapped.HandleRequest (request, retValue);
+      return;
+    }
+
+  std::unique_lock<std::mutex> lock(server.run.mutChain);
+  for (const auto& call : batch)
+    if (!server.IsLocalCall (call))
+      {
+        VLOG (1) << "Read-only batch needs the base chain, not locking";
+        lock.unlock ();
+        wrapped.HandleRequest (request, retValue);
+        return;
+      }
+
+  CHECK (!inReadOnlyBatch);
+  inReadOnlyBatch = true;
+  try
+    {
+      wrapped.HandleRequest (request, retValue);
+    }
+  catch (...)
+    {
+      inReadOnlyBatch = false;
+      throw;
+    }
+  inReadOnlyBatch = false;
+}
+
+bool
+Controller::RpcServer::IsLocalCall (const Json::Value& call)
+{
+  const std::string method = call["method"].asString ();
+
+  if (method == "getnetworkinfo")
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      return cachedVersion != -1;
+    }
+  if (method == "getblockchaininfo")
+    {
+      std::lock_guard<std::mutex> lock(mut);
+      return !cachedChain.empty ();
+    }
+
+  /* Invalid arguments lead to an error without querying the base chain,
+     so they count as local.  */
+  const Json::Value& params = call["params"];
+  const auto getParam = [&params] (const std::string& name)
+    {
+      if (params.isArray () && params.size () == 1)
+        return params[0];
+      if (params.isObject ())
+        return params[name];
+      return Json::Value ();
+    };
+
+  if (method == "getblockhash")
+    {
+      const Json::Value height = getParam ("height");
+      if (!height.isInt ())
+        return true;
+
+      /* Only pruned blocks that are not cached need the base chain.  */
+      const int h = height.asInt ();
+      std::string hash;
+      return h < 0 || h >= run.chain.GetLowestUnprunedHeight ()
+                || run.prunedHashes.GetHash (h, hash);
+    }
+
+  if (method == "getblockheader")
+    {
+      const Json::Value hash = getParam ("blockhash");
+      if (!hash.isString ())
+        return true;
+
+      uint64_t height;
+      return run.chain.GetHeightForHash (hash.asString (), height)
+                || run.prunedHashes.GetHeight (hash.asString (), height);
+    }
+
+  return false;
+}
+
 Controller::RpcServer::RpcServer (jsonrpc::AbstractServerConnector& conn,
                                   RunData& r)
   : XayaRpcServerStub(conn), run(r),
@@ -203,6 +1138,26 @@ Controller::RpcServer::RpcServer (jsonrpc::AbstractServerConnector& conn,
                           "gameid", jsonrpc::JSON_STRING,
                           "toblock", jsonrpc::JSON_STRING,
                           nullptr)
+{
+  for (const char* method : RPC_METHODS)
+    metrics.emplace (method, MethodMetrics (method));
+
+  jsonrpc::IClientConnectionHandler* protocol = conn.GetHandler ();
+  CHECK (protocol != nullptr);
+  batchHandler = std::make_unique<BatchHandler> (*this, *protocol);
+  conn.SetHandler (batchHandler.get ());
+}
+
+Controller::RpcServer::MethodMetrics::MethodMetrics (const std::string& method)
+  : requests(MetricsRegistry::Get ().GetCounter (
+        "xayax_rpc_requests_total", "RPC requests by method",
+        "method=\"" + method + "\"")),
+    errors(MetricsRegistry::Get ().GetCounter (
+        "xayax_rpc_errors_total", "RPC requests by method that failed",
+        "method=\"" + method + "\"")),
+    latency(MetricsRegistry::Get ().GetHistogram (
+        "xayax_rpc_request_seconds", "Time for processing RPC requests",
+        Histogram::LatencyBuckets (), "method=\"" + method + "\""))
 {}
 
 void
@@ -210,23 +1165,50 @@ Controller::RpcServer::HandleMethodCall (jsonrpc::Procedure& proc,
                                          const Json::Value& input,
                                          Json::Value& output)
 {
+  const std::string& method = proc.GetProcedureName ();
+
+  /* All methods the stub dispatches to are known, but just in case,
+     unknown ones get their metrics looked up on the fly.  */
+  std::unique_ptr<MethodMetrics> unknownMethod;
+  const auto mit = metrics.find (method);
+  if (mit == metrics.end ())
+    unknownMethod = std::make_unique<MethodMetrics> (method);
+  const MethodMetrics& m
+      = (unknownMethod != nullptr ? *unknownMethod : mit->second);
 
-  if (proc.GetProcedureName () == "game_sendupdates")
+  m.requests.Increment ();
+  ScopedTimer timer(m.latency);
+
+  try
     {
-      Json::Value fixedInput = input;
-      if (fixedInput.isObject () && !fixedInput.isMember ("toblock"))
-        fixedInput["toblock"] = "";
+      /* game_sendupdates is admitted in game_sendupdates3, which all
+         variants of the method end up in.  */
+      std::unique_ptr<RateLimiter::Admission> admission;
+      if (method == "getrawmempool")
+        admission = Admit ();
 
-      if (!procGameSendUpdates3.ValdiateParameters (fixedInput))
-        throw jsonrpc::JsonRpcException (
-            jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
-            "invalid parameters for game_sendupdates");
+      if (method == "game_sendupdates")
+        {
+          Json::Value fixedInput = input;
+          if (fixedInput.isObject () && !fixedInput.isMember ("toblock"))
+            fixedInput["toblock"] = "";
 
-      game_sendupdates3I (fixedInput, output);
-      return;
-    }
+          if (!procGameSendUpdates3.ValdiateParameters (fixedInput))
+            throw jsonrpc::JsonRpcException (
+                jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+                "invalid parameters for game_sendupdates");
+
+          game_sendupdates3I (fixedInput, output);
+          return;
+        }
 
-  XayaRpcServerStub::HandleMethodCall (proc, input, output);
+      XayaRpcServerStub::HandleMethodCall (proc, input, output);
+    }
+  catch (...)
+    {
+      m.errors.Increment ();
+      throw;
+    }
 }
 
 Json::Value
@@ -234,18 +1216,116 @@ Controller::RpcServer::getzmqnotifications ()
 {
   std::lock_guard<std::mutex> lock(run.parent.mut);
 
-  Json::Value res(Json::arrayValue);
-  Json::Value cur(Json::objectValue);
-  cur["type"] = "pubgameblocks";
-  cur["address"] = run.parent.zmqAddr;
-  res.append (cur);
+  const auto endpoints = run.parent.GetZmqEndpoints ();
+  CHECK (!endpoints.empty ());
+
+  /* The primary endpoint publishes all games, and is the only one reported
+     with the standard types (so that all GSPs find their notifications
+     there).  Additional shards are reported with their own types and the
+     games they publish, for subscribers that want to use them instead.  */
+  const auto add = [] (Json::Value& arr, const std::string& type,
+                        const std::string& addr) -> Json::Value&
+    {
+      Json::Value cur(Json::objectValue);
+      cur["type"] = type;
+      cur["address"] = addr;
+      return arr.append (cur);
+    };
+
+  std::vector<std::vector<std::string>> games;
+  if (endpoints.size () > 1)
+    {
+      games = run.zmq.GetGamesPerEndpoint ();
+      CHECK_EQ (games.size (), endpoints.size ());
+    }
 
+  Json::Value res(Json::arrayValue);
+  std::vector<std::string> types = {"pubgameblocks"};
   if (run.parent.pending)
+    types.push_back ("pubgamepending");
+  for (const auto& t : types)
+    {
+      add (res, t, endpoints[0]);
+      for (size_t i = 1; i < endpoints.size (); ++i)
+        {
+          Json::Value& cur = add (res, t + "shard", endpoints[i]);
+          Json::Value shardGames(Json::arrayValue);
+          for (const auto& g : games[i])
+            shardGames.append (g);
+          cur["games"] = shardGames;
+        }
+    }
+
+  return res;
+}
+
+Json::Value
+Controller::RpcServer::getzmqstats ()
+{
+  Json::Value topics(Json::objectValue);
+  for (const auto& entry : run.zmq.GetTopicStats ())
     {
-      cur["type"] = "pubgamepending";
-      res.append (cur);
+      const auto& stats = entry.second;
+
+      Json::Value cur(Json::objectValue);
+      cur["sent"] = static_cast<Json::Int64> (stats.sent);
+      cur["bytes"] = static_cast<Json::Int64> (stats.bytes);
+      cur["dropped"] = static_cast<Json::Int64> (stats.dropped);
+
+      Json::Value latency(Json::objectValue);
+      if (stats.sent > 0)
+        latency["average"]
+            = static_cast<Json::Int64> (stats.totalLatency.count ()
+                                          / stats.sent);
+      latency["max"] = static_cast<Json::Int64> (stats.maxLatency.count ());
+      cur["latencyus"] = latency;
+
+      topics[entry.first] = cur;
     }
 
+  Json::Value queued(Json::arrayValue);
+  for (const auto num : run.zmq.GetQueueSizes ())
+    queued.append (static_cast<Json::Int64> (num));
+
+  const auto compression = run.zmq.GetCompressionStats ();
+  Json::Value zstd(Json::objectValue);
+  zstd["messages"] = static_cast<Json::Int64> (compression.messages);
+  zstd["rawbytes"] = static_cast<Json::Int64> (compression.rawBytes);
+  zstd["compressedbytes"]
+      = static_cast<Json::Int64> (compression.compressedBytes);
+  std::string dict;
+  unsigned dictId;
+  if (run.zmq.GetZstdDictionary (dict, dictId))
+    zstd["dictid"] = static_cast<Json::Int64> (dictId);
+
+  const auto pendingStats = run.zmq.GetPendingBatchStats ();
+  Json::Value pending(Json::objectValue);
+  pending["messages"] = static_cast<Json::Int64> (pendingStats.messages);
+  pending["moves"] = static_cast<Json::Int64> (pendingStats.moves);
+  pending["maxmoves"] = static_cast<Json::Int64> (pendingStats.maxMoves);
+
+  Json::Value res(Json::objectValue);
+  res["topics"] = topics;
+  res["queued"] = queued;
+  res["coalesced"] = static_cast<Json::Int64> (run.zmq.GetCoalescedBlocks ());
+  res["zstd"] = zstd;
+  res["pending"] = pending;
+
+  return res;
+}
+
+Json::Value
+Controller::RpcServer::getzmqdictionary ()
+{
+  std::string dict;
+  unsigned dictId;
+  if (!run.zmq.GetZstdDictionary (dict, dictId))
+    return Json::Value ();
+
+  Json::Value res(Json::objectValue);
+  res["id"] = static_cast<Json::Int64> (dictId);
+  res["dictionary"] = xaya::EncodeBase64 (dict);
+
   return res;
 }
 
@@ -300,7 +1380,7 @@ Controller::RpcServer::getblockchaininfo ()
     res["chain"] = cachedChain;
   }
 
-  std::lock_guard<std::mutex> lockChain(run.mutChain);
+  const auto lockChain = LockChain ();
   const auto tipHeight = run.chain.GetTipHeight ();
   if (tipHeight == -1)
     {
@@ -323,67 +1403,189 @@ Controller::RpcServer::getblockchaininfo ()
 std::string
 Controller::RpcServer::getblockhash (const int height)
 {
-  std::lock_guard<std::mutex> lock(run.mutChain);
+  auto lock = LockChain ();
 
   std::string hash;
   if (run.chain.GetHashForHeight (height, hash))
     return hash;
 
   /* This might be a pruned block.  In this case, we query the main chain
-     for it.  */
+     for it (unless we have it cached already).  */
 
-  if (height >= run.chain.GetLowestUnprunedHeight ())
+  if (height < 0 || height >= run.chain.GetLowestUnprunedHeight ())
     throw jsonrpc::JsonRpcException (-8, "block height out of range");
 
+  if (run.prunedHashes.GetHash (height, hash))
+    return hash;
+
   std::vector<BlockData> blocks;
-  try
-    {
-      blocks = run.parent.base.GetBlockRange (height, 1);
-    }
-  catch (const std::exception& exc)
-    {
-      PropagateBaseChainError (exc);
-    }
+  {
+    ScopedUnlock unlock(&lock);
+    const auto admission = Admit ();
+    try
+      {
+        blocks = run.parent.base.GetBlockRange (height, 1);
+      }
+    catch (const std::exception& exc)
+      {
+        PropagateBaseChainError (exc);
+      }
+  }
 
   if (blocks.empty ())
     throw jsonrpc::JsonRpcException (-8, "block height out of range");
 
   CHECK_EQ (blocks.size (), 1);
+  run.prunedHashes.Add (height, blocks[0].hash);
   return blocks[0].hash;
 }
 
 Json::Value
 Controller::RpcServer::getblockheader (const std::string& hash)
 {
-  std::lock_guard<std::mutex> lock(run.mutChain);
+  auto lock = LockChain ();
 
   Json::Value res(Json::objectValue);
   res["hash"] = hash;
 
   uint64_t height;
-  if (run.chain.GetHeightForHash (hash, height))
+  if (run.chain.GetHeightForHash (hash, height)
+        || run.prunedHashes.GetHeight (hash, height))
     {
       res["height"] = static_cast<Json::Int64> (height);
       return res;
     }
 
   /* Check the base chain to see if this might be a pruned block.  */
-  try
+  int64_t baseHeight = -1;
+  {
+    ScopedUnlock unlock(&lock);
+    try
+      {
+        baseHeight = run.parent.base.GetMainchainHeight (hash);
+      }
+    catch (const std::exception& exc)
+      {
+        PropagateBaseChainError (exc);
+      }
+  }
+
+  if (baseHeight == -1)
+    throw jsonrpc::JsonRpcException (-5, "block not found");
+
+  /* Only blocks below our pruning depth are final and can be cached.
+     Others may be on a branch the base chain just switched to.  */
+  CHECK_GE (baseHeight, 0);
+  if (baseHeight < run.chain.GetLowestUnprunedHeight ())
+    run.prunedHashes.Add (baseHeight, hash);
+
+  res["height"] = static_cast<Json::Int64> (baseHeight);
+  return res;
+}
+
+Json::Value
+Controller::RpcServer::getblockrange (const int count,
+                                      const std::string& gameId,
+                                      const int start)
+{
+  if (start < 0 || count < 0)
+    throw jsonrpc::JsonRpcException (-8, "invalid block range");
+
+  std::unique_lock<std::mutex> lock(run.mutChain);
+
+  Json::Value res(Json::objectValue);
+  const int64_t tipHeight = run.chain.GetTipHeight ();
+  res["tipheight"] = static_cast<Json::Int64> (tipHeight);
+  res["blocks"] = Json::Value (Json::arrayValue);
+
+  CHECK_GT (FLAGS_xayax_block_range, 0);
+  if (tipHeight < start)
+    return res;
+  const unsigned num
+      = std::min<int64_t> ({count, FLAGS_xayax_block_range,
+                            tipHeight - start + 1});
+  if (num == 0)
+    return res;
+
+  /* Recently published blocks are taken directly from the ZMQ replay
+     buffer.  Otherwise we fetch them from the base chain without holding
+     the lock, and then verify that they are still on the main chain.  */
+  std::vector<BlockData> blocks;
+  if (!run.GetRecentBlockRange (start, num, blocks))
     {
-      const int64_t baseHeight = run.parent.base.GetMainchainHeight (hash);
-      if (baseHeight != -1)
+      {
+        ScopedUnlock unlock(&lock);
+        const auto admission = Admit ();
+        try
+          {
+            blocks = run.FetchBlockRange (start, num);
+          }
+        catch (const std::exception& exc)
+          {
+            PropagateBaseChainError (exc);
+          }
+      }
+
+      const int64_t lowestUnpruned = run.chain.GetLowestUnprunedHeight ();
+      for (unsigned i = 0; i < blocks.size (); ++i)
         {
-          CHECK_GE (baseHeight, 0);
-          res["height"] = static_cast<Json::Int64> (baseHeight);
-          return res;
+          if (static_cast<int64_t> (blocks[i].height) < lowestUnpruned)
+            continue;
+
+          std::string hash;
+          if (!run.chain.GetHashForHeight (blocks[i].height, hash)
+                || hash != blocks[i].hash)
+            {
+              VLOG (1)
+                  << "Block range changed while fetching, returning only "
+                  << i << " blocks";
+              blocks.resize (i);
+              break;
+            }
         }
     }
-  catch (const std::exception& exc)
-    {
-      PropagateBaseChainError (exc);
-    }
+  lock.unlock ();
+
+  for (auto& payload : run.zmq.GetBlockPayloads (blocks, gameId))
+    res["blocks"].append (std::move (payload));
+
+  return res;
+}
+
+std::string
+Controller::RpcServer::waitforchange (const std::string& blockHash)
+{
+  /* Each blocking call occupies an RPC worker thread (with the built-in
+     HTTP connector, which has a fixed number of them), so we limit how
+     many can be waiting at the same time.  */
+  int maxWaiters = FLAGS_xayax_waitforchange_max_waiters;
+  if (maxWaiters == 0 && FLAGS_xayax_rpc_threads > 0)
+    maxWaiters = std::max (FLAGS_xayax_rpc_threads / 2, 1);
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (maxWaiters > 0 && waiters >= static_cast<unsigned> (maxWaiters))
+      throw jsonrpc::JsonRpcException (-32005,
+                                       "too many waitforchange calls");
+    ++waiters;
+  }
+
+  std::string res;
+  {
+    std::unique_lock<std::mutex> lock(run.mutChain);
+
+    const auto timeout = std::chrono::steady_clock::now ()
+        + std::chrono::milliseconds (FLAGS_xayax_waitforchange_timeout_ms);
+    run.cvTip.wait_until (lock, timeout, [this, &blockHash] ()
+      {
+        return run.stopWaiting || run.GetTipHash () != blockHash;
+      });
+
+    res = run.GetTipHash ();
+  }
 
-  throw jsonrpc::JsonRpcException (-5, "block not found");
+  std::lock_guard<std::mutex> lock(mut);
+  --waiters;
+  return res;
 }
 
 Json::Value
@@ -404,9 +1606,7 @@ Controller::RpcServer::game_sendupdates3 (const std::string& from,
                                           const std::string& gameId,
                                           const std::string& to)
 {
-  /* TODO: Actually use the gameId to filter notifications sent.  For now,
-     we just trigger "default" ones.  This works as GSPs track their games
-     anyway, but it may send too many notifications.  */
+  const auto admission = Admit ();
 
   std::ostringstream reqtoken;
   {
@@ -416,13 +1616,39 @@ Controller::RpcServer::game_sendupdates3 (const std::string& from,
   }
 
   std::vector<BlockData> detaches, attaches;
+  uint64_t streamed = 0;
+  std::string streamTarget;
   bool ok;
   try
     {
-      std::lock_guard<std::mutex> lock(run.mutChain);
+      /* The lock is released while fetching blocks from the base chain,
+         so that other requests and syncing are not blocked.  */
+      std::unique_lock<std::mutex> lock(run.mutChain);
       ok = run.PushZmqBlocks (
               from, to, {}, FLAGS_xayax_block_range, reqtoken.str (),
-              detaches, attaches);
+              gameId, &lock, detaches, attaches);
+
+      /* If the GSP is further behind than what we sent right now, stream
+         the remaining blocks up to the current tip in the background.
+         The response then reports the final target, so that the GSP
+         keeps processing our notifications until it reaches it.  If the
+         stream does not get there, the GSP is told through a gap in the
+         sequence numbers.  */
+      if (ok && FLAGS_xayax_stream_catchup && to.empty ()
+            && !attaches.empty ())
+        {
+          const int64_t tipHeight = run.chain.GetTipHeight ();
+          const uint64_t lastHeight = attaches.back ().height;
+          std::string tipHash;
+          if (tipHeight > static_cast<int64_t> (lastHeight)
+                && run.chain.GetHashForHeight (tipHeight, tipHash)
+                && run.StartCatchUp (attaches.back (), tipHash, tipHeight,
+                                     reqtoken.str (), gameId))
+            {
+              streamed = tipHeight - lastHeight;
+              streamTarget = tipHash;
+            }
+        }
     }
   catch (const std::exception& exc)
     {
@@ -430,7 +1656,9 @@ Controller::RpcServer::game_sendupdates3 (const std::string& from,
     }
 
   std::string toBlock;
-  if (!attaches.empty ())
+  if (!streamTarget.empty ())
+    toBlock = streamTarget;
+  else if (!attaches.empty ())
     toBlock = attaches.back ().hash;
   else if (!detaches.empty ())
     toBlock = detaches.back ().parent;
@@ -439,7 +1667,7 @@ Controller::RpcServer::game_sendupdates3 (const std::string& from,
 
   Json::Value steps(Json::objectValue);
   steps["detach"] = static_cast<Json::Int64> (detaches.size ());
-  steps["attach"] = static_cast<Json::Int64> (attaches.size ());
+  steps["attach"] = static_cast<Json::Int64> (attaches.size () + streamed);
 
   Json::Value res(Json::objectValue);
   res["reqtoken"] = reqtoken.str ();
@@ -447,7 +1675,91 @@ Controller::RpcServer::game_sendupdates3 (const std::string& from,
   res["steps"] = steps;
   res["error"] = !ok;
 
-  return res;
+  return res;
+}
+
+std::string
+Controller::RpcServer::DecodeSignature (const std::string& sgn)
+{
+  /* The RPC argument for the signature is always base64 encoded (as with
+     Xaya Core).  The base chains expect "raw byte" signatures.  */
+  std::string rawSgn;
+  if (!xaya::DecodeBase64 (sgn, rawSgn))
+    {
+      LOG (WARNING) << "Signature is not base64: " << sgn;
+      throw jsonrpc::JsonRpcException (
+          jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+          "signature is not base64-encoded");
+    }
+
+  return rawSgn;
+}
+
+Json::Value
+Controller::RpcServer::VerificationResult (const std::string& addr,
+                                           const SignatureCache::Result& res)
+{
+  /* If addr is passed as "", then this RPC is supposed to do recovery
+     and return the signer address.  Otherwise, it should just return true
+     or false depending on validity for the given address.  This is what the
+     RPC does in Xaya Core.  */
+  if (!addr.empty ())
+    return res.valid && res.address == addr;
+
+  Json::Value out(Json::objectValue);
+  out["valid"] = res.valid;
+  if (res.valid)
+    out["address"] = res.address;
+  return out;
+}
+
+std::unique_ptr<RateLimiter::Admission>
+Controller::RpcServer::Admit ()
+{
+  if (run.limiter == nullptr)
+    return nullptr;
+
+  /* Requests from connectors that cannot identify their clients (like the
+     HTTP server of libjson-rpc-cpp) share a single bucket, so that the
+     limits still apply to them as a whole.  */
+  std::string client = ClientScope::GetCurrent ();
+  if (client.empty ())
+    client = "unknown";
+
+  auto& reg = MetricsRegistry::Get ();
+  static Counter& admitted = reg.GetCounter (
+      "xayax_rpc_admission_total",
+      "Expensive RPC requests by admission result",
+      "result=\"admitted\"");
+  static Counter& rateLimited = reg.GetCounter (
+      "xayax_rpc_admission_total",
+      "Expensive RPC requests by admission result",
+      "result=\"ratelimited\"");
+  static Counter& tooManyConcurrent = reg.GetCounter (
+      "xayax_rpc_admission_total",
+      "Expensive RPC requests by admission result",
+      "result=\"concurrency\"");
+
+  std::unique_ptr<RateLimiter::Admission> res;
+  switch (run.limiter->TryAdmit (client, res))
+    {
+    case RateLimiter::Result::ADMITTED:
+      admitted.Increment ();
+      return res;
+
+    case RateLimiter::Result::RATE_LIMITED:
+      rateLimited.Increment ();
+      VLOG (1) << "Rate limit exceeded for RPC client";
+      break;
+
+    case RateLimiter::Result::TOO_MANY_CONCURRENT:
+      tooManyConcurrent.Increment ();
+      VLOG (1) << "Too many concurrent requests from RPC client";
+      break;
+    }
+
+  /* This is the "limit exceeded" error code from EIP-1474.  */
+  throw jsonrpc::JsonRpcException (-32005, "request limit exceeded");
 }
 
 Json::Value
@@ -455,65 +1767,110 @@ Controller::RpcServer::verifymessage (const std::string& addr,
                                       const std::string& msg,
                                       const std::string& sgn)
 {
-  /* The RPC argument for the signature is always base64 encoded (as with
-     Xaya Core).  The base chains expect "raw byte" signatures.  */
-  std::string rawSgn;
-  if (!xaya::DecodeBase64 (sgn, rawSgn))
-    {
-      LOG (WARNING) << "Signature is not base64: " << sgn;
-      throw jsonrpc::JsonRpcException (
-          jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
-          "signature is not base64-encoded");
-    }
-
-  /* If addr is passed as "", then this RPC is supposed to do recovery
-     and return the signer address.  Otherwise, it should just return true
-     or false depending on validity for the given address.  This is what the
-     RPC does in Xaya Core.  */
-  const bool addrRecovery = addr.empty ();
+  const std::string rawSgn = DecodeSignature (sgn);
 
-  std::string signerAddr;
-  bool ok;
+  SignatureCache::Result res;
   try
     {
-      ok = run.parent.base.VerifyMessage (msg, rawSgn, signerAddr);
+      res = run.VerifyMessage (msg, rawSgn);
     }
   catch (const std::exception& exc)
     {
       PropagateBaseChainError (exc);
     }
 
-  if (!ok)
+  return VerificationResult (addr, res);
+}
+
+Json::Value
+Controller::RpcServer::verifymessages (const Json::Value& requests)
+{
+  struct Request
+  {
+    std::string address;
+    std::string message;
+    std::string signature;
+    SignatureCache::Result result;
+  };
+
+  if (requests.size ()
+        > static_cast<unsigned> (std::max (FLAGS_xayax_verify_max_batch, 0)))
     {
-      if (!addrRecovery)
-        return false;
+      std::ostringstream msg;
+      msg << "at most " << FLAGS_xayax_verify_max_batch
+          << " requests are allowed per call";
+      throw jsonrpc::JsonRpcException (
+          jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS, msg.str ());
+    }
 
-      Json::Value res(Json::objectValue);
-      res["valid"] = false;
-      return res;
+  /* Parse and validate all requests first, so that we do not start
+     any verification work for invalid calls.  */
+  std::vector<Request> reqs;
+  for (const auto& r : requests)
+    {
+      if (!r.isObject () || !r["message"].isString ()
+            || !r["signature"].isString ()
+            || !(r["address"].isNull () || r["address"].isString ()))
+        throw jsonrpc::JsonRpcException (
+            jsonrpc::Errors::ERROR_RPC_INVALID_PARAMS,
+            "each request must be an object with message, signature and"
+            " optionally address");
+
+      Request cur;
+      cur.address = r["address"].asString ();
+      cur.message = r["message"].asString ();
+      cur.signature = DecodeSignature (r["signature"].asString ());
+      reqs.push_back (std::move (cur));
     }
 
-  if (!addrRecovery)
-    return signerAddr == addr;
+  std::mutex mutErr;
+  bool failed = false;
+  std::string error;
+  run.verifyPool.Run (reqs.size (), [&] (const size_t i)
+    {
+      try
+        {
+          reqs[i].result = run.VerifyMessage (reqs[i].message,
+                                              reqs[i].signature);
+        }
+      catch (const std::exception& exc)
+        {
+          std::lock_guard<std::mutex> lock(mutErr);
+          failed = true;
+          error = exc.what ();
+        }
+    });
+
+  if (failed)
+    PropagateBaseChainError (std::runtime_error (error));
+
+  Json::Value res(Json::arrayValue);
+  for (const auto& r : reqs)
+    res.append (VerificationResult (r.address, r.result));
 
-  Json::Value res(Json::objectValue);
-  res["valid"] = true;
-  res["address"] = signerAddr;
   return res;
 }
 
 Json::Value
 Controller::RpcServer::getrawmempool ()
 {
+  /* Without pending tracking, we get no notifications about new
+     transactions and thus cannot keep a cache up-to-date.  */
+  bool refresh = false;
   std::vector<std::string> mempool;
-  try
-    {
-      mempool = run.parent.base.GetMempool ();
-    }
-  catch (const std::exception& exc)
-    {
-      PropagateBaseChainError (exc);
-    }
+  if (!run.parent.pending || !run.mempool.Get (mempool, refresh))
+    try
+      {
+        mempool = run.parent.base.GetMempool ();
+        if (refresh)
+          run.mempool.Refreshed (mempool);
+      }
+    catch (const std::exception& exc)
+      {
+        if (refresh)
+          run.mempool.RefreshFailed ();
+        PropagateBaseChainError (exc);
+      }
 
   Json::Value res(Json::arrayValue);
   for (const auto& txid : mempool)
@@ -532,8 +1889,8 @@ Controller::RpcServer::stop ()
 
 Controller::RunData::RunData (Controller& p, const std::string& dbFile)
   : parent(p), chain(dbFile),
-    zmq(parent.zmqAddr), pendings(zmq),
-    http(parent.rpcPort)
+    zmq(parent.GetZmqEndpoints ()), pendings(zmq),
+    verifyPool(std::max (FLAGS_xayax_verify_threads, 0))
 {
   CHECK (parent.run == nullptr);
   parent.run = this;
@@ -544,12 +1901,87 @@ Controller::RunData::RunData (Controller& p, const std::string& dbFile)
   for (const auto& g : parent.trackedGames)
     zmq.TrackGame (g);
 
-  if (parent.rpcListenLocally)
-    http.BindLocalhost ();
+  if (FLAGS_xayax_rpc_threads > 0)
+    {
+      CHECK_GT (FLAGS_xayax_rpc_queue, 0);
+      CHECK_GT (FLAGS_xayax_rpc_max_connections, 0);
+      auto server = std::make_unique<HttpConnector> (parent.rpcPort,
+                                                     parent.rpcListenLocally,
+                                                     FLAGS_xayax_rpc_threads,
+                                                     FLAGS_xayax_rpc_queue);
+      server->SetMaxConnections (FLAGS_xayax_rpc_max_connections);
+      http = std::move (server);
+    }
+  else
+    {
+      auto server = std::make_unique<jsonrpc::HttpServer> (parent.rpcPort);
+      if (parent.rpcListenLocally)
+        server->BindLocalhost ();
+      http = std::move (server);
+    }
+
+  if (FLAGS_xayax_rpc_client_rate > 0 || FLAGS_xayax_rpc_client_concurrency > 0)
+    {
+      if (FLAGS_xayax_rpc_threads <= 0)
+        LOG (WARNING)
+            << "RPC clients can only be told apart with --xayax_rpc_threads,"
+            << " all clients share the same request limits";
+      limiter = std::make_unique<RateLimiter> (
+          std::max (FLAGS_xayax_rpc_client_rate, 0.0),
+          std::max (FLAGS_xayax_rpc_client_burst, 1),
+          std::max (FLAGS_xayax_rpc_client_concurrency, 0));
+    }
 
-  rpc = std::make_unique<RpcServer> (http, *this);
+  rpc = std::make_unique<RpcServer> (*http, *this);
   rpc->StartListening ();
 
+  if (!parent.rpcSocket.empty ())
+    {
+      /* The socket file may still exist from an earlier run, and would
+         prevent us from listening on it.  But we must not delete anything
+         else that happens to be at the configured path.  */
+      if (fs::exists (fs::symlink_status (parent.rpcSocket)))
+        {
+          CHECK (fs::is_socket (fs::symlink_status (parent.rpcSocket)))
+              << "RPC socket path " << parent.rpcSocket
+              << " exists and is not a socket";
+          LOG (WARNING) << "Removing existing RPC socket " << parent.rpcSocket;
+          fs::remove (parent.rpcSocket);
+        }
+
+      /* The socket uses the same number of workers as the built-in
+         TCP connector, if that is enabled.  */
+      const unsigned threads
+          = FLAGS_xayax_rpc_threads > 0 ? FLAGS_xayax_rpc_threads : 4;
+      unixSocket = std::make_unique<HttpConnector> (parent.rpcSocket, threads,
+                                                    FLAGS_xayax_rpc_queue);
+      unixSocket->SetMaxConnections (FLAGS_xayax_rpc_max_connections);
+      unixSocket->SetHandler (http->GetHandler ());
+      CHECK (unixSocket->StartListening ())
+          << "Failed to listen on RPC socket " << parent.rpcSocket;
+    }
+
+  if (parent.metricsPort > 0)
+    {
+      metricsHttp = std::make_unique<HttpConnector> (parent.metricsPort,
+                                                     parent.rpcListenLocally,
+                                                     1, 16);
+      metricsHttp->SetPageHandler ([] (const std::string& target,
+                                       std::string& contentType,
+                                       std::string& body)
+        {
+          if (target != "/metrics")
+            return false;
+
+          contentType = "text/plain; version=0.0.4";
+          body = MetricsRegistry::Get ().Render ();
+          return true;
+        });
+      CHECK (metricsHttp->StartListening ())
+          << "Failed to serve metrics on port " << parent.metricsPort;
+      LOG (INFO) << "Serving metrics on port " << parent.metricsPort;
+    }
+
   parent.ServersStarted ();
 
   parent.base.SetCallbacks (this);
@@ -562,7 +1994,20 @@ Controller::RunData::~RunData ()
   CHECK (parent.run == this);
   parent.run = nullptr;
 
+  /* Wake up pending waitforchange calls, so that stopping the RPC server
+     does not have to wait for their timeouts.  */
+  {
+    std::lock_guard<std::mutex> lock(mutChain);
+    stopWaiting = true;
+    cvTip.notify_all ();
+  }
+
+  if (metricsHttp != nullptr)
+    metricsHttp->StopListening ();
+  if (unixSocket != nullptr)
+    unixSocket->StopListening ();
   rpc->StopListening ();
+  StopCatchUps ();
 
   parent.base.SetCallbacks (nullptr);
   if (sync != nullptr)
@@ -581,6 +2026,23 @@ void
 Controller::RunData::PendingMoves (const std::vector<MoveData>& moves)
 {
   pendings.PendingMoves (moves);
+  mempool.AddMoves (moves);
+}
+
+SignatureCache::Result
+Controller::RunData::VerifyMessage (const std::string& msg,
+                                    const std::string& sgn)
+{
+  SignatureCache::Result res;
+  if (signatures.Get (msg, sgn, res))
+    return res;
+
+  res.valid = parent.base.VerifyMessage (msg, sgn, res.address);
+  if (!res.valid)
+    res.address.clear ();
+  signatures.Add (msg, sgn, res);
+
+  return res;
 }
 
 void
@@ -588,10 +2050,16 @@ Controller::RunData::TipUpdatedFrom (const std::string& oldTip,
                                      const std::vector<BlockData>& attaches)
 {
   CHECK (!attaches.empty ());
+
+  /* Update the mempool before notifying GSPs, so that they will not see
+     the confirmed transactions as still pending afterwards.  */
+  mempool.BlocksAttached (attaches);
+
   std::vector<BlockData> detach, queriedAttach;
   try
     {
-      PushZmqBlocks (oldTip, "", attaches, 0, "", detach, queriedAttach);
+      PushZmqBlocks (oldTip, "", attaches, 0, "", "", nullptr,
+                     detach, queriedAttach);
     }
   catch (const std::exception& exc)
     {
@@ -604,6 +2072,10 @@ Controller::RunData::TipUpdatedFrom (const std::string& oldTip,
      notifications have been sent to GSPs.  */
   pendings.ChainstateTipChanged (attaches.back ().hash);
 
+  /* The chain lock is held by the caller, so waitforchange calls will
+     see the new tip once we are done here.  */
+  cvTip.notify_all ();
+
   /* The pruning and sanityChecks flags in parent are never modified
      while the process is running, so it is fine to read them here without
      holding the parent mutex.  */
@@ -614,17 +2086,324 @@ Controller::RunData::TipUpdatedFrom (const std::string& oldTip,
   CHECK_GE (parent.maxReorgDepth, 0);
   const auto tipHeight = chain.GetTipHeight ();
   if (tipHeight > parent.maxReorgDepth + 1)
-    chain.Prune (tipHeight - parent.maxReorgDepth - 1);
+    {
+      const int64_t untilHeight = tipHeight - parent.maxReorgDepth - 1;
+
+      /* Remember the most recent of the blocks that will be pruned now, as
+         those are the most likely ones for GSPs to look up.  */
+      const int64_t fromHeight
+          = std::max<int64_t> (chain.GetLowestUnprunedHeight (),
+                               untilHeight - FLAGS_xayax_hash_cache_size + 1);
+      for (int64_t h = fromHeight; h <= untilHeight; ++h)
+        {
+          std::string hash;
+          if (chain.GetHashForHeight (h, hash))
+            prunedHashes.Add (h, hash);
+        }
+
+      chain.Prune (untilHeight);
+    }
+}
+
+std::string
+Controller::RunData::GetTipHash () const
+{
+  const auto tipHeight = chain.GetTipHeight ();
+  if (tipHeight == -1)
+    return "";
+
+  CHECK_GE (tipHeight, 0);
+  std::string tipHash;
+  CHECK (chain.GetHashForHeight (tipHeight, tipHash));
+  return tipHash;
+}
+
+bool
+Controller::RunData::GetRecentBlockRange (const uint64_t start,
+                                          const unsigned num,
+                                          std::vector<BlockData>& blocks)
+{
+  blocks.clear ();
+  for (uint64_t h = start; h < start + num; ++h)
+    {
+      std::string hash;
+      BlockData blk;
+      if (!chain.GetHashForHeight (h, hash) || !zmq.GetRecentBlock (hash, blk))
+        {
+          blocks.clear ();
+          return false;
+        }
+      blocks.push_back (std::move (blk));
+    }
+
+  VLOG (1)
+      << "Using " << num << " blocks from height " << start
+      << " from the replay buffer";
+  return true;
+}
+
+std::vector<BlockData>
+Controller::RunData::FetchBlockRange (const uint64_t start,
+                                     const uint64_t count)
+{
+  const auto key = std::make_pair (start, count);
+
+  std::promise<std::vector<BlockData>> promise;
+  {
+    std::unique_lock<std::mutex> lock(mutFetches);
+    const auto mit = fetches.find (key);
+    if (mit != fetches.end ())
+      {
+        auto fut = mit->second;
+        lock.unlock ();
+
+        VLOG (1)
+            << "Waiting for in-flight fetch of " << count
+            << " blocks from height " << start;
+        return fut.get ();
+      }
+
+    fetches.emplace (key, promise.get_future ().share ());
+  }
+
+  /* We do the actual fetch now, and make sure to hand the result (or
+     exception) to waiting requests and remove the in-flight entry in
+     any case.  */
+  try
+    {
+      auto res = parent.base.GetBlockRange (start, count);
+      promise.set_value (res);
+
+      std::lock_guard<std::mutex> lock(mutFetches);
+      fetches.erase (key);
+      return res;
+    }
+  catch (...)
+    {
+      promise.set_exception (std::current_exception ());
+
+      std::lock_guard<std::mutex> lock(mutFetches);
+      fetches.erase (key);
+      throw;
+    }
+}
+
+bool
+Controller::RunData::StartCatchUp (const BlockData& last,
+                                   const std::string& targetHash,
+                                   const uint64_t targetHeight,
+                                   const std::string& reqtoken,
+                                   const std::string& gameId)
+{
+  std::lock_guard<std::mutex> lock(mutCatchUp);
+  if (stopCatchUp)
+    return false;
+
+  /* Clean up the jobs that have finished already.  */
+  for (auto it = catchUpJobs.begin (); it != catchUpJobs.end (); )
+    if (it->wait_for (std::chrono::seconds (0)) == std::future_status::ready)
+      it = catchUpJobs.erase (it);
+    else
+      ++it;
+
+  if (catchUpJobs.size ()
+        >= static_cast<size_t> (std::max (FLAGS_xayax_stream_max_jobs, 0)))
+    {
+      LOG (WARNING)
+          << "Too many streaming catch-ups running, not streaming for "
+          << reqtoken;
+      return false;
+    }
+
+  LOG (INFO)
+      << "Streaming blocks " << (last.height + 1) << " to " << targetHeight
+      << " for " << reqtoken;
+  catchUpJobs.push_back (std::async (std::launch::async,
+      &RunData::RunCatchUp, this, last.hash, last.height + 1, targetHash,
+      targetHeight, reqtoken, gameId));
+  return true;
+}
+
+void
+Controller::RunData::RunCatchUp (std::string prev, uint64_t next,
+                                 const std::string& targetHash,
+                                 const uint64_t targetHeight,
+                                 const std::string& reqtoken,
+                                 const std::string& gameId)
+{
+  CHECK_GT (FLAGS_xayax_block_range, 0);
+  const auto fetch = [this, targetHeight] (const uint64_t start)
+    {
+      const uint64_t count
+          = std::min<uint64_t> (FLAGS_xayax_block_range,
+                                targetHeight - start + 1);
+      return std::async (std::launch::async,
+                         &RunData::FetchBlockRange, this, start, count);
+    };
+
+  const auto startTime = std::chrono::steady_clock::now ();
+  uint64_t sent = 0;
+
+  auto ahead = fetch (next);
+  while (next <= targetHeight)
+    {
+      std::vector<BlockData> blocks;
+      try
+        {
+          blocks = ahead.get ();
+        }
+      catch (const std::exception& exc)
+        {
+          LOG (WARNING)
+              << "Error fetching blocks for " << reqtoken << ": " << exc.what ();
+          break;
+        }
+      if (blocks.empty ())
+        {
+          LOG (WARNING) << "Base chain returned no blocks for " << reqtoken;
+          break;
+        }
+
+      /* Start fetching the next chunk while we publish this one.  */
+      const uint64_t after = next + blocks.size ();
+      if (after <= targetHeight)
+        ahead = fetch (after);
+
+      /* Make sure the blocks connect to what we sent so far, and that we
+         do not send blocks the local chainstate does not know yet.  */
+      if (blocks.front ().parent != prev)
+        {
+          LOG (WARNING)
+              << "Chain changed while streaming blocks for " << reqtoken;
+          break;
+        }
+      {
+        std::lock_guard<std::mutex> lock(mutChain);
+        uint64_t height;
+        if (blocks.back ().height
+                >= static_cast<uint64_t> (chain.GetLowestUnprunedHeight ())
+              && !chain.GetHeightForHash (blocks.back ().hash, height))
+          {
+            LOG (WARNING)
+                << "Streamed blocks for " << reqtoken
+                << " are not known to the local chain state";
+            break;
+          }
+      }
+
+      try
+        {
+          zmq.SendBlockAttaches (blocks, reqtoken, gameId);
+        }
+      catch (const std::exception& exc)
+        {
+          LOG (WARNING)
+              << "Error sending blocks for " << reqtoken << ": " << exc.what ();
+          break;
+        }
+      prev = blocks.back ().hash;
+      next = after;
+      sent += blocks.size ();
+
+      /* Apply the rate limit, but stop waiting when we are shut down.  */
+      std::unique_lock<std::mutex> lock(mutCatchUp);
+      if (FLAGS_xayax_stream_blocks_per_second > 0)
+        {
+          const auto until = startTime
+              + std::chrono::milliseconds (
+                  1'000 * sent / FLAGS_xayax_stream_blocks_per_second);
+          cvCatchUp.wait_until (lock, until, [this] ()
+            {
+              return stopCatchUp;
+            });
+        }
+      if (stopCatchUp)
+        break;
+    }
+
+  /* The GSP was told to wait for the target block.  If we did not send it,
+     or it has been reorged away in the meantime (so that the GSP may have
+     ignored the live notifications for that while catching up), then it
+     has to find out from a gap in the sequence numbers instead.  */
+  bool reached = (prev == targetHash);
+  if (reached)
+    {
+      std::lock_guard<std::mutex> lock(mutChain);
+      std::string hash;
+      reached = chain.GetHashForHeight (targetHeight, hash)
+                  && hash == targetHash;
+    }
+  if (!reached)
+    {
+      LOG (WARNING)
+          << "Streaming for " << reqtoken << " did not reach " << targetHash
+          << ", marking the block notifications as missed";
+      try
+        {
+          zmq.SkipBlockNotifications (gameId);
+        }
+      catch (const std::exception& exc)
+        {
+          LOG (WARNING)
+              << "Error skipping notifications for " << reqtoken << ": "
+              << exc.what ();
+        }
+      return;
+    }
+
+  LOG (INFO) << "Finished streaming " << sent << " blocks for " << reqtoken;
+}
+
+void
+Controller::RunData::StopCatchUps ()
+{
+  std::list<std::future<void>> jobs;
+  {
+    std::lock_guard<std::mutex> lock(mutCatchUp);
+    stopCatchUp = true;
+    cvCatchUp.notify_all ();
+    jobs = std::move (catchUpJobs);
+  }
+
+  for (auto& j : jobs)
+    j.wait ();
 }
 
 bool
 Controller::RunData::PushZmqBlocks (const std::string& from,
                                     const std::string& to,
                                     const std::vector<BlockData>& attaches,
-                                    unsigned num,
+                                    const unsigned num,
                                     const std::string& reqtoken,
+                                    const std::string& gameId,
+                                    std::unique_lock<std::mutex>* lockChain,
                                     std::vector<BlockData>& detach,
                                     std::vector<BlockData>& queriedAttach)
+{
+  std::vector<BlockData> toAttach;
+  const bool ok = GetZmqBlocks (from, to, attaches, num, lockChain,
+                                detach, queriedAttach, toAttach);
+
+  /* Sending just queues the notifications in the ZMQ publisher, but
+     there is no need to hold the lock for it anyway.  */
+  ScopedUnlock unlock(lockChain);
+  for (const auto& blk : detach)
+    zmq.SendBlockDetach (blk, reqtoken, gameId);
+  if (!toAttach.empty ())
+    zmq.SendBlockAttaches (toAttach, reqtoken, gameId);
+
+  return ok;
+}
+
+bool
+Controller::RunData::GetZmqBlocks (const std::string& from,
+                                   const std::string& to,
+                                   const std::vector<BlockData>& attaches,
+                                   unsigned num,
+                                   std::unique_lock<std::mutex>* lockChain,
+                                   std::vector<BlockData>& detach,
+                                   std::vector<BlockData>& queriedAttach,
+                                   std::vector<BlockData>& toAttach)
 {
   /* This "dual-purpose" method may be called with an explicit "to" block
      and no attaches from the game_sendupdates RPC, or with attaches but
@@ -632,27 +2411,33 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
      be called with both set (which simplifies assumptions/logic below).  */
   CHECK (to.empty () || attaches.empty ());
 
+  detach.clear ();
+  queriedAttach.clear ();
+  toAttach.clear ();
+
   /* If this is a sequence of the very first blocks / blocks re-imported
      not matching up to the current chain, just push the attach blocks.  */
   if (from.empty ())
     {
       LOG_IF (WARNING, attaches.empty ())
           << "Requested ZMQ blocks without explicit from and no attaches";
-      for (const auto& blk : attaches)
-        zmq.SendBlockAttach (blk, reqtoken);
+      toAttach = attaches;
       return true;
     }
 
-  const int64_t pruningDepth = chain.GetLowestUnprunedHeight ();
+  int64_t pruningDepth = chain.GetLowestUnprunedHeight ();
   CHECK_GE (pruningDepth, 0);
 
-  detach.clear ();
   int64_t mainchainHeight = -1;
   if (!chain.GetForkBranch (from, detach))
     {
       /* The block is not known, which most likely means that it is
          an old main chain block that was pruned.  */
-      mainchainHeight = parent.base.GetMainchainHeight (from);
+      {
+        ScopedUnlock unlock(lockChain);
+        mainchainHeight = parent.base.GetMainchainHeight (from);
+      }
+      pruningDepth = chain.GetLowestUnprunedHeight ();
       if (mainchainHeight == -1)
         {
           /* Usually, the 'from' block is one that was previously a best tip
@@ -680,8 +2465,23 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
           return false;
         }
     }
-  for (const auto& blk : detach)
-    zmq.SendBlockDetach (blk, reqtoken);
+
+  /* The detaches from the local chainstate, which we use to check
+     that it has not been changed in the meantime at the end.  This has
+     to be done whenever we released the lock while querying the base
+     chain (e.g. in a reorg).  */
+  const std::vector<BlockData> branch = detach;
+  const auto branchUnchanged = [this, &from, &branch] ()
+    {
+      std::vector<BlockData> branchNow;
+      chain.GetForkBranch (from, branchNow);
+      return branchNow.size () == branch.size ()
+          && std::equal (branch.begin (), branch.end (), branchNow.begin (),
+                         [] (const BlockData& a, const BlockData& b)
+                           {
+                             return a.hash == b.hash;
+                           });
+    };
 
   /* Find the height starting from which we need to send attach blocks from
      the main chain.  forkPoint will be the main-chain block to which we
@@ -718,7 +2518,10 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
   int64_t toHeight = -1;
   if (!to.empty ())
     {
-      toHeight = parent.base.GetMainchainHeight (to);
+      {
+        ScopedUnlock unlock(lockChain);
+        toHeight = parent.base.GetMainchainHeight (to);
+      }
       if (toHeight == -1)
         {
           LOG (WARNING)
@@ -741,8 +2544,11 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
              Query them as range on the main chain and then add in the
              right order to detach.  */
           num = std::min<unsigned> (num, forkHeight - toHeight);
-          const auto toDetach
-              = parent.base.GetBlockRange (forkHeight - num + 1, num);
+          std::vector<BlockData> toDetach;
+          {
+            ScopedUnlock unlock(lockChain);
+            toDetach = FetchBlockRange (forkHeight - num + 1, num);
+          }
           if (toDetach.back ().hash != forkPoint)
             {
               LOG (WARNING)
@@ -750,11 +2556,30 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
                   << forkPoint << ", race condition?";
               return false;
             }
-          for (auto it = toDetach.rbegin (); it != toDetach.rend (); ++it)
+
+          /* The detaches towards "to" have to be from the current main
+             chain, i.e. the fork point must still be on it (unless it
+             has been pruned) and the branch to it unchanged.  */
+          std::string hashNow;
+          if (forkHeight >= static_cast<uint64_t> (
+                                chain.GetLowestUnprunedHeight ())
+                && (!chain.GetHashForHeight (forkHeight, hashNow)
+                      || hashNow != forkPoint))
+            {
+              LOG (WARNING)
+                  << "Fork point " << forkPoint
+                  << " is no longer on the main chain, race condition?";
+              return false;
+            }
+          if (!branchUnchanged ())
             {
-              detach.push_back (*it);
-              zmq.SendBlockDetach (*it, reqtoken);
+              LOG (WARNING)
+                  << "Chain state changed while querying detach blocks,"
+                     " race condition?";
+              return false;
             }
+          for (auto it = toDetach.rbegin (); it != toDetach.rend (); ++it)
+            detach.push_back (*it);
           return true;
         }
 
@@ -785,7 +2610,7 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
               CHECK_EQ (blk.parent, forkPoint);
             }
           if (blk.height > forkHeight)
-            zmq.SendBlockAttach (blk, reqtoken);
+            toAttach.push_back (blk);
         }
       CHECK (foundForkPoint);
       return true;
@@ -801,7 +2626,14 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
     targetHeight = toHeight;
   CHECK_GE (targetHeight, forkHeight);
   num = std::min<unsigned> (num, targetHeight - forkHeight);
-  queriedAttach = parent.base.GetBlockRange (forkHeight + 1, num);
+  if (!GetRecentBlockRange (forkHeight + 1, num, queriedAttach))
+    {
+      {
+        ScopedUnlock unlock(lockChain);
+        queriedAttach = FetchBlockRange (forkHeight + 1, num);
+      }
+      pruningDepth = chain.GetLowestUnprunedHeight ();
+    }
   if (queriedAttach.empty ())
     return true;
 
@@ -841,9 +2673,18 @@ Controller::RunData::PushZmqBlocks (const std::string& from,
       CHECK_EQ (height, queriedAttach.back ().height);
     }
 
-  for (const auto& blk : queriedAttach)
-    zmq.SendBlockAttach (blk, reqtoken);
+  /* If we released the lock while querying the base chain, the detach
+     branch may have changed by now (e.g. in a reorg).  */
+  if (!branchUnchanged ())
+    {
+      LOG (WARNING)
+          << "Chain state changed while querying attach blocks,"
+             " race condition?";
+      queriedAttach.clear ();
+      return false;
+    }
 
+  toAttach = queriedAttach;
   return true;
 }
 
@@ -867,6 +2708,22 @@ Controller::SetZmqEndpoint (const std::string& addr)
   zmqAddr = addr;
 }
 
+void
+Controller::AddZmqShardEndpoint (const std::string& addr)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (run == nullptr) << "Instance is already running";
+  zmqShardAddrs.push_back (addr);
+}
+
+std::vector<std::string>
+Controller::GetZmqEndpoints () const
+{
+  std::vector<std::string> res = {zmqAddr};
+  res.insert (res.end (), zmqShardAddrs.begin (), zmqShardAddrs.end ());
+  return res;
+}
+
 void
 Controller::SetRpcBinding (const int p, const bool local)
 {
@@ -876,6 +2733,22 @@ Controller::SetRpcBinding (const int p, const bool local)
   rpcListenLocally = local;
 }
 
+void
+Controller::SetRpcUnixSocket (const std::string& path)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (run == nullptr) << "Instance is already running";
+  rpcSocket = path;
+}
+
+void
+Controller::SetMetricsPort (const int p)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  CHECK (run == nullptr) << "Instance is already running";
+  metricsPort = p;
+}
+
 void
 Controller::EnablePending ()
 {
@@ -11,6 +11,7 @@
 #include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace xayax
 {
@@ -55,10 +56,21 @@ private:
   /** Endpoint for the ZMQ server.  */
   std::string zmqAddr;
 
+  /**
+   * Additional endpoints for ZMQ publisher shards.  If any are set, the
+   * games are distributed over these (while the main endpoint still
+   * publishes all of them).
+   */
+  std::vector<std::string> zmqShardAddrs;
+
   /** Whether or not the RPC server should listen only locally.  */
   bool rpcListenLocally;
   /** Port for the RPC server.  */
   int rpcPort = -1;
+  /** If not empty, path of a Unix domain socket to serve RPC on as well.  */
+  std::string rpcSocket;
+  /** If positive, port for serving the metrics page over HTTP.  */
+  int metricsPort = -1;
 
   /** Mutex for this instance (for the Run/Stop interaction).  */
   std::mutex mut;
@@ -78,6 +90,12 @@ private:
    */
   void DisableSyncForTesting ();
 
+  /**
+   * Returns all ZMQ endpoints (the main one followed by all shards).
+   * Must be called with the lock held.
+   */
+  std::vector<std::string> GetZmqEndpoints () const;
+
   friend class ControllerTests;
 
 protected:
@@ -108,12 +126,44 @@ public:
    */
   void SetZmqEndpoint (const std::string& addr);
 
+  /**
+   * Adds another endpoint for a ZMQ publisher shard.  Notifications for
+   * each game are sent through one of the shard endpoints in addition to
+   * the main one set with SetZmqEndpoint, so that the load of building and
+   * sending them can be spread across multiple threads by subscribing to
+   * the shards.  The main endpoint is reported by getzmqnotifications with
+   * the standard types, and the shards as "pubgameblocksshard" (and
+   * "pubgamependingshard") together with the games they publish.
+   */
+  void AddZmqShardEndpoint (const std::string& addr);
+
   /**
    * Sets up the binding parameters (port and whether or not to bind only
    * on localhost) for the RPC server.
    */
   void SetRpcBinding (int p, bool local);
 
+  /**
+   * Makes the RPC server also available on a Unix domain socket at the given
+   * path (in addition to TCP).  This avoids the overhead of TCP for clients
+   * on the same host.  The socket speaks HTTP just like the main RPC
+   * interface, so that any HTTP JSON-RPC client that supports Unix sockets
+   * can use it (e.g. curl with --unix-socket).  Clients are identified by
+   * their user ID for the per-client request limits.
+   *
+   * If something exists at the path already, it is removed on startup if
+   * it is a socket (e.g. left over from an earlier run), and startup fails
+   * if it is anything else.
+   */
+  void SetRpcUnixSocket (const std::string& path);
+
+  /**
+   * Enables serving of the metrics (see MetricsRegistry) in the Prometheus
+   * text format on the given port, at the path /metrics.  The binding
+   * is local-only or not in the same way as for the RPC server.
+   */
+  void SetMetricsPort (int p);
+
   /**
    * Tries to enable tracking of pending moves.  This will call EnablePending
    * on the base-chain implementation, and if the base chain supports pendings,
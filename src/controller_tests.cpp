@@ -7,6 +7,8 @@
 #include "rpc-stubs/xayarpcclient.h"
 #include "testutils.hpp"
 
+#include <xayautil/base64.hpp>
+
 #include <jsonrpccpp/client.h>
 #include <jsonrpccpp/client/connectors/httpclient.h>
 #include <jsonrpccpp/common/exception.h>
@@ -15,14 +17,33 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #include <experimental/filesystem>
 
+#include <cstring>
+#include <set>
 #include <sstream>
+#include <thread>
 
 namespace xayax
 {
 
 DECLARE_int32 (xayax_block_range);
+DECLARE_int32 (xayax_hash_cache_size);
+DECLARE_int32 (xayax_mempool_refresh_ms);
+DECLARE_int32 (xayax_rpc_threads);
+DECLARE_double (xayax_rpc_client_rate);
+DECLARE_int32 (xayax_rpc_client_burst);
+DECLARE_int32 (xayax_zmq_replay_blocks);
+DECLARE_bool (xayax_stream_catchup);
+DECLARE_int32 (xayax_stream_max_jobs);
+DECLARE_int32 (xayax_stream_blocks_per_second);
+DECLARE_int32 (xayax_verify_max_batch);
+DECLARE_int32 (xayax_waitforchange_timeout_ms);
+DECLARE_int32 (xayax_waitforchange_max_waiters);
 
 namespace
 {
@@ -37,6 +58,8 @@ using testing::ElementsAre;
  * production (and doesn't really hurt us much).
  */
 constexpr const char* ZMQ_ADDR = "tcp://127.0.0.1:49837";
+/** Endpoint for an additional ZMQ publisher shard.  */
+constexpr const char* ZMQ_ADDR_SHARD = "tcp://127.0.0.1:49838";
 
 /** Port for the local test RPC server.  */
 constexpr int RPC_PORT = 49'838;
@@ -55,6 +78,64 @@ GetRpcEndpoint ()
   return out.str ();
 }
 
+/**
+ * Minimal JSON-RPC client connector that sends HTTP requests over a Unix
+ * domain socket (one connection per request).
+ */
+class UnixHttpClient : public jsonrpc::IClientConnector
+{
+
+private:
+
+  /** The path of the socket.  */
+  const std::string path;
+
+public:
+
+  explicit UnixHttpClient (const std::string& p)
+    : path(p)
+  {}
+
+  void
+  SendRPCMessage (const std::string& message, std::string& result) override
+  {
+    const int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    CHECK_GE (fd, 0);
+
+    sockaddr_un addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    CHECK_LT (path.size (), sizeof (addr.sun_path));
+    std::strcpy (addr.sun_path, path.c_str ());
+    CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+
+    std::ostringstream req;
+    req << "POST / HTTP/1.1\r\n"
+        << "Content-Type: application/json\r\n"
+        << "Content-Length: " << message.size () << "\r\n"
+        << "Connection: close\r\n"
+        << "\r\n"
+        << message;
+    const std::string data = req.str ();
+    CHECK_EQ (send (fd, data.data (), data.size (), MSG_NOSIGNAL),
+              static_cast<ssize_t> (data.size ()));
+
+    std::string response;
+    char buf[4'096];
+    ssize_t n;
+    while ((n = recv (fd, buf, sizeof (buf), 0)) > 0)
+      response.append (buf, n);
+    close (fd);
+
+    CHECK_EQ (response.compare (0, 12, "HTTP/1.1 200"), 0) << response;
+    const auto bodyStart = response.find ("\r\n\r\n");
+    CHECK_NE (bodyStart, std::string::npos);
+    result = response.substr (bodyStart + 4);
+  }
+
+};
+
 /* ************************************************************************** */
 
 } // anonymous namespace
@@ -74,6 +155,12 @@ private:
   /** Path of the temporary data directory.  */
   fs::path dataDir;
 
+  /** If not empty, the RPC server listens on this Unix socket as well.  */
+  std::string rpcSocket;
+
+  /** If not empty, an additional ZMQ shard endpoint to configure.  */
+  std::string zmqShard;
+
   /**
    * Our controller instance.  We use a unique_ptr so that it can be
    * stopped and recreated to test data permanence, catching up and
@@ -117,6 +204,27 @@ protected:
    */
   void DisableSync ();
 
+  /**
+   * Configures a Unix domain socket in the data directory for the RPC
+   * server, which will be used on the next restart.  Returns its path.
+   */
+  std::string
+  EnableRpcSocket ()
+  {
+    rpcSocket = (dataDir / "rpc.sock").string ();
+    return rpcSocket;
+  }
+
+  /**
+   * Configures an additional ZMQ publisher shard, which will be used on
+   * the next restart.
+   */
+  void
+  EnableZmqShard ()
+  {
+    zmqShard = ZMQ_ADDR_SHARD;
+  }
+
   /**
    * Stops the controller instance we currently have and destructs it.
    */
@@ -142,11 +250,22 @@ protected:
    */
   void WaitForZmqTip (const BlockData& tip);
 
+  /**
+   * Forgets all ZMQ messages received so far, and expects the next
+   * block-attach message to come after a gap in the sequence numbers.
+   */
+  void ExpectZmqGap ();
+
   /**
    * Awaits n pending ZMQ messages and returns them.
    */
   std::vector<Json::Value> AwaitPending (size_t num);
 
+  /**
+   * Awaits n block-attach ZMQ messages and returns them.
+   */
+  std::vector<Json::Value> AwaitAttaches (size_t num);
+
   /**
    * Builds up a move-data instance from the given data.  The actual
    * move data is built with our GAME_ID and the given JSON value.
@@ -187,7 +306,11 @@ public:
     : Controller(tc.base, tc.dataDir.string ())
   {
     SetZmqEndpoint (ZMQ_ADDR);
+    if (!tc.zmqShard.empty ())
+      AddZmqShardEndpoint (tc.zmqShard);
     SetRpcBinding (RPC_PORT, true);
+    if (!tc.rpcSocket.empty ())
+      SetRpcUnixSocket (tc.rpcSocket);
     EnableSanityChecks ();
     TrackGame (GAME_ID);
   }
@@ -293,6 +416,13 @@ ControllerTests::WaitForZmqTip (const BlockData& tip)
     }
 }
 
+void
+ControllerTests::ExpectZmqGap ()
+{
+  controller->sub->ForgetAll ();
+  controller->sub->ExpectGap ("game-block-attach json " + GAME_ID);
+}
+
 std::vector<Json::Value>
 ControllerTests::AwaitPending (const size_t num)
 {
@@ -300,6 +430,13 @@ ControllerTests::AwaitPending (const size_t num)
   return controller->sub->AwaitMessages (topic, num);
 }
 
+std::vector<Json::Value>
+ControllerTests::AwaitAttaches (const size_t num)
+{
+  const std::string topic = "game-block-attach json " + GAME_ID;
+  return controller->sub->AwaitMessages (topic, num);
+}
+
 MoveData
 ControllerTests::Move (const std::string& ns, const std::string& name,
                        const std::string& txid, const Json::Value& mv)
@@ -449,6 +586,184 @@ TEST_F (ControllerRpcTests, GetZmqNotifications)
   EXPECT_EQ (rpc.getzmqnotifications (), expected);
 }
 
+TEST_F (ControllerRpcTests, GetZmqNotificationsWithShard)
+{
+  auto expected = ParseJson (R"([
+    {
+      "type": "pubgameblocks"
+    },
+    {
+      "type": "pubgameblocksshard",
+      "games": ["game"]
+    }
+  ])");
+  expected[0]["address"] = ZMQ_ADDR;
+  expected[1]["address"] = ZMQ_ADDR_SHARD;
+
+  EnableZmqShard ();
+  Restart ();
+  EXPECT_EQ (rpc.getzmqnotifications (), expected);
+}
+
+TEST_F (ControllerRpcTests, BuiltinHttpConnector)
+{
+  FLAGS_xayax_rpc_threads = 4;
+  Restart ();
+
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+  EXPECT_EQ (rpc.getblockhash (a.height), a.hash);
+  EXPECT_EQ (rpc.getblockchaininfo ()["bestblockhash"], a.hash);
+
+  FLAGS_xayax_rpc_threads = 0;
+}
+
+TEST_F (ControllerRpcTests, ClientRateLimit)
+{
+  FLAGS_xayax_rpc_threads = 4;
+  FLAGS_xayax_rpc_client_rate = 0.001;
+  FLAGS_xayax_rpc_client_burst = 2;
+  Restart ();
+
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  rpc.getrawmempool ();
+  rpc.getrawmempool ();
+  try
+    {
+      rpc.getrawmempool ();
+      FAIL () << "Expected the request to be rate limited";
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      EXPECT_EQ (exc.GetCode (), -32005);
+    }
+  EXPECT_EQ (base.GetMempoolCalls (), 2);
+
+  /* Cheap requests are not limited.  */
+  EXPECT_EQ (rpc.getblockhash (a.height), a.hash);
+  EXPECT_EQ (rpc.getblockchaininfo ()["bestblockhash"], a.hash);
+
+  FLAGS_xayax_rpc_client_burst = 20;
+  FLAGS_xayax_rpc_client_rate = 0;
+  FLAGS_xayax_rpc_threads = 0;
+}
+
+TEST_F (ControllerRpcTests, ClientRateLimitUnknownClients)
+{
+  FLAGS_xayax_rpc_client_rate = 0.001;
+  FLAGS_xayax_rpc_client_burst = 2;
+  Restart ();
+
+  /* The HTTP server of libjson-rpc-cpp does not identify clients, but
+     the limits still apply (with all clients sharing them).  */
+  rpc.getrawmempool ();
+  rpc.getrawmempool ();
+  EXPECT_THROW (rpc.getrawmempool (), jsonrpc::JsonRpcException);
+  EXPECT_EQ (base.GetMempoolCalls (), 2);
+
+  FLAGS_xayax_rpc_client_burst = 20;
+  FLAGS_xayax_rpc_client_rate = 0;
+}
+
+TEST_F (ControllerRpcTests, ClientRateLimitBlockRange)
+{
+  FLAGS_xayax_rpc_threads = 4;
+  FLAGS_xayax_rpc_client_rate = 0.001;
+  FLAGS_xayax_rpc_client_burst = 2;
+  Restart ();
+
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  /* Ranges served from the replay buffer are cheap and not limited.  */
+  const unsigned before = base.GetBlockRangeCalls ();
+  for (unsigned i = 0; i < 5; ++i)
+    rpc.getblockrange (10, GAME_ID, a.height);
+  EXPECT_EQ (base.GetBlockRangeCalls (), before);
+
+  FLAGS_xayax_zmq_replay_blocks = 0;
+  const auto b = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (b);
+  rpc.getblockrange (10, GAME_ID, b.height);
+  rpc.getblockrange (10, GAME_ID, b.height);
+  EXPECT_THROW (rpc.getblockrange (10, GAME_ID, b.height),
+                jsonrpc::JsonRpcException);
+  FLAGS_xayax_zmq_replay_blocks = 256;
+
+  FLAGS_xayax_rpc_client_burst = 20;
+  FLAGS_xayax_rpc_client_rate = 0;
+  FLAGS_xayax_rpc_threads = 0;
+}
+
+TEST_F (ControllerRpcTests, ClientRateLimitSendUpdates)
+{
+  FLAGS_xayax_rpc_threads = 4;
+  FLAGS_xayax_rpc_client_rate = 0.001;
+  FLAGS_xayax_rpc_client_burst = 2;
+  Restart ();
+
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  /* All variants of game_sendupdates are subject to admission control,
+     and share the same bucket.  */
+  rpc.game_sendupdates2 (genesis.hash, GAME_ID);
+  rpc.game_sendupdates3 (genesis.hash, GAME_ID, a.hash);
+  EXPECT_THROW (rpc.game_sendupdates2 (genesis.hash, GAME_ID),
+                jsonrpc::JsonRpcException);
+  EXPECT_THROW (rpc.game_sendupdates3 (genesis.hash, GAME_ID, a.hash),
+                jsonrpc::JsonRpcException);
+
+  FLAGS_xayax_rpc_client_burst = 20;
+  FLAGS_xayax_rpc_client_rate = 0;
+  FLAGS_xayax_rpc_threads = 0;
+}
+
+TEST_F (ControllerRpcTests, UnixSocket)
+{
+  const std::string path = EnableRpcSocket ();
+  Restart ();
+  /* Restarting again checks that the old socket file is cleaned up.  */
+  Restart ();
+
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  UnixHttpClient client(path);
+  XayaRpcClient unixRpc(client);
+  EXPECT_EQ (unixRpc.getblockhash (a.height), a.hash);
+  EXPECT_EQ (unixRpc.getblockchaininfo ()["bestblockhash"], a.hash);
+
+  /* HTTP is still available as well.  */
+  EXPECT_EQ (rpc.getblockhash (a.height), a.hash);
+}
+
+TEST_F (ControllerRpcTests, GetZmqStats)
+{
+  const auto a = base.SetTip (base.NewBlock ());
+  ExpectZmq ({}, {a});
+
+  const auto stats = rpc.getzmqstats ();
+  const auto& topic = stats["topics"]["game-block-attach json " + GAME_ID];
+  ASSERT_TRUE (topic.isObject ());
+  EXPECT_GE (topic["sent"].asInt (), 1);
+  EXPECT_GT (topic["bytes"].asInt (), 0);
+  EXPECT_EQ (topic["dropped"].asInt (), 0);
+  EXPECT_EQ (stats["queued"], ParseJson ("[0]"));
+  EXPECT_EQ (stats["pending"]["messages"].asInt (), 0);
+  EXPECT_EQ (stats["coalesced"].asInt (), 0);
+  EXPECT_FALSE (stats["zstd"].isMember ("dictid"));
+}
+
+TEST_F (ControllerRpcTests, GetZmqDictionary)
+{
+  /* No dictionary is configured by default.  The training itself is
+     tested with the ZMQ publisher.  */
+  EXPECT_TRUE (rpc.getzmqdictionary ().isNull ());
+}
+
 TEST_F (ControllerRpcTests, TrackedGames)
 {
   rpc.trackedgames ("remove", GAME_ID);
@@ -507,6 +822,177 @@ TEST_F (ControllerRpcTests, GetBlockHashAndHeader)
   EXPECT_THROW (rpc.getblockheader ("invalid"), jsonrpc::JsonRpcException);
 }
 
+TEST_F (ControllerRpcTests, GetBlockRange)
+{
+  auto blk = base.NewBlock ();
+  blk.moves.push_back (Move ("p", "domob", "tx", 42));
+  const auto a = base.SetTip (blk);
+  const auto b = base.SetTip (base.NewBlock ());
+  const auto msg = AwaitAttaches (2);
+  ASSERT_EQ (msg.size (), 2);
+
+  auto res = rpc.getblockrange (10, GAME_ID, genesis.height);
+  EXPECT_EQ (res["tipheight"].asInt (), b.height);
+  ASSERT_EQ (res["blocks"].size (), 3);
+  EXPECT_EQ (res["blocks"][0]["block"]["hash"], genesis.hash);
+  EXPECT_EQ (res["blocks"][1], msg[0]);
+  EXPECT_EQ (res["blocks"][2], msg[1]);
+
+  /* The number of blocks returned is capped by the block range.  */
+  FLAGS_xayax_block_range = 1;
+  res = rpc.getblockrange (10, GAME_ID, a.height);
+  ASSERT_EQ (res["blocks"].size (), 1);
+  EXPECT_EQ (res["blocks"][0], msg[0]);
+  FLAGS_xayax_block_range = 128;
+
+  /* Blocks not in the replay buffer are fetched from the base chain.  */
+  FLAGS_xayax_zmq_replay_blocks = 0;
+  const auto c = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (c);
+  res = rpc.getblockrange (10, "other", c.height);
+  ASSERT_EQ (res["blocks"].size (), 1);
+  EXPECT_EQ (res["blocks"][0]["block"]["hash"], c.hash);
+  EXPECT_EQ (res["blocks"][0]["moves"], ParseJson ("[]"));
+  FLAGS_xayax_zmq_replay_blocks = 256;
+
+  res = rpc.getblockrange (10, GAME_ID, c.height + 1);
+  EXPECT_EQ (res["tipheight"].asInt (), c.height);
+  EXPECT_EQ (res["blocks"], ParseJson ("[]"));
+
+  EXPECT_THROW (rpc.getblockrange (1, GAME_ID, -1),
+                jsonrpc::JsonRpcException);
+}
+
+TEST_F (ControllerRpcTests, WaitForChange)
+{
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  EXPECT_EQ (rpc.waitforchange (genesis.hash), a.hash);
+
+  FLAGS_xayax_waitforchange_timeout_ms = 10;
+  EXPECT_EQ (rpc.waitforchange (a.hash), a.hash);
+  FLAGS_xayax_waitforchange_timeout_ms = 5'000;
+
+  BlockData b;
+  std::thread updater([this, &b] ()
+    {
+      SleepSome ();
+      b = base.SetTip (base.NewBlock ());
+    });
+  const auto res = rpc.waitforchange (a.hash);
+  updater.join ();
+  EXPECT_EQ (res, b.hash);
+}
+
+TEST_F (ControllerRpcTests, WaitForChangeMaxWaiters)
+{
+  FLAGS_xayax_waitforchange_max_waiters = 1;
+
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  std::string res;
+  std::thread waiter([this, &a, &res] ()
+    {
+      jsonrpc::HttpClient client(GetRpcEndpoint ());
+      XayaRpcClient threadRpc(client);
+      res = threadRpc.waitforchange (a.hash);
+    });
+  SleepSome ();
+
+  EXPECT_THROW (rpc.waitforchange (a.hash), jsonrpc::JsonRpcException);
+
+  const auto b = base.SetTip (base.NewBlock ());
+  waiter.join ();
+  EXPECT_EQ (res, b.hash);
+
+  /* Now that the other call is done, we can wait again.  */
+  FLAGS_xayax_waitforchange_timeout_ms = 10;
+  EXPECT_EQ (rpc.waitforchange (b.hash), b.hash);
+  FLAGS_xayax_waitforchange_timeout_ms = 5'000;
+
+  FLAGS_xayax_waitforchange_max_waiters = 0;
+}
+
+TEST_F (ControllerRpcTests, BatchRequests)
+{
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  jsonrpc::BatchCall batch;
+  Json::Value params(Json::objectValue);
+  params["height"] = static_cast<Json::Int> (genesis.height);
+  const int idGenesis = batch.addCall ("getblockhash", params);
+  params["height"] = static_cast<Json::Int> (a.height);
+  const int idA = batch.addCall ("getblockhash", params);
+  params["height"] = static_cast<Json::Int> (a.height + 1);
+  const int idInvalid = batch.addCall ("getblockhash", params);
+  const int idInfo = batch.addCall ("getblockchaininfo", Json::Value ());
+
+  auto res = rpc.CallProcedures (batch);
+  EXPECT_EQ (res.getResult (idGenesis), genesis.hash);
+  EXPECT_EQ (res.getResult (idA), a.hash);
+  EXPECT_EQ (res.getResult (idInfo)["bestblockhash"], a.hash);
+  EXPECT_TRUE (res.hasErrors ());
+  Json::Value errorId = idInvalid;
+  EXPECT_EQ (res.getErrorCode (errorId), -8);
+
+  /* Batches with other methods are processed as well, just not
+     with the chain lock held throughout.  */
+  jsonrpc::BatchCall mixed;
+  params["height"] = static_cast<Json::Int> (a.height);
+  const int idHash = mixed.addCall ("getblockhash", params);
+  const int idMempool = mixed.addCall ("getrawmempool", Json::Value ());
+
+  res = rpc.CallProcedures (mixed);
+  EXPECT_FALSE (res.hasErrors ());
+  EXPECT_EQ (res.getResult (idHash), a.hash);
+  EXPECT_EQ (res.getResult (idMempool), ParseJson ("[]"));
+}
+
+TEST_F (ControllerRpcTests, BatchWithBaseChain)
+{
+  /* Prune everything and do not cache pruned hashes, so that the batch
+     needs the base chain.  */
+  FLAGS_xayax_hash_cache_size = 0;
+  Restart (0);
+  const auto a = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (a);
+
+  /* While the batch is waiting for the base chain, the chain lock is
+     not held, so that other calls go through.  */
+  base.SetBlockRangeDelay (std::chrono::milliseconds (500));
+  jsonrpc::BatchCall batch;
+  Json::Value params(Json::objectValue);
+  params["height"] = static_cast<Json::Int> (genesis.height);
+  const int idGenesis = batch.addCall ("getblockhash", params);
+  params["height"] = static_cast<Json::Int> (a.height);
+  const int idA = batch.addCall ("getblockhash", params);
+
+  jsonrpc::BatchResponse res;
+  std::thread batchThread ([this, &batch, &res] ()
+    {
+      jsonrpc::HttpClient client(GetRpcEndpoint ());
+      XayaRpcClient threadRpc(client);
+      res = threadRpc.CallProcedures (batch);
+    });
+  SleepSome ();
+
+  const auto before = std::chrono::steady_clock::now ();
+  EXPECT_EQ (rpc.getblockhash (a.height), a.hash);
+  EXPECT_LT (std::chrono::steady_clock::now () - before,
+             std::chrono::milliseconds (250));
+
+  batchThread.join ();
+  EXPECT_FALSE (res.hasErrors ());
+  EXPECT_EQ (res.getResult (idGenesis), genesis.hash);
+  EXPECT_EQ (res.getResult (idA), a.hash);
+
+  base.SetBlockRangeDelay (std::chrono::milliseconds (0));
+  FLAGS_xayax_hash_cache_size = 10'000;
+}
+
 TEST_F (ControllerRpcTests, Pending)
 {
   /* We need to add a first block to get the PendingManager into synced
@@ -555,10 +1041,166 @@ TEST_F (ControllerRpcTests, Pending)
   ));
 }
 
+TEST_F (ControllerRpcTests, MempoolCache)
+{
+  Restart (1'000'000, true);
+  const auto blk = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (blk);
+
+  EXPECT_EQ (rpc.getrawmempool (), ParseJson ("[]"));
+  EXPECT_EQ (base.GetMempoolCalls (), 1);
+
+  const auto mv1 = Move ("p", "domob", "tx1", 1);
+  const auto mv2 = Move ("p", "domob", "tx2", 2);
+  base.AddPending ({mv1});
+  base.AddPending ({mv2});
+  AwaitPending (2);
+
+  EXPECT_EQ (rpc.getrawmempool (), ParseJson (R"(["tx1", "tx2"])"));
+  EXPECT_EQ (base.GetMempoolCalls (), 1);
+
+  /* The base chain still has tx1 in its mempool, but we remove it from
+     the cache when it gets confirmed.  */
+  auto confirmed = base.NewBlock ();
+  confirmed.moves.push_back (mv1);
+  base.SetTip (confirmed);
+  WaitForZmqTip (confirmed);
+
+  EXPECT_EQ (rpc.getrawmempool (), ParseJson (R"(["tx2"])"));
+  EXPECT_EQ (base.GetMempoolCalls (), 1);
+
+  /* A refresh picks up the base-chain state again.  */
+  FLAGS_xayax_mempool_refresh_ms = 0;
+  EXPECT_EQ (rpc.getrawmempool (), ParseJson (R"(["tx1", "tx2"])"));
+  EXPECT_EQ (base.GetMempoolCalls (), 2);
+  FLAGS_xayax_mempool_refresh_ms = 10'000;
+}
+
+/**
+ * Returns the base64-encoded signature of a message by the given address,
+ * as accepted by the test base chain.
+ */
+std::string
+Signature (const std::string& msg, const std::string& addr)
+{
+  return xaya::EncodeBase64 (TestBaseChain::Sign (msg, addr));
+}
+
+TEST_F (ControllerRpcTests, VerifyMessage)
+{
+  const auto sgn = Signature ("foo", "addr");
+
+  EXPECT_EQ (rpc.verifymessage ("", "foo", sgn), ParseJson (R"({
+    "valid": true,
+    "address": "addr"
+  })"));
+  EXPECT_EQ (rpc.verifymessage ("addr", "foo", sgn), true);
+  EXPECT_EQ (rpc.verifymessage ("other", "foo", sgn), false);
+
+  EXPECT_EQ (rpc.verifymessage ("", "bar", sgn), ParseJson (R"({
+    "valid": false
+  })"));
+  EXPECT_EQ (rpc.verifymessage ("addr", "bar", sgn), false);
+
+  EXPECT_THROW (rpc.verifymessage ("", "foo", "invalid base64"),
+                jsonrpc::JsonRpcException);
+
+  /* Each (message, signature) pair is only verified once on the
+     base chain, including invalid ones.  */
+  EXPECT_EQ (base.GetVerifyMessageCalls (), 2);
+}
+
+TEST_F (ControllerRpcTests, VerifyMessages)
+{
+  const auto sgn = Signature ("foo", "addr");
+
+  EXPECT_EQ (rpc.verifymessages (ParseJson ("[]")), ParseJson ("[]"));
+
+  Json::Value requests(Json::arrayValue);
+  for (unsigned i = 0; i < 20; ++i)
+    {
+      const std::string msg = "msg " + std::to_string (i);
+      Json::Value r(Json::objectValue);
+      r["message"] = msg;
+      r["signature"] = Signature (msg, "addr " + std::to_string (i));
+      requests.append (r);
+    }
+  requests[0]["address"] = "addr 0";
+  requests[1]["address"] = "wrong";
+  requests[2]["signature"] = sgn;
+
+  const auto res = rpc.verifymessages (requests);
+  ASSERT_EQ (res.size (), requests.size ());
+  EXPECT_EQ (res[0], true);
+  EXPECT_EQ (res[1], false);
+  EXPECT_EQ (res[2], ParseJson (R"({"valid": false})"));
+  for (unsigned i = 3; i < res.size (); ++i)
+    {
+      EXPECT_EQ (res[i]["valid"], true);
+      EXPECT_EQ (res[i]["address"], "addr " + std::to_string (i));
+    }
+  EXPECT_EQ (base.GetVerifyMessageCalls (), requests.size ());
+
+  /* The cache is shared with verifymessage.  */
+  EXPECT_EQ (rpc.verifymessage ("addr 3", "msg 3",
+                                 requests[3]["signature"].asString ()),
+             true);
+  EXPECT_EQ (rpc.verifymessages (requests), res);
+  EXPECT_EQ (base.GetVerifyMessageCalls (), requests.size ());
+
+  EXPECT_THROW (rpc.verifymessages (ParseJson ("[42]")),
+                jsonrpc::JsonRpcException);
+  EXPECT_THROW (rpc.verifymessages (ParseJson (R"([
+    {"message": "foo", "signature": "invalid base64"}
+  ])")), jsonrpc::JsonRpcException);
+
+  /* Cached results are returned even if the base chain fails, but any
+     uncached signature leads to an error for the entire call.  */
+  base.SetShouldThrow (true);
+  EXPECT_EQ (rpc.verifymessages (requests), res);
+  requests.append (requests[3]);
+  requests[20]["message"] = "uncached";
+  EXPECT_THROW (rpc.verifymessages (requests), jsonrpc::JsonRpcException);
+  base.SetShouldThrow (false);
+}
+
+TEST_F (ControllerRpcTests, VerifyMessagesMaxBatch)
+{
+  FLAGS_xayax_verify_max_batch = 2;
+
+  Json::Value requests(Json::arrayValue);
+  for (unsigned i = 0; i < 3; ++i)
+    {
+      const std::string msg = "msg " + std::to_string (i);
+      Json::Value r(Json::objectValue);
+      r["message"] = msg;
+      r["signature"] = Signature (msg, "addr");
+      requests.append (r);
+    }
+
+  try
+    {
+      rpc.verifymessages (requests);
+      FAIL () << "Expected the call to fail";
+    }
+  catch (const jsonrpc::JsonRpcException& exc)
+    {
+      EXPECT_EQ (exc.GetCode (), -32602);
+    }
+  EXPECT_EQ (base.GetVerifyMessageCalls (), 0);
+
+  requests.resize (2);
+  EXPECT_EQ (rpc.verifymessages (requests).size (), 2);
+
+  FLAGS_xayax_verify_max_batch = 1'000;
+}
+
 TEST_F (ControllerRpcTests, BaseChainErrors)
 {
   /* We want to prune up to the last block (so we can test the handling
-     of pruned blocks in RPC methods).  */
+     of pruned blocks in RPC methods).  Those should not be cached, though,
+     so that the base chain is actually queried for them.  */
+  FLAGS_xayax_hash_cache_size = 0;
   Restart (0);
 
   base.SetTip (base.NewBlock ());
@@ -589,6 +1231,82 @@ TEST_F (ControllerRpcTests, BaseChainErrors)
   EXPECT_EQ (res["hash"], blk.hash);
   EXPECT_EQ (res["height"].asInt (), blk.height);
   EXPECT_THROW (rpc.getblockheader (genesis.hash), jsonrpc::JsonRpcException);
+
+  FLAGS_xayax_hash_cache_size = 10'000;
+}
+
+TEST_F (ControllerRpcTests, PrunedHashCache)
+{
+  FLAGS_xayax_hash_cache_size = 1;
+  Restart (0);
+
+  const auto a = base.SetTip (base.NewBlock ());
+  const auto b = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (b);
+
+  /* Block a has been cached when it was pruned.  There is only room
+     for one entry in the cache, so genesis was not.  */
+  base.SetShouldThrow (true);
+  EXPECT_EQ (rpc.getblockhash (a.height), a.hash);
+  EXPECT_EQ (rpc.getblockheader (a.hash)["height"].asInt (), a.height);
+  EXPECT_THROW (rpc.getblockhash (genesis.height), jsonrpc::JsonRpcException);
+
+  /* Answers from the base chain are cached as well.  */
+  base.SetShouldThrow (false);
+  EXPECT_EQ (rpc.getblockheader (genesis.hash)["height"].asInt (),
+             genesis.height);
+  base.SetShouldThrow (true);
+  EXPECT_EQ (rpc.getblockhash (genesis.height), genesis.hash);
+  EXPECT_THROW (rpc.getblockhash (a.height), jsonrpc::JsonRpcException);
+
+  base.SetShouldThrow (false);
+  FLAGS_xayax_hash_cache_size = 10'000;
+}
+
+TEST_F (ControllerRpcTests, CoalescedSendUpdates)
+{
+  /* Make sure the blocks are not served from the replay buffer, and
+     that syncing does not query the base chain during the test.  */
+  FLAGS_xayax_zmq_replay_blocks = 0;
+  base.SetTip (base.NewBlock ());
+  const auto b = base.SetTip (base.NewBlock ());
+  WaitForZmqTip (b);
+  DisableSync ();
+
+  base.SetBlockRangeDelay (std::chrono::milliseconds (200));
+  const unsigned callsBefore = base.GetBlockRangeCalls ();
+
+  constexpr unsigned num = 5;
+  std::vector<Json::Value> results(num);
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < num; ++i)
+    threads.emplace_back ([this, &results, i] ()
+      {
+        jsonrpc::HttpClient client(GetRpcEndpoint ());
+        XayaRpcClient threadRpc(client);
+        results[i] = threadRpc.game_sendupdates2 (genesis.hash, GAME_ID);
+      });
+  for (auto& t : threads)
+    t.join ();
+
+  /* All requests shared a single fetch, but have their own reqtoken.  */
+  EXPECT_EQ (base.GetBlockRangeCalls (), callsBefore + 1);
+  std::set<std::string> tokens;
+  for (const auto& res : results)
+    {
+      EXPECT_EQ (res["toblock"], b.hash);
+      EXPECT_EQ (res["steps"]["attach"], 2);
+      tokens.insert (res["reqtoken"].asString ());
+    }
+  EXPECT_EQ (tokens.size (), num);
+
+  std::set<std::string> received;
+  for (const auto& msg : AwaitAttaches (2 * num))
+    received.insert (msg["reqtoken"].asString ());
+  EXPECT_EQ (received, tokens);
+
+  base.SetBlockRangeDelay (std::chrono::milliseconds (0));
+  FLAGS_xayax_zmq_replay_blocks = 256;
 }
 
 /* ************************************************************************** */
@@ -635,6 +1353,20 @@ TEST_F (ControllerSendUpdatesTests, AttachOnly)
   ExpectZmq ({}, {b, c}, upd["reqtoken"].asString ());
 }
 
+TEST_F (ControllerSendUpdatesTests, OnlyRequestedGame)
+{
+  /* Notifications are only sent for the requested game, not for other
+     tracked games (which would fail the test when the subscriber finds
+     unexpected messages).  */
+  rpc.trackedgames ("add", "other game");
+  SleepSome ();
+
+  const auto upd = rpc.game_sendupdates2 (genesis.hash, GAME_ID);
+  ExpectZmq ({}, {b, c}, upd["reqtoken"].asString ());
+
+  rpc.game_sendupdates2 (genesis.hash, "untracked game");
+}
+
 TEST_F (ControllerSendUpdatesTests, DetachOnly)
 {
   base.SetTip (b);
@@ -855,6 +1587,97 @@ TEST_F (ControllerSendUpdatesTests, BlockRange)
   ExpectZmq ({branch[1], branch[0], chain[2]}, {}, upd["reqtoken"].asString ());
 }
 
+TEST_F (ControllerSendUpdatesTests, StreamingCatchUp)
+{
+  FLAGS_xayax_block_range = 2;
+  FLAGS_xayax_stream_catchup = true;
+
+  /* genesis - b - c - chain0 - ... - chain4
+             \ a
+  */
+  const auto chain = base.AttachBranch (c.hash, 5);
+  WaitForZmqTip (chain.back ());
+
+  /* The first two blocks are sent right away, and the others streamed
+     afterwards (but all with the same reqtoken).  */
+  auto upd = rpc.game_sendupdates2 (a.hash, GAME_ID);
+  EXPECT_EQ (upd["toblock"], chain.back ().hash);
+  EXPECT_EQ (upd["steps"], ParseJson (R"({
+    "attach": 7,
+    "detach": 1
+  })"));
+  std::vector<BlockData> attaches = {b, c};
+  attaches.insert (attaches.end (), chain.begin (), chain.end ());
+  ExpectZmq ({a}, attaches, upd["reqtoken"].asString ());
+
+  /* With an explicit target, nothing is streamed.  */
+  upd = rpc.game_sendupdates3 (genesis.hash, GAME_ID, chain[2].hash);
+  EXPECT_EQ (upd["toblock"], c.hash);
+  ExpectZmq ({}, {b, c}, upd["reqtoken"].asString ());
+
+  FLAGS_xayax_stream_catchup = false;
+  FLAGS_xayax_block_range = 128;
+}
+
+TEST_F (ControllerSendUpdatesTests, StreamingCatchUpReorg)
+{
+  FLAGS_xayax_block_range = 2;
+  FLAGS_xayax_stream_catchup = true;
+  FLAGS_xayax_stream_blocks_per_second = 2;
+
+  /* genesis - b - c - chain0 - chain1 - chain2 - chain3 - chain4
+                                     \ branch0 - branch1 - branch2 - branch3
+  */
+  const auto chain = base.AttachBranch (c.hash, 5);
+  WaitForZmqTip (chain.back ());
+
+  auto upd = rpc.game_sendupdates2 (genesis.hash, GAME_ID);
+  EXPECT_EQ (upd["toblock"], chain.back ().hash);
+  const std::string reqtoken = upd["reqtoken"].asString ();
+  ExpectZmq ({}, {b, c, chain[0], chain[1]}, reqtoken);
+
+  /* While the stream waits for the rate limit, the chain reorgs away
+     from the announced target.  */
+  const auto branch = base.AttachBranch (chain[1].hash, 4);
+  ExpectZmq ({chain[4], chain[3], chain[2]}, branch);
+
+  /* Whatever the stream sends from now on, it cannot deliver the target.
+     The GSP must see a gap before the next live notification, so that
+     it does not wait for the target forever.  */
+  std::this_thread::sleep_for (std::chrono::seconds (3));
+  ExpectZmqGap ();
+  const auto next = base.SetTip (base.NewBlock ());
+  ExpectZmq ({}, {next});
+
+  FLAGS_xayax_stream_blocks_per_second = 0;
+  FLAGS_xayax_stream_catchup = false;
+  FLAGS_xayax_block_range = 128;
+}
+
+TEST_F (ControllerSendUpdatesTests, StreamingCatchUpLimit)
+{
+  FLAGS_xayax_block_range = 2;
+  FLAGS_xayax_stream_catchup = true;
+  FLAGS_xayax_stream_max_jobs = 0;
+
+  const auto chain = base.AttachBranch (c.hash, 5);
+  WaitForZmqTip (chain.back ());
+
+  /* Without a free slot for streaming, the request is answered like
+     without streaming enabled.  */
+  auto upd = rpc.game_sendupdates2 (genesis.hash, GAME_ID);
+  EXPECT_EQ (upd["toblock"], c.hash);
+  EXPECT_EQ (upd["steps"], ParseJson (R"({
+    "attach": 2,
+    "detach": 0
+  })"));
+  ExpectZmq ({}, {b, c}, upd["reqtoken"].asString ());
+
+  FLAGS_xayax_stream_max_jobs = 4;
+  FLAGS_xayax_stream_catchup = false;
+  FLAGS_xayax_block_range = 128;
+}
+
 /* ************************************************************************** */
 
 } // anonymous namespace
@@ -0,0 +1,967 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "private/httpconnector.hpp"
+
+#include "private/ratelimit.hpp"
+
+#include <glog/logging.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+namespace xayax
+{
+
+namespace
+{
+
+/** Maximum size of the request line and headers.  */
+constexpr size_t MAX_HEADER_SIZE = 64 << 10;
+
+/** Maximum size of a request body.  */
+constexpr size_t MAX_BODY_SIZE = 64 << 20;
+
+/**
+ * Total time allowed for receiving a request (from when its first byte
+ * arrived) and for sending a response.  This is a deadline for the whole
+ * operation, so that clients trickling in data slowly cannot hold on to
+ * resources for longer.
+ */
+constexpr auto IO_TIMEOUT = std::chrono::seconds (5);
+
+/** Time after which idle keep-alive connections are closed.  */
+constexpr auto KEEPALIVE_TIMEOUT = std::chrono::seconds (60);
+
+/** Interval at which the poller checks for expired idle connections.  */
+constexpr int POLL_INTERVAL_MS = 1'000;
+
+/**
+ * Time for which we stop accepting new connections after accept failed
+ * (e.g. because we ran out of file descriptors).
+ */
+constexpr auto ACCEPT_BACKOFF = std::chrono::milliseconds (100);
+
+/**
+ * Data about an HTTP request that we parse from the received data.
+ */
+struct Request
+{
+
+  /** The request method (e.g. "POST").  */
+  std::string method;
+
+  /** The request target (e.g. "/").  */
+  std::string target;
+
+  /** Whether the connection should be kept open after the response.  */
+  bool keepAlive = true;
+
+  /** Whether the client expects a "100 Continue" before sending the body.  */
+  bool expectContinue = false;
+
+  /** The request body.  */
+  std::string body;
+
+};
+
+/**
+ * Result of trying to parse a request from the received data.
+ */
+enum class ParseResult
+{
+  /** A full request has been received and parsed.  */
+  COMPLETE,
+  /** The headers are there, but not yet the full body.  */
+  HEADERS_ONLY,
+  /** The headers have not been fully received.  */
+  INCOMPLETE,
+  /** The request is malformed or unsupported.  */
+  INVALID,
+  /** The request body is too large.  */
+  TOO_LARGE,
+};
+
+/**
+ * Returns the given string converted to lower case.
+ */
+std::string
+ToLower (std::string str)
+{
+  for (auto& c : str)
+    c = std::tolower (static_cast<unsigned char> (c));
+  return str;
+}
+
+/**
+ * Removes leading and trailing whitespace from a string.
+ */
+std::string
+Trim (const std::string& str)
+{
+  const auto start = str.find_first_not_of (" \t");
+  if (start == std::string::npos)
+    return "";
+  const auto end = str.find_last_not_of (" \t");
+  return str.substr (start, end - start + 1);
+}
+
+/**
+ * Tries to parse a request from the start of the buffer.  If a complete
+ * request is found, it is removed from the buffer.
+ */
+ParseResult
+ParseRequest (std::string& buffer, Request& req)
+{
+  const auto headerEnd = buffer.find ("\r\n\r\n");
+  if (headerEnd == std::string::npos)
+    return buffer.size () > MAX_HEADER_SIZE
+              ? ParseResult::INVALID : ParseResult::INCOMPLETE;
+  if (headerEnd > MAX_HEADER_SIZE)
+    return ParseResult::INVALID;
+
+  std::istringstream lines(buffer.substr (0, headerEnd));
+  std::string line;
+
+  if (!std::getline (lines, line))
+    return ParseResult::INVALID;
+  if (!line.empty () && line.back () == '\r')
+    line.pop_back ();
+  std::istringstream requestLine(line);
+  std::string version;
+  if (!(requestLine >> req.method >> req.target >> version))
+    return ParseResult::INVALID;
+
+  if (version == "HTTP/1.1")
+    req.keepAlive = true;
+  else if (version == "HTTP/1.0")
+    req.keepAlive = false;
+  else
+    return ParseResult::INVALID;
+
+  size_t contentLength = 0;
+  req.expectContinue = false;
+  while (std::getline (lines, line))
+    {
+      if (!line.empty () && line.back () == '\r')
+        line.pop_back ();
+
+      const auto colon = line.find (':');
+      if (colon == std::string::npos)
+        return ParseResult::INVALID;
+      const std::string key = ToLower (Trim (line.substr (0, colon)));
+      const std::string value = Trim (line.substr (colon + 1));
+
+      if (key == "content-length")
+        {
+          if (value.empty ()
+                || value.find_first_not_of ("0123456789") != std::string::npos
+                || value.size () > 12)
+            return ParseResult::INVALID;
+          contentLength = std::stoull (value);
+        }
+      else if (key == "transfer-encoding")
+        return ParseResult::INVALID;
+      else if (key == "connection")
+        {
+          const std::string lower = ToLower (value);
+          if (lower == "close")
+            req.keepAlive = false;
+          else if (lower == "keep-alive")
+            req.keepAlive = true;
+        }
+      else if (key == "expect" && ToLower (value) == "100-continue")
+        req.expectContinue = true;
+    }
+
+  if (contentLength > MAX_BODY_SIZE)
+    return ParseResult::TOO_LARGE;
+
+  const size_t bodyStart = headerEnd + 4;
+  if (buffer.size () < bodyStart + contentLength)
+    return ParseResult::HEADERS_ONLY;
+
+  req.body = buffer.substr (bodyStart, contentLength);
+  buffer.erase (0, bodyStart + contentLength);
+
+  return ParseResult::COMPLETE;
+}
+
+/**
+ * Returns the reason phrase for the HTTP status codes we use.
+ */
+const char*
+ReasonPhrase (const int code)
+{
+  switch (code)
+    {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 413:
+      return "Payload Too Large";
+    case 503:
+      return "Service Unavailable";
+    default:
+      LOG (FATAL) << "Unexpected HTTP status code: " << code;
+    }
+}
+
+/**
+ * Sends as much of the data as the (non-blocking) socket accepts right away.
+ * Returns the number of bytes sent, or -1 if there was an error.
+ */
+ssize_t
+SendNow (const int fd, const std::string& data, const size_t offset = 0)
+{
+  while (true)
+    {
+      const ssize_t n = send (fd, data.data () + offset, data.size () - offset,
+                              MSG_NOSIGNAL);
+      if (n >= 0)
+        return n;
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+}
+
+/**
+ * Formats an HTTP response with the given status code and body.
+ */
+std::string
+FormatResponse (const int code, const std::string& body, const bool keepAlive,
+                const std::string& contentType = "application/json")
+{
+  std::ostringstream out;
+  out << "HTTP/1.1 " << code << " " << ReasonPhrase (code) << "\r\n"
+      << "Content-Type: " << contentType << "\r\n"
+      << "Content-Length: " << body.size () << "\r\n"
+      << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n"
+      << "\r\n"
+      << body;
+  return out.str ();
+}
+
+/**
+ * Returns the identity of the peer of an accepted connection.  For TCP
+ * connections, this is the source address.  On a Unix domain socket, the
+ * connecting process is identified by its user ID (which the kernel
+ * vouches for, unlike e.g. its process ID, which a client could change
+ * at will by forking).
+ */
+std::string
+GetPeerIdentity (const int fd, const sockaddr_storage& addr)
+{
+  if (addr.ss_family == AF_INET)
+    {
+      const auto& in = reinterpret_cast<const sockaddr_in&> (addr);
+      char peer[INET_ADDRSTRLEN] = "";
+      inet_ntop (AF_INET, &in.sin_addr, peer, sizeof (peer));
+      return peer;
+    }
+
+  ucred cred;
+  socklen_t len = sizeof (cred);
+  if (addr.ss_family == AF_UNIX
+        && getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+    return "uid " + std::to_string (cred.uid);
+
+  return "";
+}
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+/**
+ * An open client connection.  The socket is non-blocking, and closed when
+ * the instance is destructed.
+ */
+class HttpConnector::Connection
+{
+
+public:
+
+  /** Result of trying to read more data.  */
+  enum class ReadResult
+  {
+    /** Some data has been read into the buffer.  */
+    DATA,
+    /** There is no data available right now.  */
+    WOULD_BLOCK,
+    /** The connection has been closed or there was an error.  */
+    CLOSED,
+  };
+
+  /** The socket.  */
+  const int fd;
+
+  /** The address of the peer.  */
+  const std::string peer;
+
+  /** Data that has been received but not yet processed.  */
+  std::string buffer;
+
+  /** Whether a "100 Continue" was sent for the current request.  */
+  bool continueSent = false;
+
+  /**
+   * Set if the buffer may contain further (pipelined) requests, which
+   * should be processed without waiting for more data to arrive.
+   */
+  bool pipelined = false;
+
+  /** Response data that has not yet been sent.  */
+  std::string output;
+
+  /** Number of bytes at the start of output that have been sent already.  */
+  size_t outputSent = 0;
+
+  /** Time when the pending output has been queued.  */
+  std::chrono::steady_clock::time_point outputStart;
+
+  /** Whether the connection should be closed once the output is sent.  */
+  bool closeAfterOutput = false;
+
+  /** Time when the connection was last active (for keep-alive expiry).  */
+  std::chrono::steady_clock::time_point lastActive;
+
+  /**
+   * Time when the first data of the current request has been received.
+   * This is only meaningful while the buffer is not empty.
+   */
+  std::chrono::steady_clock::time_point requestStart;
+
+private:
+
+  /** Counter of open connections, which this one is part of.  */
+  std::atomic<size_t>& numOpen;
+
+public:
+
+  explicit Connection (const int f, const std::string& p,
+                       std::atomic<size_t>& cnt)
+    : fd(f), peer(p), lastActive(std::chrono::steady_clock::now ()),
+      numOpen(cnt)
+  {
+    const int one = 1;
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+    ++numOpen;
+  }
+
+  ~Connection ()
+  {
+    close (fd);
+    --numOpen;
+  }
+
+  Connection () = delete;
+  Connection (const Connection&) = delete;
+  void operator= (const Connection&) = delete;
+
+  /**
+   * Reads more data into the buffer, without blocking.
+   */
+  ReadResult
+  Read ()
+  {
+    char buf[16 << 10];
+    while (true)
+      {
+        const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          return ReadResult::WOULD_BLOCK;
+        if (n <= 0)
+          return ReadResult::CLOSED;
+
+        if (buffer.empty ())
+          requestStart = std::chrono::steady_clock::now ();
+        buffer.append (buf, n);
+        return ReadResult::DATA;
+      }
+  }
+
+  /**
+   * Returns true if there is output that has not been sent yet.
+   */
+  bool
+  HasOutput () const
+  {
+    return outputSent < output.size ();
+  }
+
+  /**
+   * Queues data to be sent.  If close is set, the connection will be
+   * closed after all output has been sent.
+   */
+  void
+  Queue (const std::string& data, const bool close)
+  {
+    if (!HasOutput ())
+      {
+        output.clear ();
+        outputSent = 0;
+        outputStart = std::chrono::steady_clock::now ();
+      }
+    output += data;
+    closeAfterOutput = closeAfterOutput || close;
+  }
+
+  /**
+   * Sends as much of the pending output as the socket accepts right
+   * away.  Returns false if the connection should be closed, either
+   * because of an error or because all output has been sent and the
+   * connection was marked for closing.
+   */
+  bool
+  Flush ()
+  {
+    if (HasOutput ())
+      {
+        const ssize_t n = SendNow (fd, output, outputSent);
+        if (n < 0)
+          return false;
+        outputSent += n;
+      }
+
+    return HasOutput () || !closeAfterOutput;
+  }
+
+  /**
+   * Returns true if a request is partially received or output is pending,
+   * and the corresponding deadline has passed.
+   */
+  bool
+  IsRequestExpired (const std::chrono::steady_clock::time_point now) const
+  {
+    if (!buffer.empty () && !pipelined && requestStart + IO_TIMEOUT < now)
+      return true;
+    return HasOutput () && outputStart + IO_TIMEOUT < now;
+  }
+
+};
+
+/* ************************************************************************** */
+
+HttpConnector::HttpConnector (const int p, const bool l, const unsigned threads,
+                              const size_t queueSize)
+  : port(p), local(l), numWorkers(threads), maxQueue(queueSize)
+{
+  CHECK_GT (numWorkers, 0);
+  CHECK_GT (maxQueue, 0);
+}
+
+HttpConnector::HttpConnector (const std::string& path, const unsigned threads,
+                              const size_t queueSize)
+  : port(-1), local(true), socketPath(path),
+    numWorkers(threads), maxQueue(queueSize)
+{
+  CHECK (!socketPath.empty ());
+  CHECK_GT (numWorkers, 0);
+  CHECK_GT (maxQueue, 0);
+}
+
+HttpConnector::~HttpConnector ()
+{
+  StopListening ();
+}
+
+void
+HttpConnector::SetMaxConnections (const size_t n)
+{
+  CHECK_EQ (listenFd, -1) << "Connection limit set while listening";
+  CHECK_GT (n, 0);
+  maxConnections = n;
+}
+
+void
+HttpConnector::SetPageHandler (PageHandler h)
+{
+  CHECK_EQ (listenFd, -1) << "Page handler set while listening";
+  pageHandler = std::move (h);
+}
+
+int
+HttpConnector::CreateListener () const
+{
+  const int fd = socket (socketPath.empty () ? AF_INET : AF_UNIX,
+                         SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      PLOG (WARNING) << "Failed to create RPC server socket";
+      return -1;
+    }
+
+  int res;
+  if (socketPath.empty ())
+    {
+      const int one = 1;
+      setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+      sockaddr_in addr;
+      std::memset (&addr, 0, sizeof (addr));
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons (port);
+      addr.sin_addr.s_addr = htonl (local ? INADDR_LOOPBACK : INADDR_ANY);
+      res = bind (fd, reinterpret_cast<const sockaddr*> (&addr),
+                  sizeof (addr));
+    }
+  else
+    {
+      sockaddr_un addr;
+      std::memset (&addr, 0, sizeof (addr));
+      addr.sun_family = AF_UNIX;
+      if (socketPath.size () >= sizeof (addr.sun_path))
+        {
+          LOG (WARNING) << "RPC socket path is too long: " << socketPath;
+          close (fd);
+          return -1;
+        }
+      std::strcpy (addr.sun_path, socketPath.c_str ());
+      res = bind (fd, reinterpret_cast<const sockaddr*> (&addr),
+                  sizeof (addr));
+    }
+
+  if (res != 0 || listen (fd, SOMAXCONN) != 0
+        || fcntl (fd, F_SETFL, O_NONBLOCK) != 0)
+    {
+      PLOG (WARNING) << "Failed to listen for RPC requests on " << GetAddress ();
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+std::string
+HttpConnector::GetAddress () const
+{
+  if (!socketPath.empty ())
+    return socketPath;
+
+  std::ostringstream out;
+  out << "port " << port;
+  return out.str ();
+}
+
+bool
+HttpConnector::StartListening ()
+{
+  CHECK_EQ (listenFd, -1) << "HttpConnector is already listening";
+
+  const int fd = CreateListener ();
+  if (fd < 0)
+    return false;
+
+  CHECK_EQ (pipe2 (wakeupFds, O_CLOEXEC | O_NONBLOCK), 0);
+  listenFd = fd;
+  shouldStop = false;
+
+  poller = std::thread ([this] () { RunPoller (); });
+  for (unsigned i = 0; i < numWorkers; ++i)
+    workers.emplace_back ([this] () { RunWorker (); });
+
+  LOG (INFO)
+      << "Listening for RPC requests on " << GetAddress ()
+      << " with " << numWorkers << " worker threads";
+  return true;
+}
+
+bool
+HttpConnector::StopListening ()
+{
+  if (listenFd == -1)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cvQueue.notify_all ();
+  }
+  WakeUpPoller ();
+
+  poller.join ();
+  for (auto& w : workers)
+    w.join ();
+  workers.clear ();
+
+  queue.clear ();
+  returned.clear ();
+
+  close (listenFd);
+  listenFd = -1;
+  if (!socketPath.empty ())
+    unlink (socketPath.c_str ());
+  close (wakeupFds[0]);
+  close (wakeupFds[1]);
+  wakeupFds[0] = wakeupFds[1] = -1;
+
+  return true;
+}
+
+uint64_t
+HttpConnector::GetNumRequests ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return numRequests;
+}
+
+uint64_t
+HttpConnector::GetNumRejected ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return numRejected;
+}
+
+void
+HttpConnector::WakeUpPoller ()
+{
+  const char byte = 0;
+  /* If the pipe is full, the poller will wake up anyway.  */
+  if (write (wakeupFds[1], &byte, 1) < 0)
+    CHECK (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void
+HttpConnector::Enqueue (std::unique_ptr<Connection> c)
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    if (queue.size () < maxQueue)
+      {
+        queue.push_back (std::move (c));
+        cvQueue.notify_one ();
+        return;
+      }
+    ++numRejected;
+  }
+
+  /* This is done on the poller thread, so we must not block.  The response
+     is only sent if it fits into the socket buffer right away, which it
+     usually does.  */
+  VLOG (1) << "RPC request queue is full, rejecting connection";
+  SendNow (c->fd, FormatResponse (503, "", false));
+  shutdown (c->fd, SHUT_WR);
+}
+
+bool
+HttpConnector::Serve (Connection& c)
+{
+  /* If there are pipelined requests already, we process them first before
+     reading more data.  That way, the buffer does not grow without bounds
+     for a client that keeps sending requests.  */
+  if (!c.pipelined && c.Read () == Connection::ReadResult::CLOSED)
+    return false;
+  c.pipelined = false;
+
+  Request req;
+  while (true)
+    {
+      const ParseResult parsed = ParseRequest (c.buffer, req);
+      switch (parsed)
+        {
+        case ParseResult::INCOMPLETE:
+        case ParseResult::HEADERS_ONLY:
+          break;
+
+        case ParseResult::INVALID:
+          c.Queue (FormatResponse (400, "", false), true);
+          return c.Flush ();
+
+        case ParseResult::TOO_LARGE:
+          c.Queue (FormatResponse (413, "", false), true);
+          return c.Flush ();
+
+        case ParseResult::COMPLETE:
+          break;
+        }
+
+      if (parsed == ParseResult::COMPLETE)
+        break;
+
+      /* If nothing at all is buffered, the connection is idle and
+         can be handed back to the poller.  */
+      if (c.buffer.empty ())
+        return true;
+
+      /* Requests that take too long to arrive are dropped, no matter
+         whether the client is sending data slowly or not at all.  */
+      if (c.IsRequestExpired (std::chrono::steady_clock::now ()))
+        {
+          VLOG (1) << "Timeout receiving request from " << c.peer;
+          return false;
+        }
+
+      if (parsed == ParseResult::HEADERS_ONLY && req.expectContinue
+            && !c.continueSent)
+        {
+          c.Queue ("HTTP/1.1 100 Continue\r\n\r\n", false);
+          c.continueSent = true;
+        }
+
+      /* We only read what is available right now.  If the client has
+         not sent more yet, the connection (with the partial request)
+         is handed back to the poller, so that it does not block
+         a worker while waiting.  */
+      switch (c.Read ())
+        {
+        case Connection::ReadResult::DATA:
+          continue;
+        case Connection::ReadResult::WOULD_BLOCK:
+          return c.Flush ();
+        case Connection::ReadResult::CLOSED:
+          return false;
+        }
+    }
+
+  /* We process a single request per turn, and then hand the connection
+     back (so that others get their turn as well).  If more requests are
+     buffered already, the poller queues the connection again right away
+     once the response has been sent.  */
+  c.continueSent = false;
+  if (!c.buffer.empty ())
+    {
+      c.requestStart = std::chrono::steady_clock::now ();
+      c.pipelined = req.keepAlive;
+    }
+
+  if (req.method == "GET" && pageHandler)
+    {
+      std::string contentType, body;
+      const bool found = pageHandler (req.target, contentType, body);
+      if (!found)
+        contentType = "text/plain";
+      c.Queue (FormatResponse (found ? 200 : 404, body, req.keepAlive,
+                               contentType),
+               !req.keepAlive);
+      return c.Flush ();
+    }
+
+  if (req.method != "POST" || GetHandler () == nullptr)
+    {
+      c.Queue (FormatResponse (405, "", req.keepAlive), !req.keepAlive);
+      return c.Flush ();
+    }
+
+  std::string response;
+  {
+    ClientScope client(c.peer);
+    ProcessRequest (req.body, response);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    ++numRequests;
+  }
+
+  c.Queue (FormatResponse (200, response, req.keepAlive), !req.keepAlive);
+  return c.Flush ();
+}
+
+void
+HttpConnector::RunPoller ()
+{
+  std::vector<std::unique_ptr<Connection>> idle;
+
+  /* When accepting connections fails (e.g. with EMFILE), the listening
+     socket stays readable.  So we stop watching it for a short time, as
+     we would spin otherwise.  */
+  std::chrono::steady_clock::time_point acceptPausedUntil;
+  bool acceptFailing = false;
+
+  while (true)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        if (shouldStop)
+          break;
+        for (auto& c : returned)
+          idle.push_back (std::move (c));
+        returned.clear ();
+      }
+
+      /* Connections are closed if they are idle for too long, or if they
+         have a partial request or unsent response whose deadline has
+         passed.  */
+      const auto now = std::chrono::steady_clock::now ();
+      idle.erase (std::remove_if (idle.begin (), idle.end (),
+                                  [now] (const std::unique_ptr<Connection>& c)
+                                    {
+                                      return c->lastActive + KEEPALIVE_TIMEOUT
+                                                < now
+                                          || c->IsRequestExpired (now);
+                                    }),
+                  idle.end ());
+
+      /* Connections with pending output are watched for being writable,
+         and the output is sent from here (without blocking).  Connections
+         with pipelined requests (and no pending output) are ready to be
+         processed right away.  */
+      std::vector<std::unique_ptr<Connection>> ready;
+      for (auto& c : idle)
+        if (!c->HasOutput () && c->pipelined)
+          ready.push_back (std::move (c));
+      idle.erase (std::remove (idle.begin (), idle.end (), nullptr),
+                  idle.end ());
+
+      const bool acceptPaused = now < acceptPausedUntil;
+
+      std::vector<pollfd> fds;
+      fds.push_back ({wakeupFds[0], POLLIN, 0});
+      /* Negative file descriptors are ignored by poll.  */
+      fds.push_back ({acceptPaused ? -1 : listenFd, POLLIN, 0});
+      for (const auto& c : idle)
+        fds.push_back ({c->fd,
+                        static_cast<short> (c->HasOutput () ? POLLOUT : POLLIN),
+                        0});
+
+      int timeout = ready.empty () ? POLL_INTERVAL_MS : 0;
+      if (acceptPaused)
+        timeout = std::min<int> (
+            timeout,
+            std::chrono::duration_cast<std::chrono::milliseconds> (
+                acceptPausedUntil - now).count () + 1);
+      if (poll (fds.data (), fds.size (), timeout) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          PLOG (FATAL) << "poll failed in RPC server";
+        }
+
+      if (fds[0].revents != 0)
+        {
+          char buf[256];
+          while (read (wakeupFds[0], buf, sizeof (buf)) > 0)
+            continue;
+        }
+
+      /* Idle connections that have data (or were closed, which the worker
+         will notice as well) are scheduled for processing.  For those
+         with pending output, we send more of it.  */
+      for (size_t i = 0; i < idle.size (); ++i)
+        {
+          if (fds[i + 2].revents == 0)
+            continue;
+
+          auto& c = idle[i];
+          if (!c->HasOutput ())
+            {
+              ready.push_back (std::move (c));
+              continue;
+            }
+
+          if (!c->Flush ())
+            {
+              c.reset ();
+              continue;
+            }
+          c->lastActive = now;
+          if (!c->HasOutput () && c->pipelined)
+            ready.push_back (std::move (c));
+        }
+      idle.erase (std::remove (idle.begin (), idle.end (), nullptr),
+                  idle.end ());
+
+      for (auto& c : ready)
+        Enqueue (std::move (c));
+
+      /* New connections are watched like idle ones until the client has
+         actually sent something, so that they do not block a worker.  */
+      if (fds[1].revents != 0)
+        while (true)
+          {
+            sockaddr_storage addr;
+            socklen_t addrLen = sizeof (addr);
+            const int fd = accept4 (listenFd,
+                                    reinterpret_cast<sockaddr*> (&addr),
+                                    &addrLen, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0)
+              {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                  break;
+
+                /* We only log the first failure in a row, so that we do
+                   not flood the log while e.g. out of file descriptors.  */
+                if (!acceptFailing)
+                  PLOG (WARNING) << "Failed to accept RPC connection";
+                acceptFailing = true;
+                acceptPausedUntil
+                    = std::chrono::steady_clock::now () + ACCEPT_BACKOFF;
+                break;
+              }
+            acceptFailing = false;
+
+            const std::string peer = GetPeerIdentity (fd, addr);
+            auto c = std::make_unique<Connection> (fd, peer, numConnections);
+
+            if (numConnections > maxConnections)
+              {
+                VLOG (1) << "Too many RPC connections, rejecting " << peer;
+                {
+                  std::lock_guard<std::mutex> lock(mut);
+                  ++numRejected;
+                }
+                SendNow (c->fd, FormatResponse (503, "", false));
+                shutdown (c->fd, SHUT_WR);
+                continue;
+              }
+
+            idle.push_back (std::move (c));
+          }
+    }
+}
+
+void
+HttpConnector::RunWorker ()
+{
+  while (true)
+    {
+      std::unique_ptr<Connection> c;
+      {
+        std::unique_lock<std::mutex> lock(mut);
+        while (queue.empty () && !shouldStop)
+          cvQueue.wait (lock);
+        if (shouldStop)
+          return;
+
+        c = std::move (queue.front ());
+        queue.pop_front ();
+      }
+
+      if (!Serve (*c))
+        continue;
+
+      c->lastActive = std::chrono::steady_clock::now ();
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        returned.push_back (std::move (c));
+      }
+      WakeUpPoller ();
+    }
+}
+
+} // namespace xayax
@@ -0,0 +1,696 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "private/httpconnector.hpp"
+
+#include "private/ratelimit.hpp"
+#include "testutils.hpp"
+
+#include <jsonrpccpp/server/connectors/httpserver.h>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace xayax
+{
+namespace
+{
+
+/** Port for the test server.  */
+constexpr int PORT = 49'839;
+
+/**
+ * Connection handler that just echoes back the request.  It can be
+ * blocked, so that we can test what happens when all workers are busy.
+ */
+class EchoHandler : public jsonrpc::IClientConnectionHandler
+{
+
+private:
+
+  std::mutex mut;
+  std::condition_variable cv;
+
+  /** Whether requests are currently blocked.  */
+  bool blocked = false;
+
+  /** The client identity of the last request.  */
+  std::string lastClient;
+
+public:
+
+  void
+  HandleRequest (const std::string& request, std::string& retValue) override
+  {
+    std::unique_lock<std::mutex> lock(mut);
+    while (blocked)
+      cv.wait (lock);
+    lastClient = ClientScope::GetCurrent ();
+    retValue = "echo " + request;
+  }
+
+  std::string
+  GetLastClient ()
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    return lastClient;
+  }
+
+  void
+  SetBlocked (const bool b)
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    blocked = b;
+    cv.notify_all ();
+  }
+
+};
+
+/**
+ * Simple HTTP client on a raw socket, so that we can control exactly
+ * what is sent (e.g. for pipelining).
+ */
+class TestClient
+{
+
+private:
+
+  int fd;
+
+  /** Data received but not yet returned.  */
+  std::string buffer;
+
+  /**
+   * Reads more data into the buffer.  Returns false on EOF.
+   */
+  bool
+  Read ()
+  {
+    char buf[4'096];
+    const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+    if (n <= 0)
+      return false;
+    buffer.append (buf, n);
+    return true;
+  }
+
+public:
+
+  /**
+   * Status code and body of a response.
+   */
+  struct Response
+  {
+    int code;
+    std::string body;
+  };
+
+  /**
+   * Connects to the Unix domain socket at the given path.
+   */
+  explicit TestClient (const std::string& path)
+  {
+    fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    CHECK_GE (fd, 0);
+
+    sockaddr_un addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    CHECK_LT (path.size (), sizeof (addr.sun_path));
+    std::strcpy (addr.sun_path, path.c_str ());
+    CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+  }
+
+  explicit TestClient (const int port)
+  {
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    CHECK_GE (fd, 0);
+
+    sockaddr_in addr;
+    std::memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (port);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    CHECK_EQ (connect (fd, reinterpret_cast<const sockaddr*> (&addr),
+                       sizeof (addr)), 0);
+  }
+
+  ~TestClient ()
+  {
+    close (fd);
+  }
+
+  TestClient () = delete;
+  TestClient (const TestClient&) = delete;
+  void operator= (const TestClient&) = delete;
+
+  /**
+   * Builds a POST request with the given body.
+   */
+  static std::string
+  BuildPost (const std::string& body, const std::string& extraHeaders = "")
+  {
+    std::ostringstream out;
+    out << "POST / HTTP/1.1\r\n"
+        << "Host: localhost\r\n"
+        << "Content-Type: application/json\r\n"
+        << "Content-Length: " << body.size () << "\r\n"
+        << extraHeaders
+        << "\r\n"
+        << body;
+    return out.str ();
+  }
+
+  void
+  Send (const std::string& data)
+  {
+    CHECK_EQ (send (fd, data.data (), data.size (), MSG_NOSIGNAL),
+              static_cast<ssize_t> (data.size ()));
+  }
+
+  /**
+   * Reads the header of the next response and returns the status line.
+   */
+  std::string
+  ReadStatusLine ()
+  {
+    size_t end;
+    while ((end = buffer.find ("\r\n")) == std::string::npos)
+      CHECK (Read ()) << "Connection closed";
+    const std::string line = buffer.substr (0, end);
+    buffer.erase (0, end + 2);
+    return line;
+  }
+
+  /**
+   * Reads the next full response.
+   */
+  Response
+  ReadResponse ()
+  {
+    size_t headerEnd;
+    while ((headerEnd = buffer.find ("\r\n\r\n")) == std::string::npos)
+      CHECK (Read ()) << "Connection closed";
+
+    Response res;
+    std::istringstream header(buffer.substr (0, headerEnd));
+    std::string version;
+    header >> version >> res.code;
+
+    size_t len = 0;
+    const std::string key = "Content-Length: ";
+    const auto pos = buffer.find (key);
+    if (pos != std::string::npos && pos < headerEnd)
+      len = std::stoul (buffer.substr (pos + key.size ()));
+
+    while (buffer.size () < headerEnd + 4 + len)
+      CHECK (Read ()) << "Connection closed";
+
+    res.body = buffer.substr (headerEnd + 4, len);
+    buffer.erase (0, headerEnd + 4 + len);
+    return res;
+  }
+
+  /**
+   * Sends a POST request and returns the response.
+   */
+  Response
+  Post (const std::string& body)
+  {
+    Send (BuildPost (body));
+    return ReadResponse ();
+  }
+
+  /**
+   * Returns the underlying socket, e.g. for sending data byte by byte.
+   */
+  int
+  GetFd () const
+  {
+    return fd;
+  }
+
+  /**
+   * Returns true if the server closed the connection.
+   */
+  bool
+  IsClosed ()
+  {
+    return buffer.empty () && !Read ();
+  }
+
+};
+
+class HttpConnectorTests : public testing::Test
+{
+
+protected:
+
+  EchoHandler handler;
+  HttpConnector server;
+
+  HttpConnectorTests ()
+    : server(PORT, true, 1, 2)
+  {
+    server.SetHandler (&handler);
+    CHECK (server.StartListening ());
+  }
+
+  ~HttpConnectorTests ()
+  {
+    handler.SetBlocked (false);
+    server.StopListening ();
+  }
+
+};
+
+TEST_F (HttpConnectorTests, KeepAlive)
+{
+  TestClient client(PORT);
+  for (const std::string msg : {"foo", "bar", "baz"})
+    {
+      const auto res = client.Post (msg);
+      EXPECT_EQ (res.code, 200);
+      EXPECT_EQ (res.body, "echo " + msg);
+    }
+  EXPECT_EQ (server.GetNumRequests (), 3);
+}
+
+TEST_F (HttpConnectorTests, Pipelining)
+{
+  TestClient client(PORT);
+  client.Send (TestClient::BuildPost ("first")
+                + TestClient::BuildPost ("second"));
+  EXPECT_EQ (client.ReadResponse ().body, "echo first");
+  EXPECT_EQ (client.ReadResponse ().body, "echo second");
+}
+
+TEST_F (HttpConnectorTests, ExpectContinue)
+{
+  TestClient client(PORT);
+  const std::string req
+      = TestClient::BuildPost ("body", "Expect: 100-continue\r\n");
+  client.Send (req.substr (0, req.size () - 4));
+  EXPECT_EQ (client.ReadStatusLine (), "HTTP/1.1 100 Continue");
+  EXPECT_EQ (client.ReadStatusLine (), "");
+  client.Send ("body");
+  EXPECT_EQ (client.ReadResponse ().body, "echo body");
+}
+
+TEST_F (HttpConnectorTests, ConnectionClose)
+{
+  TestClient client(PORT);
+  client.Send (TestClient::BuildPost ("foo", "Connection: close\r\n"));
+  EXPECT_EQ (client.ReadResponse ().body, "echo foo");
+  EXPECT_TRUE (client.IsClosed ());
+}
+
+TEST_F (HttpConnectorTests, InvalidRequests)
+{
+  {
+    TestClient client(PORT);
+    client.Send ("GET / HTTP/1.1\r\n\r\n");
+    EXPECT_EQ (client.ReadResponse ().code, 405);
+    EXPECT_EQ (client.Post ("foo").body, "echo foo");
+  }
+
+  {
+    TestClient client(PORT);
+    client.Send ("POST / HTTP/1.1\r\nContent-Length: abc\r\n\r\n");
+    EXPECT_EQ (client.ReadResponse ().code, 400);
+    EXPECT_TRUE (client.IsClosed ());
+  }
+
+  {
+    TestClient client(PORT);
+    client.Send ("POST / HTTP/1.1\r\nContent-Length: 1000000000\r\n\r\n");
+    EXPECT_EQ (client.ReadResponse ().code, 413);
+    EXPECT_TRUE (client.IsClosed ());
+  }
+}
+
+TEST_F (HttpConnectorTests, QueueFull)
+{
+  handler.SetBlocked (true);
+
+  /* The first request is taken by the single worker, and blocks there.
+     The next two are queued, and the fourth rejected right away.  */
+  TestClient busy(PORT);
+  busy.Send (TestClient::BuildPost ("busy"));
+  SleepSome ();
+  TestClient queued1(PORT);
+  queued1.Send (TestClient::BuildPost ("queued 1"));
+  TestClient queued2(PORT);
+  queued2.Send (TestClient::BuildPost ("queued 2"));
+  SleepSome ();
+
+  TestClient rejected(PORT);
+  rejected.Send (TestClient::BuildPost ("rejected"));
+  EXPECT_EQ (rejected.ReadResponse ().code, 503);
+  EXPECT_TRUE (rejected.IsClosed ());
+  EXPECT_EQ (server.GetNumRejected (), 1);
+
+  handler.SetBlocked (false);
+  EXPECT_EQ (busy.ReadResponse ().body, "echo busy");
+  EXPECT_EQ (queued1.ReadResponse ().body, "echo queued 1");
+  EXPECT_EQ (queued2.ReadResponse ().body, "echo queued 2");
+}
+
+TEST_F (HttpConnectorTests, IdleConnectionsDoNotBlockWorkers)
+{
+  /* With a single worker, an idle keep-alive connection must not prevent
+     other connections from being served.  */
+  TestClient idle(PORT);
+  EXPECT_EQ (idle.Post ("first").body, "echo first");
+
+  TestClient other(PORT);
+  EXPECT_EQ (other.Post ("second").body, "echo second");
+  EXPECT_EQ (idle.Post ("third").body, "echo third");
+}
+
+TEST_F (HttpConnectorTests, PartialRequestsDoNotBlockWorkers)
+{
+  /* With a single worker, a client that has sent only part of a request
+     must not prevent other connections from being served.  */
+  TestClient slow(PORT);
+  const std::string req = TestClient::BuildPost ("slow");
+  slow.Send (req.substr (0, 10));
+  SleepSome ();
+
+  TestClient other(PORT);
+  EXPECT_EQ (other.Post ("other").body, "echo other");
+
+  slow.Send (req.substr (10));
+  EXPECT_EQ (slow.ReadResponse ().body, "echo slow");
+}
+
+TEST_F (HttpConnectorTests, PipeliningClientNotReading)
+{
+  /* A client that pipelines requests with large responses, but does not
+     read the responses, must not hold on to the (single) worker.  */
+  TestClient greedy(PORT);
+  std::string pending;
+  for (unsigned i = 0; i < 20; ++i)
+    pending += TestClient::BuildPost (std::string (1 << 20, 'x'));
+
+  size_t sent = 0;
+  const auto start = std::chrono::steady_clock::now ();
+  while (sent < pending.size ()
+           && std::chrono::steady_clock::now () - start
+                < std::chrono::seconds (1))
+    {
+      const ssize_t n = send (greedy.GetFd (), pending.data () + sent,
+                              pending.size () - sent,
+                              MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n > 0)
+        sent += n;
+      else
+        std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+
+  TestClient other(PORT);
+  const auto before = std::chrono::steady_clock::now ();
+  EXPECT_EQ (other.Post ("other").body, "echo other");
+  EXPECT_LT (std::chrono::steady_clock::now () - before,
+             std::chrono::seconds (1));
+}
+
+TEST_F (HttpConnectorTests, RequestDeadline)
+{
+  /* A client that keeps sending data slowly is disconnected when the
+     request has not been received in full after the deadline, even
+     though each read by itself succeeds quickly.  */
+  TestClient slow(PORT);
+  const std::string req = TestClient::BuildPost (std::string (100, 'x'));
+  const auto start = std::chrono::steady_clock::now ();
+  for (size_t i = 0; i < req.size () - 1; ++i)
+    {
+      if (std::chrono::steady_clock::now () - start > std::chrono::seconds (10))
+        break;
+      if (send (slow.GetFd (), req.data () + i, 1, MSG_NOSIGNAL) != 1)
+        break;
+      std::this_thread::sleep_for (std::chrono::milliseconds (200));
+    }
+
+  EXPECT_TRUE (slow.IsClosed ());
+  EXPECT_LT (std::chrono::steady_clock::now () - start,
+             std::chrono::seconds (10));
+}
+
+TEST_F (HttpConnectorTests, ClientIdentity)
+{
+  TestClient client(PORT);
+
+  client.Post ("foo");
+  EXPECT_EQ (handler.GetLastClient (), "127.0.0.1");
+
+  /* The Authorization header is not authenticated, so it must not be
+     used to identify the client.  */
+  client.Send (TestClient::BuildPost ("foo",
+                                      "Authorization: Basic dXNlcjpwYXNz\r\n"));
+  client.ReadResponse ();
+  EXPECT_EQ (handler.GetLastClient (), "127.0.0.1");
+}
+
+TEST_F (HttpConnectorTests, GetWithoutPageHandler)
+{
+  TestClient client(PORT);
+  client.Send ("GET /metrics HTTP/1.1\r\n\r\n");
+  EXPECT_EQ (client.ReadResponse ().code, 405);
+}
+
+TEST (HttpConnectorPageTests, PageHandler)
+{
+  HttpConnector server(PORT, true, 1, 2);
+  server.SetPageHandler ([] (const std::string& target,
+                             std::string& contentType, std::string& body)
+    {
+      if (target != "/page")
+        return false;
+      contentType = "text/plain";
+      body = "content";
+      return true;
+    });
+  ASSERT_TRUE (server.StartListening ());
+
+  {
+    TestClient client(PORT);
+    client.Send ("GET /page HTTP/1.1\r\n\r\n");
+    auto res = client.ReadResponse ();
+    EXPECT_EQ (res.code, 200);
+    EXPECT_EQ (res.body, "content");
+
+    client.Send ("GET /other HTTP/1.1\r\n\r\n");
+    EXPECT_EQ (client.ReadResponse ().code, 404);
+
+    /* Without a JSON-RPC handler, POST requests are not allowed.  */
+    client.Send (TestClient::BuildPost ("foo"));
+    EXPECT_EQ (client.ReadResponse ().code, 405);
+  }
+
+  server.StopListening ();
+}
+
+TEST (HttpConnectorLimitTests, MaxConnections)
+{
+  EchoHandler handler;
+  HttpConnector server(PORT, true, 1, 2);
+  server.SetHandler (&handler);
+  server.SetMaxConnections (2);
+  ASSERT_TRUE (server.StartListening ());
+
+  {
+    TestClient first(PORT);
+    EXPECT_EQ (first.Post ("first").body, "echo first");
+    {
+      TestClient second(PORT);
+      EXPECT_EQ (second.Post ("second").body, "echo second");
+
+      TestClient rejected(PORT);
+      EXPECT_EQ (rejected.ReadResponse ().code, 503);
+      EXPECT_TRUE (rejected.IsClosed ());
+      EXPECT_EQ (server.GetNumRejected (), 1);
+    }
+
+    /* Once a connection is closed, new ones are accepted again.  */
+    SleepSome ();
+    TestClient third(PORT);
+    EXPECT_EQ (third.Post ("third").body, "echo third");
+    EXPECT_EQ (first.Post ("again").body, "echo again");
+  }
+
+  server.StopListening ();
+}
+
+TEST (HttpConnectorLimitTests, OutOfFileDescriptors)
+{
+  EchoHandler handler;
+  HttpConnector server(PORT, true, 1, 2);
+  server.SetHandler (&handler);
+  ASSERT_TRUE (server.StartListening ());
+
+  rlimit original;
+  ASSERT_EQ (getrlimit (RLIMIT_NOFILE, &original), 0);
+
+  /* We connect a client, and then lower the file descriptor limit so
+     that the server cannot accept it.  */
+  const int dummy = dup (0);
+  ASSERT_GE (dummy, 0);
+  close (dummy);
+  TestClient client(PORT);
+
+  rlimit lowered = original;
+  lowered.rlim_cur = dummy + 1;
+  ASSERT_EQ (setrlimit (RLIMIT_NOFILE, &lowered), 0);
+
+  /* The poller must not spin while accepting fails.  */
+  rusage before, after;
+  ASSERT_EQ (getrusage (RUSAGE_SELF, &before), 0);
+  std::this_thread::sleep_for (std::chrono::seconds (1));
+  ASSERT_EQ (getrusage (RUSAGE_SELF, &after), 0);
+  const auto cpuMs = [] (const rusage& r)
+    {
+      return (r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1'000
+          + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1'000;
+    };
+  EXPECT_LT (cpuMs (after) - cpuMs (before), 200);
+
+  /* Once file descriptors are available again, the client is served.  */
+  ASSERT_EQ (setrlimit (RLIMIT_NOFILE, &original), 0);
+  EXPECT_EQ (client.Post ("foo").body, "echo foo");
+
+  server.StopListening ();
+}
+
+TEST (HttpConnectorUnixTests, UnixSocket)
+{
+  const std::string path = testing::TempDir () + "httpconnector.sock";
+  unlink (path.c_str ());
+
+  EchoHandler handler;
+  HttpConnector server(path, 1, 2);
+  server.SetHandler (&handler);
+  ASSERT_TRUE (server.StartListening ());
+
+  {
+    TestClient client(path);
+    EXPECT_EQ (client.Post ("foo").body, "echo foo");
+    EXPECT_EQ (client.Post ("bar").body, "echo bar");
+    EXPECT_EQ (handler.GetLastClient (), "uid " + std::to_string (getuid ()));
+  }
+
+  server.StopListening ();
+  EXPECT_NE (access (path.c_str (), F_OK), 0);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Simple load test, which sends many requests in parallel through both
+ * our connector and jsonrpc::HttpServer and logs the throughput and latency
+ * for comparison.  This is a benchmark rather than a test, and thus
+ * disabled by default.  It can be run with --gtest_also_run_disabled_tests.
+ */
+class HttpConnectorLoadTest : public testing::Test
+{
+
+protected:
+
+  static constexpr unsigned CLIENTS = 16;
+  static constexpr unsigned REQUESTS_PER_CLIENT = 500;
+
+  EchoHandler handler;
+
+  /**
+   * Runs the load test against the server on our port and logs the
+   * results with the given label.
+   */
+  void
+  RunLoad (const std::string& label)
+  {
+    std::mutex mut;
+    std::vector<std::chrono::microseconds> latencies;
+    std::atomic<unsigned> failures(0);
+
+    const auto start = std::chrono::steady_clock::now ();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < CLIENTS; ++i)
+      threads.emplace_back ([&] ()
+        {
+          TestClient client(PORT);
+          std::vector<std::chrono::microseconds> mine;
+          for (unsigned j = 0; j < REQUESTS_PER_CLIENT; ++j)
+            {
+              const auto before = std::chrono::steady_clock::now ();
+              const auto res = client.Post (R"({"method":"getblockhash"})");
+              const auto after = std::chrono::steady_clock::now ();
+              if (res.code != 200)
+                ++failures;
+              mine.push_back (
+                  std::chrono::duration_cast<std::chrono::microseconds> (
+                      after - before));
+            }
+
+          std::lock_guard<std::mutex> lock(mut);
+          latencies.insert (latencies.end (), mine.begin (), mine.end ());
+        });
+    for (auto& t : threads)
+      t.join ();
+    const auto elapsed = std::chrono::steady_clock::now () - start;
+
+    EXPECT_EQ (failures, 0);
+    ASSERT_EQ (latencies.size (), CLIENTS * REQUESTS_PER_CLIENT);
+    std::sort (latencies.begin (), latencies.end ());
+    const auto p99 = latencies[latencies.size () * 99 / 100];
+    const double seconds
+        = std::chrono::duration_cast<std::chrono::duration<double>> (elapsed)
+            .count ();
+
+    LOG (INFO)
+        << label << ": " << static_cast<uint64_t> (latencies.size () / seconds)
+        << " requests/s, p99 latency " << p99.count () << " us";
+  }
+
+};
+
+TEST_F (HttpConnectorLoadTest, DISABLED_CompareWithLibjsonrpccpp)
+{
+  {
+    HttpConnector server(PORT, true, 8, 128);
+    server.SetHandler (&handler);
+    ASSERT_TRUE (server.StartListening ());
+    RunLoad ("HttpConnector");
+    server.StopListening ();
+  }
+
+  {
+    jsonrpc::HttpServer server(PORT);
+    server.BindLocalhost ();
+    server.SetHandler (&handler);
+    ASSERT_TRUE (server.StartListening ());
+    RunLoad ("jsonrpc::HttpServer");
+    server.StopListening ();
+  }
+}
+
+} // anonymous namespace
+} // namespace xayax
@@ -0,0 +1,200 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <sstream>
+
+namespace xayax
+{
+
+Histogram::Histogram (const std::vector<double>& b)
+  : bounds(b), buckets(new std::atomic<uint64_t>[b.size () + 1])
+{
+  CHECK (std::is_sorted (bounds.begin (), bounds.end ()));
+  for (size_t i = 0; i <= bounds.size (); ++i)
+    buckets[i] = 0;
+}
+
+void
+Histogram::Observe (const double v)
+{
+  const size_t bucket
+      = std::lower_bound (bounds.begin (), bounds.end (), v) - bounds.begin ();
+  buckets[bucket].fetch_add (1, std::memory_order_relaxed);
+  count.fetch_add (1, std::memory_order_relaxed);
+
+  double cur = sum.load (std::memory_order_relaxed);
+  while (!sum.compare_exchange_weak (cur, cur + v, std::memory_order_relaxed))
+    ;
+}
+
+std::vector<uint64_t>
+Histogram::GetCumulativeCounts () const
+{
+  std::vector<uint64_t> res;
+  uint64_t total = 0;
+  for (size_t i = 0; i <= bounds.size (); ++i)
+    {
+      total += buckets[i].load (std::memory_order_relaxed);
+      res.push_back (total);
+    }
+  return res;
+}
+
+const std::vector<double>&
+Histogram::LatencyBuckets ()
+{
+  static const std::vector<double> buckets =
+    {
+      0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+      0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0,
+    };
+  return buckets;
+}
+
+MetricsRegistry&
+MetricsRegistry::Get ()
+{
+  static MetricsRegistry instance;
+  return instance;
+}
+
+MetricsRegistry::Family&
+MetricsRegistry::GetFamily (const std::string& name, const Type type,
+                            const std::string& help)
+{
+  auto mit = families.find (name);
+  if (mit == families.end ())
+    {
+      Family f;
+      f.type = type;
+      f.help = help;
+      mit = families.emplace (name, std::move (f)).first;
+    }
+
+  CHECK (mit->second.type == type)
+      << "Metric " << name << " used with different types";
+  return mit->second;
+}
+
+Counter&
+MetricsRegistry::GetCounter (const std::string& name, const std::string& help,
+                             const std::string& labels)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& ptr = GetFamily (name, Type::COUNTER, help).counters[labels];
+  if (ptr == nullptr)
+    ptr = std::make_unique<Counter> ();
+  return *ptr;
+}
+
+Gauge&
+MetricsRegistry::GetGauge (const std::string& name, const std::string& help,
+                           const std::string& labels)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& ptr = GetFamily (name, Type::GAUGE, help).gauges[labels];
+  if (ptr == nullptr)
+    ptr = std::make_unique<Gauge> ();
+  return *ptr;
+}
+
+Histogram&
+MetricsRegistry::GetHistogram (const std::string& name, const std::string& help,
+                               const std::vector<double>& buckets,
+                               const std::string& labels)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  auto& ptr = GetFamily (name, Type::HISTOGRAM, help).histograms[labels];
+  if (ptr == nullptr)
+    ptr = std::make_unique<Histogram> (buckets);
+  return *ptr;
+}
+
+namespace
+{
+
+/**
+ * Returns the metric name with the given labels (which may be empty)
+ * and an optional extra label appended.
+ */
+std::string
+WithLabels (const std::string& name, const std::string& labels,
+            const std::string& extra = "")
+{
+  std::string all = labels;
+  if (!extra.empty ())
+    {
+      if (!all.empty ())
+        all += ",";
+      all += extra;
+    }
+
+  if (all.empty ())
+    return name;
+  return name + "{" + all + "}";
+}
+
+} // anonymous namespace
+
+std::string
+MetricsRegistry::Render () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  std::ostringstream out;
+  for (const auto& entry : families)
+    {
+      const auto& name = entry.first;
+      const auto& f = entry.second;
+
+      out << "# HELP " << name << " " << f.help << "\n";
+      switch (f.type)
+        {
+        case Type::COUNTER:
+          out << "# TYPE " << name << " counter\n";
+          for (const auto& c : f.counters)
+            out << WithLabels (name, c.first) << " "
+                << c.second->Get () << "\n";
+          break;
+
+        case Type::GAUGE:
+          out << "# TYPE " << name << " gauge\n";
+          for (const auto& g : f.gauges)
+            out << WithLabels (name, g.first) << " "
+                << g.second->Get () << "\n";
+          break;
+
+        case Type::HISTOGRAM:
+          out << "# TYPE " << name << " histogram\n";
+          for (const auto& h : f.histograms)
+            {
+              const auto& bounds = h.second->GetBounds ();
+              const auto counts = h.second->GetCumulativeCounts ();
+              for (size_t i = 0; i < bounds.size (); ++i)
+                {
+                  std::ostringstream le;
+                  le << "le=\"" << bounds[i] << "\"";
+                  out << WithLabels (name + "_bucket", h.first, le.str ())
+                      << " " << counts[i] << "\n";
+                }
+              out << WithLabels (name + "_bucket", h.first, "le=\"+Inf\"")
+                  << " " << counts.back () << "\n";
+              out << WithLabels (name + "_sum", h.first) << " "
+                  << h.second->GetSum () << "\n";
+              out << WithLabels (name + "_count", h.first) << " "
+                  << counts.back () << "\n";
+            }
+          break;
+        }
+    }
+
+  return out.str ();
+}
+
+} // namespace xayax
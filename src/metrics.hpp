@@ -0,0 +1,273 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAX_METRICS_HPP
+#define XAYAX_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace xayax
+{
+
+/**
+ * A monotonically increasing counter metric.
+ */
+class Counter
+{
+
+private:
+
+  std::atomic<uint64_t> value{0};
+
+public:
+
+  Counter () = default;
+
+  Counter (const Counter&) = delete;
+  void operator= (const Counter&) = delete;
+
+  void
+  Increment (const uint64_t n = 1)
+  {
+    value.fetch_add (n, std::memory_order_relaxed);
+  }
+
+  uint64_t
+  Get () const
+  {
+    return value.load (std::memory_order_relaxed);
+  }
+
+};
+
+/**
+ * A gauge metric, i.e. a value that can go up and down.
+ */
+class Gauge
+{
+
+private:
+
+  std::atomic<int64_t> value{0};
+
+public:
+
+  Gauge () = default;
+
+  Gauge (const Gauge&) = delete;
+  void operator= (const Gauge&) = delete;
+
+  void
+  Set (const int64_t v)
+  {
+    value.store (v, std::memory_order_relaxed);
+  }
+
+  void
+  Add (const int64_t n)
+  {
+    value.fetch_add (n, std::memory_order_relaxed);
+  }
+
+  int64_t
+  Get () const
+  {
+    return value.load (std::memory_order_relaxed);
+  }
+
+};
+
+/**
+ * A histogram metric with fixed buckets (given by their upper bounds).
+ */
+class Histogram
+{
+
+private:
+
+  /** Upper bounds of the buckets (in increasing order).  */
+  const std::vector<double> bounds;
+
+  /**
+   * Counts of observations per bucket (not cumulative).  The last entry
+   * is for values above all bounds.
+   */
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+
+  /** Total number of observations.  */
+  std::atomic<uint64_t> count{0};
+
+  /** Sum of all observed values.  */
+  std::atomic<double> sum{0.0};
+
+public:
+
+  explicit Histogram (const std::vector<double>& b);
+
+  Histogram () = delete;
+  Histogram (const Histogram&) = delete;
+  void operator= (const Histogram&) = delete;
+
+  /**
+   * Records an observed value.
+   */
+  void Observe (double v);
+
+  /**
+   * Returns the bucket bounds.
+   */
+  const std::vector<double>&
+  GetBounds () const
+  {
+    return bounds;
+  }
+
+  /**
+   * Returns the cumulative counts for each bucket (including a last
+   * one for +Inf, which equals the total count).
+   */
+  std::vector<uint64_t> GetCumulativeCounts () const;
+
+  uint64_t
+  GetCount () const
+  {
+    return count.load (std::memory_order_relaxed);
+  }
+
+  double
+  GetSum () const
+  {
+    return sum.load (std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns the default buckets for latencies in seconds.
+   */
+  static const std::vector<double>& LatencyBuckets ();
+
+};
+
+/**
+ * RAII helper that records the time (in seconds) from its construction
+ * until its destruction in a histogram.
+ */
+class ScopedTimer
+{
+
+private:
+
+  Histogram& hist;
+  const std::chrono::steady_clock::time_point start;
+
+public:
+
+  explicit ScopedTimer (Histogram& h)
+    : hist(h), start(std::chrono::steady_clock::now ())
+  {}
+
+  ~ScopedTimer ()
+  {
+    const std::chrono::duration<double> elapsed
+        = std::chrono::steady_clock::now () - start;
+    hist.Observe (elapsed.count ());
+  }
+
+  ScopedTimer () = delete;
+  ScopedTimer (const ScopedTimer&) = delete;
+  void operator= (const ScopedTimer&) = delete;
+
+};
+
+/**
+ * Global registry of all metrics, which can render them in the Prometheus
+ * text exposition format.  Metrics are created on first access and live
+ * for the lifetime of the process, so that call sites can (and for hot
+ * paths should) keep references to them, e.g. in function-local statics.
+ * Updating metrics is lock-free; only creating and rendering them locks.
+ *
+ * Metrics with the same name but different labels (given in the Prometheus
+ * syntax, e.g. method="getblockhash") form one family.
+ */
+class MetricsRegistry
+{
+
+private:
+
+  /** The possible types of metrics.  */
+  enum class Type
+  {
+    COUNTER,
+    GAUGE,
+    HISTOGRAM,
+  };
+
+  /**
+   * All metrics with the same name.
+   */
+  struct Family
+  {
+
+    Type type;
+    std::string help;
+
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+
+  };
+
+  mutable std::mutex mut;
+
+  /** All metric families by name.  */
+  std::map<std::string, Family> families;
+
+  /**
+   * Returns the family with the given name, creating it if needed.  Must
+   * be called with the lock held.
+   */
+  Family& GetFamily (const std::string& name, Type type,
+                     const std::string& help);
+
+public:
+
+  MetricsRegistry () = default;
+
+  MetricsRegistry (const MetricsRegistry&) = delete;
+  void operator= (const MetricsRegistry&) = delete;
+
+  /**
+   * Returns the global instance.
+   */
+  static MetricsRegistry& Get ();
+
+  Counter& GetCounter (const std::string& name, const std::string& help,
+                       const std::string& labels = "");
+  Gauge& GetGauge (const std::string& name, const std::string& help,
+                   const std::string& labels = "");
+
+  /**
+   * Returns a histogram.  The buckets are only used when it is created.
+   */
+  Histogram& GetHistogram (
+      const std::string& name, const std::string& help,
+      const std::vector<double>& buckets = Histogram::LatencyBuckets (),
+      const std::string& labels = "");
+
+  /**
+   * Renders all metrics in the Prometheus text format.
+   */
+  std::string Render () const;
+
+};
+
+} // namespace xayax
+
+#endif // XAYAX_METRICS_HPP
@@ -0,0 +1,104 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.hpp"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+namespace xayax
+{
+namespace
+{
+
+TEST (MetricsTests, CounterAndGauge)
+{
+  MetricsRegistry reg;
+
+  auto& c = reg.GetCounter ("test_total", "A counter");
+  c.Increment ();
+  c.Increment (5);
+  EXPECT_EQ (c.Get (), 6);
+  EXPECT_EQ (&reg.GetCounter ("test_total", "A counter"), &c);
+
+  auto& g = reg.GetGauge ("test_gauge", "A gauge");
+  g.Set (10);
+  g.Add (-3);
+  EXPECT_EQ (g.Get (), 7);
+}
+
+TEST (MetricsTests, Histogram)
+{
+  Histogram h({1.0, 2.0, 5.0});
+  for (const double v : {0.5, 1.0, 1.5, 3.0, 10.0})
+    h.Observe (v);
+
+  EXPECT_EQ (h.GetCumulativeCounts (), std::vector<uint64_t> ({2, 3, 4, 5}));
+  EXPECT_EQ (h.GetCount (), 5);
+  EXPECT_DOUBLE_EQ (h.GetSum (), 16.0);
+}
+
+TEST (MetricsTests, ConcurrentUpdates)
+{
+  MetricsRegistry reg;
+  auto& c = reg.GetCounter ("test_total", "A counter");
+  auto& h = reg.GetHistogram ("test_seconds", "A histogram", {1.0});
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < 4; ++i)
+    threads.emplace_back ([&] ()
+      {
+        for (unsigned j = 0; j < 1'000; ++j)
+          {
+            c.Increment ();
+            h.Observe (0.5);
+          }
+      });
+  for (auto& t : threads)
+    t.join ();
+
+  EXPECT_EQ (c.Get (), 4'000);
+  EXPECT_EQ (h.GetCount (), 4'000);
+  EXPECT_DOUBLE_EQ (h.GetSum (), 2'000.0);
+}
+
+TEST (MetricsTests, Render)
+{
+  MetricsRegistry reg;
+  reg.GetCounter ("requests_total", "Requests", R"(method="a")").Increment (2);
+  reg.GetCounter ("requests_total", "Requests", R"(method="b")").Increment ();
+  reg.GetGauge ("height", "Tip height").Set (42);
+  auto& h = reg.GetHistogram ("latency_seconds", "Latency", {0.1, 1.0},
+                              R"(method="a")");
+  h.Observe (0.05);
+  h.Observe (2.0);
+
+  EXPECT_EQ (reg.Render (), R"(# HELP height Tip height
+# TYPE height gauge
+height 42
+# HELP latency_seconds Latency
+# TYPE latency_seconds histogram
+latency_seconds_bucket{method="a",le="0.1"} 1
+latency_seconds_bucket{method="a",le="1"} 1
+latency_seconds_bucket{method="a",le="+Inf"} 2
+latency_seconds_sum{method="a"} 2.05
+latency_seconds_count{method="a"} 2
+# HELP requests_total Requests
+# TYPE requests_total counter
+requests_total{method="a"} 2
+requests_total{method="b"} 1
+)");
+}
+
+TEST (MetricsTests, TypeMismatch)
+{
+  MetricsRegistry reg;
+  reg.GetCounter ("foo", "Foo");
+  EXPECT_DEATH (reg.GetGauge ("foo", "Foo"), "different types");
+}
+
+} // anonymous namespace
+} // namespace xayax
@@ -0,0 +1,199 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notification.hpp"
+
+#include "proto/blockdata.pb.h"
+
+#include <zstd.h>
+
+#include <glog/logging.h>
+
+#include <sstream>
+
+namespace xayax
+{
+
+namespace
+{
+
+/**
+ * Maximum size of decompressed data we accept, to avoid allocating
+ * arbitrary amounts of memory for invalid data.
+ */
+constexpr unsigned long long MAX_DECOMPRESSED_SIZE = 1ull << 30;
+
+/**
+ * Parses a JSON value from the binary notification.  Unlike LoadJson,
+ * this does not abort on errors, since the data is coming from the outside.
+ */
+bool
+ParseJsonField (const std::string& str, Json::Value& val)
+{
+  Json::CharReaderBuilder rbuilder;
+  rbuilder["allowComments"] = false;
+  rbuilder["strictRoot"] = false;
+  rbuilder["failIfExtra"] = true;
+  rbuilder["rejectDupKeys"] = true;
+
+  std::string parseErrs;
+  std::istringstream in(str);
+  if (!Json::parseFromStream (rbuilder, in, &val, &parseErrs))
+    {
+      LOG (WARNING) << "Invalid JSON in binary notification: " << parseErrs;
+      return false;
+    }
+
+  return true;
+}
+
+/**
+ * Parses the metadata of a block or move, which is the base object
+ * into which the other fields are inserted.
+ */
+bool
+ParseMetadata (const std::string& str, Json::Value& val)
+{
+  if (str.empty ())
+    {
+      val = Json::Value (Json::objectValue);
+      return true;
+    }
+
+  if (!ParseJsonField (str, val))
+    return false;
+  if (val.isNull ())
+    val = Json::Value (Json::objectValue);
+
+  return val.isObject ();
+}
+
+/**
+ * Converts a Move from the GameBlock message to the JSON format of
+ * a move or admin command (with the value put into the given field).
+ */
+bool
+DecodeMove (const proto::Move& mv, const std::string& valueField,
+            const bool withName, Json::Value& res)
+{
+  if (!ParseMetadata (mv.metadata (), res))
+    return false;
+
+  res["txid"] = mv.txid ();
+  if (withName)
+    res["name"] = mv.name ();
+
+  Json::Value value;
+  if (!ParseJsonField (mv.mv (), value))
+    return false;
+  res[valueField] = value;
+
+  if (mv.burns_size () != 1)
+    return false;
+  Json::Value burnt;
+  if (!ParseJsonField (mv.burns ().begin ()->second, burnt))
+    return false;
+  res["burnt"] = burnt;
+
+  return true;
+}
+
+} // anonymous namespace
+
+bool
+DecodeBinaryBlockNotification (const std::string& data, Json::Value& res)
+{
+  proto::GameBlock pb;
+  if (!pb.ParseFromString (data))
+    {
+      LOG (WARNING) << "Failed to parse binary block notification";
+      return false;
+    }
+
+  const auto& blkPb = pb.block ();
+  Json::Value blk;
+  if (!ParseMetadata (blkPb.metadata (), blk))
+    return false;
+  blk["hash"] = blkPb.hash ();
+  blk["parent"] = blkPb.parent ();
+  blk["height"] = static_cast<Json::Int64> (blkPb.height ());
+  blk["rngseed"] = blkPb.rngseed ();
+
+  res = Json::Value (Json::objectValue);
+  res["block"] = blk;
+
+  Json::Value moves(Json::arrayValue);
+  for (const auto& mv : pb.moves ())
+    {
+      Json::Value cur;
+      if (!DecodeMove (mv, "move", true, cur))
+        return false;
+      moves.append (cur);
+    }
+  res["moves"] = moves;
+
+  Json::Value admin(Json::arrayValue);
+  for (const auto& cmd : pb.admin ())
+    {
+      Json::Value cur;
+      if (!DecodeMove (cmd, "cmd", false, cur))
+        return false;
+      admin.append (cur);
+    }
+  res["admin"] = admin;
+
+  if (!pb.reqtoken ().empty ())
+    res["reqtoken"] = pb.reqtoken ();
+
+  return true;
+}
+
+bool
+DecompressNotification (const std::string& data, const std::string& dict,
+                        std::string& res)
+{
+  const auto size = ZSTD_getFrameContentSize (data.data (), data.size ());
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+      LOG (WARNING) << "Invalid zstd frame in notification";
+      return false;
+    }
+  if (size > MAX_DECOMPRESSED_SIZE)
+    {
+      LOG (WARNING) << "Compressed notification is too large: " << size;
+      return false;
+    }
+
+  ZSTD_DCtx* ctx = ZSTD_createDCtx ();
+  CHECK (ctx != nullptr);
+
+  res.resize (size);
+  const size_t len
+      = ZSTD_decompress_usingDict (ctx, &res[0], res.size (),
+                                   data.data (), data.size (),
+                                   dict.data (), dict.size ());
+  ZSTD_freeDCtx (ctx);
+
+  if (ZSTD_isError (len))
+    {
+      LOG (WARNING)
+          << "Failed to decompress notification: " << ZSTD_getErrorName (len);
+      return false;
+    }
+  if (len != size)
+    {
+      LOG (WARNING) << "Mismatch in decompressed notification size";
+      return false;
+    }
+
+  return true;
+}
+
+unsigned
+GetNotificationDictionaryId (const std::string& data)
+{
+  return ZSTD_getDictID_fromFrame (data.data (), data.size ());
+}
+
+} // namespace xayax
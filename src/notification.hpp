@@ -0,0 +1,49 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAX_NOTIFICATION_HPP
+#define XAYAX_NOTIFICATION_HPP
+
+#include <json/json.h>
+
+#include <string>
+
+namespace xayax
+{
+
+/**
+ * Decodes the payload of a binary block notification, as published on the
+ * "game-block-attach bin <game>" and "game-block-detach bin <game>" ZMQ
+ * topics.  The format is the GameBlock protocol buffer from
+ * proto/blockdata.proto.  The result is the same JSON data that is
+ * published for the block on the corresponding "json" topic.
+ *
+ * Returns false if the data is invalid.
+ */
+bool DecodeBinaryBlockNotification (const std::string& data, Json::Value& res);
+
+/**
+ * Decompresses the payload of a notification on one of the "zstd" ZMQ
+ * topics (e.g. "game-block-attach zstd <game>").  The payload is a single
+ * zstd frame, which contains the JSON data as published on the corresponding
+ * "json" topic.  If the publisher is configured with a dictionary, then
+ * the same dictionary must be passed here (otherwise dict should be empty).
+ *
+ * Returns false if the data is invalid.
+ */
+bool DecompressNotification (const std::string& data, const std::string& dict,
+                             std::string& res);
+
+/**
+ * Returns the ID of the zstd dictionary that is needed to decompress the
+ * payload of a "zstd" notification.  Subscribers can compare it to the ID
+ * of the dictionary they have, and fetch the current one from the
+ * getzmqdictionary RPC if it does not match.  Returns zero if the frame
+ * does not need a dictionary (or is invalid).
+ */
+unsigned GetNotificationDictionaryId (const std::string& data);
+
+} // namespace xayax
+
+#endif // XAYAX_NOTIFICATION_HPP
@@ -0,0 +1,111 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notification.hpp"
+
+#include "proto/blockdata.pb.h"
+#include "testutils.hpp"
+
+#include <gtest/gtest.h>
+
+namespace xayax
+{
+namespace
+{
+
+using NotificationTests = testing::Test;
+
+TEST_F (NotificationTests, InvalidData)
+{
+  Json::Value res;
+  EXPECT_FALSE (DecodeBinaryBlockNotification ("\xFF\xFF", res));
+
+  proto::GameBlock pb;
+  pb.mutable_block ()->set_metadata ("[1, 2]");
+  EXPECT_FALSE (DecodeBinaryBlockNotification (pb.SerializeAsString (), res));
+
+  pb.mutable_block ()->set_metadata ("");
+  auto& mv = *pb.add_moves ();
+  mv.set_mv ("{invalid");
+  mv.mutable_burns ()->insert ({"game", "0"});
+  EXPECT_FALSE (DecodeBinaryBlockNotification (pb.SerializeAsString (), res));
+
+  mv.set_mv ("42");
+  mv.mutable_burns ()->clear ();
+  EXPECT_FALSE (DecodeBinaryBlockNotification (pb.SerializeAsString (), res));
+}
+
+TEST_F (NotificationTests, Decoding)
+{
+  proto::GameBlock pb;
+  auto& blk = *pb.mutable_block ();
+  blk.set_hash ("block");
+  blk.set_parent ("parent");
+  blk.set_height (10);
+  blk.set_rngseed ("seed");
+  blk.set_metadata (R"({"timestamp":5})");
+
+  auto& mv = *pb.add_moves ();
+  mv.set_ns ("p");
+  mv.set_txid ("tx1");
+  mv.set_name ("domob");
+  mv.set_mv (R"({"x":1})");
+  mv.mutable_burns ()->insert ({"game", "1.5"});
+  mv.set_metadata (R"({"out":{}})");
+
+  auto& cmd = *pb.add_admin ();
+  cmd.set_ns ("g");
+  cmd.set_txid ("tx2");
+  cmd.set_name ("game");
+  cmd.set_mv (R"("reset")");
+  cmd.mutable_burns ()->insert ({"game", "0"});
+  cmd.set_metadata ("null");
+
+  /* The reqtoken can be set by merging another message.  */
+  proto::GameBlock token;
+  token.set_reqtoken ("token");
+
+  Json::Value res;
+  ASSERT_TRUE (DecodeBinaryBlockNotification (
+      pb.SerializeAsString () + token.SerializeAsString (), res));
+  EXPECT_EQ (res, ParseJson (R"({
+    "block":
+      {
+        "hash": "block",
+        "parent": "parent",
+        "height": 10,
+        "rngseed": "seed",
+        "timestamp": 5
+      },
+    "moves":
+      [
+        {
+          "txid": "tx1",
+          "name": "domob",
+          "move": {"x": 1},
+          "burnt": 1.5,
+          "out": {}
+        }
+      ],
+    "admin":
+      [
+        {
+          "txid": "tx2",
+          "cmd": "reset",
+          "burnt": 0
+        }
+      ],
+    "reqtoken": "token"
+  })"));
+}
+
+TEST_F (NotificationTests, InvalidCompressedData)
+{
+  std::string res;
+  EXPECT_FALSE (DecompressNotification ("", "", res));
+  EXPECT_FALSE (DecompressNotification ("not zstd data", "", res));
+}
+
+} // anonymous namespace
+} // namespace xayax
@@ -1,14 +1,66 @@
-// Copyright (C) 2021 The Xaya developers
+// Copyright (C) 2021-2024 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "private/pending.hpp"
 
+#include "metrics.hpp"
+
 #include <glog/logging.h>
 
 namespace xayax
 {
 
+namespace
+{
+
+/**
+ * Metrics about the handling of pending moves.
+ */
+struct PendingMetrics
+{
+
+  /** Moves sent right away.  */
+  Counter& sent;
+
+  /** Moves queued until the chainstate catches up.  */
+  Counter& queued;
+
+  /** Moves that were dropped (before the first tip or from the queue).  */
+  Counter& dropped;
+
+  /** Number of batches of moves currently queued.  */
+  Gauge& queueSize;
+
+  static Counter&
+  GetMovesCounter (const std::string& result)
+  {
+    return MetricsRegistry::Get ().GetCounter (
+        "xayax_pending_moves_total",
+        "Pending moves received from the base chain by what happened to them",
+        "result=\"" + result + "\"");
+  }
+
+  PendingMetrics ()
+    : sent(GetMovesCounter ("sent")),
+      queued(GetMovesCounter ("queued")),
+      dropped(GetMovesCounter ("dropped")),
+      queueSize(MetricsRegistry::Get ().GetGauge (
+          "xayax_pending_queue_size",
+          "Batches of pending moves queued until the chainstate catches up"))
+  {}
+
+  static PendingMetrics&
+  Get ()
+  {
+    static PendingMetrics instance;
+    return instance;
+  }
+
+};
+
+} // anonymous namespace
+
 void
 PendingManager::TipChanged (const std::string& tip)
 {
@@ -19,7 +71,11 @@ PendingManager::TipChanged (const std::string& tip)
       << "Dropping " << pendingsQueue.size ()
       << " queued pending moves for new tip change";
 
+  auto& metrics = PendingMetrics::Get ();
+  for (const auto& mv : pendingsQueue)
+    metrics.dropped.Increment (mv.size ());
   pendingsQueue.clear ();
+  metrics.queueSize.Set (0);
   notificationTip = tip;
   CHECK (!notificationTip.empty ());
 }
@@ -28,6 +84,7 @@ void
 PendingManager::PendingMoves (const std::vector<MoveData>& moves)
 {
   std::lock_guard<std::mutex> lock(mut);
+  auto& metrics = PendingMetrics::Get ();
 
   /* Until we receive a first tip update, just drop everything.  We don't
      know anything about our state with respect to blocks, so better not try
@@ -35,6 +92,7 @@ PendingManager::PendingMoves (const std::vector<MoveData>& moves)
   if (chainstateTip.empty ())
     {
       LOG (WARNING) << "Ignoring pending moves before first tip update";
+      metrics.dropped.Increment (moves.size ());
       return;
     }
 
@@ -44,6 +102,7 @@ PendingManager::PendingMoves (const std::vector<MoveData>& moves)
       VLOG (1) << "Sending " << moves.size () << " pending moves immediately";
       CHECK (pendingsQueue.empty ());
       zmq.SendPendingMoves (moves);
+      metrics.sent.Increment (moves.size ());
       return;
     }
 
@@ -51,6 +110,8 @@ PendingManager::PendingMoves (const std::vector<MoveData>& moves)
      the chainstate catches up.  */
   VLOG (1) << "Adding " << moves.size () << " pending moves to queue";
   pendingsQueue.push_back (moves);
+  metrics.queued.Increment (moves.size ());
+  metrics.queueSize.Set (pendingsQueue.size ());
 }
 
 void
@@ -68,9 +129,14 @@ PendingManager::ChainstateTipChanged (const std::string& newTip)
       LOG_IF (INFO, !pendingsQueue.empty ())
           << "Sending " << pendingsQueue.size ()
           << " previously queued pending moves";
+      auto& metrics = PendingMetrics::Get ();
       for (const auto& mv : pendingsQueue)
-        zmq.SendPendingMoves (mv);
+        {
+          zmq.SendPendingMoves (mv);
+          metrics.sent.Increment (mv.size ());
+        }
       pendingsQueue.clear ();
+      metrics.queueSize.Set (0);
     }
 }
 
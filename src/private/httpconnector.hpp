@@ -0,0 +1,231 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAX_HTTPCONNECTOR_HPP
+#define XAYAX_HTTPCONNECTOR_HPP
+
+#include <jsonrpccpp/server.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xayax
+{
+
+/**
+ * HTTP server connector for libjson-rpc-cpp, which can be used instead of
+ * jsonrpc::HttpServer when many clients are polling the RPC interface
+ * concurrently.
+ *
+ * A single poller thread accepts new connections and watches idle
+ * keep-alive connections.  As soon as a connection has data, it is put
+ * onto a bounded queue, from which a fixed pool of worker threads takes
+ * it and processes a single request.  The connection is then handed back
+ * to the poller, which sends the response (without blocking, as far as
+ * the client reads it) and queues the connection again for the next
+ * (potentially pipelined) request once the response is out.  The same
+ * happens if only part of a request has arrived so far, so that slow
+ * clients never block a worker, and clients sending many requests cannot
+ * hold on to one either.  Each request has to arrive completely within
+ * a fixed time after its first byte, and each response has to be read
+ * by the client within the same time; the connection is closed otherwise.
+ * If the queue is full, the connection is answered with a (best-effort,
+ * non-blocking) 503 error right away instead of letting the client wait.
+ * The same is done for new connections beyond a maximum number of open
+ * ones, so that clients cannot exhaust our file descriptors.
+ *
+ * Note that RPC methods which block for a long time (like waitforchange)
+ * still occupy a worker while they run.
+ *
+ * Only what is needed for JSON-RPC is supported:  POST requests with
+ * a Content-Length.  GET requests can be answered by an optional page
+ * handler (e.g. for metrics), and other methods are answered with 405.
+ *
+ * While a JSON-RPC request is processed, the client is identified to the
+ * RPC server through ClientScope by its source address (or its user ID
+ * when listening on a Unix domain socket).  We do not use
+ * the Authorization header for this, as it is not authenticated and
+ * clients could thus pick arbitrary identities.
+ */
+class HttpConnector : public jsonrpc::AbstractServerConnector
+{
+
+public:
+
+  /**
+   * Handler for GET requests.  It is called with the request target
+   * (e.g. "/metrics") and fills in the content type and body of the
+   * response.  It returns false if the page does not exist.
+   */
+  using PageHandler = std::function<bool (const std::string& target,
+                                          std::string& contentType,
+                                          std::string& body)>;
+
+private:
+
+  class Connection;
+
+  /** Port to listen on (for TCP).  */
+  const int port;
+
+  /** Whether to bind only on localhost (for TCP).  */
+  const bool local;
+
+  /** Path of the Unix domain socket to listen on, or empty for TCP.  */
+  const std::string socketPath;
+
+  /** Number of worker threads.  */
+  const unsigned numWorkers;
+
+  /** Maximum number of connections waiting for a worker.  */
+  const size_t maxQueue;
+
+  /** Maximum number of open connections.  */
+  size_t maxConnections = 1'024;
+
+  /** Number of currently open connections.  */
+  std::atomic<size_t> numConnections{0};
+
+  /** The handler for GET requests, if any.  */
+  PageHandler pageHandler;
+
+  /** The listening socket (or -1 if not listening).  */
+  int listenFd = -1;
+
+  /**
+   * Pipe used to wake up the poller, e.g. when a connection is handed
+   * back or we are shutting down.
+   */
+  int wakeupFds[2] = {-1, -1};
+
+  /** Lock for the shared state below.  */
+  std::mutex mut;
+
+  /** Notified when connections are queued or we stop.  */
+  std::condition_variable cvQueue;
+
+  /** Set to true when the threads should stop.  */
+  bool shouldStop = false;
+
+  /** Connections with data that are waiting for a worker.  */
+  std::deque<std::unique_ptr<Connection>> queue;
+
+  /** Connections handed back by workers that the poller should watch.  */
+  std::vector<std::unique_ptr<Connection>> returned;
+
+  /** Number of requests processed.  */
+  uint64_t numRequests = 0;
+
+  /**
+   * Number of connections rejected because the queue was full or there
+   * were too many open connections.
+   */
+  uint64_t numRejected = 0;
+
+  /** The poller thread.  */
+  std::thread poller;
+
+  /** The worker threads.  */
+  std::vector<std::thread> workers;
+
+  /**
+   * Creates the listening socket.  Returns -1 on failure.
+   */
+  int CreateListener () const;
+
+  /**
+   * Returns a description of the address we listen on, for logging.
+   */
+  std::string GetAddress () const;
+
+  /**
+   * Wakes up the poller thread.
+   */
+  void WakeUpPoller ();
+
+  /**
+   * Puts a connection onto the queue, or rejects it if the queue is full.
+   */
+  void Enqueue (std::unique_ptr<Connection> c);
+
+  /**
+   * Processes the next request on the connection (if it is available
+   * completely), and queues the response for sending.  Returns true if
+   * the connection should be kept open.
+   */
+  bool Serve (Connection& c);
+
+  /**
+   * Main loop of the poller thread.
+   */
+  void RunPoller ();
+
+  /**
+   * Main loop of a worker thread.
+   */
+  void RunWorker ();
+
+public:
+
+  /**
+   * Constructs the connector for the given port, with the given number
+   * of worker threads and size of the queue.
+   */
+  explicit HttpConnector (int p, bool l, unsigned threads, size_t queueSize);
+
+  /**
+   * Constructs the connector for a Unix domain socket at the given path.
+   * Clients are identified (see ClientScope) by their user ID.  The socket
+   * file is removed again when we stop listening.
+   */
+  explicit HttpConnector (const std::string& path, unsigned threads,
+                          size_t queueSize);
+
+  ~HttpConnector ();
+
+  HttpConnector () = delete;
+  HttpConnector (const HttpConnector&) = delete;
+  void operator= (const HttpConnector&) = delete;
+
+  /**
+   * Sets the handler for GET requests.  This must be called before
+   * starting to listen.
+   */
+  void SetPageHandler (PageHandler h);
+
+  /**
+   * Sets the maximum number of open connections.  Further connections
+   * are answered with a 503 error and closed right away.  This must be
+   * called before starting to listen.
+   */
+  void SetMaxConnections (size_t n);
+
+  bool StartListening () override;
+  bool StopListening () override;
+
+  /**
+   * Returns the number of requests processed so far.
+   */
+  uint64_t GetNumRequests ();
+
+  /**
+   * Returns the number of connections that have been rejected because
+   * all workers were busy and the queue was full, or because there were
+   * too many open connections.
+   */
+  uint64_t GetNumRejected ();
+
+};
+
+} // namespace xayax
+
+#endif // XAYAX_HTTPCONNECTOR_HPP
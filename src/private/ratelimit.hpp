@@ -0,0 +1,183 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAX_RATELIMIT_HPP
+#define XAYAX_RATELIMIT_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace xayax
+{
+
+/**
+ * RAII helper that sets the identity of the client whose RPC request is
+ * processed on the current thread.  This is set by connectors that know
+ * about their clients (like HttpConnector), and used by the RPC server
+ * for per-client admission control.  The identity is empty if it is not
+ * known (e.g. with the HTTP server of libjson-rpc-cpp), in which case
+ * all such requests are treated as coming from a single client.
+ */
+class ClientScope
+{
+
+private:
+
+  /** The identity that was set before, to restore it afterwards.  */
+  std::string previous;
+
+public:
+
+  explicit ClientScope (const std::string& id);
+  ~ClientScope ();
+
+  ClientScope () = delete;
+  ClientScope (const ClientScope&) = delete;
+  void operator= (const ClientScope&) = delete;
+
+  /**
+   * Returns the identity of the client for the current thread.
+   */
+  static const std::string& GetCurrent ();
+
+};
+
+/**
+ * Per-client admission control for expensive operations.  Each client
+ * has a token bucket, which is refilled at a fixed rate up to a maximum
+ * burst size, and a cap on the number of operations it may have running
+ * concurrently.  Rejecting a request only needs a single lookup under
+ * a lock, so that misbehaving clients are turned away cheaply before
+ * they can put load on the base chain.
+ */
+class RateLimiter
+{
+
+public:
+
+  using Clock = std::chrono::steady_clock;
+
+  /** The possible results of trying to admit an operation.  */
+  enum class Result
+  {
+    ADMITTED,
+    RATE_LIMITED,
+    TOO_MANY_CONCURRENT,
+  };
+
+  class Admission;
+
+private:
+
+  /**
+   * State for a single client.
+   */
+  struct ClientState
+  {
+
+    /** Tokens currently in the bucket.  */
+    double tokens;
+
+    /** Time when the tokens were last refilled.  */
+    Clock::time_point lastRefill;
+
+    /** Number of admitted operations that are still running.  */
+    unsigned active = 0;
+
+  };
+
+  /** Tokens refilled per second (or zero for no rate limit).  */
+  const double rate;
+
+  /** Maximum number of tokens in a bucket.  */
+  const double burst;
+
+  /** Maximum concurrent operations per client (or zero for no limit).  */
+  const unsigned maxConcurrent;
+
+  /** Lock for the client states.  */
+  std::mutex mut;
+
+  /** The state of each client we know.  */
+  std::unordered_map<std::string, ClientState> clients;
+
+  /** Number of known clients above which we prune idle ones.  */
+  size_t pruneThreshold;
+
+  /**
+   * Removes clients that have no operations running and a full bucket,
+   * i.e. which are in the same state as unknown clients.  This keeps
+   * the memory usage bounded.  Must be called with the lock held.
+   */
+  void PruneIdle (Clock::time_point now);
+
+  /**
+   * Marks an operation of the given client as finished.
+   */
+  void Release (const std::string& client);
+
+public:
+
+  /**
+   * Constructs the limiter with the given refill rate (per second), burst
+   * size and concurrency cap.  A rate or cap of zero disables that limit.
+   */
+  explicit RateLimiter (double r, unsigned b, unsigned concurrent);
+
+  RateLimiter () = delete;
+  RateLimiter (const RateLimiter&) = delete;
+  void operator= (const RateLimiter&) = delete;
+
+  /**
+   * Tries to admit an operation for the given client.  If it is admitted,
+   * the returned Admission must be kept alive while the operation runs.
+   */
+  Result TryAdmit (const std::string& client, std::unique_ptr<Admission>& adm,
+                   Clock::time_point now = Clock::now ());
+
+  /**
+   * Returns the number of clients for which state is kept.
+   */
+  size_t GetNumClients ();
+
+};
+
+/**
+ * An admitted operation, which releases its concurrency slot when
+ * it is destructed.
+ */
+class RateLimiter::Admission
+{
+
+private:
+
+  RateLimiter& limiter;
+  const std::string client;
+
+  explicit Admission (RateLimiter& l, const std::string& c)
+    : limiter(l), client(c)
+  {}
+
+  friend class RateLimiter;
+
+public:
+
+  ~Admission ()
+  {
+    limiter.Release (client);
+  }
+
+  Admission () = delete;
+  Admission (const Admission&) = delete;
+  void operator= (const Admission&) = delete;
+
+};
+
+} // namespace xayax
+
+#endif // XAYAX_RATELIMIT_HPP
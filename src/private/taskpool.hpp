@@ -0,0 +1,111 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAX_TASKPOOL_HPP
+#define XAYAX_TASKPOOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xayax
+{
+
+/**
+ * A pool of threads for running batches of independent tasks in parallel.
+ * Each call to Run submits a batch of tasks (e.g. one per game), which are
+ * picked up by idle pool threads and the calling thread itself.  A pool
+ * can be shared between multiple users (e.g. the ZMQ publisher shards),
+ * so that idle threads can help with whoever currently has the most work.
+ */
+class TaskPool
+{
+
+private:
+
+  /**
+   * A batch of tasks submitted by one Run call.  The instance lives
+   * on the stack of Run, which only returns once all tasks are done.
+   */
+  struct Batch
+  {
+
+    /** The function to call for each task index.  */
+    const std::function<void (size_t)>& fn;
+
+    /** Total number of tasks.  */
+    const size_t num;
+
+    /** Next task index that has not been claimed yet.  */
+    size_t next = 0;
+
+    /** Number of tasks that have been finished.  */
+    size_t done = 0;
+
+    /** Condition variable notified when all tasks are done.  */
+    std::condition_variable cvDone;
+
+    explicit Batch (const std::function<void (size_t)>& f, const size_t n)
+      : fn(f), num(n)
+    {}
+
+  };
+
+  /** Lock for the pool state and all batches.  */
+  std::mutex mut;
+
+  /** Condition variable notified when new batches are submitted.  */
+  std::condition_variable cv;
+
+  /** Batches that have unclaimed tasks.  */
+  std::deque<Batch*> batches;
+
+  /** Set to true when the threads should stop.  */
+  bool shouldStop = false;
+
+  /** The pool threads.  */
+  std::vector<std::thread> threads;
+
+  /**
+   * Claims the next task index of a batch.  If this was the last
+   * unclaimed task, the batch is removed from the queue.  Must be called
+   * with the lock held.
+   */
+  size_t Claim (Batch& b);
+
+  /**
+   * Runs a claimed task with the lock released, and marks it as done.
+   */
+  static void RunTask (std::unique_lock<std::mutex>& lock, Batch& b, size_t i);
+
+  /**
+   * Runs the worker loop of a pool thread.
+   */
+  void RunWorker ();
+
+public:
+
+  explicit TaskPool (unsigned numThreads);
+  ~TaskPool ();
+
+  TaskPool () = delete;
+  TaskPool (const TaskPool&) = delete;
+  void operator= (const TaskPool&) = delete;
+
+  /**
+   * Calls fn for all indices from 0 to num-1 in parallel, and returns
+   * when all of them are done.  The calls are independent and may happen
+   * in any order.  fn must not throw.
+   */
+  void Run (size_t num, const std::function<void (size_t)>& fn);
+
+};
+
+} // namespace xayax
+
+#endif // XAYAX_TASKPOOL_HPP
@@ -6,13 +6,19 @@
 #define XAYAX_ZMQPUB_HPP
 
 #include "blockdata.hpp"
+#include "private/taskpool.hpp"
 
 #include <json/json.h>
 #include <zmq.hpp>
 
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 namespace xayax
 {
@@ -20,23 +26,81 @@ namespace xayax
 /**
  * ZMQ publisher that can push block and move data per the Xaya ZMQ spec:
  * https://github.com/xaya/xaya/blob/master/doc/xaya/interface.md
+ *
+ * The sockets are XPUB sockets, so that we can keep track of which topics
+ * are actually subscribed to.  Notifications for topics without any
+ * subscriber are not built at all, which makes tracked-but-idle games
+ * (e.g. of a GSP that crashed without untracking) essentially free.
+ *
+ * The publisher can be sharded across multiple sockets (each bound to
+ * its own endpoint).  Every shard has its own worker thread that builds
+ * and sends the notifications for the games assigned to it, so that
+ * publishing for many games scales across cores.  The first (primary)
+ * endpoint publishes all games, so that subscribers which only know about
+ * a single endpoint (like stock GSPs) keep working.  Each game is in
+ * addition assigned to one of the other endpoints, and subscribers that
+ * connect there instead take the load off the primary (as notifications
+ * without subscribers are not built).  On each endpoint, the notifications
+ * for a particular game are in order.  The per-game payloads themselves
+ * are built in parallel on a thread pool shared by all shards (and cached
+ * per block, so they are built only once for all endpoints), while the
+ * sending is still done on the shard's thread in a deterministic order.
+ *
+ * Each shard has a bounded queue of notification jobs.  Callers sending
+ * notifications block while it is full, and errors while sending are
+ * reported (as exception) to the next caller.
+ *
+ * In addition to the "json" topics from the spec, block notifications
+ * are also available in a binary encoding on the opt-in topics
+ * "game-block-attach bin <game>" and "game-block-detach bin <game>"
+ * (see DecodeBinaryBlockNotification).  Those are only produced if
+ * there is a subscription that explicitly includes the "bin" part.
+ *
+ * Similarly, the opt-in "zstd" topics (e.g. "game-block-attach zstd <game>")
+ * carry the JSON payload compressed with zstd, optionally using a
+ * dictionary.  The dictionary can be configured or trained from recent
+ * payloads, and subscribers get it with the getzmqdictionary RPC.  Its ID
+ * is part of every frame (see GetNotificationDictionaryId), so that they
+ * know when to fetch a new one (see DecompressNotification).
+ *
+ * Finally, the opt-in topic "game-block-attach-batch json <game>" carries
+ * all block attaches for a game, with runs of blocks that are attached
+ * together (e.g. for catch-up) packed into messages of the form
+ * {"blocks": [...], "reqtoken": ...}.  Each entry in the array is exactly
+ * the payload of the corresponding "game-block-attach json" message.  GSPs
+ * can subscribe to this topic instead of the per-block attach topic to
+ * reduce the per-message overhead.
  */
 class ZmqPub
 {
 
 private:
 
+  class BlockNotification;
+  struct CatchUpRun;
+  class Shard;
+  class ZstdDictionary;
+
   zmq::context_t ctx;
-  zmq::socket_t sock;
 
   /**
-   * Lock for this instance, mainly for the ZMQ socket and the in-memory map
-   * of sequence numbers).
+   * The dictionary used for zstd compression, if one is configured or
+   * has been trained.  It is shared (read-only) with the shards, which
+   * switch to a new one in order with their queued notifications.
    */
-  std::mutex mut;
+  std::shared_ptr<const ZstdDictionary> zstdDict;
+
+  /**
+   * Thread pool for building the per-game payloads in parallel.  It is
+   * shared between the shards and must outlive them.
+   */
+  std::unique_ptr<TaskPool> pool;
+
+  /** The publisher shards, which each own a socket and worker thread.  */
+  std::vector<std::unique_ptr<Shard>> shards;
 
-  /** Next sequence number per command string.  */
-  std::unordered_map<std::string, uint32_t> nextSeq;
+  /** Lock for this instance (mainly the games map).  */
+  std::mutex mut;
 
   /**
    * The games that are currently tracked.  For each game, we store a current
@@ -48,29 +112,146 @@ private:
   std::unordered_map<std::string, uint64_t> games;
 
   /**
-   * Sends a multipart message consisting of command, JSON data and the right
-   * sequence number.  The caller must ensure that all locks are held
-   * as required.
+   * Replay buffer of the most recently published blocks (in order of
+   * when they were first published).  This allows us to serve typical
+   * game_sendupdates requests (for blocks just missed by a GSP) from
+   * memory, without fetching the blocks again or rebuilding payloads.
+   */
+  std::deque<std::shared_ptr<BlockNotification>> recentBlocks;
+
+  /** The blocks in the replay buffer by hash.  */
+  std::unordered_map<std::string, std::shared_ptr<BlockNotification>>
+      recentByHash;
+
+  /**
+   * Number of blocks added to the replay buffer since the zstd dictionary
+   * was last trained.
+   */
+  uint64_t blocksSinceTraining = 0;
+
+  /**
+   * Returns the index of the non-primary shard that a game is assigned to.
+   * Must only be called if there are multiple shards.
+   */
+  size_t GetExtraShard (const std::string& g) const;
+
+  /**
+   * Returns the tracked games grouped by the index of the shard they
+   * are published on.  The primary shard has all games.  Must be called
+   * with the lock held.
+   */
+  std::vector<std::vector<std::string>> GetGamesPerShard () const;
+
+  /**
+   * Returns the games to send a notification for gameId to, grouped by
+   * shard.  If gameId is empty, these are all tracked games.  Otherwise
+   * it is only gameId itself, or nothing if it is not tracked (as then
+   * nobody would be listening anyway).  Must be called with the lock held.
+   */
+  std::vector<std::vector<std::string>> GetGamesPerShard (
+      const std::string& gameId) const;
+
+  /**
+   * Throws the first error (if any) that occurred on one of the shards
+   * since the last call.  Must be called with the lock held.
    */
-  void SendMessage (const std::string& cmd, const Json::Value& data);
+  void RethrowShardErrors ();
 
   /**
-   * Sends notifications for all tracked games for the given block, which is
-   * either being detached or attached (and the "cmdPrefix" must be set
-   * accordingly).
+   * Returns the notification data for a given block, taking it from the
+   * replay buffer if it is there and adding it otherwise.  Must be called
+   * with the lock held.
    */
-  void SendBlock (const std::string& cmdPrefix, const BlockData& blk,
-                  const std::string& reqtoken);
+  std::shared_ptr<BlockNotification> GetNotification (const BlockData& blk);
+
+  /**
+   * Sends notifications for all tracked games for the given sequence of
+   * blocks, which are either being detached or attached (and the "cmdPrefix"
+   * must be set accordingly).  For attaches, this also sends the batched
+   * notifications for the whole sequence.  If gameId is not empty, then
+   * the notifications are only sent for this game (if it is tracked).
+   */
+  void SendBlocks (const std::string& cmdPrefix,
+                   const std::vector<BlockData>& blocks,
+                   const std::string& reqtoken, const std::string& gameId);
 
 public:
 
+  /**
+   * Statistics about the zstd-compressed notifications sent.
+   */
+  struct CompressionStats
+  {
+
+    /** Number of compressed messages sent.  */
+    uint64_t messages = 0;
+
+    /** Total size of the payloads before compression.  */
+    uint64_t rawBytes = 0;
+
+    /** Total size of the compressed payloads sent.  */
+    uint64_t compressedBytes = 0;
+
+  };
+
+  /**
+   * Statistics about the messages for a particular topic.
+   */
+  struct TopicStats
+  {
+
+    /** Number of messages sent.  */
+    uint64_t sent = 0;
+
+    /** Total size of the payloads sent.  */
+    uint64_t bytes = 0;
+
+    /**
+     * Number of messages dropped because the high-water mark was reached.
+     * This is only detected if the nodrop mode is enabled; otherwise ZMQ
+     * drops messages for slow subscribers silently.
+     */
+    uint64_t dropped = 0;
+
+    /** Total time between queuing and sending of all sent messages.  */
+    std::chrono::microseconds totalLatency{0};
+
+    /** Maximum time between queuing and sending of a message.  */
+    std::chrono::microseconds maxLatency{0};
+
+  };
+
+  /**
+   * Statistics about the (potentially batched) pending-move notifications.
+   */
+  struct PendingBatchStats
+  {
+
+    /** Number of pending-move messages sent.  */
+    uint64_t messages = 0;
+
+    /** Total number of moves in those messages.  */
+    uint64_t moves = 0;
+
+    /** Maximum number of moves in a single message.  */
+    uint64_t maxMoves = 0;
+
+  };
+
   /**
    * Constructs the publisher, binding to the given address.
    */
   explicit ZmqPub (const std::string& addr);
 
   /**
-   * Stops the publisher and cleans up the connection.
+   * Constructs the publisher with one shard for each of the given
+   * addresses.  There must be at least one.
+   */
+  explicit ZmqPub (const std::vector<std::string>& addrs);
+
+  /**
+   * Stops the publisher and cleans up the connection.  Notifications that
+   * are still queued will be sent out before.
    */
   ~ZmqPub ();
 
@@ -87,23 +268,110 @@ public:
   /**
    * Pushes notifications for all tracked games and the given block
    * being attached.  If reqtoken is not empty, it will explicitly be set
-   * in the notifications.
+   * in the notifications.  If gameId is not empty, the notifications are
+   * only sent for that game instead of all tracked games (e.g. for
+   * answering a game_sendupdates request).
    */
-  void SendBlockAttach (const BlockData& blk, const std::string& reqtoken);
+  void SendBlockAttach (const BlockData& blk, const std::string& reqtoken,
+                        const std::string& gameId = "");
 
   /**
-   * Pushes notifications for all tracked games and the given block
-   * being detached.
+   * Pushes notifications for all tracked games and a sequence of blocks
+   * being attached in order.  This is equivalent to calling SendBlockAttach
+   * for each of them, except that the batched topic packs the blocks
+   * into as few messages as possible.
+   */
+  void SendBlockAttaches (const std::vector<BlockData>& blocks,
+                          const std::string& reqtoken,
+                          const std::string& gameId = "");
+
+  /**
+   * Pushes notifications for all tracked games (or just gameId if it
+   * is not empty) and the given block being detached.
    */
-  void SendBlockDetach (const BlockData& blk, const std::string& reqtoken);
+  void SendBlockDetach (const BlockData& blk, const std::string& reqtoken,
+                        const std::string& gameId = "");
+
+  /**
+   * Advances the sequence numbers of all block-notification topics for
+   * the tracked games (or just gameId if it is not empty) without sending
+   * anything.  Subscribers then see a gap with the next notification and
+   * know that they have missed some, e.g. when a catch-up that was announced
+   * to a GSP could not be completed.
+   */
+  void SkipBlockNotifications (const std::string& gameId = "");
 
   /**
    * Pushes notifications for all tracked games for one or more moves
    * created by a pending transaction.  All MoveData entries in the list
-   * must refer to the same txid.
+   * must refer to the same txid.  If batching of pending moves is enabled,
+   * the moves of multiple transactions are collected for a short time
+   * window and then sent in order as a single notification per game.
    */
   void SendPendingMoves (const std::vector<MoveData>& moves);
 
+  /**
+   * Returns the payloads for the given game that would be sent as
+   * block-attach notifications for each of the blocks.  This uses the
+   * cached payloads from the replay buffer if possible.
+   */
+  std::vector<Json::Value> GetBlockPayloads (
+      const std::vector<BlockData>& blocks, const std::string& gameId);
+
+  /**
+   * Looks up a block by hash in the buffer of recently published blocks.
+   * Returns true and fills in the full block data if it is found.
+   */
+  bool GetRecentBlock (const std::string& hash, BlockData& blk);
+
+  /**
+   * Trains a new zstd dictionary from the JSON payloads in the replay
+   * buffer and switches to it for all notifications sent from now on.
+   * If a dictionary file is configured, the new dictionary is written
+   * there as well.  Returns false if training failed (e.g. because there
+   * are not enough payloads yet).
+   */
+  bool TrainZstdDictionary ();
+
+  /**
+   * Returns the zstd dictionary currently in use and its ID.  Returns false
+   * if no dictionary is used.
+   */
+  bool GetZstdDictionary (std::string& data, unsigned& id);
+
+  /**
+   * Returns the accumulated statistics about compressed notifications.
+   */
+  CompressionStats GetCompressionStats ();
+
+  /**
+   * Returns the accumulated statistics per topic.
+   */
+  std::map<std::string, TopicStats> GetTopicStats ();
+
+  /**
+   * Returns the accumulated statistics about pending-move notifications.
+   */
+  PendingBatchStats GetPendingBatchStats ();
+
+  /**
+   * Returns the number of currently queued notification jobs for each
+   * of the shards.
+   */
+  std::vector<size_t> GetQueueSizes ();
+
+  /**
+   * Returns the number of catch-up blocks that were merged into an already
+   * queued run of blocks (with the coalesce-catchup mode enabled).
+   */
+  uint64_t GetCoalescedBlocks ();
+
+  /**
+   * Returns the tracked games that are published on each of the
+   * endpoints (in the order they were passed to the constructor).
+   */
+  std::vector<std::vector<std::string>> GetGamesPerEndpoint ();
+
 };
 
 } // namespace xayax
@@ -0,0 +1,140 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "private/ratelimit.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace xayax
+{
+
+namespace
+{
+
+/**
+ * Minimum number of known clients above which we prune idle ones.  The
+ * actual threshold grows with the number of clients that remain after
+ * pruning, so that the cost of pruning stays amortised constant.
+ */
+constexpr size_t MIN_PRUNE_THRESHOLD = 1'024;
+
+/** Identity of the client for the current thread.  */
+thread_local std::string currentClient;
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+ClientScope::ClientScope (const std::string& id)
+  : previous(std::move (currentClient))
+{
+  currentClient = id;
+}
+
+ClientScope::~ClientScope ()
+{
+  currentClient = std::move (previous);
+}
+
+const std::string&
+ClientScope::GetCurrent ()
+{
+  return currentClient;
+}
+
+/* ************************************************************************** */
+
+RateLimiter::RateLimiter (const double r, const unsigned b,
+                          const unsigned concurrent)
+  : rate(r), burst(std::max (b, 1u)), maxConcurrent(concurrent),
+    pruneThreshold(MIN_PRUNE_THRESHOLD)
+{
+  CHECK_GE (rate, 0.0);
+}
+
+void
+RateLimiter::PruneIdle (const Clock::time_point now)
+{
+  for (auto it = clients.begin (); it != clients.end (); )
+    {
+      const auto& state = it->second;
+      const std::chrono::duration<double> elapsed = now - state.lastRefill;
+      if (state.active == 0 && state.tokens + elapsed.count () * rate >= burst)
+        it = clients.erase (it);
+      else
+        ++it;
+    }
+}
+
+RateLimiter::Result
+RateLimiter::TryAdmit (const std::string& client,
+                       std::unique_ptr<Admission>& adm,
+                       const Clock::time_point now)
+{
+  std::unique_lock<std::mutex> lock(mut);
+
+  auto mit = clients.find (client);
+  if (mit == clients.end ())
+    {
+      if (clients.size () >= pruneThreshold)
+        {
+          PruneIdle (now);
+          pruneThreshold = std::max (MIN_PRUNE_THRESHOLD, 2 * clients.size ());
+        }
+
+      ClientState state;
+      state.tokens = burst;
+      state.lastRefill = now;
+      mit = clients.emplace (client, state).first;
+    }
+  auto& state = mit->second;
+
+  if (maxConcurrent > 0 && state.active >= maxConcurrent)
+    return Result::TOO_MANY_CONCURRENT;
+
+  if (rate > 0.0)
+    {
+      if (now > state.lastRefill)
+        {
+          const std::chrono::duration<double> elapsed = now - state.lastRefill;
+          state.tokens = std::min (burst, state.tokens + elapsed.count () * rate);
+          state.lastRefill = now;
+        }
+
+      if (state.tokens < 1.0)
+        return Result::RATE_LIMITED;
+      state.tokens -= 1.0;
+    }
+
+  ++state.active;
+  lock.unlock ();
+
+  /* This must be done without holding the lock, as it may destruct an
+     earlier admission that adm held, which calls Release.  */
+  adm.reset (new Admission (*this, client));
+
+  return Result::ADMITTED;
+}
+
+void
+RateLimiter::Release (const std::string& client)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  auto mit = clients.find (client);
+  CHECK (mit != clients.end ());
+  CHECK_GT (mit->second.active, 0);
+  --mit->second.active;
+}
+
+size_t
+RateLimiter::GetNumClients ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return clients.size ();
+}
+
+} // namespace xayax
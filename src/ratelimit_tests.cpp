@@ -0,0 +1,145 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "private/ratelimit.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xayax
+{
+namespace
+{
+
+using Result = RateLimiter::Result;
+using Admission = RateLimiter::Admission;
+
+class RateLimiterTests : public testing::Test
+{
+
+protected:
+
+  const RateLimiter::Clock::time_point start = RateLimiter::Clock::now ();
+
+  /**
+   * Returns the time point the given number of milliseconds after start.
+   */
+  RateLimiter::Clock::time_point
+  At (const int ms) const
+  {
+    return start + std::chrono::milliseconds (ms);
+  }
+
+};
+
+TEST_F (RateLimiterTests, TokenBucket)
+{
+  RateLimiter limiter(10.0, 3, 0);
+  std::unique_ptr<Admission> adm;
+
+  for (unsigned i = 0; i < 3; ++i)
+    EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (0)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (0)), Result::RATE_LIMITED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (50)), Result::RATE_LIMITED);
+
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (100)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (100)), Result::RATE_LIMITED);
+
+  /* The bucket is refilled only up to the burst size.  */
+  for (unsigned i = 0; i < 3; ++i)
+    EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (10'000)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (10'000)), Result::RATE_LIMITED);
+}
+
+TEST_F (RateLimiterTests, PerClient)
+{
+  RateLimiter limiter(1.0, 1, 0);
+  std::unique_ptr<Admission> adm;
+
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (0)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", adm, At (0)), Result::RATE_LIMITED);
+  EXPECT_EQ (limiter.TryAdmit ("bar", adm, At (0)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("bar", adm, At (0)), Result::RATE_LIMITED);
+}
+
+TEST_F (RateLimiterTests, Concurrency)
+{
+  RateLimiter limiter(0.0, 1, 2);
+
+  std::unique_ptr<Admission> a1, a2, a3;
+  EXPECT_EQ (limiter.TryAdmit ("foo", a1, At (0)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", a2, At (0)), Result::ADMITTED);
+  EXPECT_EQ (limiter.TryAdmit ("foo", a3, At (0)),
+             Result::TOO_MANY_CONCURRENT);
+  EXPECT_EQ (a3, nullptr);
+  EXPECT_EQ (limiter.TryAdmit ("bar", a3, At (0)), Result::ADMITTED);
+
+  a1.reset ();
+  EXPECT_EQ (limiter.TryAdmit ("foo", a1, At (0)), Result::ADMITTED);
+}
+
+TEST_F (RateLimiterTests, ConcurrencyRejectKeepsTokens)
+{
+  RateLimiter limiter(1.0, 2, 1);
+
+  std::unique_ptr<Admission> a1, a2;
+  EXPECT_EQ (limiter.TryAdmit ("foo", a1, At (0)), Result::ADMITTED);
+  for (unsigned i = 0; i < 10; ++i)
+    EXPECT_EQ (limiter.TryAdmit ("foo", a2, At (0)),
+               Result::TOO_MANY_CONCURRENT);
+
+  a1.reset ();
+  EXPECT_EQ (limiter.TryAdmit ("foo", a1, At (0)), Result::ADMITTED);
+}
+
+TEST_F (RateLimiterTests, PrunesIdleClients)
+{
+  RateLimiter limiter(1.0, 1, 1);
+
+  std::unique_ptr<Admission> busy;
+  ASSERT_EQ (limiter.TryAdmit ("busy", busy, At (0)), Result::ADMITTED);
+
+  /* Each client uses up its token, but the bucket is full again one
+     second later.  So all but the most recent clients can be pruned.  */
+  for (unsigned i = 0; i < 5'000; ++i)
+    {
+      std::unique_ptr<Admission> adm;
+      ASSERT_EQ (limiter.TryAdmit ("client " + std::to_string (i), adm,
+                                   At (1'000 * i)),
+                 Result::ADMITTED);
+    }
+  EXPECT_LT (limiter.GetNumClients (), 5'000);
+
+  /* The state of the busy client has been kept.  */
+  std::unique_ptr<Admission> adm;
+  EXPECT_EQ (limiter.TryAdmit ("busy", adm, At (10'000'000)),
+             Result::TOO_MANY_CONCURRENT);
+}
+
+TEST (ClientScopeTests, NestedAndPerThread)
+{
+  EXPECT_EQ (ClientScope::GetCurrent (), "");
+  {
+    ClientScope outer("foo");
+    EXPECT_EQ (ClientScope::GetCurrent (), "foo");
+    {
+      ClientScope inner("bar");
+      EXPECT_EQ (ClientScope::GetCurrent (), "bar");
+
+      std::string other = "unset";
+      std::thread ([&other] () { other = ClientScope::GetCurrent (); }).join ();
+      EXPECT_EQ (other, "");
+    }
+    EXPECT_EQ (ClientScope::GetCurrent (), "foo");
+  }
+  EXPECT_EQ (ClientScope::GetCurrent (), "");
+}
+
+} // anonymous namespace
+} // namespace xayax
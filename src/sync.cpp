@@ -1,9 +1,11 @@
-// Copyright (C) 2021 The Xaya developers
+// Copyright (C) 2021-2024 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "private/sync.hpp"
 
+#include "metrics.hpp"
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -28,6 +30,41 @@ namespace
  */
 constexpr auto WAIT_BETWEEN_STEPS = std::chrono::milliseconds (1);
 
+/**
+ * Metrics about the sync process.
+ */
+struct SyncMetrics
+{
+
+  Histogram& stepTime;
+  Gauge& baseTipHeight;
+  Counter& blocksFetched;
+  Counter& forkSearches;
+
+  SyncMetrics ()
+    : stepTime(MetricsRegistry::Get ().GetHistogram (
+          "xayax_sync_step_seconds",
+          "Time for one sync update step (including base-chain queries)")),
+      baseTipHeight(MetricsRegistry::Get ().GetGauge (
+          "xayax_sync_base_tip_height",
+          "Height of the base-chain tip as last seen by sync")),
+      blocksFetched(MetricsRegistry::Get ().GetCounter (
+          "xayax_sync_blocks_fetched_total",
+          "Blocks fetched from the base chain for syncing")),
+      forkSearches(MetricsRegistry::Get ().GetCounter (
+          "xayax_sync_fork_searches_total",
+          "Sync steps that went back further to find a fork point"))
+  {}
+
+  static SyncMetrics&
+  Get ()
+  {
+    static SyncMetrics instance;
+    return instance;
+  }
+
+};
+
 } // anonymous namespace
 
 Sync::Sync (BaseChain& b, Chainstate& c, std::mutex& mutC, const uint64_t pd)
@@ -129,6 +166,7 @@ bool
 Sync::ImportNewTip (const uint64_t height)
 {
   const auto blocks = base.GetBlockRange (height, 1);
+  SyncMetrics::Get ().blocksFetched.Increment (blocks.size ());
   if (blocks.empty ())
     {
       LOG (WARNING)
@@ -154,9 +192,13 @@ Sync::UpdateStep ()
 {
   std::lock_guard<std::mutex> lock(mutChain);
 
+  auto& metrics = SyncMetrics::Get ();
+  ScopedTimer timer(metrics.stepTime);
+
   /* Check the current height of the base chain, and what height we
      want to quick-sync to / initialise at based on the pruning depth.  */
   const uint64_t baseTip = base.GetTipHeight ();
+  metrics.baseTipHeight.Set (baseTip);
   const uint64_t genesisHeight
       = (baseTip < pruningDepth ? 0 : baseTip - pruningDepth);
 
@@ -182,6 +224,7 @@ Sync::UpdateStep ()
       << "Requesting " << num << " blocks from " << startHeight
       << " from the base chain";
   const auto blocks = base.GetBlockRange (startHeight, num);
+  metrics.blocksFetched.Increment (blocks.size ());
 
   /* If we are reactivating a chain that we already have locally by
      attaching one of the blocks in that current fork, we need to query
@@ -204,6 +247,7 @@ Sync::UpdateStep ()
          there is no harm in requesting that block itself as well.  If it
          matches the one we have, then the attach will be fine.  This also
          covers the case of just detaches back to the lowest unpruned block.  */
+      metrics.forkSearches.Increment ();
       IncreaseNumBlocks ();
       nextStartHeight = std::max<int64_t> (chain.GetLowestUnprunedHeight (),
                                            startHeight - num);
@@ -0,0 +1,106 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "private/taskpool.hpp"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace xayax
+{
+
+TaskPool::TaskPool (const unsigned numThreads)
+{
+  for (unsigned i = 0; i < numThreads; ++i)
+    threads.emplace_back ([this] ()
+      {
+        RunWorker ();
+      });
+}
+
+TaskPool::~TaskPool ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    CHECK (batches.empty ());
+    shouldStop = true;
+    cv.notify_all ();
+  }
+
+  for (auto& t : threads)
+    t.join ();
+}
+
+size_t
+TaskPool::Claim (Batch& b)
+{
+  CHECK_LT (b.next, b.num);
+  const size_t res = b.next++;
+
+  if (b.next == b.num)
+    {
+      const auto mit = std::find (batches.begin (), batches.end (), &b);
+      CHECK (mit != batches.end ());
+      batches.erase (mit);
+    }
+
+  return res;
+}
+
+void
+TaskPool::RunTask (std::unique_lock<std::mutex>& lock, Batch& b,
+                   const size_t i)
+{
+  lock.unlock ();
+  b.fn (i);
+  lock.lock ();
+
+  ++b.done;
+  if (b.done == b.num)
+    b.cvDone.notify_all ();
+}
+
+void
+TaskPool::RunWorker ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      while (batches.empty () && !shouldStop)
+        cv.wait (lock);
+      if (shouldStop)
+        return;
+
+      Batch& b = *batches.front ();
+      const size_t i = Claim (b);
+      RunTask (lock, b, i);
+    }
+}
+
+void
+TaskPool::Run (const size_t num, const std::function<void (size_t)>& fn)
+{
+  /* For a single task, there is no benefit in involving the pool.  */
+  if (threads.empty () || num <= 1)
+    {
+      for (size_t i = 0; i < num; ++i)
+        fn (i);
+      return;
+    }
+
+  std::unique_lock<std::mutex> lock(mut);
+  Batch b(fn, num);
+  batches.push_back (&b);
+  cv.notify_all ();
+
+  /* Work on the tasks ourselves as well, until all are claimed.  Then wait
+     for the ones still running on pool threads.  */
+  while (b.next < b.num)
+    RunTask (lock, b, Claim (b));
+  while (b.done < b.num)
+    b.cvDone.wait (lock);
+}
+
+} // namespace xayax
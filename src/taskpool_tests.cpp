@@ -0,0 +1,88 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "private/taskpool.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace xayax
+{
+namespace
+{
+
+TEST (TaskPoolTests, AllTasksRun)
+{
+  TaskPool pool(4);
+
+  for (const size_t num : {0, 1, 2, 100})
+    {
+      std::vector<std::atomic<unsigned>> calls(num);
+      pool.Run (num, [&] (const size_t i)
+        {
+          ++calls[i];
+        });
+
+      for (const auto& c : calls)
+        EXPECT_EQ (c, 1);
+    }
+}
+
+TEST (TaskPoolTests, WithoutThreads)
+{
+  TaskPool pool(0);
+
+  std::vector<size_t> order;
+  pool.Run (5, [&] (const size_t i)
+    {
+      order.push_back (i);
+    });
+
+  EXPECT_EQ (order, std::vector<size_t> ({0, 1, 2, 3, 4}));
+}
+
+TEST (TaskPoolTests, RunsInParallel)
+{
+  TaskPool pool(3);
+
+  std::mutex mut;
+  std::set<std::thread::id> threads;
+  pool.Run (4, [&] (const size_t)
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (50));
+      std::lock_guard<std::mutex> lock(mut);
+      threads.insert (std::this_thread::get_id ());
+    });
+
+  EXPECT_GT (threads.size (), 1);
+}
+
+TEST (TaskPoolTests, ConcurrentCallers)
+{
+  TaskPool pool(2);
+
+  std::atomic<unsigned> total(0);
+  std::vector<std::thread> callers;
+  for (unsigned i = 0; i < 4; ++i)
+    callers.emplace_back ([&] ()
+      {
+        pool.Run (50, [&] (const size_t)
+          {
+            ++total;
+          });
+      });
+  for (auto& t : callers)
+    t.join ();
+
+  EXPECT_EQ (total, 200);
+}
+
+} // anonymous namespace
+} // namespace xayax
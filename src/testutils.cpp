@@ -4,6 +4,8 @@
 
 #include "testutils.hpp"
 
+#include "notification.hpp"
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
@@ -188,6 +190,33 @@ TestBaseChain::GetBlockRangeCalls () const
   return getBlockRangeCalls;
 }
 
+unsigned
+TestBaseChain::GetMempoolCalls () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return getMempoolCalls;
+}
+
+std::string
+TestBaseChain::Sign (const std::string& msg, const std::string& addr)
+{
+  return "sgn " + msg + " " + addr;
+}
+
+unsigned
+TestBaseChain::GetVerifyMessageCalls () const
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return verifyMessageCalls;
+}
+
+void
+TestBaseChain::SetBlockRangeDelay (const std::chrono::milliseconds d)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  blockRangeDelay = d;
+}
+
 void
 TestBaseChain::Start ()
 {
@@ -240,10 +269,17 @@ std::vector<BlockData>
 TestBaseChain::GetBlockRange (const uint64_t start, const uint64_t count)
 {
   MaybeThrow ();
-  std::lock_guard<std::mutex> lock(mut);
+  std::unique_lock<std::mutex> lock(mut);
   std::vector<BlockData> res;
 
   ++getBlockRangeCalls;
+  if (blockRangeDelay.count () > 0)
+    {
+      const auto delay = blockRangeDelay;
+      lock.unlock ();
+      std::this_thread::sleep_for (delay);
+      lock.lock ();
+    }
 
   for (uint64_t h = start; h < start + count; ++h)
     {
@@ -283,6 +319,7 @@ TestBaseChain::GetMempool ()
 {
   MaybeThrow ();
   std::lock_guard<std::mutex> lock(mut);
+  ++getMempoolCalls;
   return mempool;
 }
 
@@ -290,7 +327,16 @@ bool
 TestBaseChain::VerifyMessage (const std::string& msg,
                               const std::string& signature, std::string& addr)
 {
-  LOG (FATAL) << "TestBaseChain::VerifyMessage is not implemented";
+  MaybeThrow ();
+  std::lock_guard<std::mutex> lock(mut);
+  ++verifyMessageCalls;
+
+  const std::string prefix = "sgn " + msg + " ";
+  if (signature.substr (0, prefix.size ()) != prefix)
+    return false;
+
+  addr = signature.substr (prefix.size ());
+  return true;
 }
 
 std::string
@@ -311,14 +357,24 @@ TestBaseChain::GetVersion ()
 
 /* ************************************************************************** */
 
-TestZmqSubscriber::TestZmqSubscriber (const std::string& addr)
+TestZmqSubscriber::TestZmqSubscriber (const std::string& addr,
+                                      const std::vector<std::string>& topics)
+  : TestZmqSubscriber (std::vector<std::string> ({addr}), topics)
+{}
+
+TestZmqSubscriber::TestZmqSubscriber (const std::vector<std::string>& addrs,
+                                      const std::vector<std::string>& topics)
   : sock(ctx, ZMQ_SUB)
 {
   std::lock_guard<std::mutex> lock(mut);
 
-  sock.connect (addr);
-  sock.set (zmq::sockopt::subscribe, "");
-  LOG (INFO) << "Connected ZMQ subscriber to " << addr;
+  for (const auto& addr : addrs)
+    {
+      sock.connect (addr);
+      LOG (INFO) << "Connected ZMQ subscriber to " << addr;
+    }
+  for (const auto& t : topics)
+    sock.set (zmq::sockopt::subscribe, t);
 
   shouldStop = false;
   receiver = std::make_unique<std::thread> ([this] ()
@@ -378,11 +434,31 @@ TestZmqSubscriber::ReceiveLoop ()
         seq |= seqBytes[i] << (8 * i);
 
       /* Check that the sequence number matches.  */
+      if (expectGap.erase (topic) > 0)
+        {
+          ASSERT_GT (seq, nextSeq[topic]);
+          nextSeq[topic] = seq;
+        }
       ASSERT_EQ (seq, nextSeq[topic]);
       ++nextSeq[topic];
 
-      /* Parse and enqueue the message.  */
-      messages[topic].push (ParseJson (data));
+      /* Parse and enqueue the message.  Binary and compressed notifications
+         are decoded into their JSON form, so that they can be checked in
+         the same way.  */
+      if (topic.find (" bin ") != std::string::npos)
+        {
+          Json::Value decoded;
+          ASSERT_TRUE (DecodeBinaryBlockNotification (data, decoded));
+          messages[topic].push (decoded);
+        }
+      else if (topic.find (" zstd ") != std::string::npos)
+        {
+          std::string decompressed;
+          ASSERT_TRUE (DecompressNotification (data, zstdDict, decompressed));
+          messages[topic].push (ParseJson (decompressed));
+        }
+      else
+        messages[topic].push (ParseJson (data));
       cv.notify_all ();
     }
 }
@@ -406,6 +482,13 @@ TestZmqSubscriber::AwaitMessages (const std::string& cmd, const size_t num)
   return res;
 }
 
+void
+TestZmqSubscriber::SetZstdDictionary (const std::string& dict)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  zstdDict = dict;
+}
+
 void
 TestZmqSubscriber::ForgetAll ()
 {
@@ -414,6 +497,20 @@ TestZmqSubscriber::ForgetAll ()
   VLOG (1) << "Forgot all received and not yet expected messages";
 }
 
+void
+TestZmqSubscriber::ExpectSequence (const std::string& cmd, const unsigned seq)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  nextSeq[cmd] = seq;
+}
+
+void
+TestZmqSubscriber::ExpectGap (const std::string& cmd)
+{
+  std::lock_guard<std::mutex> lock(mut);
+  expectGap.insert (cmd);
+}
+
 /* ************************************************************************** */
 
 } // namespace xayax
@@ -12,13 +12,16 @@
 #include <json/json.h>
 #include <zmq.hpp>
 
+#include <chrono>
 #include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace xayax
 {
@@ -86,6 +89,15 @@ private:
   /** How many times GetBlockRange has been called.  */
   unsigned getBlockRangeCalls = 0;
 
+  /** How many times GetMempool has been called.  */
+  unsigned getMempoolCalls = 0;
+
+  /** How many times VerifyMessage has been called.  */
+  unsigned verifyMessageCalls = 0;
+
+  /** Artificial delay for GetBlockRange calls.  */
+  std::chrono::milliseconds blockRangeDelay{0};
+
   /**
    * Constructs a new block hash based on our counter.
    */
@@ -160,6 +172,28 @@ public:
    */
   unsigned GetBlockRangeCalls () const;
 
+  /**
+   * Returns how many times GetMempool has been called.
+   */
+  unsigned GetMempoolCalls () const;
+
+  /**
+   * Returns a (raw) signature of the given message by the given address,
+   * which our VerifyMessage accepts.
+   */
+  static std::string Sign (const std::string& msg, const std::string& addr);
+
+  /**
+   * Returns how many times VerifyMessage has been called.
+   */
+  unsigned GetVerifyMessageCalls () const;
+
+  /**
+   * Sets an artificial delay for GetBlockRange calls, which simulates
+   * a slow base chain.
+   */
+  void SetBlockRangeDelay (std::chrono::milliseconds d);
+
   void Start () override;
   bool EnablePending () override;
   uint64_t GetTipHeight () override;
@@ -196,9 +230,15 @@ private:
   /** Expected next sequence number for each command.  */
   std::map<std::string, unsigned> nextSeq;
 
+  /** Commands for which the next message should skip sequence numbers.  */
+  std::set<std::string> expectGap;
+
   /** For each command, the queue of not-yet-expected messages.  */
   std::map<std::string, std::queue<Json::Value>> messages;
 
+  /** Dictionary to use for decompressing zstd notifications.  */
+  std::string zstdDict;
+
   /** Background thread that polls the ZMQ socket and notifies waiters.  */
   std::unique_ptr<std::thread> receiver;
 
@@ -214,8 +254,18 @@ public:
 
   /**
    * Constructs the subscriber and connects it to a socket at the given address.
+   * By default, it subscribes to all messages, but an explicit list of
+   * topic prefixes can be given instead.
    */
-  explicit TestZmqSubscriber (const std::string& addr);
+  explicit TestZmqSubscriber (const std::string& addr,
+                              const std::vector<std::string>& topics = {""});
+
+  /**
+   * Constructs the subscriber connecting to all the given addresses
+   * (e.g. all shards of a publisher).
+   */
+  explicit TestZmqSubscriber (const std::vector<std::string>& addrs,
+                              const std::vector<std::string>& topics = {""});
 
   /**
    * Cleans up everything, expecting that no unexpected messages have been
@@ -229,11 +279,32 @@ public:
    */
   std::vector<Json::Value> AwaitMessages (const std::string& cmd, size_t num);
 
+  /**
+   * Sets the dictionary to use for decompressing notifications on
+   * zstd topics.
+   */
+  void SetZstdDictionary (const std::string& dict);
+
   /**
    * Forgets / ignores all unexpected messages.
    */
   void ForgetAll ();
 
+  /**
+   * Sets the sequence number we expect for the next message of the given
+   * topic (instead of the default zero for the first message).  This can
+   * be used to verify the sequence numbers of a subscriber that joins
+   * after some messages have been published already.
+   */
+  void ExpectSequence (const std::string& cmd, unsigned seq);
+
+  /**
+   * Expects that the next message of the given topic has a sequence number
+   * larger than the next one, i.e. that the publisher marked some messages
+   * as missed.  The exact size of the gap is not checked.
+   */
+  void ExpectGap (const std::string& cmd);
+
 };
 
 } // namespace xayax
@@ -4,16 +4,89 @@
 
 #include "private/zmqpub.hpp"
 
+#include "metrics.hpp"
+#include "private/jsonutils.hpp"
+#include "proto/blockdata.pb.h"
+
 #include <univalue.h>
+#include <zdict.h>
+#include <zstd.h>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <map>
+#include <queue>
+#include <set>
 #include <sstream>
+#include <thread>
 
 namespace xayax
 {
 
+DEFINE_int32 (xayax_zmq_replay_blocks, 256,
+              "number of recently published blocks to keep in memory for"
+              " answering game_sendupdates requests");
+
+DEFINE_bool (xayax_zmq_nodrop, false,
+             "if enabled, ZMQ messages exceeding the high-water mark are"
+             " dropped for all subscribers, which allows exact accounting"
+             " of dropped messages");
+DEFINE_bool (xayax_zmq_coalesce_catchup, false,
+             "if enabled, notifications for game_sendupdates requests that"
+             " are queued while a publisher is under pressure are merged"
+             " into the run of blocks queued before for the same request,"
+             " so that they take a single queue slot and are sent together"
+             " on the batched attach topic");
+DEFINE_int32 (xayax_zmq_pressure_queue, 64,
+              "number of queued notification jobs at which a publisher"
+              " is considered under pressure");
+
+DEFINE_int32 (xayax_zmq_queue_size, 1'024,
+              "maximum number of queued notification jobs per publisher;"
+              " callers sending notifications block while it is full");
+
+DEFINE_int32 (xayax_zmq_build_threads, 4,
+              "number of threads (shared between all publisher shards) used"
+              " to build the per-game notification payloads in parallel;"
+              " with zero, they are built on the publisher threads directly");
+
+DEFINE_int32 (xayax_zmq_batch_max_blocks, 100,
+              "maximum number of blocks in one message of the batched"
+              " block-attach topic");
+DEFINE_int32 (xayax_zmq_batch_max_bytes, 1 << 20,
+              "maximum payload size (unless a single block is larger) of one"
+              " message of the batched block-attach topic");
+
+DEFINE_int32 (xayax_zmq_pending_window_ms, 0,
+              "if positive, pending moves are collected for this many"
+              " milliseconds and then sent as one notification per game");
+DEFINE_int32 (xayax_zmq_pending_max_moves, 100,
+              "maximum number of pending moves collected before the"
+              " notifications are sent even if the window is not over yet");
+
+DEFINE_int32 (xayax_zmq_zstd_level, 3,
+              "compression level for the zstd ZMQ topics");
+DEFINE_string (xayax_zmq_zstd_dictionary, "",
+               "if set, file with a zstd dictionary to use for compressing"
+               " the zstd ZMQ topics (subscribers need the same dictionary,"
+               " see getzmqdictionary); trained dictionaries are written"
+               " to it as well");
+DEFINE_int32 (xayax_zmq_zstd_train_blocks, 0,
+              "if positive, a new zstd dictionary is trained from the"
+              " payloads in the replay buffer every this many new blocks");
+DEFINE_int32 (xayax_zmq_zstd_dict_size, 16'384,
+              "maximum size in bytes of trained zstd dictionaries");
+
 namespace
 {
 
@@ -24,6 +97,8 @@ constexpr int SEND_HWM = 1'000;
 constexpr const char* PREFIX_ATTACH = "game-block-attach";
 /** Topic prefix for block-detach messages.  */
 constexpr const char* PREFIX_DETACH = "game-block-detach";
+/** Topic prefix for batched block-attach messages.  */
+constexpr const char* PREFIX_ATTACH_BATCH = "game-block-attach-batch";
 
 /** Topic prefix for pending moves.  */
 constexpr const char* PREFIX_MOVE = "game-pending-move";
@@ -220,247 +295,2067 @@ PerTxData::PerTxData (const MoveData& mv)
     }
 }
 
-} // anonymous namespace
+/**
+ * Computes the shard index for a given game ID.  We use FNV-1a rather than
+ * std::hash, so that the assignment is stable across builds and restarts.
+ */
+size_t
+GetShardForGame (const std::string& g, const size_t numShards)
+{
+  uint64_t hash = 14'695'981'039'346'656'037ull;
+  for (const unsigned char c : g)
+    {
+      hash ^= c;
+      hash *= 1'099'511'628'211ull;
+    }
 
-ZmqPub::ZmqPub (const std::string& addr)
-  : sock(ctx, zmq::socket_type::pub)
+  return hash % numShards;
+}
+
+/**
+ * A list of moves (e.g. of a block or pending transaction) which is shared
+ * between the shards publishing notifications for them.  The moves are
+ * parsed only once, and only when the first shard actually needs them
+ * (i.e. there is at least one game with subscribers).
+ */
+class ParsedMoves
 {
-  LOG (INFO) << "Binding ZMQ publisher to " << addr;
-  sock.set (zmq::sockopt::sndhwm, SEND_HWM);
-  sock.set (zmq::sockopt::tcp_keepalive, 1);
-  sock.bind (addr);
+
+private:
+
+  /** The raw moves.  */
+  const std::vector<MoveData> moves;
+
+  /** Flag used to ensure we parse the data only once.  */
+  std::once_flag parseOnce;
+
+  /** The parsed per-transaction data.  */
+  std::vector<std::unique_ptr<PerTxData>> parsed;
+
+public:
+
+  explicit ParsedMoves (const std::vector<MoveData>& mv)
+    : moves(mv)
+  {}
+
+  ParsedMoves () = delete;
+  ParsedMoves (const ParsedMoves&) = delete;
+  void operator= (const ParsedMoves&) = delete;
+
+  /**
+   * Returns the raw moves.
+   */
+  const std::vector<MoveData>&
+  GetRaw () const
+  {
+    return moves;
+  }
+
+  /**
+   * Returns the parsed data, parsing the moves if not yet done.  This
+   * is thread-safe.
+   */
+  const std::vector<std::unique_ptr<PerTxData>>&
+  Get ()
+  {
+    std::call_once (parseOnce, [this] ()
+      {
+        for (const auto& mv : moves)
+          parsed.push_back (std::make_unique<PerTxData> (mv));
+      });
+
+    return parsed;
+  }
+
+};
+
+/**
+ * Adds the reqtoken field to a serialised block payload.  The keys of
+ * a JSON object are serialised in sorted order, and "reqtoken" sorts after
+ * all other keys ("admin", "block" and "moves").  Thus we can simply splice
+ * it in at the end, which gives the exact same result as if the payload
+ * had been serialised with the field set.
+ */
+std::string
+WithReqtoken (const std::string& payload, const std::string& reqtoken)
+{
+  if (reqtoken.empty ())
+    return payload;
+
+  CHECK (!payload.empty () && payload.back () == '}');
+  std::string res = payload.substr (0, payload.size () - 1);
+  if (res != "{")
+    res += ',';
+  res += "\"reqtoken\":" + StoreJson (reqtoken) + "}";
+
+  return res;
 }
 
-ZmqPub::~ZmqPub ()
+/**
+ * Adds the reqtoken to a serialised GameBlock protocol buffer.  Since
+ * concatenating serialised messages merges them, we can simply append
+ * a message with only the reqtoken set.
+ */
+std::string
+WithBinaryReqtoken (const std::string& payload, const std::string& reqtoken)
 {
-  std::lock_guard<std::mutex> lock(mut);
+  if (reqtoken.empty ())
+    return payload;
 
-  /* Make sure we close the socket right away.  */
-  sock.set (zmq::sockopt::linger, 0);
-  sock.close ();
+  proto::GameBlock pb;
+  pb.set_reqtoken (reqtoken);
+
+  return payload + pb.SerializeAsString ();
 }
 
+/**
+ * Fills in a Move protocol buffer for the binary notification format
+ * from the JSON of a move or admin command (with the value in the given
+ * field).  Everything except the explicit fields is metadata.
+ */
 void
-ZmqPub::TrackGame (const std::string& g)
+EncodeMove (Json::Value data, const std::string& ns,
+            const std::string& valueField, const std::string& game,
+            proto::Move& pb)
 {
-  std::lock_guard<std::mutex> lock(mut);
+  CHECK (data.isObject ());
 
-  uint64_t newDepth;
-  auto mit = games.find (g);
-  if (mit == games.end ())
-    {
-      games.emplace (g, 1);
-      newDepth = 1;
-    }
-  else
+  pb.set_ns (ns);
+  pb.set_txid (data["txid"].asString ());
+  data.removeMember ("txid");
+  /* Only player moves have the name set explicitly.  */
+  if (ns == "p")
     {
-      newDepth = mit->second + 1;
-      mit->second = newDepth;
+      pb.set_name (data["name"].asString ());
+      data.removeMember ("name");
     }
 
-  LOG (INFO) << "Tracking game '" << g << "', new depth: " << newDepth;
+  pb.set_mv (StoreJson (data[valueField]));
+  data.removeMember (valueField);
+
+  pb.mutable_burns ()->insert ({game, StoreJson (data["burnt"])});
+  data.removeMember ("burnt");
+
+  pb.set_metadata (StoreJson (data));
 }
 
-void
-ZmqPub::UntrackGame (const std::string& g)
+/**
+ * Builds the binary notification payload (a serialised GameBlock)
+ * for a block and one game.
+ */
+std::string
+EncodeGameBlock (const BlockData& header, const Json::Value& moves,
+                 const Json::Value& admin, const std::string& game)
 {
-  std::lock_guard<std::mutex> lock(mut);
+  proto::GameBlock pb;
 
-  uint64_t newDepth;
-  auto mit = games.find (g);
-  if (mit == games.end ())
-    newDepth = 0;
-  else
-    {
-      CHECK_GT (mit->second, 0);
-      newDepth = mit->second - 1;
+  auto& blk = *pb.mutable_block ();
+  blk.set_hash (header.hash);
+  blk.set_parent (header.parent);
+  blk.set_height (header.height);
+  blk.set_rngseed (header.rngseed);
+  blk.set_metadata (StoreJson (InitFromMetadata (header)));
 
-      if (newDepth == 0)
-        games.erase (mit);
-      else
-        mit->second = newDepth;
-    }
+  for (const auto& mv : moves)
+    EncodeMove (mv, "p", "move", game, *pb.add_moves ());
+  for (const auto& cmd : admin)
+    EncodeMove (cmd, "g", "cmd", game, *pb.add_admin ());
 
-  LOG (INFO) << "Untracking game '" << g << "', new depth: " << newDepth;
+  return pb.SerializeAsString ();
 }
 
-void
-ZmqPub::SendMessage (const std::string& cmd, const Json::Value& data)
+/**
+ * Compressor for zstd payloads.  Compression contexts are not thread-safe,
+ * so each shard has its own instance.
+ */
+class ZstdCompressor
 {
-  auto mitSeq = nextSeq.find (cmd);
-  if (mitSeq == nextSeq.end ())
-    mitSeq = nextSeq.emplace (cmd, 0).first;
 
-  uint32_t seq = mitSeq->second;
-  uint8_t seqBytes[sizeof (seq)];
-  for (unsigned i = 0; i < sizeof (seq); ++i)
-    {
-      seqBytes[i] = seq & 0xFF;
-      seq >>= 8;
-    }
-  CHECK_EQ (seq, 0);
+private:
 
-  Json::StreamWriterBuilder wbuilder;
-  wbuilder["commentStyle"] = "None";
-  wbuilder["indentation"] = "";
-  wbuilder["enableYAMLCompatibility"] = false;
-  wbuilder["dropNullPlaceholders"] = false;
-  wbuilder["useSpecialFloats"] = false;
-  const std::string dataStr = Json::writeString (wbuilder, data);
+  /** The compression context.  */
+  ZSTD_CCtx* ctx;
 
-  /* We want to handle EAGAIN in the same way as other errors.  */
-  if (!sock.send (zmq::message_t (cmd), zmq::send_flags::sndmore))
-    throw zmq::error_t ();
+public:
 
-  VLOG (1) << "Sent ZMQ message: " << cmd;
-  VLOG (2) << "Payload data:\n" << data;
+  ZstdCompressor ()
+    : ctx(ZSTD_createCCtx ())
+  {
+    CHECK (ctx != nullptr);
+  }
 
-  /* Once the first send succeeded, ZMQ guarantees atomic delivery of
-     the further parts.  */
-  CHECK (sock.send (zmq::message_t (dataStr), zmq::send_flags::sndmore));
-  CHECK (sock.send (zmq::message_t (seqBytes, sizeof (seq)),
-                    zmq::send_flags::none));
+  ~ZstdCompressor ()
+  {
+    ZSTD_freeCCtx (ctx);
+  }
 
-  /* Increase the sequence number at the end.  If the sending fails and
-     throws, we want to keep the previous one.  */
-  ++mitSeq->second;
+  ZstdCompressor (const ZstdCompressor&) = delete;
+  void operator= (const ZstdCompressor&) = delete;
+
+  /**
+   * Compresses the given data into a single zstd frame, using the
+   * given dictionary if it is not null.
+   */
+  std::string Compress (const std::string& data, const ZSTD_CDict* dict);
+
+};
+
+std::string
+ZstdCompressor::Compress (const std::string& data, const ZSTD_CDict* dict)
+{
+  std::string res(ZSTD_compressBound (data.size ()), '\0');
+
+  size_t len;
+  if (dict == nullptr)
+    len = ZSTD_compressCCtx (ctx, &res[0], res.size (),
+                             data.data (), data.size (),
+                             FLAGS_xayax_zmq_zstd_level);
+  else
+    len = ZSTD_compress_usingCDict (ctx, &res[0], res.size (),
+                                    data.data (), data.size (), dict);
+  CHECK (!ZSTD_isError (len))
+      << "zstd compression failed: " << ZSTD_getErrorName (len);
+
+  res.resize (len);
+  return res;
 }
 
-void
-ZmqPub::SendBlock (const std::string& cmdPrefix, const BlockData& blk,
-                   const std::string& reqtoken)
+/**
+ * Metrics about the ZMQ publisher.  These are aggregated over all topics,
+ * as the per-topic details are available from the getzmqstats RPC.
+ */
+struct ZmqMetrics
 {
-  std::lock_guard<std::mutex> lock(mut);
 
-  /* Prepare the template object for this block that is the same for each game
-     we track.  */
+  Counter& sent;
+  Counter& bytes;
+  Counter& dropped;
+  Counter& replayHits;
+  Counter& replayMisses;
+  Histogram& buildTime;
+
+  ZmqMetrics ()
+    : sent(MetricsRegistry::Get ().GetCounter (
+          "xayax_zmq_messages_sent_total",
+          "ZMQ messages sent")),
+      bytes(MetricsRegistry::Get ().GetCounter (
+          "xayax_zmq_bytes_sent_total",
+          "Payload bytes of ZMQ messages sent")),
+      dropped(MetricsRegistry::Get ().GetCounter (
+          "xayax_zmq_messages_dropped_total",
+          "ZMQ messages dropped because the send queue was full")),
+      replayHits(MetricsRegistry::Get ().GetCounter (
+          "xayax_zmq_replay_requests_total",
+          "Block notifications requested from the replay buffer by result",
+          "result=\"hit\"")),
+      replayMisses(MetricsRegistry::Get ().GetCounter (
+          "xayax_zmq_replay_requests_total",
+          "Block notifications requested from the replay buffer by result",
+          "result=\"miss\"")),
+      buildTime(MetricsRegistry::Get ().GetHistogram (
+          "xayax_zmq_payload_build_seconds",
+          "Time for building the ZMQ payloads of a block"))
+  {}
+
+  static ZmqMetrics&
+  Get ()
+  {
+    static ZmqMetrics instance;
+    return instance;
+  }
+
+};
+
+} // anonymous namespace
+
+/* ************************************************************************** */
+
+/**
+ * Dictionary for zstd compression, either loaded from a file or trained
+ * from recent payloads.
+ */
+class ZmqPub::ZstdDictionary
+{
+
+private:
+
+  /** The raw dictionary data, as it has to be used by subscribers.  */
+  std::string data;
+
+  /** The dictionary ID (zero if the data has no zstd dictionary header).  */
+  unsigned id;
+
+  ZSTD_CDict* dict;
+
+public:
+
+  explicit ZstdDictionary (const std::string& d);
+
+  ~ZstdDictionary ()
+  {
+    ZSTD_freeCDict (dict);
+  }
+
+  ZstdDictionary () = delete;
+  ZstdDictionary (const ZstdDictionary&) = delete;
+  void operator= (const ZstdDictionary&) = delete;
+
+  const ZSTD_CDict*
+  Get () const
+  {
+    return dict;
+  }
+
+  const std::string&
+  GetData () const
+  {
+    return data;
+  }
+
+  unsigned
+  GetId () const
+  {
+    return id;
+  }
+
+};
+
+ZmqPub::ZstdDictionary::ZstdDictionary (const std::string& d)
+  : data(d), id(ZSTD_getDictID_fromDict (d.data (), d.size ()))
+{
+  CHECK (!data.empty ()) << "Empty zstd dictionary";
+  dict = ZSTD_createCDict (data.data (), data.size (),
+                           FLAGS_xayax_zmq_zstd_level);
+  CHECK (dict != nullptr) << "Failed to load zstd dictionary";
+}
+
+/* ************************************************************************** */
+
+/**
+ * A published block together with the notification payloads built for it.
+ * Instances are shared between the shards and kept in the replay buffer,
+ * so that blocks published again (e.g. for a game_sendupdates request)
+ * do not have to be re-fetched or re-serialised.  The stored payloads
+ * have no reqtoken, which is added when sending.
+ */
+class ZmqPub::BlockNotification
+{
+
+private:
+
+  /** The block's data except for the moves.  */
+  BlockData header;
+
+  /** The JSON object with the "block" field, common for all games.  */
+  Json::Value blkTemplate;
+
+  /** The moves in the block.  */
+  ParsedMoves moves;
+
+  /** Lock for the payloads map.  */
+  mutable std::mutex mut;
+
+  /**
+   * Serialised payloads that have been built so far, keyed by the encoding
+   * and game (e.g. "json mygame").
+   */
+  std::unordered_map<std::string, std::string> payloads;
+
+public:
+
+  explicit BlockNotification (const BlockData& blk);
+
+  BlockNotification () = delete;
+  BlockNotification (const BlockNotification&) = delete;
+  void operator= (const BlockNotification&) = delete;
+
+  const std::string&
+  GetHash () const
+  {
+    return header.hash;
+  }
+
+  /**
+   * Returns the block's header data (without moves).
+   */
+  const BlockData&
+  GetHeader () const
+  {
+    return header;
+  }
+
+  /**
+   * Returns the full block data (including moves).
+   */
+  BlockData GetBlock () const;
+
+  /**
+   * Returns true if the given block data is exactly the one this
+   * notification is for.
+   */
+  bool Matches (const BlockData& blk) const;
+
+  /**
+   * Adds the moves and admin commands in this block to the arrays of the
+   * games present in the maps (which need to be initialised with arrays
+   * for all games we are interested in).
+   */
+  void CollectMoves (std::map<std::string, Json::Value>& perGameMoves,
+                     std::map<std::string, Json::Value>& perGameAdmin);
+
+  /**
+   * Builds the JSON payload for one game from its moves and commands.
+   */
+  std::string BuildJson (const Json::Value& gameMoves,
+                         const Json::Value& gameAdmin) const;
+
+  /**
+   * Looks up the payload for the given encoding and game, if it has
+   * been built already.
+   */
+  bool GetPayload (const std::string& key, std::string& payload) const;
+
+  /**
+   * Stores the payload for a given encoding and game.
+   */
+  void SetPayload (const std::string& key, const std::string& payload);
+
+};
+
+ZmqPub::BlockNotification::BlockNotification (const BlockData& blk)
+  : moves(blk.moves)
+{
+  header.hash = blk.hash;
+  header.parent = blk.parent;
+  header.height = blk.height;
+  header.rngseed = blk.rngseed;
+  header.metadata = blk.metadata;
+
   Json::Value blkJson = InitFromMetadata (blk);
   blkJson["hash"] = blk.hash;
   blkJson["parent"] = blk.parent;
   blkJson["height"] = static_cast<Json::Int64> (blk.height);
   blkJson["rngseed"] = blk.rngseed;
-  Json::Value blkTemplate(Json::objectValue);
+  blkTemplate = Json::Value (Json::objectValue);
   blkTemplate["block"] = blkJson;
-  if (!reqtoken.empty ())
-    blkTemplate["reqtoken"] = reqtoken;
+}
 
-  /* Start with an empty array of moves and commands for every game
-     that we track.  */
-  std::map<std::string, Json::Value> perGameMoves;
-  std::map<std::string, Json::Value> perGameAdmin;
-  for (const auto& entry : games)
-    {
-      CHECK_GT (entry.second, 0);
-      perGameMoves.emplace (entry.first, Json::Value (Json::arrayValue));
-      perGameAdmin.emplace (entry.first, Json::Value (Json::arrayValue));
-    }
+BlockData
+ZmqPub::BlockNotification::GetBlock () const
+{
+  BlockData res = header;
+  res.moves = moves.GetRaw ();
+  return res;
+}
 
-  /* Process all moves in the block and add relevant data to the per-game
-     arrays.  */
-  for (const auto& mv : blk.moves)
-    {
-      const PerTxData data(mv);
+bool
+ZmqPub::BlockNotification::Matches (const BlockData& blk) const
+{
+  return header.hash == blk.hash && header.parent == blk.parent
+          && header.height == blk.height && header.rngseed == blk.rngseed
+          && header.metadata == blk.metadata
+          && moves.GetRaw () == blk.moves;
+}
 
-      for (const auto& entry : data.GetMovesPerGame ())
+void
+ZmqPub::BlockNotification::CollectMoves (
+    std::map<std::string, Json::Value>& perGameMoves,
+    std::map<std::string, Json::Value>& perGameAdmin)
+{
+  for (const auto& data : moves.Get ())
+    {
+      for (const auto& entry : data->GetMovesPerGame ())
         {
           const auto mit = perGameMoves.find (entry.first);
           if (mit == perGameMoves.end ())
             continue;
 
-          CHECK_EQ (games.count (entry.first), 1);
           CHECK (mit->second.isArray ());
           mit->second.append (entry.second);
         }
 
       std::string adminGame;
       Json::Value adminCmd;
-      if (data.GetAdminCommand (adminGame, adminCmd))
+      if (data->GetAdminCommand (adminGame, adminCmd))
         {
           const auto mit = perGameAdmin.find (adminGame);
           if (mit == perGameAdmin.end ())
             continue;
 
-          CHECK_EQ (games.count (adminGame), 1);
           CHECK (mit->second.isArray ());
           mit->second.append (adminCmd);
         }
     }
+}
 
-  /* Send out notifications for all tracked games.  */
-  for (const auto& entry : games)
-    {
-      CHECK_GT (entry.second, 0);
-
-      const auto mitMv = perGameMoves.find (entry.first);
-      CHECK (mitMv != perGameMoves.end ());
-      CHECK (mitMv->second.isArray ());
+std::string
+ZmqPub::BlockNotification::BuildJson (const Json::Value& gameMoves,
+                                      const Json::Value& gameAdmin) const
+{
+  Json::Value thisGame = blkTemplate;
+  thisGame["moves"] = gameMoves;
+  thisGame["admin"] = gameAdmin;
+  return StoreJson (thisGame);
+}
 
-      const auto mitCmd = perGameAdmin.find (entry.first);
-      CHECK (mitCmd != perGameAdmin.end ());
-      CHECK (mitCmd->second.isArray ());
+bool
+ZmqPub::BlockNotification::GetPayload (const std::string& key,
+                                       std::string& payload) const
+{
+  std::lock_guard<std::mutex> lock(mut);
 
-      Json::Value thisGame = blkTemplate;
-      thisGame["moves"] = mitMv->second;
-      thisGame["admin"] = mitCmd->second;
+  const auto mit = payloads.find (key);
+  if (mit == payloads.end ())
+    return false;
 
-      SendMessage (cmdPrefix + " json " + entry.first, thisGame);
-    }
+  payload = mit->second;
+  return true;
 }
 
 void
-ZmqPub::SendBlockAttach (const BlockData& blk, const std::string& reqtoken)
+ZmqPub::BlockNotification::SetPayload (const std::string& key,
+                                       const std::string& payload)
 {
-  VLOG (1) << "Block attach: " << blk.hash;
-  SendBlock (PREFIX_ATTACH, blk, reqtoken);
+  std::lock_guard<std::mutex> lock(mut);
+  payloads[key] = payload;
 }
 
-void
-ZmqPub::SendBlockDetach (const BlockData& blk, const std::string& reqtoken)
-{
-  VLOG (1) << "Block detach: " << blk.hash;
-  SendBlock (PREFIX_DETACH, blk, reqtoken);
-}
+/* ************************************************************************** */
 
-void
-ZmqPub::SendPendingMoves (const std::vector<MoveData>& moves)
+/**
+ * A run of blocks sent for a game_sendupdates request (i.e. with reqtoken)
+ * on one shard.  While it is queued, further blocks for the same request
+ * may be appended to it.
+ */
+struct ZmqPub::CatchUpRun
+{
+
+  /** The command prefix (attach or detach).  */
+  std::string cmdPrefix;
+
+  /** The reqtoken of the request.  */
+  std::string reqtoken;
+
+  /** The games to send the blocks for.  */
+  std::vector<std::string> games;
+
+  /** The blocks in order.  */
+  std::vector<std::shared_ptr<BlockNotification>> blocks;
+
+};
+
+/* ************************************************************************** */
+
+/**
+ * A single publisher shard.  It owns a ZMQ socket and a worker thread,
+ * which processes a queue of jobs that build and send the notifications.
+ * The socket, sequence numbers and subscriptions are only accessed
+ * from the worker thread.
+ */
+class ZmqPub::Shard
+{
+
+private:
+
+  zmq::socket_t sock;
+
+  /** Compressor for the zstd topics.  */
+  ZstdCompressor zstd;
+
+  /**
+   * The dictionary currently used for the zstd topics (if any).  This is
+   * only accessed from the worker thread, so that switching it applies
+   * exactly to the notifications queued after the switch.
+   */
+  std::shared_ptr<const ZstdDictionary> zstdDict;
+
+  /** Pool for building payloads in parallel.  */
+  TaskPool& pool;
+
+  /** Next sequence number per command string.  */
+  std::unordered_map<std::string, uint32_t> nextSeq;
+
+  /**
+   * Currently active subscriptions on the XPUB socket, with the number
+   * of subscribers for each topic prefix.  This is updated from the
+   * (un)subscribe messages we read from the socket.
+   */
+  std::map<std::string, unsigned> subscriptions;
+
+  /**
+   * A queued job together with the time when it was queued (for measuring
+   * the latency of notifications).
+   */
+  struct Job
+  {
+    std::function<void ()> run;
+    std::chrono::steady_clock::time_point queued;
+
+    /**
+     * If this job publishes catch-up blocks, the run of blocks it sends.
+     * Further blocks may be added to it while the job is queued.
+     */
+    std::shared_ptr<CatchUpRun> catchUp;
+  };
+
+  /** Lock for the job queue.  */
+  std::mutex mut;
+
+  /** Condition variable notified when new jobs are queued.  */
+  std::condition_variable cv;
+
+  /** Condition variable notified when jobs are taken off the queue.  */
+  std::condition_variable cvSpace;
+
+  /** Queued jobs to be run on the worker thread.  */
+  std::queue<Job> jobs;
+
+  /**
+   * The first error that occurred while sending notifications on the
+   * worker thread and that has not yet been reported to a caller.
+   */
+  std::exception_ptr error;
+
+  /** Time when the currently running job was queued.  */
+  std::chrono::steady_clock::time_point currentQueued;
+
+  /**
+   * Set to true when a message has been dropped due to the high-water mark.
+   * This is reset when the queue of jobs is empty again.
+   */
+  std::atomic<bool> recentDrop{false};
+
+  /** Number of catch-up blocks merged into an already queued run.  */
+  uint64_t coalescedBlocks = 0;
+
+  /** Lock for the statistics.  */
+  mutable std::mutex mutStats;
+
+  /** Statistics per topic.  */
+  std::map<std::string, TopicStats> stats;
+
+  /** Statistics about batched pending moves.  */
+  PendingBatchStats pendingStats;
+
+  /**
+   * Pending moves per game collected in the current batch (which is only
+   * accessed from the worker thread).  Each value is the JSON array that
+   * will be sent for the game.
+   */
+  std::map<std::string, Json::Value> pendingBatch;
+
+  /** Number of moves in the current batch.  */
+  size_t pendingBatchMoves = 0;
+
+  /** Time when the current batch was started.  */
+  std::chrono::steady_clock::time_point pendingBatchStart;
+
+  /** Set to true when the worker thread should stop.  */
+  bool shouldStop = false;
+
+  /** The worker thread.  */
+  std::thread worker;
+
+  /**
+   * Runs the worker loop, processing jobs until we are stopped.
+   */
+  void RunWorker ();
+
+  /**
+   * Runs a function on the worker thread (with the lock not held),
+   * processing subscription updates before and handling any errors.
+   */
+  void RunSafely (const std::function<void ()>& fn);
+
+  /**
+   * Sends a multipart message consisting of command, serialised JSON data
+   * and the right sequence number.
+   */
+  void SendMessage (const std::string& cmd, const std::string& payload);
+
+  /**
+   * Advances the sequence number for a command without actually sending
+   * anything.  This is used for messages that are skipped because nobody
+   * is subscribed to them, so that the numbering is the same as if they
+   * had been sent (and dropped by ZMQ).
+   */
+  void SkipMessage (const std::string& cmd);
+
+  /**
+   * Returns true if the shard is currently under pressure, i.e. too many
+   * jobs are queued or messages have been dropped recently.  Must be
+   * called with mut held.
+   */
+  bool IsUnderPressure () const;
+
+  /**
+   * Adds a job to the queue, waiting until there is room for it.
+   * Must be called with the lock on mut.
+   */
+  void PushJob (std::unique_lock<std::mutex>& lock, Job&& job);
+
+  /**
+   * Reads all (un)subscribe messages currently queued on the XPUB socket
+   * and updates the subscriptions map accordingly.
+   */
+  void ProcessSubscriptions ();
+
+  /**
+   * Returns true if there is at least one subscriber for the given
+   * topic (i.e. a subscription to a prefix of it).  If minLength is
+   * given, then only subscriptions to prefixes of at least that length
+   * count.  This is used for opt-in topics, which should not be produced
+   * just because someone subscribed to everything.
+   */
+  bool HasSubscriber (const std::string& cmd, size_t minLength = 0) const;
+
+  /**
+   * Returns the JSON and binary payloads (without reqtoken) of a block for
+   * the given games.  Payloads are taken from the block's cache if they
+   * have been built before, and are built (and stored in the cache)
+   * otherwise.
+   */
+  void GetPayloads (BlockNotification& blk,
+                    const std::set<std::string>& jsonGames,
+                    const std::set<std::string>& binGames,
+                    std::map<std::string, std::string>& jsonPayloads,
+                    std::map<std::string, std::string>& binPayloads);
+
+public:
+
+  /** Number of zstd messages sent (for statistics).  */
+  std::atomic<uint64_t> zstdMessages{0};
+  /** Size of zstd payloads sent before compression (for statistics).  */
+  std::atomic<uint64_t> zstdRawBytes{0};
+  /** Size of zstd payloads sent after compression (for statistics).  */
+  std::atomic<uint64_t> zstdCompressedBytes{0};
+
+  explicit Shard (zmq::context_t& ctx, const std::string& addr,
+                  std::shared_ptr<const ZstdDictionary> dict, TaskPool& p);
+  ~Shard ();
+
+  Shard () = delete;
+  Shard (const Shard&) = delete;
+  void operator= (const Shard&) = delete;
+
+  /**
+   * Queues a job to be run on the worker thread.  If the queue is full,
+   * this blocks until the worker has made room.
+   */
+  void Enqueue (std::function<void ()> job);
+
+  /**
+   * Queues a switch to a new zstd dictionary, which applies to all
+   * notifications queued after this call.
+   */
+  void SetZstdDictionary (std::shared_ptr<const ZstdDictionary> dict);
+
+  /**
+   * Queues a job that publishes the given run of catch-up blocks.  If the
+   * coalescing mode is enabled and the shard is under pressure, the blocks
+   * are instead appended to the last queued job if that is a run for the
+   * same request and games.
+   */
+  void EnqueueCatchUp (std::shared_ptr<CatchUpRun> run);
+
+  /**
+   * Returns (and clears) the error that occurred on the worker thread
+   * since the last call, or null if there was none.
+   */
+  std::exception_ptr TakeError ();
+
+  /**
+   * Returns the number of currently queued jobs.
+   */
+  size_t GetQueueSize ();
+
+  /**
+   * Returns the number of catch-up blocks that were merged into an
+   * already queued run.
+   */
+  uint64_t GetCoalescedBlocks ();
+
+  /**
+   * Adds the statistics of this shard to the given map.
+   */
+  void AddStats (std::map<std::string, TopicStats>& res) const;
+
+  /**
+   * Sends block notifications for the given games, which must all
+   * belong to this shard.
+   */
+  void PublishBlock (const std::string& cmdPrefix, BlockNotification& blk,
+                     const std::string& reqtoken,
+                     const std::vector<std::string>& games);
+
+  /**
+   * Sends the batched block-attach notifications for a sequence of
+   * blocks and the given games.
+   */
+  void PublishBlockBatch (
+      const std::vector<std::shared_ptr<BlockNotification>>& blocks,
+      const std::string& reqtoken, const std::vector<std::string>& games);
+
+  /**
+   * Advances the sequence numbers of all block topics (attach and detach
+   * in all encodings, as well as the batched attaches) for the given games
+   * without sending anything.
+   */
+  void SkipBlocks (const std::vector<std::string>& games);
+
+  /**
+   * Builds pending-move notifications for the given games.  They are
+   * added to the current batch, which is sent right away if batching
+   * is disabled or the batch is full.
+   */
+  void PublishPendingMoves (ParsedMoves& moves,
+                            const std::vector<std::string>& games);
+
+  /**
+   * Sends out the current batch of pending moves (if any).  This is done
+   * when the batching window is over, and also before any block
+   * notifications to keep the order between them and pending moves.
+   */
+  void FlushPendingMoves ();
+
+  /**
+   * Returns the statistics about batched pending moves.
+   */
+  PendingBatchStats GetPendingStats () const;
+
+};
+
+ZmqPub::Shard::Shard (zmq::context_t& ctx, const std::string& addr,
+                      std::shared_ptr<const ZstdDictionary> dict,
+                      TaskPool& p)
+  : sock(ctx, zmq::socket_type::xpub),
+    zstdDict(std::move (dict)),
+    pool(p)
+{
+  LOG (INFO) << "Binding ZMQ publisher to " << addr;
+  sock.set (zmq::sockopt::sndhwm, SEND_HWM);
+  sock.set (zmq::sockopt::tcp_keepalive, 1);
+  /* We want to see every subscribe and unsubscribe (including those
+     triggered by disconnecting peers), not just the first / last one for
+     each topic, so that we can count the subscribers ourselves.  */
+  sock.set (zmq::sockopt::xpub_verboser, 1);
+  if (FLAGS_xayax_zmq_nodrop)
+    sock.set (zmq::sockopt::xpub_nodrop, 1);
+  sock.bind (addr);
+
+  worker = std::thread ([this] ()
+    {
+      RunWorker ();
+    });
+}
+
+ZmqPub::Shard::~Shard ()
+{
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    shouldStop = true;
+    cv.notify_all ();
+    cvSpace.notify_all ();
+  }
+  worker.join ();
+
+  /* Make sure we close the socket right away.  */
+  sock.set (zmq::sockopt::linger, 0);
+  sock.close ();
+}
+
+void
+ZmqPub::Shard::PushJob (std::unique_lock<std::mutex>& lock, Job&& job)
+{
+  const size_t maxJobs = std::max (FLAGS_xayax_zmq_queue_size, 1);
+
+  if (jobs.size () >= maxJobs)
+    {
+      VLOG (1) << "ZMQ publisher queue is full, waiting";
+      cvSpace.wait (lock, [this, maxJobs] ()
+        {
+          return jobs.size () < maxJobs || shouldStop;
+        });
+    }
+
+  job.queued = std::chrono::steady_clock::now ();
+  jobs.push (std::move (job));
+  cv.notify_all ();
+}
+
+void
+ZmqPub::Shard::Enqueue (std::function<void ()> job)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  Job j;
+  j.run = std::move (job);
+  PushJob (lock, std::move (j));
+}
+
+void
+ZmqPub::Shard::SetZstdDictionary (std::shared_ptr<const ZstdDictionary> dict)
+{
+  Enqueue ([this, dict] ()
+    {
+      zstdDict = dict;
+    });
+}
+
+void
+ZmqPub::Shard::EnqueueCatchUp (std::shared_ptr<CatchUpRun> run)
+{
+  CHECK (!run->reqtoken.empty ());
+
+  std::unique_lock<std::mutex> lock(mut);
+
+  /* Only the last queued job can be extended, as otherwise the order
+     of notifications would change.  The worker takes jobs off the queue
+     with the lock held, so a queued run is never being sent while
+     we add to it.  */
+  if (FLAGS_xayax_zmq_coalesce_catchup && !jobs.empty ()
+        && IsUnderPressure ())
+    {
+      auto& last = jobs.back ().catchUp;
+      if (last != nullptr && last->cmdPrefix == run->cmdPrefix
+            && last->reqtoken == run->reqtoken && last->games == run->games)
+        {
+          VLOG (1)
+              << "Publisher under pressure, merging " << run->blocks.size ()
+              << " catch-up blocks into the queued run";
+          for (auto& b : run->blocks)
+            last->blocks.push_back (std::move (b));
+          coalescedBlocks += run->blocks.size ();
+          return;
+        }
+    }
+
+  Job j;
+  j.catchUp = run;
+  j.run = [this, run] ()
+    {
+      FlushPendingMoves ();
+      for (const auto& n : run->blocks)
+        PublishBlock (run->cmdPrefix, *n, run->reqtoken, run->games);
+      if (run->cmdPrefix == PREFIX_ATTACH)
+        PublishBlockBatch (run->blocks, run->reqtoken, run->games);
+    };
+  PushJob (lock, std::move (j));
+}
+
+std::exception_ptr
+ZmqPub::Shard::TakeError ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  std::exception_ptr res;
+  std::swap (res, error);
+  return res;
+}
+
+size_t
+ZmqPub::Shard::GetQueueSize ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return jobs.size ();
+}
+
+uint64_t
+ZmqPub::Shard::GetCoalescedBlocks ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return coalescedBlocks;
+}
+
+bool
+ZmqPub::Shard::IsUnderPressure () const
+{
+  if (recentDrop)
+    return true;
+
+  return jobs.size () > static_cast<size_t> (FLAGS_xayax_zmq_pressure_queue);
+}
+
+void
+ZmqPub::Shard::AddStats (std::map<std::string, TopicStats>& res) const
+{
+  std::lock_guard<std::mutex> lock(mutStats);
+  for (const auto& entry : stats)
+    {
+      auto& cur = res[entry.first];
+      cur.sent += entry.second.sent;
+      cur.bytes += entry.second.bytes;
+      cur.dropped += entry.second.dropped;
+      cur.totalLatency += entry.second.totalLatency;
+      cur.maxLatency = std::max (cur.maxLatency, entry.second.maxLatency);
+    }
+}
+
+void
+ZmqPub::Shard::RunWorker ()
+{
+  std::unique_lock<std::mutex> lock(mut);
+  while (true)
+    {
+      /* The pending batch is only accessed from this thread, so it is fine
+         to check it here.  If there is one, we wait for new jobs only until
+         its window is over.  */
+      const auto deadline
+          = pendingBatchStart
+              + std::chrono::milliseconds (FLAGS_xayax_zmq_pending_window_ms);
+      bool batchDue = false;
+      while (jobs.empty () && !shouldStop && !batchDue)
+        {
+          if (pendingBatch.empty ())
+            cv.wait (lock);
+          else
+            batchDue = (cv.wait_until (lock, deadline)
+                          == std::cv_status::timeout);
+        }
+
+      /* Even if we should stop, we first finish all queued jobs and the
+         pending batch so that no notifications are lost.  */
+      if (jobs.empty ())
+        {
+          lock.unlock ();
+          RunSafely ([this] ()
+            {
+              FlushPendingMoves ();
+            });
+          lock.lock ();
+
+          if (shouldStop && jobs.empty ())
+            return;
+          continue;
+        }
+
+      auto job = std::move (jobs.front ());
+      jobs.pop ();
+      currentQueued = job.queued;
+      cvSpace.notify_all ();
+
+      lock.unlock ();
+      RunSafely (job.run);
+      lock.lock ();
+
+      if (jobs.empty ())
+        recentDrop = false;
+    }
+}
+
+void
+ZmqPub::Shard::RunSafely (const std::function<void ()>& fn)
+{
+  try
+    {
+      ProcessSubscriptions ();
+      fn ();
+    }
+  catch (const std::exception& exc)
+    {
+      /* GSPs are able to recover from missing ZMQ notifications, so we
+         just continue with the next job.  But the error is kept, so that
+         it is reported to the next caller sending notifications.  This
+         applies not only to ZMQ errors but also to everything else that
+         can go wrong while building the payloads (which would otherwise
+         escape the worker thread and terminate the process).  */
+      LOG (WARNING) << "Error while sending ZMQ notification: " << exc.what ();
+      std::lock_guard<std::mutex> lock(mut);
+      if (error == nullptr)
+        error = std::current_exception ();
+    }
+}
+
+void
+ZmqPub::Shard::ProcessSubscriptions ()
+{
+  while (true)
+    {
+      zmq::message_t msg;
+      if (!sock.recv (msg, zmq::recv_flags::dontwait))
+        return;
+
+      /* Subscription messages consist of a single byte (one for subscribe,
+         zero for unsubscribe) followed by the topic prefix.  */
+      const std::string data = msg.to_string ();
+      if (data.empty () || (data[0] != 0 && data[0] != 1))
+        {
+          LOG (WARNING) << "Ignoring unexpected message on the XPUB socket";
+          continue;
+        }
+      const std::string topic = data.substr (1);
+
+      if (data[0] == 1)
+        {
+          const unsigned cnt = ++subscriptions[topic];
+          VLOG (1) << "New subscription to '" << topic << "', now: " << cnt;
+          continue;
+        }
+
+      auto mit = subscriptions.find (topic);
+      if (mit == subscriptions.end ())
+        {
+          LOG (WARNING) << "Unsubscribe from unknown topic '" << topic << "'";
+          continue;
+        }
+      CHECK_GT (mit->second, 0);
+      --mit->second;
+      VLOG (1)
+          << "Removed subscription to '" << topic << "', now: " << mit->second;
+      if (mit->second == 0)
+        subscriptions.erase (mit);
+    }
+}
+
+bool
+ZmqPub::Shard::HasSubscriber (const std::string& cmd,
+                              const size_t minLength) const
+{
+  for (const auto& entry : subscriptions)
+    if (entry.first.size () >= minLength
+          && cmd.compare (0, entry.first.size (), entry.first) == 0)
+      return true;
+
+  return false;
+}
+
+void
+ZmqPub::Shard::SkipMessage (const std::string& cmd)
+{
+  VLOG (1) << "Skipping ZMQ message: " << cmd;
+  ++nextSeq[cmd];
+}
+
+void
+ZmqPub::Shard::SendMessage (const std::string& cmd, const std::string& payload)
+{
+  auto mitSeq = nextSeq.find (cmd);
+  if (mitSeq == nextSeq.end ())
+    mitSeq = nextSeq.emplace (cmd, 0).first;
+
+  uint32_t seq = mitSeq->second;
+  uint8_t seqBytes[sizeof (seq)];
+  for (unsigned i = 0; i < sizeof (seq); ++i)
+    {
+      seqBytes[i] = seq & 0xFF;
+      seq >>= 8;
+    }
+  CHECK_EQ (seq, 0);
+
+  /* With the nodrop option, sending fails with EAGAIN if the high-water mark
+     is reached.  In that case, the message is not delivered to anyone, and
+     we handle it the same as if ZMQ had dropped it (including advancing the
+     sequence number so that subscribers can detect it).  */
+  if (!sock.send (zmq::message_t (cmd),
+                  zmq::send_flags::sndmore | zmq::send_flags::dontwait))
+    {
+      LOG_EVERY_N (WARNING, 100)
+          << "ZMQ send queue is full, dropping message: " << cmd;
+      ++mitSeq->second;
+      recentDrop = true;
+
+      ZmqMetrics::Get ().dropped.Increment ();
+      std::lock_guard<std::mutex> lock(mutStats);
+      ++stats[cmd].dropped;
+      return;
+    }
+
+  VLOG (1) << "Sent ZMQ message: " << cmd;
+  VLOG (2) << "Payload data:\n" << payload;
+
+  /* Once the first send succeeded, ZMQ guarantees atomic delivery of
+     the further parts.  */
+  CHECK (sock.send (zmq::message_t (payload), zmq::send_flags::sndmore));
+  CHECK (sock.send (zmq::message_t (seqBytes, sizeof (seq)),
+                    zmq::send_flags::none));
+
+  /* Increase the sequence number at the end.  If the sending fails and
+     throws, we want to keep the previous one.  */
+  ++mitSeq->second;
+
+  auto& metrics = ZmqMetrics::Get ();
+  metrics.sent.Increment ();
+  metrics.bytes.Increment (payload.size ());
+
+  const auto latency = std::chrono::duration_cast<std::chrono::microseconds> (
+      std::chrono::steady_clock::now () - currentQueued);
+  std::lock_guard<std::mutex> lock(mutStats);
+  auto& topicStats = stats[cmd];
+  ++topicStats.sent;
+  topicStats.bytes += payload.size ();
+  topicStats.totalLatency += latency;
+  topicStats.maxLatency = std::max (topicStats.maxLatency, latency);
+}
+
+void
+ZmqPub::Shard::GetPayloads (BlockNotification& blk,
+                            const std::set<std::string>& jsonGames,
+                            const std::set<std::string>& binGames,
+                            std::map<std::string, std::string>& jsonPayloads,
+                            std::map<std::string, std::string>& binPayloads)
+{
+  jsonPayloads.clear ();
+  binPayloads.clear ();
+
+  /* Look up the payloads that have been built already.  For all others,
+     we start with an empty array of moves and commands for the game.  */
+  std::set<std::string> buildJson;
+  std::set<std::string> buildBin;
+  std::map<std::string, Json::Value> perGameMoves;
+  std::map<std::string, Json::Value> perGameAdmin;
+  for (const auto& g : jsonGames)
+    {
+      std::string payload;
+      if (blk.GetPayload ("json " + g, payload))
+        jsonPayloads.emplace (g, std::move (payload));
+      else
+        buildJson.insert (g);
+    }
+  for (const auto& g : binGames)
+    {
+      std::string payload;
+      if (blk.GetPayload ("bin " + g, payload))
+        binPayloads.emplace (g, std::move (payload));
+      else
+        buildBin.insert (g);
+    }
+  for (const auto* build : {&buildJson, &buildBin})
+    for (const auto& g : *build)
+      {
+        perGameMoves.emplace (g, Json::Value (Json::arrayValue));
+        perGameAdmin.emplace (g, Json::Value (Json::arrayValue));
+      }
+
+  /* We only time blocks for which some payloads are actually built,
+     not those that are fully answered from the already built ones.  */
+  std::unique_ptr<ScopedTimer> buildTimer;
+  if (!perGameMoves.empty ())
+    buildTimer = std::make_unique<ScopedTimer> (ZmqMetrics::Get ().buildTime);
+
+  /* Process all moves in the block and add relevant data to the per-game
+     arrays of payloads we need to build.  If there are none (e.g. because
+     nobody is interested in this block at all), we do not even need
+     to look at the moves.  */
+  if (!perGameMoves.empty ())
+    blk.CollectMoves (perGameMoves, perGameAdmin);
+
+  /* Build the payloads for each game in parallel.  Every task only reads
+     the shared data and writes its own result slot, and the results
+     are collected afterwards.  The sending is then done in a deterministic
+     order again by the caller.  */
+  std::vector<std::string> buildGames;
+  for (const auto& entry : perGameMoves)
+    buildGames.push_back (entry.first);
+  std::vector<std::string> builtJson(buildGames.size ());
+  std::vector<std::string> builtBin(buildGames.size ());
+  pool.Run (buildGames.size (), [&] (const size_t i)
+    {
+      const std::string& g = buildGames[i];
+      const Json::Value& gameMoves = perGameMoves.at (g);
+      const Json::Value& gameAdmin = perGameAdmin.at (g);
+      CHECK (gameMoves.isArray ());
+      CHECK (gameAdmin.isArray ());
+
+      if (buildJson.count (g) > 0)
+        builtJson[i] = blk.BuildJson (gameMoves, gameAdmin);
+
+      if (buildBin.count (g) > 0)
+        builtBin[i] = EncodeGameBlock (blk.GetHeader (), gameMoves,
+                                       gameAdmin, g);
+    });
+
+  for (size_t i = 0; i < buildGames.size (); ++i)
+    {
+      const std::string& g = buildGames[i];
+      if (buildJson.count (g) > 0)
+        {
+          blk.SetPayload ("json " + g, builtJson[i]);
+          jsonPayloads.emplace (g, std::move (builtJson[i]));
+        }
+      if (buildBin.count (g) > 0)
+        {
+          blk.SetPayload ("bin " + g, builtBin[i]);
+          binPayloads.emplace (g, std::move (builtBin[i]));
+        }
+    }
+}
+
+void
+ZmqPub::Shard::PublishBlock (const std::string& cmdPrefix,
+                             BlockNotification& blk,
+                             const std::string& reqtoken,
+                             const std::vector<std::string>& games)
+{
+  /* The binary and compressed topics are opt-in, so they need a subscription
+     that explicitly includes the encoding.  */
+  const std::string binPrefix = cmdPrefix + " bin";
+  const std::string zstdPrefix = cmdPrefix + " zstd";
+
+  /* Find the topics for every game that we track and for which someone
+     is listening.  Topics without subscribers just have their sequence
+     number advanced.  */
+  std::set<std::string> sendJson;
+  std::set<std::string> sendZstd;
+  std::set<std::string> sendBin;
+  std::set<std::string> needJson;
+  for (const auto& g : games)
+    {
+      const std::string jsonCmd = cmdPrefix + " json " + g;
+      if (HasSubscriber (jsonCmd))
+        sendJson.insert (g);
+      else
+        SkipMessage (jsonCmd);
+
+      const std::string zstdCmd = zstdPrefix + " " + g;
+      if (HasSubscriber (zstdCmd, zstdPrefix.size ()))
+        sendZstd.insert (g);
+      else
+        SkipMessage (zstdCmd);
+
+      /* The compressed topic is based on the JSON payload as well.  */
+      if (sendJson.count (g) > 0 || sendZstd.count (g) > 0)
+        needJson.insert (g);
+
+      const std::string binCmd = binPrefix + " " + g;
+      if (HasSubscriber (binCmd, binPrefix.size ()))
+        sendBin.insert (g);
+      else
+        SkipMessage (binCmd);
+    }
+
+  std::map<std::string, std::string> jsonPayloads;
+  std::map<std::string, std::string> binPayloads;
+  GetPayloads (blk, needJson, sendBin, jsonPayloads, binPayloads);
+
+  /* Send out notifications for all topics with subscribers.  */
+  for (const auto& g : sendJson)
+    SendMessage (cmdPrefix + " json " + g,
+                 WithReqtoken (jsonPayloads.at (g), reqtoken));
+  /* The cached compressed payloads depend on the dictionary as well.  */
+  const ZSTD_CDict* cdict = nullptr;
+  std::string zstdKey = "zstd ";
+  if (zstdDict != nullptr)
+    {
+      cdict = zstdDict->Get ();
+      zstdKey += std::to_string (zstdDict->GetId ()) + " ";
+    }
+  for (const auto& g : sendZstd)
+    {
+      /* Only the payloads without reqtoken are cached, as those are the
+         ones sent during normal operation.  */
+      const std::string raw = WithReqtoken (jsonPayloads.at (g), reqtoken);
+      std::string compressed;
+      if (!reqtoken.empty () || !blk.GetPayload (zstdKey + g, compressed))
+        {
+          compressed = zstd.Compress (raw, cdict);
+          if (reqtoken.empty ())
+            blk.SetPayload (zstdKey + g, compressed);
+        }
+
+      SendMessage (zstdPrefix + " " + g, compressed);
+      ++zstdMessages;
+      zstdRawBytes += raw.size ();
+      zstdCompressedBytes += compressed.size ();
+    }
+  for (const auto& entry : binPayloads)
+    SendMessage (binPrefix + " " + entry.first,
+                 WithBinaryReqtoken (entry.second, reqtoken));
+}
+
+void
+ZmqPub::Shard::PublishBlockBatch (
+    const std::vector<std::shared_ptr<BlockNotification>>& blocks,
+    const std::string& reqtoken, const std::vector<std::string>& games)
+{
+  /* The batched topic is opt-in as well, and only exists for JSON.  */
+  const std::string batchPrefix = std::string (PREFIX_ATTACH_BATCH) + " json";
+  const size_t minLength = std::string (PREFIX_ATTACH_BATCH).size ();
+
+  std::set<std::string> batchGames;
+  for (const auto& g : games)
+    {
+      const std::string cmd = batchPrefix + " " + g;
+      if (HasSubscriber (cmd, minLength))
+        batchGames.insert (g);
+      else
+        SkipMessage (cmd);
+    }
+  if (batchGames.empty ())
+    return;
+
+  std::map<std::string, std::vector<std::string>> perGame;
+  for (const auto& blk : blocks)
+    {
+      std::map<std::string, std::string> jsonPayloads;
+      std::map<std::string, std::string> binPayloads;
+      GetPayloads (*blk, batchGames, {}, jsonPayloads, binPayloads);
+      for (auto& entry : jsonPayloads)
+        perGame[entry.first].push_back (std::move (entry.second));
+    }
+
+  /* Pack the block payloads into messages of the form
+     {"blocks": [...], "reqtoken": ...}, where each element is exactly the
+     payload of the per-block topic.  Each message is bounded in size and
+     number of blocks, except that a single large block is always sent.  */
+  const size_t maxBlocks = std::max (FLAGS_xayax_zmq_batch_max_blocks, 1);
+  const size_t maxBytes = std::max (FLAGS_xayax_zmq_batch_max_bytes, 0);
+  for (const auto& entry : perGame)
+    {
+      const std::string cmd = batchPrefix + " " + entry.first;
+
+      std::string cur;
+      size_t num = 0;
+      const auto flush = [&] ()
+        {
+          if (num == 0)
+            return;
+          SendMessage (cmd, WithReqtoken ("{\"blocks\":[" + cur + "]}",
+                                          reqtoken));
+          cur.clear ();
+          num = 0;
+        };
+
+      for (const auto& payload : entry.second)
+        {
+          if (num >= maxBlocks || cur.size () + payload.size () + 1 > maxBytes)
+            flush ();
+          if (num > 0)
+            cur += ',';
+          cur += payload;
+          ++num;
+        }
+      flush ();
+    }
+}
+
+void
+ZmqPub::Shard::SkipBlocks (const std::vector<std::string>& games)
+{
+  for (const auto& g : games)
+    {
+      for (const std::string prefix : {PREFIX_ATTACH, PREFIX_DETACH})
+        for (const std::string enc : {"json", "bin", "zstd"})
+          SkipMessage (prefix + " " + enc + " " + g);
+      SkipMessage (PREFIX_ATTACH_BATCH + (" json " + g));
+    }
+}
+
+void
+ZmqPub::Shard::PublishPendingMoves (ParsedMoves& moves,
+                                    const std::vector<std::string>& games)
+{
+  /* We only collect moves for games that we track and that have
+     subscribers.  Unlike blocks, pending notifications are only sent for
+     games that actually have moves in the transaction, so we cannot sensibly
+     advance sequence numbers for the skipped ones.  But that is fine, as
+     nobody is listening to them anyway.  */
+  std::set<std::string> subscribed;
+  for (const auto& g : games)
+    if (HasSubscriber (PREFIX_MOVE + (" json " + g)))
+      subscribed.insert (g);
+  if (subscribed.empty ())
+    return;
+
+  /* Process all the transactions, adding to the list of moves per game
+     in the current batch.  */
+  for (const auto& data : moves.Get ())
+    for (const auto& entry : data->GetMovesPerGame ())
+      {
+        if (subscribed.count (entry.first) == 0)
+          continue;
+
+        if (pendingBatch.empty ())
+          pendingBatchStart = std::chrono::steady_clock::now ();
+
+        auto& batch = pendingBatch[entry.first];
+        if (batch.isNull ())
+          batch = Json::Value (Json::arrayValue);
+        batch.append (entry.second);
+        ++pendingBatchMoves;
+      }
+
+  if (FLAGS_xayax_zmq_pending_window_ms <= 0
+        || pendingBatchMoves
+              >= static_cast<size_t> (FLAGS_xayax_zmq_pending_max_moves))
+    FlushPendingMoves ();
+}
+
+void
+ZmqPub::Shard::FlushPendingMoves ()
+{
+  if (pendingBatch.empty ())
+    return;
+
+  /* The latency for the notifications includes the batching window.  */
+  currentQueued = pendingBatchStart;
+
+  for (const auto& entry : pendingBatch)
+    {
+      CHECK (entry.second.isArray ());
+      CHECK_GT (entry.second.size (), 0);
+      SendMessage (PREFIX_MOVE + (" json " + entry.first),
+                   StoreJson (entry.second));
+
+      std::lock_guard<std::mutex> lock(mutStats);
+      ++pendingStats.messages;
+      pendingStats.moves += entry.second.size ();
+      pendingStats.maxMoves = std::max<uint64_t> (pendingStats.maxMoves,
+                                                  entry.second.size ());
+    }
+
+  pendingBatch.clear ();
+  pendingBatchMoves = 0;
+}
+
+ZmqPub::PendingBatchStats
+ZmqPub::Shard::GetPendingStats () const
+{
+  std::lock_guard<std::mutex> lock(mutStats);
+  return pendingStats;
+}
+
+/* ************************************************************************** */
+
+ZmqPub::ZmqPub (const std::string& addr)
+  : ZmqPub(std::vector<std::string> {addr})
+{}
+
+ZmqPub::ZmqPub (const std::vector<std::string>& addrs)
+{
+  CHECK (!addrs.empty ()) << "No ZMQ endpoints given";
+
+  const std::string& dictFile = FLAGS_xayax_zmq_zstd_dictionary;
+  if (!dictFile.empty ())
+    {
+      std::ifstream in(dictFile, std::ios::binary);
+      if (!in && FLAGS_xayax_zmq_zstd_train_blocks > 0)
+        LOG (INFO)
+            << "zstd dictionary " << dictFile
+            << " does not exist yet, it will be trained";
+      else
+        {
+          CHECK (in) << "Failed to open zstd dictionary " << dictFile;
+          std::ostringstream data;
+          data << in.rdbuf ();
+          zstdDict = std::make_shared<ZstdDictionary> (data.str ());
+          LOG (INFO)
+              << "Using zstd dictionary " << dictFile
+              << " (ID " << zstdDict->GetId () << ", "
+              << zstdDict->GetData ().size () << " bytes)";
+        }
+    }
+
+  CHECK_GE (FLAGS_xayax_zmq_build_threads, 0);
+  pool = std::make_unique<TaskPool> (FLAGS_xayax_zmq_build_threads);
+
+  for (const auto& a : addrs)
+    shards.push_back (std::make_unique<Shard> (ctx, a, zstdDict, *pool));
+
+  LOG_IF (INFO, shards.size () > 1)
+      << "Sharding ZMQ notifications across " << shards.size ()
+      << " publishers";
+}
+
+ZmqPub::~ZmqPub ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  /* This finishes all queued jobs and closes the sockets.  */
+  shards.clear ();
+  pool.reset ();
+}
+
+void
+ZmqPub::TrackGame (const std::string& g)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  uint64_t newDepth;
+  auto mit = games.find (g);
+  if (mit == games.end ())
+    {
+      games.emplace (g, 1);
+      newDepth = 1;
+    }
+  else
+    {
+      newDepth = mit->second + 1;
+      mit->second = newDepth;
+    }
+
+  LOG (INFO) << "Tracking game '" << g << "', new depth: " << newDepth;
+}
+
+void
+ZmqPub::UntrackGame (const std::string& g)
 {
-  CHECK (!moves.empty ());
-  VLOG (1) << "Pending moves for transaction: " << moves.front ().txid;
   std::lock_guard<std::mutex> lock(mut);
 
-  /* We start with an empty array of moves for each game that we track.  */
-  std::map<std::string, Json::Value> movesPerGame;
+  uint64_t newDepth;
+  auto mit = games.find (g);
+  if (mit == games.end ())
+    newDepth = 0;
+  else
+    {
+      CHECK_GT (mit->second, 0);
+      newDepth = mit->second - 1;
+
+      if (newDepth == 0)
+        games.erase (mit);
+      else
+        mit->second = newDepth;
+    }
+
+  LOG (INFO) << "Untracking game '" << g << "', new depth: " << newDepth;
+}
+
+size_t
+ZmqPub::GetExtraShard (const std::string& g) const
+{
+  CHECK_GT (shards.size (), 1);
+  return 1 + GetShardForGame (g, shards.size () - 1);
+}
+
+std::vector<std::vector<std::string>>
+ZmqPub::GetGamesPerShard () const
+{
+  std::vector<std::vector<std::string>> res(shards.size ());
   for (const auto& entry : games)
     {
       CHECK_GT (entry.second, 0);
-      movesPerGame.emplace (entry.first, Json::Value (Json::arrayValue));
+      res[0].push_back (entry.first);
+      if (shards.size () > 1)
+        res[GetExtraShard (entry.first)].push_back (entry.first);
     }
 
-  /* Process all the MoveData instances, adding to the list of moves
-     per game.  */
-  std::string lastTxid;
-  for (const auto& mv : moves)
+  return res;
+}
+
+std::vector<std::vector<std::string>>
+ZmqPub::GetGamesPerShard (const std::string& gameId) const
+{
+  if (gameId.empty ())
+    return GetGamesPerShard ();
+
+  std::vector<std::vector<std::string>> res(shards.size ());
+  if (games.count (gameId) == 0)
+    {
+      VLOG (1) << "Not sending blocks for untracked game " << gameId;
+      return res;
+    }
+
+  res[0].push_back (gameId);
+  if (shards.size () > 1)
+    res[GetExtraShard (gameId)].push_back (gameId);
+
+  return res;
+}
+
+std::vector<std::vector<std::string>>
+ZmqPub::GetGamesPerEndpoint ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+  return GetGamesPerShard ();
+}
+
+void
+ZmqPub::RethrowShardErrors ()
+{
+  std::exception_ptr first;
+  for (const auto& s : shards)
     {
-      if (!lastTxid.empty ())
-        CHECK_EQ (lastTxid, mv.txid) << "All moves must be from the same txid";
-      lastTxid = mv.txid;
+      auto cur = s->TakeError ();
+      if (first == nullptr)
+        first = std::move (cur);
+    }
+
+  if (first != nullptr)
+    std::rethrow_exception (first);
+}
+
+std::shared_ptr<ZmqPub::BlockNotification>
+ZmqPub::GetNotification (const BlockData& blk)
+{
+  /* We verify that the block data matches, not just the hash.  With real
+     blockchain data, that is always the case; but this makes sure we never
+     send out stale data, even if the base chain misbehaves.  */
+  const auto mit = recentByHash.find (blk.hash);
+  if (mit != recentByHash.end () && mit->second->Matches (blk))
+    {
+      VLOG (1) << "Using replay buffer for block " << blk.hash;
+      ZmqMetrics::Get ().replayHits.Increment ();
+      return mit->second;
+    }
+  ZmqMetrics::Get ().replayMisses.Increment ();
+
+  auto res = std::make_shared<BlockNotification> (blk);
+  if (FLAGS_xayax_zmq_replay_blocks <= 0)
+    return res;
+
+  ++blocksSinceTraining;
+
+  recentBlocks.push_back (res);
+  recentByHash[blk.hash] = res;
+  while (recentBlocks.size ()
+            > static_cast<size_t> (FLAGS_xayax_zmq_replay_blocks))
+    {
+      /* The hash may have been replaced with a newer entry, in which
+         case we must keep that.  */
+      const auto& old = recentBlocks.front ();
+      const auto mitOld = recentByHash.find (old->GetHash ());
+      if (mitOld != recentByHash.end () && mitOld->second == old)
+        recentByHash.erase (mitOld);
+      recentBlocks.pop_front ();
+    }
+
+  return res;
+}
+
+void
+ZmqPub::SendBlocks (const std::string& cmdPrefix,
+                    const std::vector<BlockData>& blocks,
+                    const std::string& reqtoken, const std::string& gameId)
+{
+  std::unique_lock<std::mutex> lock(mut);
+  if (games.empty () || blocks.empty ())
+    return;
+
+  const auto perShard = GetGamesPerShard (gameId);
+  if (perShard[0].empty ())
+    return;
 
-      const PerTxData data(mv);
-      for (const auto& entry : data.GetMovesPerGame ())
+  std::vector<std::shared_ptr<BlockNotification>> notifications;
+  for (const auto& blk : blocks)
+    notifications.push_back (GetNotification (blk));
+  const bool batch = (cmdPrefix == PREFIX_ATTACH);
+
+  /* Queue the actual work on each shard.  This is done with our lock held,
+     so that the order of notifications is consistent even if multiple
+     threads are sending blocks.  */
+  for (size_t i = 0; i < shards.size (); ++i)
+    {
+      if (perShard[i].empty ())
+        continue;
+
+      Shard& shard = *shards[i];
+      const auto& shardGames = perShard[i];
+      if (!reqtoken.empty ())
         {
-          const auto mit = movesPerGame.find (entry.first);
-          if (mit == movesPerGame.end ())
-            continue;
+          auto run = std::make_shared<CatchUpRun> ();
+          run->cmdPrefix = cmdPrefix;
+          run->reqtoken = reqtoken;
+          run->games = shardGames;
+          run->blocks = notifications;
+          shard.EnqueueCatchUp (std::move (run));
+          continue;
+        }
 
-          CHECK_EQ (games.count (entry.first), 1);
-          mit->second.append (entry.second);
+      shard.Enqueue ([&shard, cmdPrefix, notifications, shardGames,
+                      batch] ()
+        {
+          shard.FlushPendingMoves ();
+          for (const auto& n : notifications)
+            shard.PublishBlock (cmdPrefix, *n, "", shardGames);
+          if (batch)
+            shard.PublishBlockBatch (notifications, "", shardGames);
+        });
+    }
+
+  RethrowShardErrors ();
+
+  /* The dictionary is trained without holding the lock, so that other
+     notifications can be queued meanwhile.  */
+  if (FLAGS_xayax_zmq_zstd_train_blocks > 0
+        && blocksSinceTraining
+              >= static_cast<uint64_t> (FLAGS_xayax_zmq_zstd_train_blocks))
+    {
+      blocksSinceTraining = 0;
+      lock.unlock ();
+      TrainZstdDictionary ();
+    }
+}
+
+bool
+ZmqPub::TrainZstdDictionary ()
+{
+  /* The samples are the JSON payloads of all tracked games in the replay
+     buffer, which are exactly what is compressed on the zstd topics
+     (except for the reqtoken).  */
+  std::string samples;
+  std::vector<size_t> sizes;
+  {
+    std::lock_guard<std::mutex> lock(mut);
+    for (const auto& blk : recentBlocks)
+      for (const auto& entry : games)
+        {
+          std::string payload;
+          if (blk->GetPayload ("json " + entry.first, payload))
+            {
+              samples += payload;
+              sizes.push_back (payload.size ());
+            }
+        }
+    blocksSinceTraining = 0;
+  }
+
+  CHECK_GT (FLAGS_xayax_zmq_zstd_dict_size, 0);
+  std::string data(FLAGS_xayax_zmq_zstd_dict_size, '\0');
+  const size_t len = ZDICT_trainFromBuffer (&data[0], data.size (),
+                                            samples.data (), sizes.data (),
+                                            sizes.size ());
+  if (ZDICT_isError (len))
+    {
+      LOG (WARNING)
+          << "Training zstd dictionary from " << sizes.size ()
+          << " payloads failed: " << ZDICT_getErrorName (len);
+      return false;
+    }
+  data.resize (len);
+
+  auto dict = std::make_shared<const ZstdDictionary> (data);
+  LOG (INFO)
+      << "Trained zstd dictionary " << dict->GetId ()
+      << " (" << len << " bytes) from " << sizes.size () << " payloads";
+
+  /* The file is replaced atomically, so that a restart never sees
+     a partially written dictionary.  */
+  const std::string& file = FLAGS_xayax_zmq_zstd_dictionary;
+  if (!file.empty ())
+    {
+      const std::string tmp = file + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios::binary);
+        out << data;
+      }
+      if (std::rename (tmp.c_str (), file.c_str ()) != 0)
+        LOG (WARNING) << "Failed to write zstd dictionary to " << file;
+    }
+
+  std::lock_guard<std::mutex> lock(mut);
+  zstdDict = dict;
+  for (const auto& s : shards)
+    s->SetZstdDictionary (dict);
+  RethrowShardErrors ();
+
+  return true;
+}
+
+bool
+ZmqPub::GetZstdDictionary (std::string& data, unsigned& id)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  if (zstdDict == nullptr)
+    return false;
+
+  data = zstdDict->GetData ();
+  id = zstdDict->GetId ();
+  return true;
+}
+
+ZmqPub::CompressionStats
+ZmqPub::GetCompressionStats ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  CompressionStats res;
+  for (const auto& s : shards)
+    {
+      res.messages += s->zstdMessages;
+      res.rawBytes += s->zstdRawBytes;
+      res.compressedBytes += s->zstdCompressedBytes;
+    }
+
+  return res;
+}
+
+std::map<std::string, ZmqPub::TopicStats>
+ZmqPub::GetTopicStats ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  std::map<std::string, TopicStats> res;
+  for (const auto& s : shards)
+    s->AddStats (res);
+
+  return res;
+}
+
+ZmqPub::PendingBatchStats
+ZmqPub::GetPendingBatchStats ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  PendingBatchStats res;
+  for (const auto& s : shards)
+    {
+      const auto cur = s->GetPendingStats ();
+      res.messages += cur.messages;
+      res.moves += cur.moves;
+      res.maxMoves = std::max (res.maxMoves, cur.maxMoves);
+    }
+
+  return res;
+}
+
+uint64_t
+ZmqPub::GetCoalescedBlocks ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  uint64_t res = 0;
+  for (const auto& s : shards)
+    res += s->GetCoalescedBlocks ();
+
+  return res;
+}
+
+std::vector<size_t>
+ZmqPub::GetQueueSizes ()
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  std::vector<size_t> res;
+  for (const auto& s : shards)
+    res.push_back (s->GetQueueSize ());
+
+  return res;
+}
+
+std::vector<Json::Value>
+ZmqPub::GetBlockPayloads (const std::vector<BlockData>& blocks,
+                          const std::string& gameId)
+{
+  const std::string key = "json " + gameId;
+
+  std::vector<Json::Value> res;
+  for (const auto& blk : blocks)
+    {
+      /* We use the replay buffer if possible, but do not add blocks to
+         it that are not there already.  Bulk queries would otherwise
+         just push out the recent blocks that are actually useful.  */
+      std::shared_ptr<BlockNotification> notification;
+      {
+        std::lock_guard<std::mutex> lock(mut);
+        const auto mit = recentByHash.find (blk.hash);
+        if (mit != recentByHash.end () && mit->second->Matches (blk))
+          notification = mit->second;
+      }
+      if (notification == nullptr)
+        notification = std::make_shared<BlockNotification> (blk);
+
+      std::string payload;
+      if (!notification->GetPayload (key, payload))
+        {
+          std::map<std::string, Json::Value> perGameMoves;
+          std::map<std::string, Json::Value> perGameAdmin;
+          perGameMoves.emplace (gameId, Json::Value (Json::arrayValue));
+          perGameAdmin.emplace (gameId, Json::Value (Json::arrayValue));
+          notification->CollectMoves (perGameMoves, perGameAdmin);
+
+          payload = notification->BuildJson (perGameMoves.at (gameId),
+                                             perGameAdmin.at (gameId));
+          notification->SetPayload (key, payload);
         }
+
+      res.push_back (LoadJson (payload));
+    }
+
+  return res;
+}
+
+bool
+ZmqPub::GetRecentBlock (const std::string& hash, BlockData& blk)
+{
+  std::lock_guard<std::mutex> lock(mut);
+
+  const auto mit = recentByHash.find (hash);
+  if (mit == recentByHash.end ())
+    return false;
+
+  blk = mit->second->GetBlock ();
+  return true;
+}
+
+void
+ZmqPub::SendBlockAttach (const BlockData& blk, const std::string& reqtoken,
+                         const std::string& gameId)
+{
+  VLOG (1) << "Block attach: " << blk.hash;
+  SendBlocks (PREFIX_ATTACH, {blk}, reqtoken, gameId);
+}
+
+void
+ZmqPub::SendBlockAttaches (const std::vector<BlockData>& blocks,
+                           const std::string& reqtoken,
+                           const std::string& gameId)
+{
+  VLOG (1) << "Attaching " << blocks.size () << " blocks";
+  SendBlocks (PREFIX_ATTACH, blocks, reqtoken, gameId);
+}
+
+void
+ZmqPub::SendBlockDetach (const BlockData& blk, const std::string& reqtoken,
+                         const std::string& gameId)
+{
+  VLOG (1) << "Block detach: " << blk.hash;
+  SendBlocks (PREFIX_DETACH, {blk}, reqtoken, gameId);
+}
+
+void
+ZmqPub::SkipBlockNotifications (const std::string& gameId)
+{
+  VLOG (1) << "Skipping block notifications for '" << gameId << "'";
+
+  std::lock_guard<std::mutex> lock(mut);
+  if (games.empty ())
+    return;
+
+  const auto perShard = GetGamesPerShard (gameId);
+  for (size_t i = 0; i < shards.size (); ++i)
+    {
+      if (perShard[i].empty ())
+        continue;
+
+      Shard& shard = *shards[i];
+      const auto& shardGames = perShard[i];
+      shard.Enqueue ([&shard, shardGames] ()
+        {
+          shard.SkipBlocks (shardGames);
+        });
+    }
+
+  RethrowShardErrors ();
+}
+
+void
+ZmqPub::SendPendingMoves (const std::vector<MoveData>& moves)
+{
+  CHECK (!moves.empty ());
+  VLOG (1) << "Pending moves for transaction: " << moves.front ().txid;
+  for (const auto& mv : moves)
+    CHECK_EQ (moves.front ().txid, mv.txid)
+        << "All moves must be from the same txid";
+
+  std::lock_guard<std::mutex> lock(mut);
+  if (games.empty ())
+    return;
+
+  auto parsed = std::make_shared<ParsedMoves> (moves);
+
+  const auto perShard = GetGamesPerShard ();
+  for (size_t i = 0; i < shards.size (); ++i)
+    {
+      if (perShard[i].empty ())
+        continue;
+
+      Shard& shard = *shards[i];
+      const auto& shardGames = perShard[i];
+      shard.Enqueue ([&shard, parsed, shardGames] ()
+        {
+          shard.PublishPendingMoves (*parsed, shardGames);
+        });
     }
 
-  /* Send out all the notifications.  */
-  for (const auto& entry : movesPerGame)
-    if (entry.second.size () > 0)
-      SendMessage (PREFIX_MOVE + (" json " + entry.first), entry.second);
+  RethrowShardErrors ();
 }
 
 } // namespace xayax
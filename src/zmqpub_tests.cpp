@@ -4,17 +4,38 @@
 
 #include "private/zmqpub.hpp"
 
+#include "private/jsonutils.hpp"
+
 #include "testutils.hpp"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <experimental/filesystem>
+#include <fstream>
+#include <sstream>
+
 namespace xayax
 {
+
+DECLARE_int32 (xayax_zmq_batch_max_blocks);
+DECLARE_bool (xayax_zmq_nodrop);
+DECLARE_int32 (xayax_zmq_pending_window_ms);
+DECLARE_int32 (xayax_zmq_pending_max_moves);
+DECLARE_bool (xayax_zmq_coalesce_catchup);
+DECLARE_int32 (xayax_zmq_pressure_queue);
+DECLARE_int32 (xayax_zmq_queue_size);
+DECLARE_string (xayax_zmq_zstd_dictionary);
+DECLARE_int32 (xayax_zmq_zstd_train_blocks);
+
 namespace
 {
 
+namespace fs = std::experimental::filesystem;
+
 using testing::ElementsAre;
 
 /**
@@ -184,6 +205,126 @@ TEST_F (ZmqPubTests, ReqToken)
   ));
 }
 
+TEST_F (ZmqPubTests, OnlyRequestedGame)
+{
+  BlockData blk;
+
+  pub.TrackGame ("foo");
+  pub.TrackGame ("bar");
+  pub.SendBlockAttach (blk, "token", "foo");
+  pub.SendBlockDetach (blk, "token", "bar");
+  /* This game is not tracked, so nothing is sent.  */
+  pub.SendBlockAttach (blk, "token", "baz");
+
+  EXPECT_EQ (sub.AwaitMessages (Attach ("foo"), 1)[0]["reqtoken"], "token");
+  EXPECT_EQ (sub.AwaitMessages (Detach ("bar"), 1)[0]["reqtoken"], "token");
+}
+
+TEST_F (ZmqPubTests, SkipBlockNotifications)
+{
+  BlockData blk;
+
+  pub.TrackGame ("foo");
+  pub.TrackGame ("bar");
+  pub.SendBlockAttach (blk, "");
+  sub.AwaitMessages (Attach ("foo"), 1);
+  sub.AwaitMessages (Attach ("bar"), 1);
+
+  /* Only the requested game sees a gap, on both attach and detach.  */
+  pub.SkipBlockNotifications ("foo");
+  sub.ExpectSequence (Attach ("foo"), 2);
+  sub.ExpectSequence (Detach ("foo"), 1);
+  pub.SendBlockAttach (blk, "");
+  pub.SendBlockDetach (blk, "");
+  sub.AwaitMessages (Attach ("foo"), 1);
+  sub.AwaitMessages (Attach ("bar"), 1);
+  sub.AwaitMessages (Detach ("foo"), 1);
+  sub.AwaitMessages (Detach ("bar"), 1);
+}
+
+TEST_F (ZmqPubTests, ReplayBuffer)
+{
+  BlockData blk;
+  blk.hash = "abc";
+  blk.height = 10;
+  blk.moves.push_back (Move ("p", "domob", "tx", R"({"g":{"game":42}})"));
+
+  BlockData recent;
+  EXPECT_FALSE (pub.GetRecentBlock ("abc", recent));
+
+  pub.TrackGame ("game");
+  pub.SendBlockAttach (blk, "");
+  ASSERT_TRUE (pub.GetRecentBlock ("abc", recent));
+  EXPECT_EQ (recent, blk);
+
+  /* Sending the block again (e.g. for a catch-up request) reuses the
+     cached payload, but with the reqtoken added.  */
+  pub.SendBlockAttach (blk, "token");
+
+  /* Changed data for the same hash is not taken from the buffer.  */
+  blk.moves.clear ();
+  pub.SendBlockAttach (blk, "");
+  ASSERT_TRUE (pub.GetRecentBlock ("abc", recent));
+  EXPECT_EQ (recent, blk);
+
+  const auto msg = sub.AwaitMessages (Attach ("game"), 3);
+  ASSERT_EQ (msg.size (), 3);
+  EXPECT_EQ (msg[0]["moves"].size (), 1);
+  EXPECT_FALSE (msg[0].isMember ("reqtoken"));
+  Json::Value withoutToken = msg[1];
+  EXPECT_EQ (withoutToken["reqtoken"], "token");
+  withoutToken.removeMember ("reqtoken");
+  EXPECT_EQ (withoutToken, msg[0]);
+  EXPECT_EQ (msg[2]["moves"].size (), 0);
+}
+
+TEST_F (ZmqPubTests, BlockPayloads)
+{
+  BlockData published;
+  published.hash = "abc";
+  published.height = 10;
+  published.moves.push_back (Move ("p", "domob", "tx1",
+                                   R"({"g":{"game":42, "other":1}})"));
+
+  BlockData unpublished;
+  unpublished.hash = "def";
+  unpublished.height = 11;
+  unpublished.moves.push_back (Move ("p", "andy", "tx2",
+                                     R"({"g":{"game":true}})"));
+
+  pub.TrackGame ("game");
+  pub.SendBlockAttach (published, "");
+  const auto msg = sub.AwaitMessages (Attach ("game"), 1);
+
+  const auto payloads = pub.GetBlockPayloads ({published, unpublished},
+                                              "game");
+  ASSERT_EQ (payloads.size (), 2);
+  EXPECT_EQ (payloads[0], msg[0]);
+  EXPECT_EQ (payloads[1]["block"]["hash"], "def");
+  EXPECT_THAT (WithoutBlock ({payloads[1]}), ElementsAre (
+    ParseJson (R"(
+      {
+        "admin": [],
+        "moves":
+          [
+            {"txid": "tx2", "name": "andy", "move": true, "burnt": 0}
+          ]
+      }
+    )")
+  ));
+
+  /* Building the payloads for blocks that were not published yet does
+     not add them to the replay buffer.  */
+  BlockData recent;
+  EXPECT_FALSE (pub.GetRecentBlock ("def", recent));
+
+  /* Payloads can also be retrieved for untracked games.  */
+  const auto other = pub.GetBlockPayloads ({published}, "other");
+  ASSERT_EQ (other.size (), 1);
+  EXPECT_EQ (other[0]["moves"].size (), 1);
+  EXPECT_EQ (other[0]["moves"][0]["move"], 1);
+}
+
 TEST_F (ZmqPubTests, MovesAndAdmin)
 {
   BlockData blk;
@@ -573,5 +714,740 @@ TEST_F (ZmqPubTests, PendingMoves)
   ));
 }
 
+TEST_F (ZmqPubTests, PendingMovesBatched)
+{
+  FLAGS_xayax_zmq_pending_window_ms = 200;
+  FLAGS_xayax_zmq_pending_max_moves = 3;
+
+  pub.TrackGame ("foo");
+  pub.TrackGame ("bar");
+
+  /* The first two transactions are collected and sent together after
+     the window is over.  */
+  pub.SendPendingMoves ({Move ("p", "domob", "tx1", R"({"g": {"foo": 1}})")});
+  pub.SendPendingMoves ({Move ("p", "andy", "tx2",
+                               R"({"g": {"foo": 2, "bar": 3}})")});
+  EXPECT_THAT (sub.AwaitMessages (Pending ("foo"), 1), ElementsAre (
+    ParseJson (R"(
+      [
+        {"txid": "tx1", "name": "domob", "move": 1, "burnt": 0},
+        {"txid": "tx2", "name": "andy", "move": 2, "burnt": 0}
+      ]
+    )")
+  ));
+  EXPECT_THAT (sub.AwaitMessages (Pending ("bar"), 1), ElementsAre (
+    ParseJson (R"(
+      [
+        {"txid": "tx2", "name": "andy", "move": 3, "burnt": 0}
+      ]
+    )")
+  ));
+
+  /* When the batch is full, it is sent right away.  */
+  for (unsigned i = 0; i < 4; ++i)
+    pub.SendPendingMoves ({Move ("p", "domob", "tx", R"({"g": {"foo": 0}})")});
+  const auto full = sub.AwaitMessages (Pending ("foo"), 2);
+  EXPECT_EQ (full[0].size (), 3);
+  EXPECT_EQ (full[1].size (), 1);
+
+  /* A block notification flushes the batch first.  */
+  pub.SendPendingMoves ({Move ("p", "domob", "tx", R"({"g": {"foo": 0}})")});
+  BlockData blk;
+  pub.SendBlockAttach (blk, "");
+  sub.AwaitMessages (Pending ("foo"), 1);
+  sub.AwaitMessages (Attach ("foo"), 1);
+  sub.AwaitMessages (Attach ("bar"), 1);
+
+  const auto stats = pub.GetPendingBatchStats ();
+  EXPECT_EQ (stats.messages, 5);
+  EXPECT_EQ (stats.moves, 8);
+  EXPECT_EQ (stats.maxMoves, 3);
+
+  FLAGS_xayax_zmq_pending_window_ms = 0;
+  FLAGS_xayax_zmq_pending_max_moves = 100;
+}
+
+TEST_F (ZmqPubTests, ManyGames)
+{
+  /* With many games, the payloads are built in parallel on the pool.
+     Verify that each game still gets exactly its own moves.  */
+  constexpr unsigned numGames = 40;
+
+  BlockData blk;
+  for (unsigned i = 0; i < numGames; ++i)
+    {
+      const std::string g = "game " + std::to_string (i);
+      pub.TrackGame (g);
+
+      Json::Value mv(Json::objectValue);
+      mv["g"][g] = i;
+      blk.moves.push_back (Move ("p", "domob", "tx " + std::to_string (i),
+                                 StoreJson (mv)));
+    }
+  pub.SendBlockAttach (blk, "");
+
+  for (unsigned i = 0; i < numGames; ++i)
+    {
+      const auto msg = sub.AwaitMessages (Attach ("game " + std::to_string (i)),
+                                          1);
+      ASSERT_EQ (msg.size (), 1);
+      ASSERT_EQ (msg[0]["moves"].size (), 1);
+      EXPECT_EQ (msg[0]["moves"][0]["txid"].asString (),
+                 "tx " + std::to_string (i));
+      EXPECT_EQ (msg[0]["moves"][0]["move"].asUInt (), i);
+    }
+}
+
+/* ************************************************************************** */
+
+/**
+ * Tests for the handling of subscriptions on the XPUB socket.  This uses
+ * a publisher without a default catch-all subscriber, so that each
+ * test can set up exactly the subscriptions it needs.
+ */
+class ZmqPubSubscriptionTests : public testing::Test
+{
+
+protected:
+
+  ZmqPub pub;
+
+  ZmqPubSubscriptionTests ()
+    : pub(ZMQ_ADDR)
+  {
+    pub.TrackGame ("foo");
+    pub.TrackGame ("bar");
+  }
+
+};
+
+TEST_F (ZmqPubSubscriptionTests, OnlySubscribedTopics)
+{
+  BlockData blk;
+  blk.hash = "block";
+
+  TestZmqSubscriber fooSub(ZMQ_ADDR, {"game-block-attach json foo"});
+  SleepSome ();
+
+  /* This will be sent for foo, and skipped for bar (but still advance
+     its sequence number).  */
+  pub.SendBlockAttach (blk, "");
+  const auto msg = fooSub.AwaitMessages ("game-block-attach json foo", 1);
+  ASSERT_EQ (msg.front ()["block"]["hash"], "block");
+
+  TestZmqSubscriber barSub(ZMQ_ADDR, {"game-block-attach json bar"});
+  barSub.ExpectSequence ("game-block-attach json bar", 1);
+  SleepSome ();
+
+  pub.SendBlockAttach (blk, "");
+  fooSub.AwaitMessages ("game-block-attach json foo", 1);
+  barSub.AwaitMessages ("game-block-attach json bar", 1);
+
+  SleepSome ();
+}
+
+TEST_F (ZmqPubSubscriptionTests, Unsubscribe)
+{
+  BlockData blk;
+
+  {
+    TestZmqSubscriber sub(ZMQ_ADDR, {"game-block-attach json foo"});
+    SleepSome ();
+    pub.SendBlockAttach (blk, "");
+    sub.AwaitMessages ("game-block-attach json foo", 1);
+  }
+
+  /* The subscriber is gone now, so this will be skipped.  */
+  SleepSome ();
+  pub.SendBlockAttach (blk, "");
+
+  TestZmqSubscriber sub(ZMQ_ADDR, {"game-block-attach json"});
+  sub.ExpectSequence ("game-block-attach json foo", 2);
+  sub.ExpectSequence ("game-block-attach json bar", 2);
+  SleepSome ();
+
+  pub.SendBlockAttach (blk, "");
+  sub.AwaitMessages ("game-block-attach json foo", 1);
+  sub.AwaitMessages ("game-block-attach json bar", 1);
+
+  SleepSome ();
+}
+
+TEST_F (ZmqPubSubscriptionTests, BinaryTopic)
+{
+  BlockData blk;
+  blk.hash = "block";
+  blk.parent = "parent";
+  blk.height = 42;
+  blk.rngseed = "seed";
+  blk.metadata = ParseJson (R"({"timestamp": 123})");
+
+  MoveData mv;
+  mv.txid = "tx1";
+  mv.ns = "p";
+  mv.name = "domob";
+  mv.mv = R"({"g":{"foo":{"x":1},"bar":[]}})";
+  mv.burns["foo"] = 10;
+  mv.metadata = ParseJson (R"({"out": {"addr": 5}})");
+  blk.moves.push_back (mv);
+
+  mv.txid = "tx2";
+  mv.ns = "g";
+  mv.name = "foo";
+  mv.mv = R"({"cmd":"upgrade"})";
+  mv.burns.clear ();
+  mv.metadata = Json::Value ();
+  blk.moves.push_back (mv);
+
+  /* The binary topics are opt-in, so a catch-all subscriber does not
+     trigger them (but will get them due to the explicit subscriber).  */
+  TestZmqSubscriber jsonSub(ZMQ_ADDR, {"game-block-attach json foo"});
+  TestZmqSubscriber binSub(ZMQ_ADDR, {"game-block-attach bin foo"});
+  SleepSome ();
+
+  pub.SendBlockAttach (blk, "");
+  pub.SendBlockAttach (blk, "token");
+
+  const auto jsonMsg
+      = jsonSub.AwaitMessages ("game-block-attach json foo", 2);
+  const auto binMsg = binSub.AwaitMessages ("game-block-attach bin foo", 2);
+  EXPECT_EQ (binMsg, jsonMsg);
+  EXPECT_EQ (binMsg[1]["reqtoken"], "token");
+  EXPECT_EQ (binMsg[0]["moves"][0]["burnt"], 10);
+  EXPECT_EQ (binMsg[0]["admin"][0]["cmd"], "upgrade");
+
+  SleepSome ();
+}
+
+TEST_F (ZmqPubSubscriptionTests, BatchedTopic)
+{
+  FLAGS_xayax_zmq_batch_max_blocks = 3;
+
+  std::vector<BlockData> blocks(7);
+  for (unsigned i = 0; i < blocks.size (); ++i)
+    {
+      blocks[i].hash = "block " + std::to_string (i);
+      blocks[i].height = i;
+
+      MoveData mv;
+      mv.txid = "tx " + std::to_string (i);
+      mv.ns = "p";
+      mv.name = "domob";
+      mv.mv = R"({"g":{"foo":42}})";
+      blocks[i].moves.push_back (mv);
+    }
+
+  TestZmqSubscriber jsonSub(ZMQ_ADDR, {"game-block-attach json foo"});
+  TestZmqSubscriber batchSub(ZMQ_ADDR, {"game-block-attach-batch json foo"});
+  SleepSome ();
+
+  pub.SendBlockAttaches (blocks, "token");
+  pub.SendBlockAttach (blocks.front (), "");
+
+  const auto batches
+      = batchSub.AwaitMessages ("game-block-attach-batch json foo", 4);
+  ASSERT_EQ (batches.size (), 4);
+  EXPECT_EQ (batches[0]["blocks"].size (), 3);
+  EXPECT_EQ (batches[1]["blocks"].size (), 3);
+  EXPECT_EQ (batches[2]["blocks"].size (), 1);
+  EXPECT_EQ (batches[3]["blocks"].size (), 1);
+  for (unsigned i = 0; i < 3; ++i)
+    EXPECT_EQ (batches[i]["reqtoken"], "token");
+  EXPECT_FALSE (batches[3].isMember ("reqtoken"));
+
+  /* The batched blocks are exactly the per-block payloads.  */
+  auto single = jsonSub.AwaitMessages ("game-block-attach json foo", 8);
+  std::vector<Json::Value> batched;
+  for (const auto& b : batches)
+    for (const auto& entry : b["blocks"])
+      batched.push_back (entry);
+  for (auto& val : single)
+    val.removeMember ("reqtoken");
+  EXPECT_EQ (batched, single);
+  EXPECT_EQ (batched[4]["moves"][0]["txid"], "tx 4");
+
+  FLAGS_xayax_zmq_batch_max_blocks = 100;
+  SleepSome ();
+}
+
+TEST_F (ZmqPubSubscriptionTests, CompressedTopic)
+{
+  BlockData blk;
+  blk.hash = "block";
+  for (unsigned i = 0; i < 100; ++i)
+    {
+      MoveData mv;
+      mv.txid = "tx" + std::to_string (i);
+      mv.ns = "p";
+      mv.name = "domob";
+      mv.mv = R"({"g":{"foo":{"some": "repetitive", "move": "data"}}})";
+      blk.moves.push_back (mv);
+    }
+
+  TestZmqSubscriber jsonSub(ZMQ_ADDR, {"game-block-attach json foo"});
+  TestZmqSubscriber zstdSub(ZMQ_ADDR, {"game-block-attach zstd foo"});
+  SleepSome ();
+
+  pub.SendBlockAttach (blk, "");
+  pub.SendBlockAttach (blk, "token");
+
+  const auto jsonMsg
+      = jsonSub.AwaitMessages ("game-block-attach json foo", 2);
+  const auto zstdMsg
+      = zstdSub.AwaitMessages ("game-block-attach zstd foo", 2);
+  EXPECT_EQ (zstdMsg, jsonMsg);
+  EXPECT_EQ (zstdMsg[0]["moves"].size (), 100);
+  EXPECT_EQ (zstdMsg[1]["reqtoken"], "token");
+
+  const auto stats = pub.GetCompressionStats ();
+  EXPECT_EQ (stats.messages, 2);
+  EXPECT_GT (stats.rawBytes, 10 * stats.compressedBytes);
+
+  SleepSome ();
+}
+
+TEST (ZmqPubCompressionTests, Dictionary)
+{
+  const std::string dict
+      = R"({"block":{"hash":"","height":0,"parent":"","rngseed":""},)"
+        R"("moves":[{"burnt":0,"move":{"some":"dictionary content"},)"
+        R"("name":"","txid":""}],"admin":[]})";
+  const std::string dictFile = testing::TempDir () + "/zstd.dict";
+  {
+    std::ofstream out(dictFile, std::ios::binary);
+    out << dict;
+  }
+
+  FLAGS_xayax_zmq_zstd_dictionary = dictFile;
+  ZmqPub pub(ZMQ_ADDR);
+  FLAGS_xayax_zmq_zstd_dictionary = "";
+  pub.TrackGame ("foo");
+
+  TestZmqSubscriber sub(ZMQ_ADDR, {"game-block-attach zstd foo"});
+  sub.SetZstdDictionary (dict);
+  SleepSome ();
+
+  BlockData blk;
+  blk.hash = "block";
+  pub.SendBlockAttach (blk, "");
+
+  const auto msg = sub.AwaitMessages ("game-block-attach zstd foo", 1);
+  EXPECT_EQ (msg[0]["block"]["hash"], "block");
+
+  SleepSome ();
+}
+
+/**
+ * Returns a block with a single small move for "foo", as typical for
+ * notifications where a dictionary helps most.
+ */
+BlockData
+SmallBlock (const unsigned i)
+{
+  BlockData res;
+  res.hash = "block " + std::to_string (i);
+  res.parent = "block " + std::to_string (i - 1);
+  res.height = i;
+
+  MoveData mv;
+  mv.txid = "tx " + std::to_string (i);
+  mv.ns = "p";
+  mv.name = "player " + std::to_string (i % 10);
+  mv.mv = R"({"g":{"foo":{"move":{"x":)" + std::to_string (i % 7)
+            + R"(,"y":)" + std::to_string (i % 5) + "}}}}";
+  res.moves.push_back (mv);
+
+  return res;
+}
+
+TEST (ZmqPubCompressionTests, TrainedDictionary)
+{
+  ZmqPub pub(ZMQ_ADDR);
+  pub.TrackGame ("foo");
+  TestZmqSubscriber sub(ZMQ_ADDR, {"game-block-attach zstd foo"});
+  SleepSome ();
+
+  std::string dict;
+  unsigned id;
+  EXPECT_FALSE (pub.GetZstdDictionary (dict, id));
+
+  constexpr unsigned num = 200;
+  for (unsigned i = 0; i < num; ++i)
+    pub.SendBlockAttach (SmallBlock (i), "");
+  sub.AwaitMessages ("game-block-attach zstd foo", num);
+  const auto without = pub.GetCompressionStats ();
+
+  ASSERT_TRUE (pub.TrainZstdDictionary ());
+  ASSERT_TRUE (pub.GetZstdDictionary (dict, id));
+  EXPECT_NE (id, 0);
+  sub.SetZstdDictionary (dict);
+
+  for (unsigned i = num; i < 2 * num; ++i)
+    pub.SendBlockAttach (SmallBlock (i), "");
+  const auto msg = sub.AwaitMessages ("game-block-attach zstd foo", num);
+  EXPECT_EQ (msg.back ()["block"]["hash"],
+             "block " + std::to_string (2 * num - 1));
+  const auto total = pub.GetCompressionStats ();
+
+  /* The payloads are so small that zstd alone does not gain much,
+     while the dictionary makes them a lot smaller.  */
+  const double ratioWithout
+      = static_cast<double> (without.compressedBytes) / without.rawBytes;
+  const double ratioWith
+      = static_cast<double> (total.compressedBytes - without.compressedBytes)
+          / (total.rawBytes - without.rawBytes);
+  LOG (INFO)
+      << "Compression ratio without dictionary: " << ratioWithout
+      << ", with dictionary: " << ratioWith;
+  EXPECT_LT (ratioWith, ratioWithout / 2);
+
+  SleepSome ();
+}
+
+TEST (ZmqPubCompressionTests, PeriodicTraining)
+{
+  const std::string dictFile = testing::TempDir () + "/trained.dict";
+  fs::remove (dictFile);
+
+  /* The dictionary file does not exist yet, which is fine as it will
+     be trained and written.  */
+  FLAGS_xayax_zmq_zstd_dictionary = dictFile;
+  FLAGS_xayax_zmq_zstd_train_blocks = 100;
+  {
+    ZmqPub pub(ZMQ_ADDR);
+    pub.TrackGame ("foo");
+    TestZmqSubscriber sub(ZMQ_ADDR, {"game-block-attach json foo"});
+    SleepSome ();
+
+    /* The first training (after 100 blocks) only has the payloads built
+       before, so wait for them before triggering it.  */
+    for (unsigned i = 0; i < 99; ++i)
+      pub.SendBlockAttach (SmallBlock (i), "");
+    sub.AwaitMessages ("game-block-attach json foo", 99);
+    pub.SendBlockAttach (SmallBlock (99), "");
+    sub.AwaitMessages ("game-block-attach json foo", 1);
+
+    std::string dict;
+    unsigned id;
+    ASSERT_TRUE (pub.GetZstdDictionary (dict, id));
+
+    std::ifstream in(dictFile, std::ios::binary);
+    std::ostringstream written;
+    written << in.rdbuf ();
+    EXPECT_EQ (written.str (), dict);
+  }
+
+  /* On restart, the written dictionary is loaded again.  */
+  FLAGS_xayax_zmq_zstd_train_blocks = 0;
+  {
+    ZmqPub pub(ZMQ_ADDR);
+    std::string dict;
+    unsigned id;
+    EXPECT_TRUE (pub.GetZstdDictionary (dict, id));
+  }
+  FLAGS_xayax_zmq_zstd_dictionary = "";
+}
+
+TEST_F (ZmqPubSubscriptionTests, TopicStats)
+{
+  TestZmqSubscriber sub(ZMQ_ADDR, {"game-block-attach json foo"});
+  SleepSome ();
+
+  BlockData blk;
+  pub.SendBlockAttach (blk, "");
+  pub.SendBlockAttach (blk, "");
+  sub.AwaitMessages ("game-block-attach json foo", 2);
+  SleepSome ();
+
+  const auto stats = pub.GetTopicStats ();
+  ASSERT_EQ (stats.size (), 1);
+  const auto& topic = stats.at ("game-block-attach json foo");
+  EXPECT_EQ (topic.sent, 2);
+  EXPECT_GT (topic.bytes, 0);
+  EXPECT_EQ (topic.dropped, 0);
+  EXPECT_GE (topic.totalLatency, topic.maxLatency);
+
+  EXPECT_THAT (pub.GetQueueSizes (), ElementsAre (0));
+}
+
+/**
+ * Tests for backpressure handling.  They use a raw subscriber socket,
+ * which subscribes to topics but does not read any messages.
+ */
+class ZmqPubBackpressureTests : public testing::Test
+{
+
+protected:
+
+  zmq::context_t ctx;
+  zmq::socket_t slowSub;
+
+  ZmqPubBackpressureTests ()
+    : slowSub(ctx, ZMQ_SUB)
+  {
+    slowSub.set (zmq::sockopt::rcvhwm, 1);
+    slowSub.set (zmq::sockopt::subscribe, "game-block-attach json foo");
+  }
+
+  ~ZmqPubBackpressureTests ()
+  {
+    FLAGS_xayax_zmq_nodrop = false;
+    FLAGS_xayax_zmq_coalesce_catchup = false;
+    FLAGS_xayax_zmq_pressure_queue = 64;
+
+    slowSub.set (zmq::sockopt::linger, 0);
+    slowSub.close ();
+  }
+
+  /**
+   * Waits until all queued notifications have been processed.
+   */
+  static void
+  WaitForQueue (ZmqPub& pub)
+  {
+    while (pub.GetQueueSizes ()[0] > 0)
+      SleepSome ();
+    SleepSome ();
+  }
+
+};
+
+TEST_F (ZmqPubBackpressureTests, DroppedMessages)
+{
+  FLAGS_xayax_zmq_nodrop = true;
+  ZmqPub pub(ZMQ_ADDR);
+  pub.TrackGame ("foo");
+  slowSub.connect (ZMQ_ADDR);
+  SleepSome ();
+
+  /* Send many large messages, so that the queue to the subscriber (which
+     is not reading) is filled up and messages have to be dropped.  */
+  constexpr unsigned num = 3'000;
+  BlockData blk;
+  blk.metadata["data"] = std::string (10'000, 'x');
+  for (unsigned i = 0; i < num; ++i)
+    {
+      blk.hash = "block " + std::to_string (i);
+      pub.SendBlockAttach (blk, "");
+    }
+  WaitForQueue (pub);
+
+  const auto stats = pub.GetTopicStats ().at ("game-block-attach json foo");
+  EXPECT_GT (stats.sent, 0);
+  EXPECT_GT (stats.dropped, 0);
+  EXPECT_EQ (stats.sent + stats.dropped, num);
+}
+
+TEST_F (ZmqPubBackpressureTests, CoalesceCatchUp)
+{
+  FLAGS_xayax_zmq_coalesce_catchup = true;
+  FLAGS_xayax_zmq_pressure_queue = 0;
+  ZmqPub pub(ZMQ_ADDR);
+  pub.TrackGame ("foo");
+  TestZmqSubscriber sub(ZMQ_ADDR, {
+    "game-block-attach json foo",
+    "game-block-attach-batch json foo",
+  });
+  SleepSome ();
+
+  /* We queue a lot of live notifications first, so that the catch-up
+     blocks queued afterwards are merged into few runs.  */
+  constexpr unsigned num = 100;
+  BlockData blk;
+  blk.metadata["data"] = std::string (10'000, 'x');
+  for (unsigned i = 0; i < num; ++i)
+    pub.SendBlockAttach (blk, "");
+  for (unsigned i = 0; i < num; ++i)
+    {
+      blk.hash = "block " + std::to_string (i);
+      blk.height = i;
+      pub.SendBlockAttach (blk, "token");
+    }
+  WaitForQueue (pub);
+
+  const uint64_t coalesced = pub.GetCoalescedBlocks ();
+  EXPECT_GT (coalesced, 0);
+
+  /* All blocks are still sent in order on the per-block topic.  */
+  const auto msg = sub.AwaitMessages ("game-block-attach json foo", 2 * num);
+  for (unsigned i = 0; i < num; ++i)
+    {
+      EXPECT_FALSE (msg[i].isMember ("reqtoken"));
+      EXPECT_EQ (msg[num + i]["reqtoken"], "token");
+      EXPECT_EQ (msg[num + i]["block"]["height"].asInt (), i);
+    }
+
+  /* The catch-up blocks are sent in one batch per queued run.  */
+  const auto batches = sub.AwaitMessages ("game-block-attach-batch json foo",
+                                          num + num - coalesced);
+  unsigned height = 0;
+  for (unsigned i = num; i < batches.size (); ++i)
+    {
+      EXPECT_EQ (batches[i]["reqtoken"], "token");
+      for (const auto& b : batches[i]["blocks"])
+        EXPECT_EQ (b["block"]["height"].asInt (), height++);
+    }
+  EXPECT_EQ (height, num);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Additional addresses for the ZMQ sockets in sharding tests.
+ */
+constexpr const char* ZMQ_ADDR_SHARD = "tcp://127.0.0.1:49838";
+constexpr const char* ZMQ_ADDR_SHARD2 = "tcp://127.0.0.1:49839";
+
+class ZmqPubShardingTests : public testing::Test
+{
+
+protected:
+
+  const std::vector<std::string> addrs
+      = {ZMQ_ADDR, ZMQ_ADDR_SHARD, ZMQ_ADDR_SHARD2};
+  const std::vector<std::string> games = {"a", "b", "c", "d", "e", "f"};
+
+  ZmqPub pub;
+
+  ZmqPubShardingTests ()
+    : pub(addrs)
+  {}
+
+  /**
+   * Tracks all games and sends two blocks.
+   */
+  void
+  SendBlocks ()
+  {
+    for (const auto& g : games)
+      pub.TrackGame (g);
+
+    BlockData blk;
+    blk.hash = "first";
+    pub.SendBlockAttach (blk, "");
+    blk.hash = "second";
+    pub.SendBlockAttach (blk, "");
+  }
+
+  /**
+   * Expects the two blocks sent by SendBlocks for the given game
+   * on the subscriber.
+   */
+  static void
+  ExpectBlocks (TestZmqSubscriber& sub, const std::string& g)
+  {
+    const auto msg = sub.AwaitMessages ("game-block-attach json " + g, 2);
+    EXPECT_EQ (msg[0]["block"]["hash"], "first");
+    EXPECT_EQ (msg[1]["block"]["hash"], "second");
+  }
+
+};
+
+TEST_F (ZmqPubShardingTests, PrimaryHasAllGames)
+{
+  TestZmqSubscriber sub(ZMQ_ADDR);
+  SleepSome ();
+
+  SendBlocks ();
+  for (const auto& g : games)
+    ExpectBlocks (sub, g);
+
+  SleepSome ();
+}
+
+TEST_F (ZmqPubShardingTests, ShardsPartitionGames)
+{
+  TestZmqSubscriber sub1(ZMQ_ADDR_SHARD);
+  TestZmqSubscriber sub2(ZMQ_ADDR_SHARD2);
+  SleepSome ();
+
+  SendBlocks ();
+
+  const auto perEndpoint = pub.GetGamesPerEndpoint ();
+  ASSERT_EQ (perEndpoint.size (), 3);
+  EXPECT_EQ (perEndpoint[0].size (), games.size ());
+  EXPECT_EQ (perEndpoint[1].size () + perEndpoint[2].size (), games.size ());
+
+  for (const auto& g : perEndpoint[1])
+    ExpectBlocks (sub1, g);
+  for (const auto& g : perEndpoint[2])
+    ExpectBlocks (sub2, g);
+
+  SleepSome ();
+}
+
+TEST_F (ZmqPubShardingTests, SingleGameUpdate)
+{
+  TestZmqSubscriber sub(ZMQ_ADDR);
+  TestZmqSubscriber sub1(ZMQ_ADDR_SHARD);
+  TestZmqSubscriber sub2(ZMQ_ADDR_SHARD2);
+  SleepSome ();
+
+  for (const auto& g : games)
+    pub.TrackGame (g);
+  BlockData blk;
+  blk.hash = "block";
+  pub.SendBlockAttach (blk, "token", "a");
+
+  /* The update is sent on the primary and the game's shard.  */
+  const auto first = pub.GetGamesPerEndpoint ()[1];
+  const bool onFirst = (std::find (first.begin (), first.end (), "a")
+                          != first.end ());
+  sub.AwaitMessages ("game-block-attach json a", 1);
+  (onFirst ? sub1 : sub2).AwaitMessages ("game-block-attach json a", 1);
+
+  SleepSome ();
+}
+
+/* ************************************************************************** */
+
+TEST (ZmqPubQueueTests, BoundedQueue)
+{
+  FLAGS_xayax_zmq_queue_size = 2;
+  ZmqPub pub(ZMQ_ADDR);
+  TestZmqSubscriber sub(ZMQ_ADDR);
+  pub.TrackGame ("foo");
+  SleepSome ();
+
+  /* Sending blocks waits for the queue, so that it never grows beyond
+     the limit, and no notifications are lost.  */
+  constexpr unsigned num = 100;
+  BlockData blk;
+  blk.metadata["data"] = std::string (10'000, 'x');
+  for (unsigned i = 0; i < num; ++i)
+    {
+      blk.hash = "block " + std::to_string (i);
+      pub.SendBlockAttach (blk, "");
+      EXPECT_LE (pub.GetQueueSizes ()[0], 2);
+    }
+
+  const auto msg = sub.AwaitMessages ("game-block-attach json foo", num);
+  for (unsigned i = 0; i < num; ++i)
+    EXPECT_EQ (msg[i]["block"]["hash"], "block " + std::to_string (i));
+
+  SleepSome ();
+  FLAGS_xayax_zmq_queue_size = 1'024;
+}
+
+TEST (ZmqPubIpcTests, IpcEndpoint)
+{
+  const std::string addr
+      = "ipc://" + (fs::temp_directory_path ()
+                      / "xayax-zmqpub-test.ipc").string ();
+  ZmqPub pub(addr);
+  TestZmqSubscriber sub(addr);
+  SleepSome ();
+
+  pub.TrackGame ("game");
+  BlockData blk;
+  blk.hash = "abc";
+  pub.SendBlockAttach (blk, "");
+
+  const auto msg = sub.AwaitMessages ("game-block-attach json game", 1);
+  EXPECT_EQ (msg[0]["block"]["hash"], "abc");
+
+  SleepSome ();
+}
+
 } // anonymous namespace
 } // namespace xayax
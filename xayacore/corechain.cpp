@@ -1,9 +1,11 @@
-// Copyright (C) 2021-2023 The Xaya developers
+// Copyright (C) 2021-2024 The Xaya developers
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "corechain.hpp"
 
+#include "messageverifier.hpp"
+#include "metrics.hpp"
 #include "rpcutils.hpp"
 
 #include "rpc-stubs/corerpcclient.h"
@@ -29,6 +31,9 @@ namespace xayax
 
 DEFINE_int32 (core_rpc_timeout_ms, 10'000,
               "timeout for RPC calls to Xaya Core");
+DEFINE_bool (core_local_verifymessage, true,
+             "whether to verify signed messages locally rather than through"
+             " Xaya Core's verifymessage RPC");
 
 /* ************************************************************************** */
 
@@ -200,6 +205,33 @@ GetNotificationAddress (CoreRpc& rpc, const std::string& type)
   return "";
 }
 
+/**
+ * Returns the histogram for the latency of a given kind of request
+ * to Xaya Core.
+ */
+Histogram&
+GetRequestHistogram (const std::string& method)
+{
+  return MetricsRegistry::Get ().GetHistogram (
+      "xayax_basechain_request_seconds",
+      "Time for requests to the base chain",
+      Histogram::LatencyBuckets (),
+      "chain=\"core\",method=\"" + method + "\"");
+}
+
+/**
+ * Returns the counter for verified messages in the given mode (locally
+ * or through Xaya Core's RPC).
+ */
+Counter&
+GetVerifyCounter (const std::string& mode)
+{
+  return MetricsRegistry::Get ().GetCounter (
+      "xayax_core_verifymessage_total",
+      "Signed messages verified by mode",
+      "mode=\"" + mode + "\"");
+}
+
 } // anonymous namespace
 
 /* ************************************************************************** */
@@ -425,6 +457,36 @@ CoreChain::Start ()
           << " for receiving tip updates from Xaya Core";
       GetListenerForAddress (addr).Subscribe ("hashblock");
     }
+
+  if (FLAGS_core_local_verifymessage)
+    SetupMessageVerifier ();
+}
+
+void
+CoreChain::SetupMessageVerifier ()
+{
+  /* This is an arbitrary key, which we just use to produce an example
+     signature that we can cross-check with Xaya Core.  */
+  const std::string key(32, '\x42');
+  const std::string msg = "Xaya X message verification";
+
+  auto v = std::make_unique<MessageVerifier> ();
+  const std::string sgn = v->Sign (msg, key);
+
+  CoreRpc rpc(endpoint);
+  const auto res = rpc->verifymessage ("", msg, xaya::EncodeBase64 (sgn));
+  CHECK (res.isObject ());
+  if (!res["valid"].asBool ()
+        || !v->LearnAddressPrefix (msg, sgn, res["address"].asString ()))
+    {
+      LOG (WARNING)
+          << "Local message verification does not match Xaya Core,"
+          << " using its verifymessage RPC instead";
+      return;
+    }
+
+  LOG (INFO) << "Verifying signed messages locally";
+  verifier = std::move (v);
 }
 
 bool
@@ -463,6 +525,9 @@ CoreChain::GetBlockRange (const uint64_t start, const uint64_t count)
   if (count == 0)
     return {};
 
+  static Histogram& time = GetRequestHistogram ("getblockrange");
+  ScopedTimer timer(time);
+
   CoreRpc rpc(endpoint);
   const uint64_t endHeight = start + count - 1;
   CHECK_GE (endHeight, start);
@@ -557,6 +622,16 @@ bool
 CoreChain::VerifyMessage (const std::string& msg, const std::string& signature,
                           std::string& addr)
 {
+  static Counter& local = GetVerifyCounter ("local");
+  static Counter& remote = GetVerifyCounter ("rpc");
+
+  if (verifier != nullptr)
+    {
+      local.Increment ();
+      return verifier->Verify (msg, signature, addr);
+    }
+
+  remote.Increment ();
   CoreRpc rpc(endpoint);
 
   Json::Value res;
@@ -17,6 +17,8 @@ namespace zmq
 namespace xayax
 {
 
+class MessageVerifier;
+
 /**
  * BaseChain connector that links back to a Xaya Core instance.  This is mainly
  * useful for testing, but could also help as part of a unified Xaya X framework
@@ -47,12 +49,25 @@ private:
    */
   std::map<std::string, std::unique_ptr<ZmqListener>> listeners;
 
+  /**
+   * Verifier for signed messages, if local verification is possible.
+   * This is set up when starting, and verified against Xaya Core.  If it
+   * fails, we fall back to Xaya Core's verifymessage RPC.
+   */
+  std::unique_ptr<MessageVerifier> verifier;
+
   /**
    * Gets and returns the ZmqListener for a given address.  If there is none
    * yet, we construct a new one.
    */
   ZmqListener& GetListenerForAddress (const std::string& addr);
 
+  /**
+   * Sets up local message verification, and cross-checks it against
+   * Xaya Core with an example signature.
+   */
+  void SetupMessageVerifier ();
+
 public:
 
   explicit CoreChain (const std::string& ep);
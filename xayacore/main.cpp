@@ -27,8 +27,19 @@ DEFINE_int32 (port, 0,
               "the port where Xaya X should listen for RPC requests");
 DEFINE_bool (listen_locally, true,
              "whether or not the RPC server should only bind on localhost");
+DEFINE_string (rpc_socket, "",
+               "if set, serve RPC requests also on a Unix domain socket"
+               " at this path (for HTTP JSON-RPC clients on the same host,"
+               " e.g. curl --unix-socket)");
+DEFINE_int32 (metrics_port, 0,
+              "if set, serve metrics in the Prometheus text format on this"
+              " port at /metrics (binding like the RPC server)");
 DEFINE_string (zmq_address, "",
-               "the address to bind the ZMQ publisher to");
+               "the address to bind the ZMQ publisher to (e.g. an ipc://"
+               " address for GSPs running on the same host)");
+DEFINE_string (zmq_shard_addresses, "",
+               "comma-separated list of additional addresses for ZMQ"
+               " publisher shards");
 
 DEFINE_int32 (max_reorg_depth, 1'000,
               "maximum supported depth of reorgs");
@@ -38,6 +49,27 @@ DEFINE_bool (pending_moves, true,
 DEFINE_bool (sanity_checks, false,
              "whether or not to run slow sanity checks for testing");
 
+/**
+ * Parses the comma-separated list of addresses and adds them as ZMQ
+ * publisher shards to the controller.
+ */
+void
+AddZmqShards (xayax::Controller& controller, std::string lst)
+{
+  CHECK (!lst.empty ());
+  while (true)
+    {
+      const auto pos = lst.find (',');
+      if (pos == std::string::npos)
+        {
+          controller.AddZmqShardEndpoint (lst);
+          return;
+        }
+      controller.AddZmqShardEndpoint (lst.substr (0, pos));
+      lst = lst.substr (pos + 1);
+    }
+}
+
 } // anonymous namespace
 
 int
@@ -68,7 +100,13 @@ main (int argc, char* argv[])
       xayax::Controller controller(base, FLAGS_datadir);
       controller.SetMaxReorgDepth (FLAGS_max_reorg_depth);
       controller.SetZmqEndpoint (FLAGS_zmq_address);
+      if (!FLAGS_zmq_shard_addresses.empty ())
+        AddZmqShards (controller, FLAGS_zmq_shard_addresses);
       controller.SetRpcBinding (FLAGS_port, FLAGS_listen_locally);
+      if (!FLAGS_rpc_socket.empty ())
+        controller.SetRpcUnixSocket (FLAGS_rpc_socket);
+      if (FLAGS_metrics_port > 0)
+        controller.SetMetricsPort (FLAGS_metrics_port);
       if (FLAGS_pending_moves)
         controller.EnablePending ();
       if (FLAGS_sanity_checks)
@@ -0,0 +1,313 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "messageverifier.hpp"
+
+#include <secp256k1_recovery.h>
+
+#include <openssl/evp.h>
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace xayax
+{
+
+namespace
+{
+
+/** The prefix of signed messages in Xaya Core.  */
+const std::string MESSAGE_MAGIC = "Xaya Signed Message:\n";
+
+/** The characters used for base58 encoding.  */
+const std::string BASE58_CHARS
+    = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+/**
+ * Computes a digest with OpenSSL.  Returns false if that fails (e.g.
+ * because RIPEMD-160 is not available in the OpenSSL providers).
+ */
+bool
+Digest (const EVP_MD* md, const std::string& data, std::string& out)
+{
+  unsigned char buf[EVP_MAX_MD_SIZE];
+  unsigned len;
+  if (md == nullptr
+        || !EVP_Digest (data.data (), data.size (), buf, &len, md, nullptr))
+    return false;
+
+  out = std::string (reinterpret_cast<const char*> (buf), len);
+  return true;
+}
+
+/**
+ * Returns the double-SHA256 hash of the data.
+ */
+std::string
+DoubleSha256 (const std::string& data)
+{
+  std::string first, res;
+  CHECK (Digest (EVP_sha256 (), data, first));
+  CHECK (Digest (EVP_sha256 (), first, res));
+  return res;
+}
+
+/**
+ * Returns the hash160 (RIPEMD-160 of SHA256) of the data.
+ */
+bool
+Hash160 (const std::string& data, std::string& res)
+{
+  std::string sha;
+  CHECK (Digest (EVP_sha256 (), data, sha));
+  return Digest (EVP_ripemd160 (), sha, res);
+}
+
+/**
+ * Appends a string with its length (as CompactSize) to the output,
+ * like the serialisation of strings in Xaya Core.
+ */
+void
+AppendString (const std::string& str, std::string& out)
+{
+  const uint64_t len = str.size ();
+  unsigned bytes;
+  if (len < 253)
+    bytes = 0;
+  else if (len <= 0xFFFF)
+    {
+      out.push_back (static_cast<char> (253));
+      bytes = 2;
+    }
+  else if (len <= 0xFFFFFFFF)
+    {
+      out.push_back (static_cast<char> (254));
+      bytes = 4;
+    }
+  else
+    {
+      out.push_back (static_cast<char> (255));
+      bytes = 8;
+    }
+
+  if (bytes == 0)
+    out.push_back (static_cast<char> (len));
+  else
+    for (unsigned i = 0; i < bytes; ++i)
+      out.push_back (static_cast<char> ((len >> (8 * i)) & 0xFF));
+
+  out += str;
+}
+
+} // anonymous namespace
+
+MessageVerifier::MessageVerifier ()
+  : ctx(secp256k1_context_create (SECP256K1_CONTEXT_SIGN
+                                    | SECP256K1_CONTEXT_VERIFY))
+{
+  CHECK (ctx != nullptr);
+}
+
+MessageVerifier::~MessageVerifier ()
+{
+  secp256k1_context_destroy (ctx);
+}
+
+std::string
+MessageVerifier::MessageHash (const std::string& msg)
+{
+  std::string data;
+  AppendString (MESSAGE_MAGIC, data);
+  AppendString (msg, data);
+  return DoubleSha256 (data);
+}
+
+std::string
+MessageVerifier::EncodeBase58Check (const std::string& data)
+{
+  const std::string full = data + DoubleSha256 (data).substr (0, 4);
+
+  /* Leading zero bytes are encoded as '1' each.  */
+  size_t zeros = 0;
+  while (zeros < full.size () && full[zeros] == 0)
+    ++zeros;
+
+  /* Base58 digits of the remaining number, least significant first.  */
+  std::vector<unsigned char> digits;
+  for (size_t i = zeros; i < full.size (); ++i)
+    {
+      unsigned carry = static_cast<unsigned char> (full[i]);
+      for (auto& d : digits)
+        {
+          carry += static_cast<unsigned> (d) << 8;
+          d = carry % 58;
+          carry /= 58;
+        }
+      for (; carry > 0; carry /= 58)
+        digits.push_back (carry % 58);
+    }
+
+  std::string res(zeros, '1');
+  for (auto it = digits.rbegin (); it != digits.rend (); ++it)
+    res.push_back (BASE58_CHARS[*it]);
+
+  return res;
+}
+
+bool
+MessageVerifier::DecodeBase58Check (const std::string& str, std::string& data)
+{
+  size_t zeros = 0;
+  while (zeros < str.size () && str[zeros] == '1')
+    ++zeros;
+
+  /* Bytes of the remaining number, least significant first.  */
+  std::vector<unsigned char> bytes;
+  for (size_t i = zeros; i < str.size (); ++i)
+    {
+      const size_t pos = BASE58_CHARS.find (str[i]);
+      if (pos == std::string::npos)
+        return false;
+
+      unsigned carry = pos;
+      for (auto& b : bytes)
+        {
+          carry += static_cast<unsigned> (b) * 58;
+          b = carry & 0xFF;
+          carry >>= 8;
+        }
+      for (; carry > 0; carry >>= 8)
+        bytes.push_back (carry & 0xFF);
+    }
+
+  std::string full(zeros, '\0');
+  for (auto it = bytes.rbegin (); it != bytes.rend (); ++it)
+    full.push_back (static_cast<char> (*it));
+
+  if (full.size () < 4)
+    return false;
+
+  data = full.substr (0, full.size () - 4);
+  return DoubleSha256 (data).substr (0, 4) == full.substr (data.size ());
+}
+
+bool
+MessageVerifier::RecoverKeyHash (const std::string& msg,
+                                 const std::string& sgn,
+                                 std::string& keyHash) const
+{
+  if (sgn.size () != 65)
+    return false;
+
+  /* The header byte encodes the recovery ID and whether or not the
+     public key is compressed.  This mirrors RecoverCompact in Xaya Core
+     exactly, which does not range-check the header but just takes the
+     bits of (header - 27) computed as int; for header bytes below 27,
+     the result is negative and the low bits are those of its two's
+     complement representation.  We compute the same bits through an
+     unsigned value, which is well-defined.  */
+  const unsigned offset
+      = static_cast<unsigned> (static_cast<unsigned char> (sgn[0])) - 27u;
+  const int recid = offset & 3;
+  const bool compressed = (offset & 4) != 0;
+
+  const auto* sgnBytes = reinterpret_cast<const unsigned char*> (sgn.data ());
+  secp256k1_ecdsa_recoverable_signature sig;
+  if (!secp256k1_ecdsa_recoverable_signature_parse_compact (ctx, &sig,
+                                                            sgnBytes + 1,
+                                                            recid))
+    return false;
+
+  const std::string hash = MessageHash (msg);
+  secp256k1_pubkey pubkey;
+  if (!secp256k1_ecdsa_recover (
+          ctx, &pubkey, &sig,
+          reinterpret_cast<const unsigned char*> (hash.data ())))
+    return false;
+
+  unsigned char serialised[65];
+  size_t len = sizeof (serialised);
+  CHECK (secp256k1_ec_pubkey_serialize (
+      ctx, serialised, &len, &pubkey,
+      compressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED));
+
+  return Hash160 (std::string (reinterpret_cast<const char*> (serialised), len),
+                  keyHash);
+}
+
+std::string
+MessageVerifier::Sign (const std::string& msg, const std::string& key) const
+{
+  CHECK_EQ (key.size (), 32) << "Invalid private key";
+  const auto* keyBytes = reinterpret_cast<const unsigned char*> (key.data ());
+  CHECK (secp256k1_ec_seckey_verify (ctx, keyBytes)) << "Invalid private key";
+
+  const std::string hash = MessageHash (msg);
+  secp256k1_ecdsa_recoverable_signature sig;
+  CHECK (secp256k1_ecdsa_sign_recoverable (
+      ctx, &sig, reinterpret_cast<const unsigned char*> (hash.data ()),
+      keyBytes, nullptr, nullptr));
+
+  unsigned char compact[64];
+  int recid;
+  CHECK (secp256k1_ecdsa_recoverable_signature_serialize_compact (
+      ctx, compact, &recid, &sig));
+
+  /* We always sign for the compressed public key.  */
+  std::string res(1, static_cast<char> (27 + recid + 4));
+  res.append (reinterpret_cast<const char*> (compact), sizeof (compact));
+
+  return res;
+}
+
+bool
+MessageVerifier::LearnAddressPrefix (const std::string& msg,
+                                     const std::string& sgn,
+                                     const std::string& addr)
+{
+  std::string data;
+  if (!DecodeBase58Check (addr, data) || data.size () != 21)
+    {
+      LOG (WARNING) << "Unexpected address format: " << addr;
+      return false;
+    }
+
+  std::string keyHash;
+  if (!RecoverKeyHash (msg, sgn, keyHash))
+    {
+      LOG (WARNING) << "Failed to recover the signer of the example signature";
+      return false;
+    }
+
+  if (data.substr (1) != keyHash)
+    {
+      LOG (WARNING)
+          << "Recovered signer does not match Xaya Core's address " << addr;
+      return false;
+    }
+
+  addressPrefix = data[0];
+  hasPrefix = true;
+
+  return true;
+}
+
+bool
+MessageVerifier::Verify (const std::string& msg, const std::string& sgn,
+                         std::string& addr) const
+{
+  CHECK (hasPrefix) << "Address prefix has not been set";
+
+  std::string keyHash;
+  if (!RecoverKeyHash (msg, sgn, keyHash))
+    return false;
+
+  addr = EncodeBase58Check (std::string (1, addressPrefix) + keyHash);
+  return true;
+}
+
+} // namespace xayax
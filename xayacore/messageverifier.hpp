@@ -0,0 +1,102 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef XAYAX_CORE_MESSAGEVERIFIER_HPP
+#define XAYAX_CORE_MESSAGEVERIFIER_HPP
+
+#include <secp256k1.h>
+
+#include <string>
+
+namespace xayax
+{
+
+/**
+ * Verifier for signed messages as done by Xaya Core's signmessage and
+ * verifymessage RPCs (i.e. the Bitcoin message-signing scheme with
+ * compact, recoverable secp256k1 signatures and P2PKH addresses).
+ * This allows us to verify signatures locally, without a round-trip
+ * to Xaya Core.
+ *
+ * The only chain-specific data needed is the base58 version byte of
+ * P2PKH addresses.  It is not configured explicitly, but learnt from
+ * an example signature verified by Xaya Core (see LearnAddressPrefix).
+ * That also ensures that the local verification matches Xaya Core.
+ *
+ * Instances are thread-safe once the address prefix has been set.
+ */
+class MessageVerifier
+{
+
+private:
+
+  /** The secp256k1 context used.  */
+  secp256k1_context* ctx;
+
+  /** The base58 version byte for P2PKH addresses.  */
+  unsigned char addressPrefix = 0;
+
+  /** Whether the address prefix has been set.  */
+  bool hasPrefix = false;
+
+  /**
+   * Recovers the signer's public key from a message and a raw (65-byte)
+   * signature, and returns the hash160 of it (which is what the address
+   * commits to).  Returns false if the signature is invalid.
+   */
+  bool RecoverKeyHash (const std::string& msg, const std::string& sgn,
+                       std::string& keyHash) const;
+
+public:
+
+  MessageVerifier ();
+  ~MessageVerifier ();
+
+  MessageVerifier (const MessageVerifier&) = delete;
+  void operator= (const MessageVerifier&) = delete;
+
+  /**
+   * Returns the hash that is signed for a given message.
+   */
+  static std::string MessageHash (const std::string& msg);
+
+  /**
+   * Encodes data (including the version byte) with base58check.
+   */
+  static std::string EncodeBase58Check (const std::string& data);
+
+  /**
+   * Decodes a base58check string and verifies its checksum.  Returns
+   * false if the string is invalid.
+   */
+  static bool DecodeBase58Check (const std::string& str, std::string& data);
+
+  /**
+   * Signs a message with the given raw private key, returning the raw
+   * signature.  This is used to produce an example signature for
+   * cross-checking our verification against Xaya Core.
+   */
+  std::string Sign (const std::string& msg, const std::string& key) const;
+
+  /**
+   * Sets the address prefix based on the given message and signature,
+   * for which Xaya Core recovered the given address.  Returns false
+   * if that address does not match our own recovery, in which case
+   * the verifier must not be used.
+   */
+  bool LearnAddressPrefix (const std::string& msg, const std::string& sgn,
+                           const std::string& addr);
+
+  /**
+   * Verifies a message with a raw signature, returning the signer
+   * address if it is valid.  This is what BaseChain::VerifyMessage does.
+   */
+  bool Verify (const std::string& msg, const std::string& sgn,
+               std::string& addr) const;
+
+};
+
+} // namespace xayax
+
+#endif // XAYAX_CORE_MESSAGEVERIFIER_HPP
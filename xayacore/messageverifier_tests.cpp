@@ -0,0 +1,429 @@
+// Copyright (C) 2024 The Xaya developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "messageverifier.hpp"
+
+#include <xayautil/base64.hpp>
+
+#include <gtest/gtest.h>
+
+#include <glog/logging.h>
+
+#include <string>
+#include <vector>
+
+namespace xayax
+{
+namespace
+{
+
+/* ************************************************************************** */
+
+/**
+ * A recorded signature vector:  Message, header byte and the full signature
+ * (base64 encoded as with verifymessage), together with the address that
+ * Xaya Core recovers from it (or empty if the signature is invalid).
+ *
+ * The vectors have been produced by an independent implementation of
+ * the message-signing scheme (plain secp256k1 arithmetic in Python,
+ * following RecoverCompact of Xaya Core).  For each message, a signature
+ * by a fixed key is made (once for the compressed and once for the
+ * uncompressed public key), and then all header bytes from 26 to 35
+ * are tried with the same (r, s) values.
+ */
+struct SignatureVector
+{
+  std::string msg;
+  int header;
+  std::string sgn;
+  std::string addr;
+};
+
+/** Address of the test key (compressed public key), on mainnet.  */
+const std::string ADDR_COMPRESSED = "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk";
+/** Address of the test key (uncompressed public key), on mainnet.  */
+const std::string ADDR_UNCOMPRESSED = "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu";
+
+/** The test private key.  */
+const std::string TEST_KEY_HEX
+    = "4013bbd2ef5ffad0163a6d4f544ca3560d190009341916fa4426a66adfab96ae";
+
+const std::vector<SignatureVector> VECTORS = {
+    {"", 26,
+     "Ggd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 27,
+     "Gwd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CYcYN3cRUczXNUacrw71fpZfaQzSzFSPu2"},
+    {"", 28,
+     "HAd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"", 29,
+     "HQd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 30,
+     "Hgd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 31,
+     "Hwd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CeAFYMCJCL18QU3c6i8yjpwEPD8f1mG8m7"},
+    {"", 32,
+     "IAd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {"", 33,
+     "IQd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 34,
+     "Igd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 35,
+     "Iwd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CYcYN3cRUczXNUacrw71fpZfaQzSzFSPu2"},
+    {"Test Message", 26,
+     "Gi8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 27,
+     "Gy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"Test Message", 28,
+     "HC8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "CGcez38FXUhXW6yHmAmcfq5f3GgeydFGu7"},
+    {"Test Message", 29,
+     "HS8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 30,
+     "Hi8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 31,
+     "Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {"Test Message", 32,
+     "IC8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "CWfUuHWzuzPFp4rwozxYKGP92fDu3Qm8qM"},
+    {"Test Message", 33,
+     "IS8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 34,
+     "Ii8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 35,
+     "Iy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 26,
+     "GhgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 27,
+     "GxgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 28,
+     "HBgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "CWUNMLnmTeZ86nTkBi5a9sdQJJkWeA7Ecu"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 29,
+     "HRgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 30,
+     "HhgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 31,
+     "HxgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 32,
+     "IBgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "CKW22DYf7xugqjvkenTbotyXmBuFWmjepS"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 33,
+     "IRgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 34,
+     "IhgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 35,
+     "IxgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {std::string (300, 'x'), 26,
+     "Glh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 27,
+     "G1h0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CSyXoxDJBbXiRcSNz9ERcFmPGFnNPpasta"},
+    {std::string (300, 'x'), 28,
+     "HFh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {std::string (300, 'x'), 29,
+     "HVh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 30,
+     "Hlh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 31,
+     "H1h0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CJeoDvRVXcBuGNzZ2cKqUcBVTvtDY3n6st"},
+    {std::string (300, 'x'), 32,
+     "IFh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {std::string (300, 'x'), 33,
+     "IVh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 34,
+     "Ilh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 35,
+     "I1h0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CSyXoxDJBbXiRcSNz9ERcFmPGFnNPpasta"},
+    {"", 26,
+     "Ggd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 27,
+     "Gwd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CYcYN3cRUczXNUacrw71fpZfaQzSzFSPu2"},
+    {"", 28,
+     "HAd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"", 29,
+     "HQd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 30,
+     "Hgd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 31,
+     "Hwd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CeAFYMCJCL18QU3c6i8yjpwEPD8f1mG8m7"},
+    {"", 32,
+     "IAd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {"", 33,
+     "IQd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 34,
+     "Igd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     ""},
+    {"", 35,
+     "Iwd7tUXqYt9DIIVLea7UyItTRmYl/3ytCIgtBRlufMEZZjkgbbiiZfwgIHGOTNw6w4oO4JGGywKWlsgnWgKobOY=",
+     "CYcYN3cRUczXNUacrw71fpZfaQzSzFSPu2"},
+    {"Test Message", 26,
+     "Gi8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 27,
+     "Gy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"Test Message", 28,
+     "HC8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "CGcez38FXUhXW6yHmAmcfq5f3GgeydFGu7"},
+    {"Test Message", 29,
+     "HS8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 30,
+     "Hi8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 31,
+     "Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {"Test Message", 32,
+     "IC8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "CWfUuHWzuzPFp4rwozxYKGP92fDu3Qm8qM"},
+    {"Test Message", 33,
+     "IS8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 34,
+     "Ii8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     ""},
+    {"Test Message", 35,
+     "Iy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfnFJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 26,
+     "GhgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 27,
+     "GxgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 28,
+     "HBgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "CWUNMLnmTeZ86nTkBi5a9sdQJJkWeA7Ecu"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 29,
+     "HRgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 30,
+     "HhgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 31,
+     "HxgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 32,
+     "IBgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "CKW22DYf7xugqjvkenTbotyXmBuFWmjepS"},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 33,
+     "IRgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 34,
+     "IhgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     ""},
+    {"\xc3\xa4\xc3\xb6\xc3\xbc", 35,
+     "IxgvZerPkiiJV28TAAwOOu/UFJzynG9dRUkq+A4VjIGlcR6XsERoI8ilrcaLsYeUMkz71eErtNIo/ZjeV42ytoQ=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {std::string (300, 'x'), 26,
+     "Glh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 27,
+     "G1h0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CSyXoxDJBbXiRcSNz9ERcFmPGFnNPpasta"},
+    {std::string (300, 'x'), 28,
+     "HFh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "Cd38vd6XNe8fDdXwxBmJGCWSqUMPYbNfLu"},
+    {std::string (300, 'x'), 29,
+     "HVh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 30,
+     "Hlh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 31,
+     "H1h0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CJeoDvRVXcBuGNzZ2cKqUcBVTvtDY3n6st"},
+    {std::string (300, 'x'), 32,
+     "IFh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CZRXHJqKgjRwY3vBcGQayiqis3e6MpyHmk"},
+    {std::string (300, 'x'), 33,
+     "IVh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 34,
+     "Ilh0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     ""},
+    {std::string (300, 'x'), 35,
+     "I1h0SmPyxQzHTKHUpMMbsbVAUaNw4HXLdpDbGOqFD99Sb9NiKBxi1ggbhEKU+DuKKjhUC1Ggq3OgRTrL1/qEwZI=",
+     "CSyXoxDJBbXiRcSNz9ERcFmPGFnNPpasta"}
+};
+
+/**
+ * Decodes a hex string to bytes.
+ */
+std::string
+FromHex (const std::string& hex)
+{
+  CHECK_EQ (hex.size () % 2, 0);
+  std::string res;
+  for (size_t i = 0; i < hex.size (); i += 2)
+    res.push_back (static_cast<char> (std::stoi (hex.substr (i, 2),
+                                                 nullptr, 16)));
+  return res;
+}
+
+/**
+ * Decodes a base64 signature from the test data.
+ */
+std::string
+DecodeSignature (const std::string& sgn)
+{
+  std::string res;
+  CHECK (xaya::DecodeBase64 (sgn, res)) << "Invalid base64: " << sgn;
+  return res;
+}
+
+class MessageVerifierTests : public testing::Test
+{
+
+protected:
+
+  MessageVerifier verifier;
+
+  MessageVerifierTests ()
+  {
+    /* Learn the prefix from the plain compressed signature of
+       "Test Message", as the Core-backed chain does with its own
+       example signature.  */
+    CHECK (verifier.LearnAddressPrefix (
+        "Test Message",
+        DecodeSignature ("Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfn"
+                         "FJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI="),
+        ADDR_COMPRESSED));
+  }
+
+};
+
+TEST_F (MessageVerifierTests, RecordedVectors)
+{
+  for (const auto& v : VECTORS)
+    {
+      const std::string sgn = DecodeSignature (v.sgn);
+      ASSERT_EQ (sgn.size (), 65);
+      ASSERT_EQ (static_cast<unsigned char> (sgn[0]), v.header);
+
+      std::string addr;
+      const bool valid = verifier.Verify (v.msg, sgn, addr);
+      EXPECT_EQ (valid, !v.addr.empty ())
+          << "Message: " << v.msg << "\nSignature: " << v.sgn;
+      if (valid)
+        {
+          EXPECT_EQ (addr, v.addr)
+              << "Message: " << v.msg << "\nSignature: " << v.sgn;
+        }
+    }
+}
+
+TEST_F (MessageVerifierTests, OutOfRangeValues)
+{
+  std::string addr;
+
+  /* s = n */
+  EXPECT_FALSE (verifier.Verify (
+      "Test Message",
+      DecodeSignature ("Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8////"
+                       "/////////////////rqu3OavSKA7v9JejNA2QUE="),
+      addr));
+
+  /* r = n */
+  EXPECT_FALSE (verifier.Verify (
+      "Test Message",
+      DecodeSignature ("H/////////////////////66rtzmr0igO7/SXozQNkFBFRfn"
+                       "FJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI="),
+      addr));
+}
+
+TEST_F (MessageVerifierTests, WrongLength)
+{
+  const std::string sgn = DecodeSignature (
+      "Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfn"
+      "FJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI=");
+
+  std::string addr;
+  ASSERT_TRUE (verifier.Verify ("Test Message", sgn, addr));
+  EXPECT_EQ (addr, ADDR_COMPRESSED);
+
+  EXPECT_FALSE (verifier.Verify ("Test Message", sgn.substr (0, 64), addr));
+  EXPECT_FALSE (verifier.Verify ("Test Message", sgn + '\0', addr));
+  EXPECT_FALSE (verifier.Verify ("Test Message", "", addr));
+}
+
+TEST_F (MessageVerifierTests, LearnAddressPrefixMismatch)
+{
+  MessageVerifier other;
+  EXPECT_FALSE (other.LearnAddressPrefix (
+      "Other Message",
+      DecodeSignature ("Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfn"
+                       "FJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI="),
+      ADDR_COMPRESSED));
+  EXPECT_FALSE (other.LearnAddressPrefix (
+      "Test Message",
+      DecodeSignature ("Hy8iZKz0DTzT97lHH5gI7svBgipqnsc0MWE9/rTW6zi8FRfn"
+                       "FJEcyINw8Ew/9JpIGu4snm8JTU4IW0V4ABW46oI="),
+      ADDR_UNCOMPRESSED));
+}
+
+TEST_F (MessageVerifierTests, SignRoundTrip)
+{
+  const std::string key = FromHex (TEST_KEY_HEX);
+  for (const std::string msg : {"", "Test Message", "\xc3\xa4\xc3\xb6\xc3\xbc"})
+    {
+      const std::string sgn = verifier.Sign (msg, key);
+      ASSERT_EQ (sgn.size (), 65);
+      EXPECT_GE (static_cast<unsigned char> (sgn[0]), 31);
+      EXPECT_LE (static_cast<unsigned char> (sgn[0]), 34);
+
+      std::string addr;
+      ASSERT_TRUE (verifier.Verify (msg, sgn, addr));
+      EXPECT_EQ (addr, ADDR_COMPRESSED);
+    }
+}
+
+/* ************************************************************************** */
+
+} // anonymous namespace
+} // namespace xayax
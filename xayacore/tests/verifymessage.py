@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 
-# Copyright (C) 2021-2022 The Xaya developers
+# Copyright (C) 2021-2024 The Xaya developers
 # Distributed under the MIT software license, see the accompanying
 # file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
@@ -20,6 +20,40 @@ def verify (xrpc, addr, msg, sgn):
   return xrpc.verifymessage (address=addr, message=msg, signature=sgn)
 
 
+def verifyWithCore (rpc, msg, sgn):
+  """
+  Verifies a message with address recovery directly through Xaya Core,
+  returning the result in the same format as Xaya X.
+  """
+
+  try:
+    return rpc.verifymessage ("", msg, sgn)
+  except jsonrpclib.ProtocolError as exc:
+    if exc.args[0][0] != -3:
+      raise
+    return {"valid": False}
+
+
+def tamperedSignatures (sgn):
+  """
+  Returns a list of signatures derived from the given one, by changing
+  the header byte (recovery ID and compression flag) and the signature
+  data itself.
+  """
+
+  raw = base64.b64decode (sgn)
+  variants = []
+
+  for header in [26, 27, 28, 29, 30, 31, 32, 33, 34, 35]:
+    variants.append (bytes ([header]) + raw[1:])
+  variants.append (raw[:10] + bytes ([raw[10] ^ 1]) + raw[11:])
+  variants.append (raw[:40] + bytes ([raw[40] ^ 0x80]) + raw[41:])
+  variants.append (raw[:-1])
+  variants.append (raw + b"\x00")
+
+  return [codecs.decode (base64.b64encode (v), "ascii") for v in variants]
+
+
 if __name__ == "__main__":
   with coretest.Fixture () as f:
     rpc = f.env.createCoreRpc ()
@@ -48,3 +82,19 @@ if __name__ == "__main__":
     res = verify (xrpc, "", "wrong", sgn)
     f.assertEqual (res["valid"], True)
     assert res["address"] != addr
+
+    # Cross-check the results of Xaya X (which verifies locally) against
+    # Xaya Core on a range of messages and (valid or tampered) signatures.
+    messages = ["", "Test Message", "äöü", "x" * 300, "y" * 70_000]
+    addresses = [rpc.getnewaddress () for _ in range (3)]
+    for m in messages:
+      for a in addresses:
+        sgn = rpc.signmessage (a, m)
+        f.assertEqual (verify (xrpc, "", m, sgn), {
+          "valid": True,
+          "address": a,
+        })
+        for s in [sgn] + tamperedSignatures (sgn):
+          f.assertEqual (verify (xrpc, "", m, s), verifyWithCore (rpc, m, s))
+          f.assertEqual (verify (xrpc, "", m + "!", s),
+                         verifyWithCore (rpc, m + "!", s))
@@ -45,6 +45,8 @@ class ZmqSubscriber:
     info = rpc.getzmqnotifications ()
     self.addr = None
     for notification in info:
+      if notification["type"] not in ["pubgameblocks", "pubgamepending"]:
+        continue
       if self.addr is None:
         self.addr = notification["address"]
       else: